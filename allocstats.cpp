@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <tuple>
+
+#include <nvh/nvprint.hpp>
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include "allocstats.h"
+
+static volatile bool     s_countAllocs = false;
+static volatile int64_t  s_allocCount  = 0;
+
+void setAllocCounting(bool enable)
+{
+  s_countAllocs = enable;
+}
+
+bool getAllocCounting()
+{
+  return s_countAllocs;
+}
+
+uint64_t getAllocCount()
+{
+  return (uint64_t)s_allocCount;
+}
+
+static inline void* countedAlloc(size_t sz)
+{
+  if(s_countAllocs)
+  {
+#ifdef WIN32
+    InterlockedIncrement64((volatile LONGLONG*)&s_allocCount);
+#else
+    __sync_add_and_fetch(&s_allocCount, 1);
+#endif
+  }
+  void* p = malloc(sz ? sz : 1);
+  if(!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+//------------------------------------------------------------------------------
+// replacement of the global operators. The aligned versions are left to the
+// runtime: nothing on the frame path uses over-aligned types
+//------------------------------------------------------------------------------
+void* operator new(size_t sz)
+{
+  return countedAlloc(sz);
+}
+void* operator new[](size_t sz)
+{
+  return countedAlloc(sz);
+}
+void* operator new(size_t sz, const std::nothrow_t&) noexcept
+{
+  try
+  {
+    return countedAlloc(sz);
+  }
+  catch(...)
+  {
+    return NULL;
+  }
+}
+void* operator new[](size_t sz, const std::nothrow_t&) noexcept
+{
+  try
+  {
+    return countedAlloc(sz);
+  }
+  catch(...)
+  {
+    return NULL;
+  }
+}
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+void operator delete[](void* p) noexcept
+{
+  free(p);
+}
+void operator delete(void* p, size_t) noexcept
+{
+  free(p);
+}
+void operator delete[](void* p, size_t) noexcept
+{
+  free(p);
+}
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+  free(p);
+}
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+  free(p);
+}
+
+//------------------------------------------------------------------------------
+// Memory accounting
+//
+// a handful of calls per resource creation: one mutex is enough
+//------------------------------------------------------------------------------
+namespace {
+typedef std::tuple<int, const void*, const void*> MemKey;
+
+struct MemState
+{
+  std::mutex                           mutex;
+  std::map<MemKey, int64_t>            allocs;
+  std::map<const void*, MemOwnerStats> models;
+  std::map<const void*, MemOwnerStats> renderers;
+  std::map<const void*, std::string>   names;
+  MemCounter                           tags[NUM_MEMTAGS];
+  MemCounter                           host;
+  MemCounter                           device;
+};
+
+MemState& memState()
+{
+  static MemState s_state;  // constructed on first use: models can be created before main()
+  return s_state;
+}
+
+void addToCounter(MemCounter& counter, int64_t bytes)
+{
+  counter.current += bytes;
+  counter.peak = std::max(counter.peak, counter.current);
+}
+
+void addToOwner(MemState& state, std::map<const void*, MemOwnerStats>& owners, const void* owner, MemTag tag, int64_t bytes)
+{
+  if(!owner)
+    return;
+  std::map<const void*, MemOwnerStats>::iterator it = owners.find(owner);
+  if(it == owners.end())
+  {
+    // only the releases of a forgotten owner can get here with bytes < 0
+    if(bytes <= 0)
+      return;
+    MemOwnerStats stats;
+    memset(&stats, 0, sizeof(MemOwnerStats));
+    stats.owner = owner;
+    std::map<const void*, std::string>::const_iterator itName = state.names.find(owner);
+    if(itName != state.names.end())
+      strncpy(stats.name, itName->second.c_str(), sizeof(stats.name) - 1);
+    it = owners.insert(std::make_pair(owner, stats)).first;
+  }
+  addToCounter(it->second.tags[tag], bytes);
+  addToCounter(memTagIsDevice(tag) ? it->second.device : it->second.host, bytes);
+}
+
+void addBytes(MemState& state, MemTag tag, const void* model, const void* renderer, int64_t bytes)
+{
+  addToCounter(state.tags[tag], bytes);
+  addToCounter(memTagIsDevice(tag) ? state.device : state.host, bytes);
+  addToOwner(state, state.models, model, tag, bytes);
+  addToOwner(state, state.renderers, renderer, tag, bytes);
+}
+
+void resetPeak(MemCounter& counter)
+{
+  counter.peak = counter.current;
+}
+
+void getOwners(const std::map<const void*, MemOwnerStats>& owners, std::vector<MemOwnerStats>& stats)
+{
+  stats.clear();
+  for(std::map<const void*, MemOwnerStats>::const_iterator it = owners.begin(); it != owners.end(); ++it)
+    stats.push_back(it->second);
+}
+
+void logOwners(const char* kind, const std::vector<MemOwnerStats>& owners)
+{
+  for(size_t i = 0; i < owners.size(); i++)
+  {
+    const MemOwnerStats& o = owners[i];
+    LOGI("  %s %-24s host %8.2f Mb (peak %8.2f) device %8.2f Mb (peak %8.2f)\n", kind, o.name[0] ? o.name : "?",
+         double(o.host.current) / (1024.0 * 1024.0), double(o.host.peak) / (1024.0 * 1024.0),
+         double(o.device.current) / (1024.0 * 1024.0), double(o.device.peak) / (1024.0 * 1024.0));
+  }
+}
+}  // namespace
+
+const char* memTagName(MemTag tag)
+{
+  static const char* s_names[NUM_MEMTAGS] = {"model file",    "model uniforms",  "tokens",       "vertex buffers",
+                                             "index buffers", "uniform buffers", "token buffers"};
+  return (tag >= 0 && tag < NUM_MEMTAGS) ? s_names[tag] : "?";
+}
+
+bool memTagIsDevice(MemTag tag)
+{
+  return tag >= MEMTAG_VERTEX_BUFFERS;
+}
+
+void memTrack(MemTag tag, const void* model, const void* renderer, int64_t bytes)
+{
+  if(bytes == 0)
+    return;
+  MemState&                   state = memState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.allocs[MemKey(tag, model, renderer)] += bytes;
+  addBytes(state, tag, model, renderer, bytes);
+}
+
+void memUntrack(MemTag tag, const void* model, const void* renderer)
+{
+  MemState&                   state = memState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  std::map<MemKey, int64_t>::iterator it = state.allocs.find(MemKey(tag, model, renderer));
+  if(it == state.allocs.end())
+    return;
+  addBytes(state, tag, model, renderer, -it->second);
+  state.allocs.erase(it);
+}
+
+void memTrackName(const void* owner, const char* name)
+{
+  MemState&                   state = memState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.names[owner] = name;
+  std::map<const void*, MemOwnerStats>* owners[] = {&state.models, &state.renderers};
+  for(int i = 0; i < 2; i++)
+  {
+    std::map<const void*, MemOwnerStats>::iterator it = owners[i]->find(owner);
+    if(it != owners[i]->end())
+    {
+      memset(it->second.name, 0, sizeof(it->second.name));
+      strncpy(it->second.name, name, sizeof(it->second.name) - 1);
+    }
+  }
+}
+
+void memForget(const void* owner)
+{
+  MemState&                   state = memState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.models.erase(owner);
+  state.renderers.erase(owner);
+  state.names.erase(owner);
+}
+
+void memGetStats(MemCounter tags[NUM_MEMTAGS], MemCounter* host, MemCounter* device)
+{
+  MemState&                   state = memState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  if(tags)
+    memcpy(tags, state.tags, sizeof(state.tags));
+  if(host)
+    *host = state.host;
+  if(device)
+    *device = state.device;
+}
+
+void memGetModels(std::vector<MemOwnerStats>& models)
+{
+  MemState&                   state = memState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  getOwners(state.models, models);
+}
+
+void memGetRenderers(std::vector<MemOwnerStats>& renderers)
+{
+  MemState&                   state = memState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  getOwners(state.renderers, renderers);
+}
+
+void memResetPeaks()
+{
+  MemState&                   state = memState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  for(int t = 0; t < NUM_MEMTAGS; t++)
+    resetPeak(state.tags[t]);
+  resetPeak(state.host);
+  resetPeak(state.device);
+  std::map<const void*, MemOwnerStats>* owners[] = {&state.models, &state.renderers};
+  for(int i = 0; i < 2; i++)
+  {
+    for(std::map<const void*, MemOwnerStats>::iterator it = owners[i]->begin(); it != owners[i]->end(); ++it)
+    {
+      for(int t = 0; t < NUM_MEMTAGS; t++)
+        resetPeak(it->second.tags[t]);
+      resetPeak(it->second.host);
+      resetPeak(it->second.device);
+    }
+  }
+}
+
+void logMemStats()
+{
+  MemCounter                 tags[NUM_MEMTAGS], host, device;
+  std::vector<MemOwnerStats> models, renderers;
+  memGetStats(tags, &host, &device);
+  memGetModels(models);
+  memGetRenderers(renderers);
+  LOGI("Memory: host %.2f Mb (peak %.2f) device %.2f Mb (peak %.2f)\n", double(host.current) / (1024.0 * 1024.0),
+       double(host.peak) / (1024.0 * 1024.0), double(device.current) / (1024.0 * 1024.0), double(device.peak) / (1024.0 * 1024.0));
+  for(int t = 0; t < NUM_MEMTAGS; t++)
+    LOGI("  %-30s %8.2f Mb (peak %8.2f)\n", memTagName((MemTag)t), double(tags[t].current) / (1024.0 * 1024.0),
+         double(tags[t].peak) / (1024.0 * 1024.0));
+  logOwners("model   ", models);
+  logOwners("renderer", renderers);
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Heap allocation counting
+//
+// the sample replaces the global operator new/delete: when counting is enabled,
+// each operator new (and TaskArena block) adds one to a process-wide counter.
+// "-countallocs" reports the allocations per frame: a steady scene should show 0
+//------------------------------------------------------------------------------
+void     setAllocCounting(bool enable);
+bool     getAllocCounting();
+// operator new calls since the start of the process, on all the threads, while counting was enabled
+uint64_t getAllocCount();
+
+//------------------------------------------------------------------------------
+// Memory accounting
+//
+// the models and the renderers report what they allocate, tagged by kind of
+// data and by owner: a model (Bk3dModel*) and/or a renderer (Renderer*).
+// Either can be NULL: the grid of a renderer has no model, a loaded file no renderer.
+// Sizes are the ones requested from malloc/new or from the graphics API: the
+// alignment and the driver overhead are not included
+//------------------------------------------------------------------------------
+// the host tags first, then the device ones
+enum MemTag
+{
+  MEMTAG_MODEL_FILE,       // host: the bk3d structures and buffer area
+  MEMTAG_MODEL_UNIFORMS,   // host: copies of the materials and object-matrices
+  MEMTAG_TOKENS,           // host: token streams of the command-list renderer
+  MEMTAG_VERTEX_BUFFERS,   // device
+  MEMTAG_INDEX_BUFFERS,    // device
+  MEMTAG_UNIFORM_BUFFERS,  // device
+  MEMTAG_TOKEN_BUFFERS,    // device: buffers the command-list renderer reads its tokens from
+  NUM_MEMTAGS
+};
+
+struct MemCounter
+{
+  int64_t current;
+  int64_t peak;
+};
+
+struct MemOwnerStats
+{
+  const void* owner;
+  char        name[64];
+  MemCounter  tags[NUM_MEMTAGS];
+  MemCounter  host;
+  MemCounter  device;
+};
+
+const char* memTagName(MemTag tag);
+bool        memTagIsDevice(MemTag tag);
+
+// adds to what the (tag, model, renderer) key already holds
+void memTrack(MemTag tag, const void* model, const void* renderer, int64_t bytes);
+// releases all that the key holds, so that the delete sites don't need the sizes
+void memUntrack(MemTag tag, const void* model, const void* renderer);
+// name shown in the breakdowns. Call again when the pointer gets reused
+void memTrackName(const void* owner, const char* name);
+// drops the breakdown of a model or renderer that is gone. Its keys still can be released
+void memForget(const void* owner);
+
+void memGetStats(MemCounter tags[NUM_MEMTAGS], MemCounter* host, MemCounter* device);
+void memGetModels(std::vector<MemOwnerStats>& models);
+void memGetRenderers(std::vector<MemOwnerStats>& renderers);
+// peaks back to the current values: the benchmark measures each run on its own
+void memResetPeaks();
+void logMemStats();
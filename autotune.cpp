@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <nvh/nvprint.hpp>
+
+#ifdef WIN32
+// std::min and std::max below
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#define EXTERNSVCUI
+#define WINDOWINERTIACAMERA_EXTERN
+#define EMUCMDLIST_EXTERN
+#include "gl_vk_bk3dthreaded.h"
+#include "benchmark.h"
+#include "autotune.h"
+
+//------------------------------------------------------------------------------
+// splits a line at the tabs
+//------------------------------------------------------------------------------
+static void splitTabs(const char* line, std::vector<std::string>& fields)
+{
+  fields.clear();
+  const char* p = line;
+  while(true)
+  {
+    const char* end = p;
+    while(*end && (*end != '\t') && (*end != '\n') && (*end != '\r'))
+      end++;
+    fields.push_back(std::string(p, end));
+    if(*end != '\t')
+      break;
+    p = end + 1;
+  }
+}
+
+bool TuneConfig::load(const char* fname)
+{
+  m_entries.clear();
+  FILE* fp = fopen(fname, "r");
+  if(!fp)
+    return true;
+  char                     line[1024];
+  std::vector<std::string> fields;
+  int                      lineNum = 0;
+  bool                     bOk     = true;
+  while(fgets(line, sizeof(line), fp))
+  {
+    lineNum++;
+    if((line[0] == '#') || (line[0] == '\n') || (line[0] == '\r') || (line[0] == '\0'))
+      continue;
+    splitTabs(line, fields);
+    TuneEntry entry;
+    char*     end = NULL;
+    if(fields.size() == 5)
+    {
+      entry.renderer      = fields[0];
+      entry.models        = fields[1];
+      entry.numCmdBuffers = (int)strtol(fields[2].c_str(), &end, 10);
+      if(*end == '\0')
+        entry.useWorkers = strtol(fields[3].c_str(), &end, 10) != 0;
+      if(*end == '\0')
+        entry.recordMs = (float)strtod(fields[4].c_str(), &end);
+    }
+    if(!end || (*end != '\0') || (entry.numCmdBuffers < 1))
+    {
+      LOGE("%s(%d): malformed line\n", fname, lineNum);
+      bOk = false;
+      continue;
+    }
+    set(entry);
+  }
+  fclose(fp);
+  return bOk;
+}
+
+bool TuneConfig::save(const char* fname) const
+{
+  FILE* fp = fopen(fname, "w");
+  if(!fp)
+  {
+    LOGE("Couldn't write %s\n", fname);
+    return false;
+  }
+  fprintf(fp, "# -autotune results: renderer, models, command-buffers, workers, recording ms\n");
+  for(size_t i = 0; i < m_entries.size(); i++)
+  {
+    const TuneEntry& e = m_entries[i];
+    fprintf(fp, "%s\t%s\t%d\t%d\t%.4f\n", e.renderer.c_str(), e.models.c_str(), e.numCmdBuffers, e.useWorkers ? 1 : 0, e.recordMs);
+  }
+  fclose(fp);
+  return true;
+}
+
+const TuneEntry* TuneConfig::find(const std::string& renderer, const std::string& models) const
+{
+  for(size_t i = 0; i < m_entries.size(); i++)
+  {
+    if((m_entries[i].renderer == renderer) && (m_entries[i].models == models))
+      return &m_entries[i];
+  }
+  return NULL;
+}
+
+void TuneConfig::set(const TuneEntry& entry)
+{
+  for(size_t i = 0; i < m_entries.size(); i++)
+  {
+    if((m_entries[i].renderer == entry.renderer) && (m_entries[i].models == entry.models))
+    {
+      m_entries[i] = entry;
+      return;
+    }
+  }
+  m_entries.push_back(entry);
+}
+
+//------------------------------------------------------------------------------
+// host name, reduced to characters that are safe in a file name
+//------------------------------------------------------------------------------
+std::string tuneFileName()
+{
+  char host[256] = "";
+#ifdef WIN32
+  DWORD size = sizeof(host);
+  if(!GetComputerNameA(host, &size))
+    host[0] = '\0';
+#else
+  if(gethostname(host, sizeof(host)) != 0)
+    host[0] = '\0';
+  host[sizeof(host) - 1] = '\0';
+#endif
+  std::string name("autotune_");
+  for(const char* c = host; *c; c++)
+  {
+    bool bSafe = ((*c >= 'a') && (*c <= 'z')) || ((*c >= 'A') && (*c <= 'Z')) || ((*c >= '0') && (*c <= '9')) || (*c == '-');
+    name += bSafe ? *c : '_';
+  }
+  if(!host[0])
+    name += "localhost";
+  return name + ".cfg";
+}
+
+//------------------------------------------------------------------------------
+// the scene of the results: the loaded models, without their directory
+//------------------------------------------------------------------------------
+static std::string tuneModelsKey()
+{
+  std::string key;
+  for(int m = 0; m < g_bk3dModels.size(); m++)
+  {
+    const std::string& name = g_bk3dModels[m]->m_name;
+    size_t             pos  = name.find_last_of("/\\");
+    if(m > 0)
+      key += "+";
+    key += (pos == std::string::npos) ? name : name.substr(pos + 1);
+  }
+  return key;
+}
+
+static std::string tuneConfigFileName()
+{
+  return g_benchOptions.tuneFileName ? std::string(g_benchOptions.tuneFileName) : tuneFileName();
+}
+
+static TuneConfig s_tuneConfig;
+
+static void applyTuneEntry(BenchmarkTarget& target, const TuneEntry& entry)
+{
+  BenchmarkConfig config = target.config();
+  config.numCmdBuffers   = std::min(std::max(entry.numCmdBuffers, 1), MAXCMDBUFFERS);
+#ifdef USEWORKERS
+  config.useWorkers = entry.useWorkers;
+#else
+  config.useWorkers = false;
+#endif
+  LOGI("auto-tune: %s, %d command-buffers, workers %d\n", entry.renderer.c_str(), config.numCmdBuffers, config.useWorkers ? 1 : 0);
+  target.setConfig(config);
+}
+
+void applyTuning(BenchmarkTarget& target)
+{
+  static bool bLoaded = false;
+  if(!g_benchOptions.useTuning)
+    return;
+  if(!bLoaded)
+  {
+    s_tuneConfig.load(tuneConfigFileName().c_str());
+    bLoaded = true;
+  }
+  const TuneEntry* entry = s_tuneConfig.find(target.renderer()->getName(), tuneModelsKey());
+  if(entry)
+    applyTuneEntry(target, *entry);
+}
+
+//------------------------------------------------------------------------------
+// -autotune <frames>: with the current renderer, renders <frames> frames of the
+// camera path of -benchmark for each candidate: numbers of command-buffers of
+// -benchcmdbuffers (default: powers of 2 up to 64) x workers off and on. Every
+// frame records its command-buffers, without pipelining. The candidates are
+// ranked on the median time of that recording and its submission: the rest of
+// the frame (GPU wait, blit, UI) doesn't depend on them and only adds noise
+//------------------------------------------------------------------------------
+void runAutoTune(BenchmarkTarget& target, int numFrames)
+{
+  std::vector<int> cmdBuffers = g_benchOptions.cmdBuffers;
+  std::vector<int> workers    = g_benchOptions.workers;
+  if(cmdBuffers.empty())
+  {
+    for(int c = 1; c <= std::min(64, MAXCMDBUFFERS); c *= 2)
+      cmdBuffers.push_back(c);
+  }
+#ifdef USEWORKERS
+  if(workers.empty())
+  {
+    workers.push_back(0);
+    workers.push_back(1);
+  }
+#else
+  workers.assign(1, 0);
+#endif
+  BenchmarkConfig prevConfig = target.config();
+
+  TuneEntry best;
+  best.renderer      = target.renderer()->getName();
+  best.models        = tuneModelsKey();
+  best.numCmdBuffers = prevConfig.numCmdBuffers;
+  best.useWorkers    = prevConfig.useWorkers;
+  best.recordMs      = -1.0f;
+  bool bClosed       = false;
+  for(int w = 0; (w < workers.size()) && !bClosed; w++)
+  {
+    for(int c = 0; (c < cmdBuffers.size()) && !bClosed; c++)
+    {
+      BenchmarkConfig config   = prevConfig;
+      config.numCmdBuffers     = cmdBuffers[c];
+      config.useWorkers        = workers[w] ? true : false;
+      config.refreshCmdBuffers = true;
+      config.pipelineDepth     = 1;
+      target.setConfig(config);
+      target.destroyCommandBuffers();
+      config = target.config();
+      BenchmarkRun run;
+      bClosed = !runBenchmarkFrames(target, numFrames, run);
+      if(bClosed)
+        break;
+      float ms = run.recordPercentile(0.5f);
+      LOGI("auto-tune: %s, %d command-buffers, workers %d: recording %.3f ms, frame %.3f ms\n", best.renderer.c_str(),
+           config.numCmdBuffers, config.useWorkers ? 1 : 0, ms, run.framePercentile(0.5f));
+      if((best.recordMs < 0.0f) || (ms < best.recordMs))
+      {
+        best.numCmdBuffers = config.numCmdBuffers;
+        best.useWorkers    = config.useWorkers;
+        best.recordMs      = ms;
+      }
+    }
+  }
+  target.endFrames();
+  // the recording mode of before, with the candidate found
+  BenchmarkConfig config   = target.config();
+  config.refreshCmdBuffers = prevConfig.refreshCmdBuffers;
+  config.pipelineDepth     = prevConfig.pipelineDepth;
+  target.setConfig(config);
+  if(bClosed || (best.recordMs < 0.0f))
+    return;
+  applyTuneEntry(target, best);
+  s_tuneConfig.set(best);
+  std::string fname = tuneConfigFileName();
+  if(s_tuneConfig.save(fname.c_str()))
+    LOGI("auto-tune: recording %.3f ms, saved to %s\n", best.recordMs, fname.c_str());
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+#include <string>
+#include <vector>
+
+class BenchmarkTarget;
+
+//------------------------------------------------------------------------------
+// Results of "-autotune": the fastest number of command-buffers and use of the
+// workers for a scene and a renderer, measured on this host.
+//
+// The file is per host (see tuneFileName()) and holds one line per scene and
+// renderer, tab-separated:
+//   <renderer> <models> <command-buffers> <workers> <recording ms>
+// <models> are the names of the loaded models, joined by '+'. Lines starting
+// with '#' are comments
+//------------------------------------------------------------------------------
+struct TuneEntry
+{
+  std::string renderer;
+  std::string models;
+  int         numCmdBuffers;
+  bool        useWorkers;
+  float       recordMs;  // median of the recording and submission of a frame (see renderFrame())
+};
+
+class TuneConfig
+{
+public:
+  // a missing file is an empty config: false only for a malformed one
+  bool load(const char* fname);
+  bool save(const char* fname) const;
+
+  // NULL if the scene wasn't tuned with this renderer
+  const TuneEntry* find(const std::string& renderer, const std::string& models) const;
+  // replaces the entry of the same renderer and models
+  void set(const TuneEntry& entry);
+
+  const std::vector<TuneEntry>& entries() const { return m_entries; }
+
+private:
+  std::vector<TuneEntry> m_entries;
+};
+
+// "autotune_<host name>.cfg", in the current directory
+std::string tuneFileName();
+
+// -autotune <frames>: the fastest configuration for the renderer of target gets applied
+// and saved to the file of this host
+void runAutoTune(BenchmarkTarget& target, int numFrames);
+// the configuration -autotune found for the renderer of target and the loaded models,
+// if any and unless -notune. The file gets read once
+void applyTuning(BenchmarkTarget& target);
@@ -0,0 +1,838 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#include <nvh/nvprint.hpp>
+
+#define EXTERNSVCUI
+#define WINDOWINERTIACAMERA_EXTERN
+#define EMUCMDLIST_EXTERN
+#include "gl_vk_bk3dthreaded.h"
+#include "benchmark.h"
+#include "autotune.h"
+
+//------------------------------------------------------------------------------
+// BenchmarkRun
+//------------------------------------------------------------------------------
+void BenchmarkRun::addFrame(float frame, float record)
+{
+  frameMs.push_back(frame);
+  recordMs.push_back(record);
+  gpuMs.push_back(BENCHMARK_NO_GPU_TIME);
+}
+
+void BenchmarkRun::setGpuTime(int frame, float gpu)
+{
+  int f = frame - firstFrame;
+  if((f >= 0) && (f < (int)gpuMs.size()))
+    gpuMs[f] = gpu;
+}
+
+void BenchmarkRun::addHitch(const std::string& profilerDump)
+{
+  hitchFrames.push_back((int)frameMs.size() - 1);
+  hitchDumps.push_back(profilerDump);
+}
+
+void BenchmarkRun::sampleMemory()
+{
+  memGetStats(NULL, &hostBytes, &deviceBytes);
+}
+
+static float percentile(const std::vector<float>& values, float p)
+{
+  if(values.empty())
+    return 0.0f;
+  std::vector<float> sorted(values);
+  std::sort(sorted.begin(), sorted.end());
+  size_t i = (size_t)(p * (float)(sorted.size() - 1) + 0.5f);
+  return sorted[std::min(i, sorted.size() - 1)];
+}
+
+float BenchmarkRun::framePercentile(float p) const
+{
+  return percentile(frameMs, p);
+}
+
+float BenchmarkRun::recordPercentile(float p) const
+{
+  return percentile(recordMs, p);
+}
+
+float BenchmarkRun::frameMean() const
+{
+  if(frameMs.empty())
+    return 0.0f;
+  double sum = 0.0;
+  for(size_t i = 0; i < frameMs.size(); i++)
+    sum += frameMs[i];
+  return (float)(sum / (double)frameMs.size());
+}
+
+//------------------------------------------------------------------------------
+// BenchmarkReport
+//------------------------------------------------------------------------------
+BenchmarkRun& BenchmarkReport::beginRun(const char* renderer, int numCmdBuffers, bool useWorkers, int numThreads)
+{
+  m_runs.push_back(BenchmarkRun());
+  BenchmarkRun& run = m_runs.back();
+  run.renderer      = renderer;
+  run.numCmdBuffers = numCmdBuffers;
+  run.useWorkers    = useWorkers;
+  run.numThreads    = numThreads;
+  memset(&run.hostBytes, 0, sizeof(MemCounter));
+  memset(&run.deviceBytes, 0, sizeof(MemCounter));
+  run.sceneCpuMs = 0.0f;
+  run.sceneGpuMs = 0.0f;
+  run.firstFrame = 0;
+  run.frameMs.reserve(m_numFrames);
+  run.recordMs.reserve(m_numFrames);
+  run.gpuMs.reserve(m_numFrames);
+  return run;
+}
+
+bool BenchmarkReport::writeCSV(const char* fname) const
+{
+  FILE* fp = fopen(fname, "w");
+  if(!fp)
+  {
+    LOGE("Couldn't write %s\n", fname);
+    return false;
+  }
+  // gpu_ms stays empty for the frames without a GPU time
+  fprintf(fp, "renderer,cmdbuffers,workers,threads,frame,frame_ms,record_ms,gpu_ms,hitch\n");
+  for(size_t r = 0; r < m_runs.size(); r++)
+  {
+    const BenchmarkRun& run   = m_runs[r];
+    size_t              hitch = 0;
+    for(size_t f = 0; f < run.frameMs.size(); f++)
+    {
+      bool bHitch = (hitch < run.hitchFrames.size()) && (run.hitchFrames[hitch] == (int)f);
+      if(bHitch)
+        hitch++;
+      char gpu[32] = "";
+      if(run.gpuMs[f] != BENCHMARK_NO_GPU_TIME)
+        sprintf(gpu, "%.4f", run.gpuMs[f]);
+      fprintf(fp, "\"%s\",%d,%d,%d,%d,%.4f,%.4f,%s,%d\n", run.renderer.c_str(), run.numCmdBuffers, run.useWorkers ? 1 : 0,
+              run.numThreads, (int)f, run.frameMs[f], run.recordMs[f], gpu, bHitch ? 1 : 0);
+    }
+  }
+  fclose(fp);
+  return true;
+}
+
+// BENCHMARK_NO_GPU_TIME gets written as null
+static void writeJSONArray(FILE* fp, const char* name, const std::vector<float>& values)
+{
+  fprintf(fp, "      \"%s\": [", name);
+  for(size_t i = 0; i < values.size(); i++)
+  {
+    if(values[i] == BENCHMARK_NO_GPU_TIME)
+      fprintf(fp, i ? ", null" : "null");
+    else
+      fprintf(fp, i ? ", %.4f" : "%.4f", values[i]);
+  }
+  fprintf(fp, "]");
+}
+
+static void writeJSONString(FILE* fp, const std::string& str)
+{
+  fputc('"', fp);
+  for(size_t i = 0; i < str.size(); i++)
+  {
+    char c = str[i];
+    if(c == '"' || c == '\\')
+      fprintf(fp, "\\%c", c);
+    else if(c == '\n')
+      fprintf(fp, "\\n");
+    else if((unsigned char)c >= 0x20)
+      fputc(c, fp);
+  }
+  fputc('"', fp);
+}
+
+static void writeJSONMemoryOwners(FILE* fp, const char* name, const std::vector<MemOwnerStats>& owners)
+{
+  fprintf(fp, "    \"%s\": [", name);
+  for(size_t i = 0; i < owners.size(); i++)
+  {
+    const MemOwnerStats& o = owners[i];
+    fprintf(fp, "%s\n      {\"name\": ", i ? "," : "");
+    writeJSONString(fp, o.name);
+    fprintf(fp, ", \"host_bytes\": %lld, \"host_peak_bytes\": %lld, \"device_bytes\": %lld, \"device_peak_bytes\": %lld}",
+            (long long)o.host.current, (long long)o.host.peak, (long long)o.device.current, (long long)o.device.peak);
+  }
+  fprintf(fp, "%s]", owners.empty() ? "" : "\n    ");
+}
+
+static void writeJSONMemory(FILE* fp)
+{
+  MemCounter                 tags[NUM_MEMTAGS];
+  std::vector<MemOwnerStats> models, renderers;
+  memGetStats(tags, NULL, NULL);
+  memGetModels(models);
+  memGetRenderers(renderers);
+  fprintf(fp, "  \"memory\": {\n    \"tags\": [");
+  for(int t = 0; t < NUM_MEMTAGS; t++)
+  {
+    fprintf(fp, "%s\n      {\"name\": \"%s\", \"device\": %s, \"bytes\": %lld, \"peak_bytes\": %lld}", t ? "," : "",
+            memTagName((MemTag)t), memTagIsDevice((MemTag)t) ? "true" : "false", (long long)tags[t].current, (long long)tags[t].peak);
+  }
+  fprintf(fp, "\n    ],\n");
+  writeJSONMemoryOwners(fp, "models", models);
+  fprintf(fp, ",\n");
+  writeJSONMemoryOwners(fp, "renderers", renderers);
+  fprintf(fp, "\n  }\n");
+}
+
+bool BenchmarkReport::writeJSON(const char* fname) const
+{
+  FILE* fp = fopen(fname, "w");
+  if(!fp)
+  {
+    LOGE("Couldn't write %s\n", fname);
+    return false;
+  }
+  fprintf(fp, "{\n  \"frames\": %d,\n  \"frame_dt\": %.6f,\n  \"runs\": [\n", m_numFrames, m_frameDT);
+  for(size_t r = 0; r < m_runs.size(); r++)
+  {
+    const BenchmarkRun& run = m_runs[r];
+    fprintf(fp, "    {\n");
+    fprintf(fp, "      \"renderer\": \"%s\",\n", run.renderer.c_str());
+    fprintf(fp, "      \"cmdbuffers\": %d,\n", run.numCmdBuffers);
+    fprintf(fp, "      \"workers\": %s,\n", run.useWorkers ? "true" : "false");
+    fprintf(fp, "      \"threads\": %d,\n", run.numThreads);
+    fprintf(fp, "      \"frame_ms_mean\": %.4f,\n", run.frameMean());
+    fprintf(fp, "      \"frame_ms_median\": %.4f,\n", run.framePercentile(0.5f));
+    fprintf(fp, "      \"frame_ms_p95\": %.4f,\n", run.framePercentile(0.95f));
+    fprintf(fp, "      \"frame_ms_p99\": %.4f,\n", run.framePercentile(0.99f));
+    fprintf(fp, "      \"frame_ms_max\": %.4f,\n", run.framePercentile(1.0f));
+    fprintf(fp, "      \"record_ms_median\": %.4f,\n", run.recordPercentile(0.5f));
+    fprintf(fp, "      \"scene_cpu_ms_avg\": %.4f,\n", run.sceneCpuMs);
+    fprintf(fp, "      \"scene_gpu_ms_avg\": %.4f,\n", run.sceneGpuMs);
+    fprintf(fp, "      \"host_bytes\": %lld,\n", (long long)run.hostBytes.current);
+    fprintf(fp, "      \"host_peak_bytes\": %lld,\n", (long long)run.hostBytes.peak);
+    fprintf(fp, "      \"device_bytes\": %lld,\n", (long long)run.deviceBytes.current);
+    fprintf(fp, "      \"device_peak_bytes\": %lld,\n", (long long)run.deviceBytes.peak);
+    fprintf(fp, "      \"hitches\": [");
+    for(size_t h = 0; h < run.hitchFrames.size(); h++)
+    {
+      fprintf(fp, "%s\n        {\"frame\": %d, \"frame_ms\": %.4f, \"profiler\": ", h ? "," : "", run.hitchFrames[h],
+              run.frameMs[run.hitchFrames[h]]);
+      writeJSONString(fp, run.hitchDumps[h]);
+      fprintf(fp, "}");
+    }
+    fprintf(fp, "%s],\n", run.hitchFrames.empty() ? "" : "\n      ");
+    writeJSONArray(fp, "frame_ms", run.frameMs);
+    fprintf(fp, ",\n");
+    writeJSONArray(fp, "record_ms", run.recordMs);
+    fprintf(fp, ",\n");
+    writeJSONArray(fp, "gpu_ms", run.gpuMs);
+    fprintf(fp, "\n    }%s\n", (r + 1 < m_runs.size()) ? "," : "");
+  }
+  fprintf(fp, "  ],\n");
+  writeJSONMemory(fp);
+  fprintf(fp, "}\n");
+  fclose(fp);
+  return true;
+}
+
+void BenchmarkReport::logSummary() const
+{
+  LOGI("benchmark: %d frames per run, dt %.4f s\n", m_numFrames, m_frameDT);
+  LOGI("renderer                 cmdbufs workers threads  mean ms  median   p95     p99     max   scene cpu  scene gpu  hitches  host MB   peak  device MB   peak\n");
+  for(size_t r = 0; r < m_runs.size(); r++)
+  {
+    const BenchmarkRun& run = m_runs[r];
+    LOGI("%-24s %7d %7d %7d %8.3f %7.3f %7.3f %7.3f %7.3f %10.3f %10.3f %8d %8.1f %6.1f %10.1f %6.1f\n", run.renderer.c_str(),
+         run.numCmdBuffers, run.useWorkers ? 1 : 0, run.numThreads, run.frameMean(), run.framePercentile(0.5f),
+         run.framePercentile(0.95f), run.framePercentile(0.99f), run.framePercentile(1.0f), run.sceneCpuMs,
+         run.sceneGpuMs, (int)run.hitchFrames.size(), double(run.hostBytes.current) / (1024.0 * 1024.0),
+         double(run.hostBytes.peak) / (1024.0 * 1024.0), double(run.deviceBytes.current) / (1024.0 * 1024.0),
+         double(run.deviceBytes.peak) / (1024.0 * 1024.0));
+  }
+}
+
+//------------------------------------------------------------------------------
+// scaling
+//------------------------------------------------------------------------------
+void BenchmarkReport::computeScaling(std::vector<BenchmarkScaling>& scaling) const
+{
+  scaling.clear();
+  for(size_t b = 0; b < m_runs.size(); b++)
+  {
+    const BenchmarkRun& base = m_runs[b];
+    if(base.useWorkers || base.frameMs.empty())
+      continue;
+    BenchmarkScaling sc;
+    sc.renderer      = base.renderer;
+    sc.numCmdBuffers = base.numCmdBuffers;
+    sc.serialMs      = base.framePercentile(0.5f);
+    double sxy = 0.0;
+    double sxx = 0.0;
+    for(size_t r = 0; r < m_runs.size(); r++)
+    {
+      const BenchmarkRun& run = m_runs[r];
+      if(!run.useWorkers || run.frameMs.empty() || (run.renderer != base.renderer) || (run.numCmdBuffers != base.numCmdBuffers))
+        continue;
+      int   n  = std::max(run.numThreads, 1);
+      float ms = run.framePercentile(0.5f);
+      float s  = (ms > 0.0f) ? sc.serialMs / ms : 0.0f;
+      sc.numThreads.push_back(n);
+      sc.frameMs.push_back(ms);
+      sc.speedup.push_back(s);
+      sc.efficiency.push_back(s / (float)n);
+      // y = x.s with x = 1 - 1/n and y = ms/serialMs - 1/n
+      double x = 1.0 - 1.0 / (double)n;
+      double y = (sc.serialMs > 0.0f ? (double)ms / (double)sc.serialMs : 1.0) - 1.0 / (double)n;
+      sxy += x * y;
+      sxx += x * x;
+    }
+    if(sc.numThreads.empty())
+      continue;
+    // a single thread count of 1 tells nothing about the serial part
+    sc.serialFraction = (sxx > 0.0) ? (float)std::min(std::max(sxy / sxx, 0.0), 1.0) : 1.0f;
+    scaling.push_back(sc);
+  }
+}
+
+bool BenchmarkReport::writeScalingCSV(const char* fname) const
+{
+  std::vector<BenchmarkScaling> scaling;
+  computeScaling(scaling);
+  FILE* fp = fopen(fname, "w");
+  if(!fp)
+  {
+    LOGE("Couldn't write %s\n", fname);
+    return false;
+  }
+  fprintf(fp, "renderer,cmdbuffers,threads,serial_ms,frame_ms,speedup,efficiency,serial_fraction\n");
+  for(size_t i = 0; i < scaling.size(); i++)
+  {
+    const BenchmarkScaling& sc = scaling[i];
+    for(size_t t = 0; t < sc.numThreads.size(); t++)
+    {
+      fprintf(fp, "\"%s\",%d,%d,%.4f,%.4f,%.3f,%.3f,%.4f\n", sc.renderer.c_str(), sc.numCmdBuffers, sc.numThreads[t],
+              sc.serialMs, sc.frameMs[t], sc.speedup[t], sc.efficiency[t], sc.serialFraction);
+    }
+  }
+  fclose(fp);
+  return true;
+}
+
+void BenchmarkReport::logScaling() const
+{
+  std::vector<BenchmarkScaling> scaling;
+  computeScaling(scaling);
+  for(size_t i = 0; i < scaling.size(); i++)
+  {
+    const BenchmarkScaling& sc = scaling[i];
+    LOGI("scaling: %s, %d command-buffers, serial %.3f ms, serial fraction %.3f (speedup bound %.1f)\n", sc.renderer.c_str(),
+         sc.numCmdBuffers, sc.serialMs, sc.serialFraction, sc.serialFraction > 0.0f ? 1.0f / sc.serialFraction : 0.0f);
+    LOGI("  threads  frame ms  speedup  efficiency\n");
+    for(size_t t = 0; t < sc.numThreads.size(); t++)
+      LOGI("  %7d %9.3f %8.2f %10.2f\n", sc.numThreads[t], sc.frameMs[t], sc.speedup[t], sc.efficiency[t]);
+  }
+}
+
+//------------------------------------------------------------------------------
+// API report
+//------------------------------------------------------------------------------
+void ApiReport::addRow(const char* name)
+{
+  m_rows.push_back(name);
+}
+
+void ApiReport::addColumn(const char* renderer, const std::vector<double>& values)
+{
+  m_columns.push_back(renderer);
+  m_values.push_back(values);
+  m_values.back().resize(m_rows.size(), 0.0);
+}
+
+void ApiReport::log() const
+{
+  std::string line = "counter                ";
+  for(size_t c = 0; c < m_columns.size(); c++)
+  {
+    char col[64];
+    snprintf(col, sizeof(col), c ? " %20.20s  ratio" : " %20.20s", m_columns[c].c_str());
+    line += col;
+  }
+  LOGI("%s\n", line.c_str());
+  for(size_t r = 0; r < m_rows.size(); r++)
+  {
+    char col[64];
+    snprintf(col, sizeof(col), "%-22.22s ", m_rows[r].c_str());
+    line = col;
+    double base = m_values.empty() ? 0.0 : m_values[0][r];
+    for(size_t c = 0; c < m_columns.size(); c++)
+    {
+      double v = m_values[c][r];
+      snprintf(col, sizeof(col), " %20.3f", v);
+      line += col;
+      if(c == 0)
+        continue;
+      if(base != 0.0)
+        snprintf(col, sizeof(col), " %6.2f", v / base);
+      else
+        snprintf(col, sizeof(col), "      -");
+      line += col;
+    }
+    LOGI("%s\n", line.c_str());
+  }
+}
+
+bool ApiReport::writeCSV(const char* fname) const
+{
+  FILE* fp = fopen(fname, "w");
+  if(!fp)
+  {
+    LOGE("Couldn't write %s\n", fname);
+    return false;
+  }
+  fprintf(fp, "counter");
+  for(size_t c = 0; c < m_columns.size(); c++)
+    fprintf(fp, ",\"%s\"", m_columns[c].c_str());
+  fprintf(fp, "\n");
+  for(size_t r = 0; r < m_rows.size(); r++)
+  {
+    fprintf(fp, "%s", m_rows[r].c_str());
+    for(size_t c = 0; c < m_columns.size(); c++)
+      fprintf(fp, ",%.4f", m_values[c][r]);
+    fprintf(fp, "\n");
+  }
+  fclose(fp);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// list of integers like 0,2,4-7
+//------------------------------------------------------------------------------
+bool parseIntList(const char* str, std::vector<int>& values)
+{
+  values.clear();
+  const char* p = str;
+  while(*p)
+  {
+    char* end;
+    int   first = (int)strtol(p, &end, 10);
+    int   last  = first;
+    if(end == p)
+      return false;
+    if(*end == '-')
+    {
+      p    = end + 1;
+      last = (int)strtol(p, &end, 10);
+      if(end == p || last < first)
+        return false;
+    }
+    for(int c = first; c <= last; c++)
+      values.push_back(c);
+    if(*end != ',' && *end != '\0')
+      return false;
+    p = (*end == ',') ? end + 1 : end;
+  }
+  return !values.empty();
+}
+
+//------------------------------------------------------------------------------
+// Command-line
+//------------------------------------------------------------------------------
+BenchmarkOptions g_benchOptions;
+
+BenchmarkOptions::BenchmarkOptions()
+    : headlessFrames(0)
+    , benchmarkFrames(0)
+    , apiReportFrames(0)
+    , autoTuneFrames(0)
+    , useTuning(true)
+    , tuneFileName(NULL)
+    , scaling(false)
+    , outName("benchmark")
+    , replayFileName(NULL)
+    , replayLoops(0)
+{
+}
+
+bool parseBenchmarkArg(int argc, const char** argv, int& i)
+{
+  BenchmarkOptions& opt = g_benchOptions;
+#ifdef USEWORKERS
+  if((strcmp(argv[i], "-benchthreads") == 0) && (i < argc - 1))
+  {
+    if(!parseIntList(argv[++i], opt.threads))
+      LOGE("Wrong thread list %s\n", argv[i]);
+    return true;
+  }
+  if((strcmp(argv[i], "-scaling") == 0) && (i < argc - 1))
+  {
+    // headless benchmark: the lists not given on the command-line get their defaults in finishBenchmarkArgs()
+    opt.benchmarkFrames = std::max(atoi(argv[++i]), 1);
+    opt.headlessFrames  = opt.benchmarkFrames;
+    opt.scaling         = true;
+    LOGI("scaling: %d frames per configuration with the null renderer\n", opt.benchmarkFrames);
+    return true;
+  }
+#endif
+  if((strcmp(argv[i], "-headless") == 0) && (i < argc - 1))
+  {
+    opt.headlessFrames = std::max(atoi(argv[++i]), 1);
+    LOGI("headless: %d frames with the null renderer\n", opt.headlessFrames);
+    return true;
+  }
+  if((strcmp(argv[i], "-benchmark") == 0) && (i < argc - 1))
+  {
+    opt.benchmarkFrames = std::max(atoi(argv[++i]), 1);
+    LOGI("benchmark: %d frames per configuration\n", opt.benchmarkFrames);
+    return true;
+  }
+  if((strcmp(argv[i], "-autotune") == 0) && (i < argc - 1))
+  {
+    opt.autoTuneFrames = std::max(atoi(argv[++i]), 1);
+    LOGI("auto-tune: %d frames per configuration\n", opt.autoTuneFrames);
+    return true;
+  }
+  if((strcmp(argv[i], "-tunefile") == 0) && (i < argc - 1))
+  {
+    opt.tuneFileName = argv[++i];
+    return true;
+  }
+  if(strcmp(argv[i], "-notune") == 0)
+  {
+    opt.useTuning = false;
+    return true;
+  }
+  if((strcmp(argv[i], "-apireport") == 0) && (i < argc - 1))
+  {
+    opt.apiReportFrames = std::max(atoi(argv[++i]), 1);
+    LOGI("API report: %d frames per renderer\n", opt.apiReportFrames);
+    return true;
+  }
+  if((strcmp(argv[i], "-benchrenderers") == 0) && (i < argc - 1))
+  {
+    if(!parseIntList(argv[++i], opt.renderers))
+      LOGE("Wrong renderer list %s\n", argv[i]);
+    return true;
+  }
+  if((strcmp(argv[i], "-benchcmdbuffers") == 0) && (i < argc - 1))
+  {
+    if(!parseIntList(argv[++i], opt.cmdBuffers))
+      LOGE("Wrong command-buffer list %s\n", argv[i]);
+    return true;
+  }
+  if((strcmp(argv[i], "-benchworkers") == 0) && (i < argc - 1))
+  {
+    if(!parseIntList(argv[++i], opt.workers))
+      LOGE("Wrong worker list %s\n", argv[i]);
+    return true;
+  }
+  if((strcmp(argv[i], "-benchout") == 0) && (i < argc - 1))
+  {
+    opt.outName = argv[++i];
+    return true;
+  }
+  if((strcmp(argv[i], "-replay") == 0) && (i < argc - 2))
+  {
+    opt.replayFileName = argv[++i];
+    opt.replayLoops    = std::max(atoi(argv[++i]), 1);
+    LOGI("replay: %s, %d times\n", opt.replayFileName, opt.replayLoops);
+    return true;
+  }
+  return false;
+}
+
+void finishBenchmarkArgs()
+{
+#ifdef USEWORKERS
+  BenchmarkOptions& opt = g_benchOptions;
+  if(!opt.scaling)
+    return;
+  // 1, 2, 4... up to the physical cores, against the main thread alone
+  if(opt.threads.empty())
+  {
+    for(int n = 1; n < CThread::PhysicalCoreCount(); n *= 2)
+      opt.threads.push_back(n);
+    opt.threads.push_back(CThread::PhysicalCoreCount());
+  }
+  if(opt.workers.empty())
+    opt.workers = {0, 1};
+  if(opt.cmdBuffers.empty())
+    opt.cmdBuffers = {4, 16, 64, MAXCMDBUFFERS};
+#endif
+}
+
+//------------------------------------------------------------------------------
+// the GPU times that came back during the last frame of the target
+//------------------------------------------------------------------------------
+static void setGpuTimes(const BenchmarkTarget& target, BenchmarkRun& run)
+{
+  const std::vector<GpuFrameTime>& gpuFrames = target.gpuFrames();
+  for(size_t i = 0; i < gpuFrames.size(); i++)
+    run.setGpuTime(gpuFrames[i].frame, gpuFrames[i].gpuMs);
+}
+//------------------------------------------------------------------------------
+// renders the frames of one configuration into run
+//------------------------------------------------------------------------------
+bool runBenchmarkFrames(BenchmarkTarget& target, int numFrames, BenchmarkRun& run)
+{
+  // hitches are relative to the frames of this configuration
+  FrameTimeMonitor& frameTimes = target.frameTimes();
+  frameTimes.clear();
+  for(int f = -BENCHMARK_WARMUP_FRAMES; f < numFrames; f++)
+  {
+    if(f == 0)
+      g_profiler.reset(1);
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    if(!target.renderFrame(std::max(f, 0)))
+      return false;
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    if(f < 0)
+      continue;
+    if(f == 0)
+      run.firstFrame = target.frameNumber() - 1;
+    run.addFrame((float)ms, (float)target.recordMs());
+    if(frameTimes.lastFrameHitch())
+      run.addHitch(frameTimes.hitches().back().profilerDump);
+    // the GPU times of frames N-k, once the GPU finished them
+    setGpuTimes(target, run);
+  }
+  // the last frames of the run, still on the GPU
+  target.finishGpuFrames();
+  setGpuTimes(target, run);
+  run.sampleMemory();
+  // the profiler averages its sections over a few frames and its GPU times come back a few
+  // frames late: the run only gets its averages, after the last frame
+  nvh::Profiler::TimerInfo info;
+  bool                     bScene = g_profiler.getTimerInfo("scene", info);
+  run.sceneCpuMs                  = bScene ? float(info.cpu.average / 1000.0) : 0.0f;
+  run.sceneGpuMs                  = bScene ? float(info.gpu.average / 1000.0) : 0.0f;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// -benchmark <frames>: for each configuration of the sweep (renderers x
+// command-buffers x workers x threads), renders BENCHMARK_WARMUP_FRAMES frames
+// then <frames> measured frames along the camera path, at a fixed time-step.
+// Writes the times of the frames to <name>.csv and <name>.json. When the sweep
+// has runs without workers, their speedup goes to <name>_scaling.csv.
+// Headless: the null renderer is the only one
+//------------------------------------------------------------------------------
+void runBenchmark(BenchmarkTarget& target, int numFrames)
+{
+  const BenchmarkOptions& opt        = g_benchOptions;
+  BenchmarkConfig         config     = target.config();
+  std::vector<int>        renderers  = opt.renderers;
+  std::vector<int>        cmdBuffers = opt.cmdBuffers;
+  std::vector<int>        workers    = opt.workers;
+  std::vector<int>        threads    = opt.threads;
+  if(!target.hasWindow() || renderers.empty())
+    renderers.assign(1, -1);
+  if(cmdBuffers.empty())
+    cmdBuffers.assign(1, config.numCmdBuffers);
+#ifdef USEWORKERS
+  if(workers.empty())
+    workers.assign(1, config.useWorkers ? 1 : 0);
+  if(threads.empty())
+    threads.assign(1, config.numThreads);
+#else
+  workers.assign(1, 0);
+  threads.assign(1, 1);
+#endif
+
+  BenchmarkReport report(numFrames, BENCHMARK_DT);
+  bool            bClosed = false;
+  for(int r = 0; (r < renderers.size()) && !bClosed; r++)
+  {
+    if(!target.switchRenderer(renderers[r]))
+    {
+      LOGE("benchmark: no renderer %d\n", renderers[r]);
+      continue;
+    }
+    // memory peaks of the runs of this renderer: not the ones of the renderer it replaced
+    memResetPeaks();
+    for(int c = 0; (c < cmdBuffers.size()) && !bClosed; c++)
+    {
+      for(int w = 0; (w < workers.size()) && !bClosed; w++)
+      {
+        // without workers, the main thread records alone: a single run whatever the pool
+        int numThreadRuns = workers[w] ? (int)threads.size() : 1;
+        for(int t = 0; (t < numThreadRuns) && !bClosed; t++)
+        {
+          config               = target.config();
+          config.numCmdBuffers = cmdBuffers[c];
+          config.useWorkers    = workers[w] ? true : false;
+          if(workers[w] && (threads[t] > 0))
+            config.numThreads = threads[t];
+          target.setConfig(config);
+          target.destroyCommandBuffers();
+          config         = target.config();
+          int numThreads = config.useWorkers ? config.numThreads : 1;
+          LOGI("benchmark: %s, %d command-buffers, workers %d, %d threads\n", target.renderer()->getName(),
+               config.numCmdBuffers, workers[w], numThreads);
+          BenchmarkRun& run = report.beginRun(target.renderer()->getName(), config.numCmdBuffers, config.useWorkers, numThreads);
+          // window closed: what got measured so far still gets written
+          bClosed = !runBenchmarkFrames(target, numFrames, run);
+        }
+      }
+    }
+  }
+  target.endFrames();
+  report.logSummary();
+  report.logScaling();
+  logMemStats();
+  std::string name(opt.outName);
+  if(report.writeCSV((name + ".csv").c_str()) && report.writeJSON((name + ".json").c_str()))
+    LOGI("benchmark: results written to %s.csv and %s.json\n", opt.outName, opt.outName);
+  std::vector<BenchmarkScaling> scaling;
+  report.computeScaling(scaling);
+  if(!scaling.empty() && report.writeScalingCSV((name + "_scaling.csv").c_str()))
+    LOGI("benchmark: speedups written to %s_scaling.csv\n", opt.outName);
+}
+
+//------------------------------------------------------------------------------
+// -apireport <frames>: renders the camera path of -benchmark with each renderer
+// (the ones of -benchrenderers, or all of them), in the current configuration
+// of command-buffers and workers. Then tabulates what each one issued for the
+// scene: the statistics of the models after the last frame, and the times.
+// Written to <benchout>_api.csv. Headless: the null renderer alone
+//------------------------------------------------------------------------------
+void runApiReport(BenchmarkTarget& target, int numFrames)
+{
+  std::vector<int> renderers = g_benchOptions.renderers;
+  if(!target.hasWindow())
+    renderers.assign(1, -1);
+  else if(renderers.empty())
+  {
+    for(int r = 0; r < g_numRenderers; r++)
+      renderers.push_back(r);
+  }
+
+  ApiReport report;
+  report.addRow("drawcalls");
+  report.addRow("primitives");
+  report.addRow("state_binds");
+  report.addRow("buffer_binds");
+  report.addRow("descriptor_binds");
+  report.addRow("attr_updates");
+  report.addRow("uniform_updates");
+  report.addRow("tokens");
+  report.addRow("bytes_recorded");
+  report.addRow("token_bytes");
+  report.addRow("frame_ms_median");
+  report.addRow("scene_cpu_ms_avg");
+  report.addRow("scene_gpu_ms_avg");
+  for(int r = 0; r < renderers.size(); r++)
+  {
+    if(!target.switchRenderer(renderers[r]))
+    {
+      LOGE("API report: no renderer %d\n", renderers[r]);
+      continue;
+    }
+    target.destroyCommandBuffers();
+    LOGI("API report: %s\n", target.renderer()->getName());
+    BenchmarkRun run;
+    if(!runBenchmarkFrames(target, numFrames, run))
+      break;
+    Bk3dModel::Stats stats;
+    memset(&stats, 0, sizeof(Bk3dModel::Stats));
+    for(int m = 0; m < g_bk3dModels.size(); m++)
+      g_bk3dModels[m]->addStats(stats);
+    std::vector<double> values;
+    values.push_back(stats.drawcalls);
+    values.push_back(stats.primitives);
+    values.push_back(stats.state_binds);
+    values.push_back(stats.buffer_binds);
+    values.push_back(stats.descriptor_binds);
+    values.push_back(stats.attr_update);
+    values.push_back(stats.uniform_update);
+    values.push_back(stats.tokens);
+    values.push_back(stats.bytes_recorded);
+    values.push_back(stats.token_bytes);
+    values.push_back(run.framePercentile(0.5f));
+    values.push_back(run.sceneCpuMs);
+    values.push_back(run.sceneGpuMs);
+    report.addColumn(target.renderer()->getName(), values);
+  }
+  target.endFrames();
+  BenchmarkConfig config = target.config();
+  LOGI("API report: %d command-buffers, workers %d. Ratios against the first renderer\n", config.numCmdBuffers,
+       config.useWorkers ? 1 : 0);
+  report.log();
+  std::string name = std::string(g_benchOptions.outName) + "_api.csv";
+  if(report.writeCSV(name.c_str()))
+    LOGI("API report: written to %s\n", name.c_str());
+}
+
+//------------------------------------------------------------------------------
+// -headless <frames>: renders the frames with the null renderer, from the first
+// viewpoint of the camera path, recording the command-buffers each frame.
+// Then reports the CPU time of the frames and what got recorded
+//------------------------------------------------------------------------------
+void runHeadless(BenchmarkTarget& target, int numFrames)
+{
+  double totalMs = 0.0;
+  double minMs   = 1e30;
+  double maxMs   = 0.0;
+  for(int f = 0; f < numFrames; f++)
+  {
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    target.renderFrame(0);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    totalMs += ms;
+    minMs = std::min(minMs, ms);
+    maxMs = std::max(maxMs, ms);
+  }
+  target.endFrames();
+  Bk3dModel::Stats stats;
+  memset(&stats, 0, sizeof(Bk3dModel::Stats));
+  for(int m = 0; m < g_bk3dModels.size(); m++)
+    g_bk3dModels[m]->addStats(stats);
+  const FrameTimeMonitor& frameTimes = target.frameTimes();
+  LOGI("headless: %d frames, %.3f ms per frame (min %.3f, max %.3f)\n", numFrames, numFrames ? totalMs / numFrames : 0.0,
+       numFrames ? minMs : 0.0, maxMs);
+  LOGI("headless: %u draw calls, %u primitives, %u vertex buffer and %u object data updates per frame\n",
+       stats.drawcalls, stats.primitives, stats.attr_update, stats.uniform_update);
+  LOGI("headless: frame p50 %.3f ms, p95 %.3f, p99 %.3f, max %.3f over the last %d frames; %d hitches\n",
+       frameTimes.frameMs.percentile(0.5f), frameTimes.frameMs.percentile(0.95f), frameTimes.frameMs.percentile(0.99f),
+       frameTimes.frameMs.percentile(1.0f), frameTimes.frameMs.size(), frameTimes.numHitches());
+}
+
+//------------------------------------------------------------------------------
+// -autotune first: the other modes then run with what it found
+//------------------------------------------------------------------------------
+bool runBenchmarkModes(BenchmarkTarget& target)
+{
+  const BenchmarkOptions& opt = g_benchOptions;
+  if(opt.autoTuneFrames > 0)
+    runAutoTune(target, opt.autoTuneFrames);
+  if(opt.apiReportFrames > 0)
+    runApiReport(target, opt.apiReportFrames);
+  else if(opt.benchmarkFrames > 0)
+    runBenchmark(target, opt.benchmarkFrames);
+  else if(!target.hasWindow())
+    runHeadless(target, opt.headlessFrames);
+  else
+    return false;
+  return true;
+}
@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+#include <string>
+#include <vector>
+
+#include "allocstats.h"
+#include "frametimes.h"
+
+class Renderer;
+
+//
+// the camera path replayed at a fixed time-step: frame N shows the same view on
+// any machine and at any frame-rate. Each configuration starts with a few frames
+// that aren't measured
+//
+#define BENCHMARK_DT (1.0f / 60.0f)
+#define BENCHMARK_WARMUP_FRAMES 10
+// GPU time of a frame the renderer didn't give (OpenGL, or not back from the GPU)
+#define BENCHMARK_NO_GPU_TIME -1.0f
+
+//------------------------------------------------------------------------------
+// Results of "-benchmark": one run per configuration of the sweep
+// (renderer x command-buffers x workers), each with the times of its frames.
+// Times are in milliseconds
+//------------------------------------------------------------------------------
+struct BenchmarkRun
+{
+  std::string renderer;
+  int         numCmdBuffers;
+  bool        useWorkers;
+  int         numThreads;
+  // one entry per measured frame
+  std::vector<float> frameMs;   // CPU wall time of the whole frame
+  std::vector<float> recordMs;  // CPU wall time of renderFrame(): recording, consolidation and submission
+  std::vector<float> gpuMs;     // GPU time of the whole frame, from its own timestamps. Or BENCHMARK_NO_GPU_TIME
+  int                firstFrame;  // BenchmarkTarget::frameNumber() of the first measured frame
+  // "scene" section of g_profiler at the end of the run. The profiler only keeps averages
+  // and gets its GPU times back a few frames late: these are not per frame
+  float sceneCpuMs;
+  float sceneGpuMs;
+  // frames flagged by FrameTimeMonitor, and the profiler at their end: its averages
+  // over the last frames, not the times of the hitch itself
+  std::vector<int>         hitchFrames;
+  std::vector<std::string> hitchDumps;
+  // memory accounting at the end of the run, in bytes. Peaks since the renderer got selected
+  MemCounter hostBytes;
+  MemCounter deviceBytes;
+
+  void  addFrame(float frame, float record);  // its GPU time comes later, see setGpuTime()
+  void  setGpuTime(int frame, float gpu);     // frame: BenchmarkTarget::frameNumber(). Ignored if not measured
+  void  addHitch(const std::string& profilerDump);  // on the last frame added
+  void  sampleMemory();
+  // p in [0,1] on the frame times: 0.5 for the median, 1 for the max
+  float framePercentile(float p) const;
+  float recordPercentile(float p) const;
+  float frameMean() const;
+};
+
+//------------------------------------------------------------------------------
+// speedup of the runs with workers over the one without (the serial baseline),
+// for a renderer and a number of command-buffers. On the median frame times
+//------------------------------------------------------------------------------
+struct BenchmarkScaling
+{
+  std::string renderer;
+  int         numCmdBuffers;
+  float       serialMs;
+  // one entry per run with workers
+  std::vector<int>   numThreads;
+  std::vector<float> frameMs;
+  std::vector<float> speedup;     // serialMs / frameMs
+  std::vector<float> efficiency;  // speedup / numThreads
+  // Amdahl: frameMs / serialMs ~= s + (1 - s) / numThreads, least-squares fit of s
+  float serialFraction;
+};
+
+class BenchmarkReport
+{
+public:
+  BenchmarkReport(int numFrames, float frameDT)
+      : m_numFrames(numFrames)
+      , m_frameDT(frameDT)
+  {
+  }
+  BenchmarkRun& beginRun(const char* renderer, int numCmdBuffers, bool useWorkers, int numThreads);
+
+  // one line per frame
+  bool writeCSV(const char* fname) const;
+  // the configurations, their summary and the times of the frames. Then the
+  // memory breakdown per tag, model and renderer at the time of the call
+  bool writeJSON(const char* fname) const;
+  // one line per run
+  void logSummary() const;
+
+  // needs runs without workers: one BenchmarkScaling per renderer and number of command-buffers
+  void computeScaling(std::vector<BenchmarkScaling>& scaling) const;
+  bool writeScalingCSV(const char* fname) const;
+  void logScaling() const;
+
+  const std::vector<BenchmarkRun>& runs() const { return m_runs; }
+
+private:
+  int                       m_numFrames;
+  float                     m_frameDT;
+  std::vector<BenchmarkRun> m_runs;
+};
+
+//------------------------------------------------------------------------------
+// "-apireport": the same scene through each renderer, one column per renderer
+// and one row per counter (state binds, tokens, bytes...). Ratios are against
+// the first column
+//------------------------------------------------------------------------------
+class ApiReport
+{
+public:
+  void addRow(const char* name);
+  // values in the order of the rows
+  void addColumn(const char* renderer, const std::vector<double>& values);
+
+  void log() const;
+  bool writeCSV(const char* fname) const;
+
+private:
+  std::vector<std::string>         m_rows;
+  std::vector<std::string>         m_columns;
+  std::vector<std::vector<double>> m_values;  // [column][row]
+};
+
+// "4,16,64" or "1-4": false if the list is malformed
+bool parseIntList(const char* str, std::vector<int>& values);
+
+//------------------------------------------------------------------------------
+// The command-line of the modes below, from parseBenchmarkArg()
+//------------------------------------------------------------------------------
+struct BenchmarkOptions
+{
+  int              headlessFrames;   // -headless <frames>: null renderer, no window
+  int              benchmarkFrames;  // -benchmark <frames>, -scaling <frames>
+  int              apiReportFrames;  // -apireport <frames>
+  int              autoTuneFrames;   // -autotune <frames>
+  bool             useTuning;        // false with -notune
+  const char*      tuneFileName;     // -tunefile. NULL: tuneFileName()
+  bool             scaling;          // -scaling: the lists not given get the defaults of finishBenchmarkArgs()
+  std::vector<int> renderers;        // -benchrenderers. empty: the current renderer
+  std::vector<int> cmdBuffers;       // -benchcmdbuffers. empty: the current number
+  std::vector<int> workers;          // -benchworkers. empty: the current use of the workers
+  std::vector<int> threads;          // -benchthreads. empty: the current pool. Re-created for each count
+  const char*      outName;          // -benchout: prefix of the result files
+  const char*      replayFileName;   // -replay <file> <loops>
+  int              replayLoops;
+
+  BenchmarkOptions();
+};
+extern BenchmarkOptions g_benchOptions;
+
+// true if argv[i] is one of the options above: i then is on its last value
+bool parseBenchmarkArg(int argc, const char** argv, int& i);
+// once all the arguments are parsed
+void finishBenchmarkArgs();
+
+//------------------------------------------------------------------------------
+// What the modes need of the sample (gl_vk_bk3dthreaded.cpp), with its window
+// or headless, where the null renderer is the only one
+//------------------------------------------------------------------------------
+struct BenchmarkConfig
+{
+  int  numCmdBuffers;
+  bool useWorkers;
+  int  numThreads;         // of the pool of workers
+  bool refreshCmdBuffers;  // records the command-buffers each frame
+  int  pipelineDepth;      // 2: the recording of a frame overlaps the end of the previous one
+};
+
+class BenchmarkTarget
+{
+public:
+  virtual ~BenchmarkTarget() {}
+
+  virtual bool      hasWindow() const = 0;
+  virtual Renderer* renderer() const  = 0;
+  // the renderer #index of g_renderers, -1 for the current one: false if there is
+  // no such renderer (any but -1 when headless)
+  virtual bool switchRenderer(int index) = 0;
+
+  virtual BenchmarkConfig config() const = 0;
+  // the command-buffers get destroyed when what they depend on changes, the pool
+  // re-created for another number of threads
+  virtual void setConfig(const BenchmarkConfig& config) = 0;
+  // with the workers that recorded them: the next frames record them again
+  virtual void destroyCommandBuffers() = 0;
+
+  // the whole frame at the position <frame> of the camera path: false if the
+  // window got closed. Feeds frameTimes()
+  virtual bool renderFrame(int frame) = 0;
+  // back to the camera of the window, once the recording ahead is done
+  virtual void endFrames() = 0;
+  // wall time of the recording and submission of the last frame
+  virtual double            recordMs() const = 0;
+  virtual FrameTimeMonitor& frameTimes()     = 0;
+  // number of the frame renderFrame() renders next: the one of the GPU times
+  virtual int frameNumber() const = 0;
+  // GPU times of earlier frames that came back during the last renderFrame(). None
+  // with the renderers that don't measure them
+  virtual const std::vector<GpuFrameTime>& gpuFrames() const = 0;
+  // waits for the GPU: gpuFrames() then holds the frames that didn't come back yet
+  virtual void finishGpuFrames() = 0;
+
+  // for the frames a mode issues itself (-replay): false if the window got closed
+  virtual bool pollEvents() = 0;
+  // blit and swap of the window, if any
+  virtual void present() = 0;
+};
+
+// the frames of one configuration, after BENCHMARK_WARMUP_FRAMES: false if the
+// window got closed
+bool runBenchmarkFrames(BenchmarkTarget& target, int numFrames, BenchmarkRun& run);
+// -benchmark and -scaling, see benchmark.cpp
+void runBenchmark(BenchmarkTarget& target, int numFrames);
+// -apireport
+void runApiReport(BenchmarkTarget& target, int numFrames);
+// -headless alone
+void runHeadless(BenchmarkTarget& target, int numFrames);
+// the modes of g_benchOptions but -replay: false if none of them ends the sample
+bool runBenchmarkModes(BenchmarkTarget& target);
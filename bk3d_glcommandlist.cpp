@@ -22,9 +22,11 @@
 #define EXTERNSVCUI
 #define WINDOWINERTIACAMERA_EXTERN
 #define EMUCMDLIST_EXTERN
+#include "allocstats.h"
 #include "gl_vk_bk3dthreaded.h"
 #include "helper_fbo.h"
 #include <nvgl/profiler_gl.hpp>
+#include "mt/CThreadWork.h"
 
 #define GRIDDEF 20
 #define GRIDSZ 1.0f
@@ -315,6 +317,7 @@ public:
 
   virtual bool buildPrimaryCmdBuffer();
   virtual bool deleteCmdBuffers();
+  virtual void prepareCmdBuffersModel(Bk3dModel* pModel, int numSlices, const int* sliceStarts);
   virtual bool buildCmdBufferModel(Bk3dModel* pModel, int bufIdx, int mstart, int mend);
   virtual void consolidateCmdBuffersModel(Bk3dModel* pModel, int numCmdBuffers);
   virtual bool deleteCmdBufferModel(Bk3dModel* pModel);
@@ -352,9 +355,23 @@ private:
   Bk3dModel*         m_pGenericModel;
   int                m_numUsedCmdBuffers;
   CommandStatesBatch m_commandModel2[MAXCMDBUFFERS];
-  std::string        m_tokenBufferModel2[MAXCMDBUFFERS];  // contains the commands to send to the GPU for setup and draw
+  TokenWriter        m_tokenBufferModel2[MAXCMDBUFFERS];  // contains the commands to send to the GPU for setup and draw
+  Bk3dModel::Stats   m_sliceStats[MAXCMDBUFFERS];
   CommandStatesBatch m_commandModel;  // used to gather the GPU pointers of a single batch and where states/fbos do change
   TokenBuffer m_tokenBufferModel;     // contains the commands to send to the GPU for setup and draw
+  size_t      m_tokenBufferModelSz;   // of m_tokenBufferModel.bufferID: only re-allocated to grow
+  TokenOptimizer m_tokenOptimizer;    // peephole pass on m_tokenBufferModel
+  //
+  // zero-copy mode (g_bZeroCopyTokens): the slices write their tokens straight into
+  // m_tokenRing, at the offsets of the prefix sum of their size estimates
+  //
+  TokenRing m_tokenRing;
+  bool      m_bZeroCopyFrame;                    // the slices being recorded go to m_tokenRing
+  int       m_displayedRegion;                   // region of m_tokenRing in m_commandModel, or -1
+  int       m_numSlices;
+  size_t    m_sliceOffsets[MAXCMDBUFFERS + 1];   // in the current region of m_tokenRing
+  size_t    m_sliceEstimates[MAXCMDBUFFERS];     // kept as long as the slice has the same meshes
+  int       m_estimateRanges[MAXCMDBUFFERS][2];  // meshes of m_sliceEstimates
 
   std::vector<BufO> m_ObjVBOs;
   std::vector<BufO> m_ObjEBOs;
@@ -389,10 +406,14 @@ public:
   bool   deleteCommandListData();
   GLenum topologyWithoutStrips(GLenum topologyGL);
   GLuint findStateOrCreate(bk3d::Mesh* pMesh, bk3d::PrimGroup* pPG);
-  bool   buildCmdBuffer(RendererCMDList* pRenderer, int bufIdx, int mstart, int mend);
+  size_t estimateCmdBufferSize(int mstart, int mend);
+  void   prepareCmdBuffers(int numSlices, const int* sliceStarts);
+  bool   buildCmdBuffer(RendererCMDList* pRenderer, int bufIdx, int mstart, int mend, bool bToRing = true);
   void   init_command_list();
   void   update_fbo_target(GLuint fbo);
   void   consolidateCmdBuffers(int numCmdBuffers);
+  void   uploadTokenBuffer();
+  void   trackTokenMemory();
   bool   initResourcesObject();
   bool   deleteResourcesObject();
   void displayObject(Renderer* pRenderer, const glm::mat4& cameraView, const glm::mat4 projection, unsigned char topologies);
@@ -492,6 +513,7 @@ bool RendererCMDList::deleteResourcesGrid()
     grid::vboCrossSz   = 0;
     grid::vboCrossAddr = 0;
   }
+  memUntrack(MEMTAG_VERTEX_BUFFERS, NULL, this);
   return true;
 }
 //------------------------------------------------------------------------------
@@ -533,6 +555,7 @@ bool RendererCMDList::initResourcesGrid()
   // make the buffer resident and get its pointer
   glGetNamedBufferParameterui64vNV(grid::vboCross, GL_BUFFER_GPU_ADDRESS_NV, &grid::vboCrossAddr);
   glMakeNamedBufferResidentNV(grid::vboCross, GL_READ_WRITE);
+  memTrack(MEMTAG_VERTEX_BUFFERS, NULL, this, grid::vboSz + grid::vboCrossSz);
   return true;
 }
 //------------------------------------------------------------------------------
@@ -545,6 +568,8 @@ void cleanTokenBufferGrid()
   grid::tokenBuffer.bufferAddr = 0;
   grid::tokenBuffer.data.clear();
   grid::command.release();
+  memUntrack(MEMTAG_TOKENS, NULL, &s_renderer);
+  memUntrack(MEMTAG_TOKEN_BUFFERS, NULL, &s_renderer);
 }
 
 //------------------------------------------------------------------------------
@@ -584,6 +609,8 @@ bool RendererCMDList::buildPrimaryCmdBuffer()
   glNamedBufferData(grid::tokenBuffer.bufferID, data.size(), &data[0], GL_STATIC_DRAW);
   glGetNamedBufferParameterui64vNV(grid::tokenBuffer.bufferID, GL_BUFFER_GPU_ADDRESS_NV, &grid::tokenBuffer.bufferAddr);
   glMakeNamedBufferResidentNV(grid::tokenBuffer.bufferID, GL_READ_WRITE);
+  memTrack(MEMTAG_TOKENS, NULL, this, data.size());
+  memTrack(MEMTAG_TOKEN_BUFFERS, NULL, this, data.size());
   //
   // Build the tables for the command-state batch
   //
@@ -777,6 +804,8 @@ bool RendererCMDList::initGraphics(int w, int h, int MSAA)
   glGetNamedBufferParameterui64vNV(g_uboLight.Id, GL_BUFFER_GPU_ADDRESS_NV, (GLuint64EXT*)&g_uboLight.Addr);
   glMakeNamedBufferResidentNV(g_uboLight.Id, GL_READ_WRITE);
   //glBindBufferBase(GL_UNIFORM_BUFFER,UBO_LIGHT, g_uboLight.Id);
+  memTrackName(this, getName());
+  memTrack(MEMTAG_UNIFORM_BUFFERS, NULL, this, g_uboMatrix.Sz + g_uboLight.Sz);
   //
   // Misc OGL setup
   //
@@ -897,6 +926,7 @@ bool RendererCMDList::terminateGraphics()
   s_vao = 0;
   g_uboLight.release();
   g_uboMatrix.release();
+  memUntrack(MEMTAG_UNIFORM_BUFFERS, NULL, this);
   grid::shader.cleanup();
   Bk3dModelCMDList::shader.cleanup();
   Bk3dModelCMDList::shaderLine.cleanup();
@@ -951,6 +981,13 @@ bool RendererCMDList::releaseResourcesModel(Bk3dModel* pModel)
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
+void RendererCMDList::prepareCmdBuffersModel(Bk3dModel* pModel, int numSlices, const int* sliceStarts)
+{
+  ((Bk3dModelCMDList*)pModel->m_pRendererData)->prepareCmdBuffers(numSlices, sliceStarts);
+}
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
 bool RendererCMDList::buildCmdBufferModel(Bk3dModel* pModel, int bufIdx, int mstart, int mend)
 {
   return ((Bk3dModelCMDList*)pModel->m_pRendererData)->buildCmdBuffer(this, bufIdx, mstart, mend);
@@ -993,6 +1030,12 @@ Bk3dModelCMDList::Bk3dModelCMDList(Bk3dModel* pGenericModel)
 {
   m_commandList               = 0;
   m_tokenBufferModel.bufferID = 0;
+  m_tokenBufferModelSz        = 0;
+  m_bZeroCopyFrame            = false;
+  m_displayedRegion           = -1;
+  m_numSlices                 = 0;
+  memset(m_estimateRanges, -1, sizeof(m_estimateRanges));
+  memset(m_sliceStats, 0, sizeof(m_sliceStats));
   memset(&m_uboObjectMatrices, 0, sizeof(BufO));
   memset(&m_uboMaterial, 0, sizeof(BufO));
 
@@ -1027,6 +1070,12 @@ bool Bk3dModelCMDList::deleteCommandListData()
   {
     m_tokenBufferModel.release();
   }
+  m_tokenBufferModelSz = 0;
+  m_tokenRing.release();
+  memUntrack(MEMTAG_TOKENS, m_pGenericModel, &s_renderer);
+  memUntrack(MEMTAG_TOKEN_BUFFERS, m_pGenericModel, &s_renderer);
+  m_bZeroCopyFrame  = false;
+  m_displayedRegion = -1;
   // delete FBOs... m_tokenBufferModel.fbos
   m_commandModel.release();
 
@@ -1037,6 +1086,7 @@ bool Bk3dModelCMDList::deleteCommandListData()
   }
   m_commandList = 0;
   memset(&m_pGenericModel->m_stats, 0, sizeof(Bk3dModel::Stats));
+  memset(m_sliceStats, 0, sizeof(m_sliceStats));
   return true;
 }
 //------------------------------------------------------------------------------
@@ -1128,16 +1178,80 @@ void Bk3dModelCMDList::update_fbo_target(GLuint fbo)
     m_commandModel.fbos[i] = fbo;
 }
 //------------------------------------------------------------------------------
+// pre-pass of buildCmdBuffer(): upper bound of the size of the tokens, as if every
+// mesh and primitive group changed the transform and the material
+//------------------------------------------------------------------------------
+size_t Bk3dModelCMDList::estimateCmdBufferSize(int mstart, int mend)
+{
+  size_t sz = sizeof(Token_LineWidth) + 3 * sizeof(Token_UniformAddress);
+  if((mend <= 0) || (mend > m_pGenericModel->m_meshFile->pMeshes->n))
+    mend = m_pGenericModel->m_meshFile->pMeshes->n;
+  for(int m = mstart; m < mend; m++)
+  {
+    bk3d::Mesh* pMesh = m_pGenericModel->m_meshFile->pMeshes->p[m];
+    sz += sizeof(Token_UniformAddress) + pMesh->pAttributes->n * sizeof(Token_AttributeAddress);
+    for(int pg = 0; pg < pMesh->pPrimGroups->n; pg++)
+    {
+      bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+      sz += 2 * sizeof(Token_UniformAddress);
+      if(pPG->indexArrayByteSize > 0)
+        sz += sizeof(Token_ElementAddress) + sizeof(Token_DrawElements);
+      else
+        sz += sizeof(Token_DrawArrays);
+    }
+  }
+  return sz;
+}
+//------------------------------------------------------------------------------
+// zero-copy mode: before the slices get recorded, gives each its own range of the
+// next region of m_tokenRing, from the prefix sum of the estimates of their sizes.
+// Called on the main thread, like everything issuing GL calls
+//------------------------------------------------------------------------------
+void Bk3dModelCMDList::prepareCmdBuffers(int numSlices, const int* sliceStarts)
+{
+  NXPROFILEFUNC(__FUNCTION__);
+  m_numSlices      = numSlices;
+  m_bZeroCopyFrame = g_bZeroCopyTokens && (numSlices > 0);
+  if(!m_bZeroCopyFrame)
+  {
+    // the consolidation of these slices will use m_tokenBufferModel again
+    if(m_tokenRing.regionSz)
+    {
+      m_tokenRing.release();
+      trackTokenMemory();
+    }
+    return;
+  }
+  size_t offset = 0;
+  for(int i = 0; i < numSlices; i++)
+  {
+    if((m_estimateRanges[i][0] != sliceStarts[i]) || (m_estimateRanges[i][1] != sliceStarts[i + 1]))
+    {
+      m_sliceEstimates[i]    = estimateCmdBufferSize(sliceStarts[i], sliceStarts[i + 1]);
+      m_estimateRanges[i][0] = sliceStarts[i];
+      m_estimateRanges[i][1] = sliceStarts[i + 1];
+    }
+    m_sliceOffsets[i] = offset;
+    offset += (m_sliceEstimates[i] + TOKENWRITER_ALIGNMENT - 1) & ~size_t(TOKENWRITER_ALIGNMENT - 1);
+  }
+  m_sliceOffsets[numSlices] = offset;
+  size_t prevRegionSz       = m_tokenRing.regionSz;
+  m_tokenRing.reserve(offset);
+  if(m_tokenRing.regionSz != prevRegionSz)
+    trackTokenMemory();
+  m_tokenRing.advance();
+}
+//------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
-bool Bk3dModelCMDList::buildCmdBuffer(RendererCMDList* pRenderer, int bufIdx, int mstart, int mend)
+bool Bk3dModelCMDList::buildCmdBuffer(RendererCMDList* pRenderer, int bufIdx, int mstart, int mend, bool bToRing)
 {
   NXPROFILEFUNC(__FUNCTION__);
   if(!m_pGenericModel->m_meshFile)
     return false;
 
-  GLsizei          tokenTableOffset = 0;
-  std::vector<int> offsets;
+  GLsizei            tokenTableOffset = 0;
+  ScratchVector<int> offsets;  // frame-temporary: from the scratch arena of this worker
 
   float  lineWidth = 1.0;
   float  width     = pRenderer->m_winSize[0];
@@ -1148,13 +1262,30 @@ bool Bk3dModelCMDList::buildCmdBuffer(RendererCMDList* pRenderer, int bufIdx, in
   //
   // Walk through meshes as if we were traversing a scene...
   //
-  m_tokenBufferModel2[bufIdx].clear();
-  m_tokenBufferModel2[bufIdx] += buildLineWidthCommand(lineWidth);
-  m_tokenBufferModel2[bufIdx] += buildUniformAddressCommand(UBO_MATRIX, g_uboMatrix.Addr, sizeof(MatrixBufferGlobal), STAGE_VERTEX);
-  m_tokenBufferModel2[bufIdx] +=
-      buildUniformAddressCommand(UBO_MATRIXOBJ, m_uboObjectMatrices.Addr, sizeof(MatrixBufferObject), STAGE_VERTEX);
-  m_tokenBufferModel2[bufIdx] += buildUniformAddressCommand(UBO_LIGHT, g_uboLight.Addr, sizeof(LightBuffer), STAGE_FRAGMENT);
-  m_pGenericModel->m_stats.uniform_update += 3;
+  TokenWriter& tokens   = m_tokenBufferModel2[bufIdx];
+  char*        ringPtr  = NULL;  // zero-copy: where the tokens of this slice land in m_tokenRing
+  GLuint64EXT  ringAddr = 0;
+  if(m_bZeroCopyFrame && bToRing)
+  {
+    ringPtr  = m_tokenRing.regionPtr() + m_sliceOffsets[bufIdx];
+    ringAddr = m_tokenRing.regionAddr() + m_sliceOffsets[bufIdx];
+    tokens.setBuffer(ringPtr, m_sliceOffsets[bufIdx + 1] - m_sliceOffsets[bufIdx]);
+  }
+  else
+  {
+    if(tokens.isExternal())
+      tokens.setBuffer(NULL, 0);
+    tokens.clear();
+    tokens.reserve(estimateCmdBufferSize(mstart, mend));
+  }
+  tokens.lineWidth(lineWidth);
+  tokens.uniformAddress(UBO_MATRIX, g_uboMatrix.Addr, STAGE_VERTEX);
+  tokens.uniformAddress(UBO_MATRIXOBJ, m_uboObjectMatrices.Addr, STAGE_VERTEX);
+  tokens.uniformAddress(UBO_LIGHT, g_uboLight.Addr, STAGE_FRAGMENT);
+  // written by the worker recording the slice, summed by consolidateCmdBuffers()
+  Bk3dModel::Stats& stats = m_sliceStats[bufIdx];
+  memset(&stats, 0, sizeof(Bk3dModel::Stats));
+  stats.descriptor_binds += 3;
 
   int totalDCs = 0;
   int nDCs     = 0;
@@ -1189,10 +1320,9 @@ bool Bk3dModelCMDList::buildCmdBuffer(RendererCMDList* pRenderer, int bufIdx, in
     if(pMesh->pTransforms && (pMesh->pTransforms->n > 0) && (curObjectTransform != pMesh->pTransforms->p[0]->ID))
     {
       curObjectTransform = pMesh->pTransforms->p[0]->ID;
-      m_tokenBufferModel2[bufIdx] +=
-          buildUniformAddressCommand(UBO_MATRIXOBJ, m_uboObjectMatrices.Addr + (curObjectTransform * sizeof(MatrixBufferObject)),
-                                     sizeof(MatrixBufferObject), STAGE_VERTEX);
-      m_pGenericModel->m_stats.uniform_update++;
+      tokens.uniformAddress(UBO_MATRIXOBJ, m_uboObjectMatrices.Addr + (curObjectTransform * sizeof(MatrixBufferObject)), STAGE_VERTEX);
+      stats.uniform_update++;
+      stats.descriptor_binds++;
     }
     //
     // build COMMANDS to assign pointers to attributes
@@ -1203,8 +1333,9 @@ bool Bk3dModelCMDList::buildCmdBuffer(RendererCMDList* pRenderer, int bufIdx, in
     {
       bk3d::Attribute* pA = pMesh->pAttributes->p[s];
       bk3d::Slot*      pS = pMesh->pSlots->p[pA->slot];
-      m_tokenBufferModel2[bufIdx] += buildAttributeAddressCommand(s, curVBO.Addr + (GLuint64)pS->userPtr.p, pS->vtxBufferSizeBytes);
-      m_pGenericModel->m_stats.attr_update++;
+      tokens.attributeAddress(s, curVBO.Addr + (GLuint64)pS->userPtr.p);
+      stats.attr_update++;
+      stats.buffer_binds++;
     }
     prevNAttr = n;
     ////////////////////////////////////////
@@ -1222,10 +1353,9 @@ bool Bk3dModelCMDList::buildCmdBuffer(RendererCMDList* pRenderer, int bufIdx, in
       if(pPG->pMaterial && (curMaterial != pPG->pMaterial->ID))
       {
         curMaterial = pPG->pMaterial->ID;
-        m_tokenBufferModel2[bufIdx] +=
-            buildUniformAddressCommand(UBO_MATERIAL, m_uboMaterial.Addr + (curMaterial * sizeof(MaterialBuffer)),
-                                       sizeof(MaterialBuffer), STAGE_FRAGMENT);
-        m_pGenericModel->m_stats.uniform_update++;
+        tokens.uniformAddress(UBO_MATERIAL, m_uboMaterial.Addr + (curMaterial * sizeof(MaterialBuffer)), STAGE_FRAGMENT);
+        stats.uniform_update++;
+        stats.descriptor_binds++;
       }
       //
       // the Primitive group can also have its own transformation
@@ -1235,10 +1365,9 @@ bool Bk3dModelCMDList::buildCmdBuffer(RendererCMDList* pRenderer, int bufIdx, in
       if(pPG->pTransforms && (pPG->pTransforms->n > 0) && (curObjectTransform != pPG->pTransforms->p[0]->ID))
       {
         curObjectTransform = pPG->pTransforms->p[0]->ID;
-        m_tokenBufferModel2[bufIdx] +=
-            buildUniformAddressCommand(UBO_MATRIXOBJ, m_uboObjectMatrices.Addr + (curObjectTransform * sizeof(MatrixBufferObject)),
-                                       sizeof(MatrixBufferObject), STAGE_VERTEX);
-        m_pGenericModel->m_stats.uniform_update++;
+        tokens.uniformAddress(UBO_MATRIXOBJ, m_uboObjectMatrices.Addr + (curObjectTransform * sizeof(MatrixBufferObject)), STAGE_VERTEX);
+        stats.uniform_update++;
+        stats.descriptor_binds++;
       }
       //
       // Choose the state Object depending on the primitive type
@@ -1281,24 +1410,28 @@ bool Bk3dModelCMDList::buildCmdBuffer(RendererCMDList* pRenderer, int bufIdx, in
         prevState = curState;
       if(prevState != curState)
       {
-        m_commandModel2[bufIdx].pushBatch(prevState, FBO, 0, NULL, (GLsizei)m_tokenBufferModel2[bufIdx].size() - tokenTableOffset);
+        m_commandModel2[bufIdx].pushBatch(prevState, FBO, ringPtr ? ringAddr + tokenTableOffset : 0,
+                                          ringPtr ? ringPtr + tokenTableOffset : NULL, (GLsizei)tokens.size() - tokenTableOffset);
         offsets.push_back(tokenTableOffset);
         // new offset
-        tokenTableOffset = (GLsizei)m_tokenBufferModel2[bufIdx].size();
+        tokenTableOffset = (GLsizei)tokens.size();
+        stats.state_binds++;
       }
       // add other token COMMANDS: elements + drawcall
       if(pPG->indexArrayByteSize > 0)
       {
-        m_tokenBufferModel2[bufIdx] += buildElementAddressCommand(curEBO.Addr + (GLuint64)pPG->userPtr, pPG->indexFormatGL);
-        m_tokenBufferModel2[bufIdx] += buildDrawElementsCommand(pPG->topologyGL, pPG->indexCount);
+        tokens.elementAddress(curEBO.Addr + (GLuint64)pPG->userPtr, pPG->indexFormatGL);
+        tokens.drawElements(pPG->topologyGL, pPG->indexCount);
+        stats.buffer_binds++;
         nDCs++;
       }
       else
       {
-        m_tokenBufferModel2[bufIdx] += buildDrawArraysCommand(pPG->topologyGL, pPG->indexCount);
+        tokens.drawArrays(pPG->topologyGL, pPG->indexCount);
         nDCs++;
       }
-      m_pGenericModel->m_stats.drawcalls++;
+      stats.drawcalls++;
+      stats.primitives += primitiveCount(pPG->topologyGL, pPG->indexCount);
 
       pPrevPG = pPG;
     }  // for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
@@ -1330,14 +1463,27 @@ bool Bk3dModelCMDList::buildCmdBuffer(RendererCMDList* pRenderer, int bufIdx, in
         // not-handled cases...
         break;
     }
-    m_commandModel2[bufIdx].pushBatch(curState, FBO, 0, NULL, (GLsizei)m_tokenBufferModel2[bufIdx].size() - tokenTableOffset);
+    m_commandModel2[bufIdx].pushBatch(curState, FBO, ringPtr ? ringAddr + tokenTableOffset : 0,
+                                      ringPtr ? ringPtr + tokenTableOffset : NULL, (GLsizei)tokens.size() - tokenTableOffset);
     offsets.push_back(tokenTableOffset);
 
     // new offset and ptr
-    tokenTableOffset = (GLsizei)m_tokenBufferModel2[bufIdx].size();
+    tokenTableOffset = (GLsizei)tokens.size();
     pPrevPG          = NULL;
+    stats.state_binds++;
   }
   totalDCs += nDCs;
+  if(ringPtr && !tokens.isExternal())
+  {
+    // the estimate of the slice was too small: the tokens went on in the memory of the
+    // writer, without the ones already in m_tokenRing. Record the slice again in that
+    // memory, for consolidateCmdBuffers() to upload it, and reserve what it took in the
+    // ring from the next frame on
+    m_sliceEstimates[bufIdx] = tokens.size();
+    return buildCmdBuffer(pRenderer, bufIdx, mstart, mend, false);
+  }
+  stats.tokens         = (unsigned int)tokens.numTokens();
+  stats.bytes_recorded = (unsigned int)tokens.size();
   return true;
 }
 //------------------------------------------------------------------------------
@@ -1351,7 +1497,10 @@ bool Bk3dModelCMDList::deleteResourcesObject()
   glDeleteBuffers(1, &m_uboObjectMatrices.Id);
   m_uboObjectMatrices.Id = 0;
   m_uboObjectMatrices.Sz = 0;
-  bk3d::Mesh* pMesh      = NULL;
+  memUntrack(MEMTAG_UNIFORM_BUFFERS, m_pGenericModel, &s_renderer);
+  memUntrack(MEMTAG_VERTEX_BUFFERS, m_pGenericModel, &s_renderer);
+  memUntrack(MEMTAG_INDEX_BUFFERS, m_pGenericModel, &s_renderer);
+  bk3d::Mesh* pMesh = NULL;
 
   for(int i = 0; i < m_ObjVBOs.size(); i++)
   {
@@ -1386,7 +1535,6 @@ bool Bk3dModelCMDList::initResourcesObject()
   glCreateBuffers(1, &curVBO.Id);
   glCreateBuffers(1, &curEBO.Id);
 
-  //m_pGenericModel->m_meshFile->pMeshes->n = 60000;
   //
   // create Buffer Object for materials
   //
@@ -1406,6 +1554,7 @@ bool Bk3dModelCMDList::initResourcesObject()
     glBindBufferBase(GL_UNIFORM_BUFFER, UBO_MATERIAL, m_uboMaterial.Id);
 
     LOGI("%d materials stored in %d Kb\n", m_pGenericModel->m_meshFile->pMaterials->nMaterials, (m_uboMaterial.Sz + 512) / 1024);
+    memTrack(MEMTAG_UNIFORM_BUFFERS, m_pGenericModel, &s_renderer, m_uboMaterial.Sz);
   }
 
   //
@@ -1428,6 +1577,7 @@ bool Bk3dModelCMDList::initResourcesObject()
     glBindBufferBase(GL_UNIFORM_BUFFER, UBO_MATRIXOBJ, m_uboObjectMatrices.Id);
 
     LOGI("%d matrices stored in %d Kb\n", m_pGenericModel->m_meshFile->pTransforms->nBones, (m_uboObjectMatrices.Sz + 512) / 1024);
+    memTrack(MEMTAG_UNIFORM_BUFFERS, m_pGenericModel, &s_renderer, m_uboObjectMatrices.Sz);
   }
 
   //
@@ -1548,29 +1698,48 @@ bool Bk3dModelCMDList::initResourcesObject()
   }
   //
   // second pass: put stuff in the buffer and store offsets
+  // the buffers are mapped so that the copies get spread over the workers
+  // (parallel_for): no OpenGL call happens inside the loop
   //
-  for(int i = 0; i < m_pGenericModel->m_meshFile->pMeshes->n; i++)
+  std::vector<char*> mappedVBOs(m_ObjVBOs.size(), NULL);
+  std::vector<char*> mappedEBOs(m_ObjEBOs.size(), NULL);
+  for(int b = 0; b < m_ObjVBOs.size(); b++)
   {
-    bk3d::Mesh* pMesh = m_pGenericModel->m_meshFile->pMeshes->p[i];
-    int         idx   = uintptr_t(pMesh->userPtr);
-    curVBO            = m_ObjVBOs[idx];
-    curEBO            = m_ObjEBOs[idx];
-    int n             = pMesh->pSlots->n;
-    for(int s = 0; s < n; s++)
-    {
-      bk3d::Slot* pS = pMesh->pSlots->p[s];
-      glNamedBufferSubData(curVBO.Id, (GLuint)uintptr_t((int*)pS->userPtr), pS->vtxBufferSizeBytes, pS->pVtxBufferData);
-    }
-    for(int pg = 0; pg < pMesh->pPrimGroups->n; pg++)
+    if(m_ObjVBOs[b].Sz > 0)
+      mappedVBOs[b] = (char*)glMapNamedBufferRange(m_ObjVBOs[b].Id, 0, m_ObjVBOs[b].Sz, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if(m_ObjEBOs[b].Sz > 0)
+      mappedEBOs[b] = (char*)glMapNamedBufferRange(m_ObjEBOs[b].Id, 0, m_ObjEBOs[b].Sz, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  }
+  parallel_for(0, m_pGenericModel->m_meshFile->pMeshes->n, 64, [&](int mstart, int mend) {
+    for(int i = mstart; i < mend; i++)
     {
-      bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
-      if(pPG->indexArrayByteSize > 0)
-        glNamedBufferSubData(curEBO.Id, (GLuint)uintptr_t(pPG->userPtr), pPG->indexArrayByteSize, pPG->pIndexBufferData);
+      bk3d::Mesh* pMesh = m_pGenericModel->m_meshFile->pMeshes->p[i];
+      int         idx   = uintptr_t(pMesh->userPtr);
+      int         n     = pMesh->pSlots->n;
+      for(int s = 0; s < n; s++)
+      {
+        bk3d::Slot* pS = pMesh->pSlots->p[s];
+        memcpy(mappedVBOs[idx] + uintptr_t(pS->userPtr), pS->pVtxBufferData, pS->vtxBufferSizeBytes);
+      }
+      for(int pg = 0; pg < pMesh->pPrimGroups->n; pg++)
+      {
+        bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+        if(pPG->indexArrayByteSize > 0)
+          memcpy(mappedEBOs[idx] + uintptr_t(pPG->userPtr), pPG->pIndexBufferData, pPG->indexArrayByteSize);
+      }
     }
-    //glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  });
+  for(int b = 0; b < m_ObjVBOs.size(); b++)
+  {
+    if(mappedVBOs[b])
+      glUnmapNamedBuffer(m_ObjVBOs[b].Id);
+    if(mappedEBOs[b])
+      glUnmapNamedBuffer(m_ObjEBOs[b].Id);
   }
   LOGI("meshes: %d in :%zu VBOs (%f Mb) and %zu EBOs (%f Mb) \n", m_pGenericModel->m_meshFile->pMeshes->n, m_ObjVBOs.size(),
        (float)totalVBOSz / (float)(1024 * 1024), m_ObjEBOs.size(), (float)totalEBOSz / (float)(1024 * 1024));
+  memTrack(MEMTAG_VERTEX_BUFFERS, m_pGenericModel, &s_renderer, totalVBOSz);
+  memTrack(MEMTAG_INDEX_BUFFERS, m_pGenericModel, &s_renderer, totalEBOSz);
   return true;
 }
 
@@ -1608,6 +1777,9 @@ void Bk3dModelCMDList::displayObject(Renderer* pRenderer, const glm::mat4& camer
       int nitems = int(m_commandModel.numItems);
       glDrawCommandsStatesAddressNV(&m_commandModel.dataGPUPtrs[0], &m_commandModel.sizes[0],
                                     &m_commandModel.stateGroups[0], &m_commandModel.fbos[0], nitems);
+      // the next recording into this region of m_tokenRing waits for the GPU to be done
+      if(m_displayedRegion >= 0)
+        m_tokenRing.fence(m_displayedRegion);
     }
     return;
   }
@@ -1620,10 +1792,65 @@ void Bk3dModelCMDList::consolidateCmdBuffers(int numCmdBuffers)
 {
   NXPROFILEFUNC(__FUNCTION__);
   m_numUsedCmdBuffers = numCmdBuffers;
+  // the statistics of the model are the ones of its slices: only written here, on the main thread
+  memset(&m_pGenericModel->m_stats, 0, sizeof(Bk3dModel::Stats));
+  for(int i = 0; i < std::min(numCmdBuffers, m_numSlices); i++)
+    m_pGenericModel->m_stats.add(m_sliceStats[i]);
+  //
+  // zero-copy: the tokens are already in m_tokenRing, and the batches of the slices
+  // have their addresses. A slice whose estimate was too small got recorded again in
+  // its own memory: only those slices are copied, to m_tokenBufferModel. The ring is
+  // write-only, so nothing gets read back from it
+  //
+  if(m_bZeroCopyFrame)
+  {
+    m_commandModel.release();
+    m_tokenBufferModel.data.clear();
+    m_pGenericModel->m_stats.token_bytes       = 0;
+    m_pGenericModel->m_stats.token_bytes_saved = 0;
+    int numCopied = 0;
+    for(int i = 0; i < m_numSlices; i++)
+    {
+      if(m_commandModel2[i].stateGroups.size() == 0)
+        continue;
+      // start with adding the viewport reference: using another token buffer
+      if(m_commandModel.numItems == 0)
+        m_commandModel.pushBatch(m_commandModel2[i].stateGroups[0], m_commandModel2[i].fbos[0], g_tokenBufferViewport.bufferAddr,
+                                 &g_tokenBufferViewport.data[0], g_tokenBufferViewport.data.size());
+      size_t first = m_commandModel.numItems;
+      m_commandModel += m_commandModel2[i];
+      m_pGenericModel->m_stats.token_bytes += (unsigned int)m_tokenBufferModel2[i].size();
+      if(m_tokenBufferModel2[i].isExternal())
+        continue;
+      // offsets in m_tokenBufferModel.data for now: they become addresses after the upload
+      size_t offset = m_tokenBufferModel.data.size();
+      for(size_t b = first; b < m_commandModel.numItems; b++)
+      {
+        m_commandModel.dataGPUPtrs[b] = offset;
+        offset += m_commandModel.sizes[b];
+      }
+      m_tokenBufferModel.data.append(m_tokenBufferModel2[i].data(), m_tokenBufferModel2[i].size());
+      numCopied++;
+    }
+    if(numCopied)
+    {
+      LOGE("token estimate of %d slices too small: their tokens copied\n", numCopied);
+      uploadTokenBuffer();
+      for(size_t b = 1; b < m_commandModel.numItems; b++)
+      {
+        if(m_commandModel.dataPtrs[b] != NULL)
+          continue;
+        m_commandModel.dataPtrs[b] = &m_tokenBufferModel.data[0] + m_commandModel.dataGPUPtrs[b];
+        m_commandModel.dataGPUPtrs[b] += m_tokenBufferModel.bufferAddr;
+      }
+    }
+    m_displayedRegion = m_tokenRing.cur;
+    return;
+  }
+  m_displayedRegion = -1;
   //
   // append the generated pieces of command-buffer
   //
-  int prevSz = m_tokenBufferModel.data.size();
   m_tokenBufferModel.data.clear();
   m_commandModel.release();
   //
@@ -1641,27 +1868,25 @@ void Bk3dModelCMDList::consolidateCmdBuffers(int numCmdBuffers)
   {
     if(m_commandModel2[i].stateGroups.size() == 0)
       continue;
-    m_tokenBufferModel.data += m_tokenBufferModel2[i];
+    m_tokenBufferModel.data.append(m_tokenBufferModel2[i].data(), m_tokenBufferModel2[i].size());
     m_commandModel += m_commandModel2[i];  // append... but the GPU addresses will be WRONG
   }
   //
-  // eventually re-allocate the buffer
+  // remove the redundant tokens of the slices, merge the batches sharing states.
+  // Item 0 is the viewport, in its own token buffer
   //
-  if(prevSz < m_tokenBufferModel.data.size())
+  m_pGenericModel->m_stats.token_bytes_saved = 0;
+  if(g_bOptimizeTokens && (m_commandModel.numItems > 1))
   {
-    if(m_tokenBufferModel.bufferID == 0)
-      glCreateBuffers(1, &m_tokenBufferModel.bufferID);
-    else
-      glMakeNamedBufferNonResidentNV(m_tokenBufferModel.bufferID);
-    glNamedBufferData(m_tokenBufferModel.bufferID, m_tokenBufferModel.data.size(), &m_tokenBufferModel.data[0], GL_STREAM_DRAW);  //GL_STATIC_DRAW);
-    // get the 64 bits pointer and make it resident: bedcause we will go through its pointer
-    glGetNamedBufferParameterui64vNV(m_tokenBufferModel.bufferID, GL_BUFFER_GPU_ADDRESS_NV, &m_tokenBufferModel.bufferAddr);
-    glMakeNamedBufferResidentNV(m_tokenBufferModel.bufferID, GL_READ_ONLY);
-  }
-  else
-  {
-    glNamedBufferSubData(m_tokenBufferModel.bufferID, 0, m_tokenBufferModel.data.size(), &m_tokenBufferModel.data[0]);
+    int n = m_tokenOptimizer.optimize(&m_tokenBufferModel.data[0], &m_commandModel.sizes[1], &m_commandModel.stateGroups[1],
+                                      &m_commandModel.fbos[1], (int)m_commandModel.numItems - 1);
+    m_commandModel.resize(1 + n);
+    const TokenOptimizer::Stats& stats = m_tokenOptimizer.getStats();
+    m_tokenBufferModel.data.resize(stats.bytesOut);
+    m_pGenericModel->m_stats.token_bytes_saved = (unsigned int)(stats.bytesIn - stats.bytesOut);
   }
+  m_pGenericModel->m_stats.token_bytes = (unsigned int)m_tokenBufferModel.data.size();
+  uploadTokenBuffer();
   //
   // start at i=1 because the first is the Viewport, resolved...
   // others need update
@@ -1678,6 +1903,40 @@ void Bk3dModelCMDList::consolidateCmdBuffers(int numCmdBuffers)
 
   //init_command_list();
 }
+//------------------------------------------------------------------------------
+// m_tokenBufferModel.data to its GL buffer, which only gets re-allocated to grow
+//------------------------------------------------------------------------------
+void Bk3dModelCMDList::uploadTokenBuffer()
+{
+  if(m_tokenBufferModelSz < m_tokenBufferModel.data.size())
+  {
+    if(m_tokenBufferModel.bufferID == 0)
+      glCreateBuffers(1, &m_tokenBufferModel.bufferID);
+    else
+      glMakeNamedBufferNonResidentNV(m_tokenBufferModel.bufferID);
+    glNamedBufferData(m_tokenBufferModel.bufferID, m_tokenBufferModel.data.size(), &m_tokenBufferModel.data[0], GL_STREAM_DRAW);  //GL_STATIC_DRAW);
+    // get the 64 bits pointer and make it resident: bedcause we will go through its pointer
+    glGetNamedBufferParameterui64vNV(m_tokenBufferModel.bufferID, GL_BUFFER_GPU_ADDRESS_NV, &m_tokenBufferModel.bufferAddr);
+    glMakeNamedBufferResidentNV(m_tokenBufferModel.bufferID, GL_READ_ONLY);
+    m_tokenBufferModelSz = m_tokenBufferModel.data.size();
+    trackTokenMemory();
+  }
+  else if(m_tokenBufferModel.data.size())
+  {
+    glNamedBufferSubData(m_tokenBufferModel.bufferID, 0, m_tokenBufferModel.data.size(), &m_tokenBufferModel.data[0]);
+  }
+}
+//------------------------------------------------------------------------------
+// memory accounting of the token streams: called when their buffers get
+// re-allocated, not on each frame
+//------------------------------------------------------------------------------
+void Bk3dModelCMDList::trackTokenMemory()
+{
+  memUntrack(MEMTAG_TOKENS, m_pGenericModel, &s_renderer);
+  memUntrack(MEMTAG_TOKEN_BUFFERS, m_pGenericModel, &s_renderer);
+  memTrack(MEMTAG_TOKENS, m_pGenericModel, &s_renderer, m_tokenBufferModel.data.capacity());
+  memTrack(MEMTAG_TOKEN_BUFFERS, m_pGenericModel, &s_renderer, m_tokenBufferModelSz + m_tokenRing.regionSz * TOKENRING_SZ);
+}
 
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
@@ -23,6 +23,7 @@
 #define EXTERNSVCUI
 #define WINDOWINERTIACAMERA_EXTERN
 #define EMUCMDLIST_EXTERN
+#include "allocstats.h"
 #include "gl_vk_bk3dthreaded.h"
 #include "helper_fbo.h"
 #include <nvgl/profiler_gl.hpp>
@@ -430,6 +431,7 @@ bool RendererStandard::initResourcesGrid()
   };
   s_vboCrossSz = sizeof(glm::vec3) * 6;
   glNamedBufferData(s_vboCross, s_vboCrossSz, glm::value_ptr(crossVtx[0]), GL_STATIC_DRAW);
+  memTrack(MEMTAG_VERTEX_BUFFERS, NULL, this, s_vboGridSz + s_vboCrossSz);
   return true;
 }
 //------------------------------------------------------------------------------
@@ -439,6 +441,7 @@ bool RendererStandard::deleteResourcesGrid()
 {
   glDeleteBuffers(1, &s_vboGrid);
   glDeleteBuffers(1, &s_vboCross);
+  memUntrack(MEMTAG_VERTEX_BUFFERS, NULL, this);
   return true;
 }
 //------------------------------------------------------------------------------
@@ -597,6 +600,8 @@ bool RendererStandard::initGraphics(int w, int h, int MSAA)
   g_uboLight.Sz = sizeof(LightBuffer);
   glNamedBufferData(g_uboLight.Id, g_uboLight.Sz, &s_light, GL_STATIC_DRAW);
   //glBindBufferBase(GL_UNIFORM_BUFFER,UBO_LIGHT, g_uboLight.Id);
+  memTrackName(this, getName());
+  memTrack(MEMTAG_UNIFORM_BUFFERS, NULL, this, g_uboMatrix.Sz + g_uboLight.Sz);
   //
   // Misc OGL setup
   //
@@ -631,6 +636,7 @@ bool RendererStandard::terminateGraphics()
   g_uboLight.Id = 0;
   glDeleteBuffers(1, &g_uboMatrix.Id);
   g_uboMatrix.Id = 0;
+  memUntrack(MEMTAG_UNIFORM_BUFFERS, NULL, this);
   s_shaderGrid.cleanup();
   s_shaderMesh.cleanup();
   s_shaderMeshLine.cleanup();
@@ -747,7 +753,10 @@ bool Bk3dModelStandard::deleteResourcesObject()
   glDeleteBuffers(1, &m_uboObjectMatrices.Id);
   m_uboObjectMatrices.Id = 0;
   m_uboObjectMatrices.Sz = 0;
-  bk3d::Mesh* pMesh      = NULL;
+  memUntrack(MEMTAG_UNIFORM_BUFFERS, m_pGenericModel, &s_renderer);
+  memUntrack(MEMTAG_VERTEX_BUFFERS, m_pGenericModel, &s_renderer);
+  memUntrack(MEMTAG_INDEX_BUFFERS, m_pGenericModel, &s_renderer);
+  bk3d::Mesh* pMesh = NULL;
 
   for(int i = 0; i < m_pGenericModel->m_meshFile->pMeshes->n; i++)
   {
@@ -784,7 +793,6 @@ bool Bk3dModelStandard::deleteResourcesObject()
 bool Bk3dModelStandard::initResourcesObject()
 {
 
-  //m_pGenericModel->m_meshFile->pMeshes->n = 60000;
   //
   // create Buffer Object for materials
   //
@@ -802,6 +810,7 @@ bool Bk3dModelStandard::initResourcesObject()
     glBindBufferBase(GL_UNIFORM_BUFFER, UBO_MATERIAL, m_uboMaterial.Id);
 
     LOGI("%d materials stored in %d Kb\n", m_pGenericModel->m_meshFile->pMaterials->nMaterials, (m_uboMaterial.Sz + 512) / 1024);
+    memTrack(MEMTAG_UNIFORM_BUFFERS, m_pGenericModel, &s_renderer, m_uboMaterial.Sz);
   }
 
   //
@@ -821,13 +830,16 @@ bool Bk3dModelStandard::initResourcesObject()
     glBindBufferBase(GL_UNIFORM_BUFFER, UBO_MATRIXOBJ, m_uboObjectMatrices.Id);
 
     LOGI("%d matrices stored in %d Kb\n", m_pGenericModel->m_meshFile->pTransforms->nBones, (m_uboObjectMatrices.Sz + 512) / 1024);
+    memTrack(MEMTAG_UNIFORM_BUFFERS, m_pGenericModel, &s_renderer, m_uboObjectMatrices.Sz);
   }
 
   //
   // First pass: evaluate the size of the single VBO
   // and store offset to where we'll find data back
   //
-  bk3d::Mesh* pMesh = NULL;
+  int64_t     totalVBOSz = 0;
+  int64_t     totalEBOSz = 0;
+  bk3d::Mesh* pMesh      = NULL;
   for(int i = 0; i < m_pGenericModel->m_meshFile->pMeshes->n; i++)
   {
     pMesh = m_pGenericModel->m_meshFile->pMeshes->p[i];
@@ -847,6 +859,7 @@ bool Bk3dModelStandard::initResourcesObject()
       glNamedBufferStorage(id, pS->vtxBufferSizeBytes, NULL, 0);  // Not working with NSight !!! https://www.opengl.org/registry/specs/ARB/buffer_storage.txt
 #endif
       glNamedBufferSubData(id, 0, pS->vtxBufferSizeBytes, pS->pVtxBufferData);
+      totalVBOSz += pS->vtxBufferSizeBytes;
     }
     //
     // Primitive groups
@@ -867,6 +880,7 @@ bool Bk3dModelStandard::initResourcesObject()
           glNamedBufferStorage(id, pPG->indexArrayByteSize, NULL, 0);  // Not working with NSight !!! https://www.opengl.org/registry/specs/ARB/buffer_storage.txt
 #endif
           glNamedBufferSubData(id, pPG->indexArrayByteOffset, pPG->indexArrayByteSize, pPG->pIndexBufferData);
+          totalEBOSz += pPG->indexArrayByteSize;
         }
         else
         {
@@ -880,6 +894,8 @@ bool Bk3dModelStandard::initResourcesObject()
     }
   }
   //LOGI("meshes: %d in :%d VBOs (%f Mb) and %d EBOs (%f Mb) \n", m_pGenericModel->m_meshFile->pMeshes->n, .size(), (float)totalVBOSz/(float)(1024*1024), m_ObjEBOs.size(), (float)totalEBOSz/(float)(1024*1024));
+  memTrack(MEMTAG_VERTEX_BUFFERS, m_pGenericModel, &s_renderer, totalVBOSz);
+  memTrack(MEMTAG_INDEX_BUFFERS, m_pGenericModel, &s_renderer, totalEBOSz);
   return true;
 }
 
@@ -898,6 +914,10 @@ void Bk3dModelStandard::displayObject(Renderer* pRenderer, const glm::mat4& came
   g_globalMatrices.mW = glm::translate(g_globalMatrices.mW, -m_pGenericModel->m_posOffset);
   g_globalMatrices.mW = glm::scale(g_globalMatrices.mW, glm::vec3(m_pGenericModel->m_scale));
   glNamedBufferSubData(g_uboMatrix.Id, 0, sizeof(g_globalMatrices), &g_globalMatrices);
+  // nothing gets recorded: the statistics are the GL calls of this frame
+  Bk3dModel::Stats& stats = m_pGenericModel->m_stats;
+  memset(&stats, 0, sizeof(Bk3dModel::Stats));
+  stats.tokens++;
 
   if(m_pGenericModel->m_meshFile)
   {
@@ -906,6 +926,8 @@ void Bk3dModelStandard::displayObject(Renderer* pRenderer, const glm::mat4& came
     glBindBufferBase(GL_UNIFORM_BUFFER, UBO_MATRIX, g_uboMatrix.Id);
     glBindBufferBase(GL_UNIFORM_BUFFER, UBO_LIGHT, g_uboLight.Id);
     glBindBufferBase(GL_UNIFORM_BUFFER, UBO_MATRIXOBJ, m_uboObjectMatrices.Id);
+    stats.descriptor_binds += 3;
+    stats.tokens += 3;
 //
 // Loop 2 times: for filled topologies, then for lines
 // ideally, the models should be pre-sorted by shaders...
@@ -923,6 +945,7 @@ void Bk3dModelStandard::displayObject(Renderer* pRenderer, const glm::mat4& came
         glEnable(GL_POLYGON_OFFSET_FILL);
         glPolygonOffset(1.0, 1.0);  // no issue with redundant call here: the state capture will just deal with simplifying things
         s_shaderMesh.bindShader();
+        stats.tokens += 3;
       }
       else
       {
@@ -930,7 +953,9 @@ void Bk3dModelStandard::displayObject(Renderer* pRenderer, const glm::mat4& came
           continue;
         glDisable(GL_POLYGON_OFFSET_FILL);
         s_shaderMeshLine.bindShader();
+        stats.tokens += 2;
       }
+      stats.state_binds++;
       for(int m = 1; m < m_pGenericModel->m_meshFile->pMeshes->n; m++)  //m_pGenericModel->m_meshFile->pMeshes->n; m++)
       {
         bk3d::Mesh* pMesh = m_pGenericModel->m_meshFile->pMeshes->p[m];
@@ -966,6 +991,9 @@ void Bk3dModelStandard::displayObject(Renderer* pRenderer, const glm::mat4& came
             curTransf = pTransf->ID;
             glBindBufferRange(GL_UNIFORM_BUFFER, UBO_MATRIXOBJ, m_uboObjectMatrices.Id,
                               curTransf * sizeof(MatrixBufferObject), sizeof(MatrixBufferObject));
+            stats.uniform_update++;
+            stats.descriptor_binds++;
+            stats.tokens++;
           }
         }
         int n = pMesh->pSlots->n;
@@ -978,6 +1006,8 @@ void Bk3dModelStandard::displayObject(Renderer* pRenderer, const glm::mat4& came
         {
           bk3d::Slot* pS = pMesh->pSlots->p[s];
           glBindBuffer(GL_ARRAY_BUFFER, pS->userData);
+          stats.buffer_binds++;
+          stats.tokens++;
           for(int a = 0; a < pS->pAttributes->n; a++)
           {
             glEnableVertexAttribArray(bindingIndex);
@@ -987,11 +1017,16 @@ void Bk3dModelStandard::displayObject(Renderer* pRenderer, const glm::mat4& came
             glVertexAttribPointer(bindingIndex, pAttr->numComp, pAttr->formatGL, GL_FALSE, pAttr->strideBytes,
                                   (const void*)pAttr->dataOffsetBytes);
             bindingIndex++;
+            stats.attr_update++;
+            stats.tokens += 2;
           }
         }
         // disable other attributes... we never know
         for(int j = bindingIndex; j <= 3 /*15*/; j++)
+        {
           glDisableVertexAttribArray(bindingIndex);
+          stats.tokens++;
+        }
         //====> render primitive groups
         for(int pg = 0; pg < pMesh->pPrimGroups->n; pg++)
         {
@@ -1028,6 +1063,9 @@ void Bk3dModelStandard::displayObject(Renderer* pRenderer, const glm::mat4& came
             curMaterial = pMat->ID;
             glBindBufferRange(GL_UNIFORM_BUFFER, UBO_MATERIAL, m_uboMaterial.Id, (curMaterial * sizeof(MaterialBuffer)),
                               sizeof(MaterialBuffer));
+            stats.uniform_update++;
+            stats.descriptor_binds++;
+            stats.tokens++;
           }
           if(pPG->pTransforms->n > 0)
           {
@@ -1037,23 +1075,32 @@ void Bk3dModelStandard::displayObject(Renderer* pRenderer, const glm::mat4& came
               curTransf = pTransf->ID;
               glBindBufferRange(GL_UNIFORM_BUFFER, UBO_MATRIXOBJ, m_uboObjectMatrices.Id,
                                 (curTransf * sizeof(MatrixBufferObject)), sizeof(MatrixBufferObject));
+              stats.uniform_update++;
+              stats.descriptor_binds++;
+              stats.tokens++;
             }
           }
           if(pPG->pIndexBufferData)
           {
             glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, (GLuint)uintptr_t(pPG->userPtr));
             glDrawElements(pPG->topologyGL, pPG->indexCount, pPG->indexFormatGL, (const void*)pPG->indexArrayByteOffset);
+            stats.buffer_binds++;
+            stats.tokens += 2;
           }
           else
           {
             glDrawArrays(pPG->topologyGL, 0, pPG->indexCount);
+            stats.tokens++;
           }
+          stats.drawcalls++;
+          stats.primitives += primitiveCount(pPG->topologyGL, pPG->indexCount);
         }
       }  // for(int m=1; m< m_pGenericModel->m_meshFile->pMeshes->n;m++)
     }    // for(int s=0; s<2; s++)
     // normally we should diable what was really used... simplification for the sample...
     glDisableVertexAttribArray(0);
     glDisableVertexAttribArray(1);
+    stats.tokens += 2;
   }
 }
 //------------------------------------------------------------------------------
@@ -0,0 +1,384 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define EXTERNSVCUI
+#define WINDOWINERTIACAMERA_EXTERN
+#define EMUCMDLIST_EXTERN
+#include "gl_vk_bk3dthreaded.h"
+#include "mt/CThreadWork.h"
+
+//------------------------------------------------------------------------------
+// Null renderer: walks the models and records the commands a real renderer would
+// send, into plain memory, without any graphics API. The CPU side of the sample
+// (traversal, workers, frame graph, recording) can then run on machines without
+// GPU. See -headless. It isn't part of g_renderers: no UI to pick it
+//------------------------------------------------------------------------------
+namespace nullrenderer {
+
+//
+// one entry per API call a real renderer would make (Vulkan-like)
+//
+enum NullCmdType
+{
+  NULLCMD_BIND_PIPELINE = 0,
+  NULLCMD_BIND_VERTEX_BUFFER,
+  NULLCMD_BIND_INDEX_BUFFER,
+  NULLCMD_BIND_OBJECT_DATA,  // dynamic offsets of the transform and of the material
+  NULLCMD_DRAW,
+  NULLCMD_DRAW_INDEXED,
+  NULLCMD_EXECUTE,  // primary stream: runs a recorded slice
+  NULLCMD_COUNT
+};
+struct NullCmd
+{
+  unsigned int type;
+  unsigned int count;  // vertices or indices of draws
+  uint64_t     args[2];
+};
+//
+// a command stream, as a command-buffer would be. The vector keeps its capacity
+// from one frame to the next
+//
+struct NullCmdStream
+{
+  std::vector<NullCmd> cmds;
+  unsigned int         numCalls[NULLCMD_COUNT];
+  unsigned int         primitives;
+
+  NullCmdStream() { clear(); }
+  void clear()
+  {
+    cmds.clear();
+    memset(numCalls, 0, sizeof(numCalls));
+    primitives = 0;
+  }
+  void push(NullCmdType type, unsigned int count, uint64_t arg0 = 0, uint64_t arg1 = 0)
+  {
+    NullCmd cmd = {(unsigned int)type, count, {arg0, arg1}};
+    cmds.push_back(cmd);
+    numCalls[type]++;
+  }
+};
+
+class Bk3dModelNull;
+//------------------------------------------------------------------------------
+// Renderer: no graphics API
+//------------------------------------------------------------------------------
+class RendererNull : public Renderer
+{
+private:
+  bool                        m_bValid;
+  std::vector<Bk3dModelNull*> m_pModels;
+  NullCmdStream               m_primary;
+  uint64_t                    m_executed[NULLCMD_COUNT];  // what displayEnd() walked through, since initGraphics()
+  uint64_t                    m_numFrames;
+
+  void execute(const NullCmdStream& stream);
+
+public:
+  RendererNull()
+  {
+    m_bValid       = false;
+    g_nullRenderer = this;
+  }
+  virtual ~RendererNull() {}
+  virtual const char* getName() { return "Null (headless)"; }
+  virtual bool        valid() { return m_bValid; };
+  virtual bool        initGraphics(int w, int h, int MSAA);
+  virtual bool        terminateGraphics();
+  virtual bool        initThreadLocalVars(int threadId) { return true; }
+  virtual void        releaseThreadLocalVars() {}
+  virtual void        destroyCommandBuffers(bool bAll) {}
+  virtual void        waitForGPUIdle() {}
+
+  virtual bool attachModel(Bk3dModel* pModel);
+  virtual bool detachModels();
+
+  virtual bool initResourcesModel(Bk3dModel* pModel) { return m_bValid; }
+
+  virtual bool buildPrimaryCmdBuffer() { return m_bValid; }
+  virtual bool buildCmdBufferModel(Bk3dModel* pModel, int bufIdx, int mstart, int mend);
+  virtual void consolidateCmdBuffersModel(Bk3dModel* pModel, int numCmdBuffers);
+  virtual bool deleteCmdBufferModel(Bk3dModel* pModel) { return m_bValid; }
+
+  virtual bool updateForChangedRenderTarget(Bk3dModel* pModel) { return false; }
+
+  virtual void displayStart(const glm::mat4& world, const InertiaCamera& camera, const glm::mat4& projection, bool bTimingGlitch);
+  virtual void displayEnd();
+  virtual void displayGrid(const InertiaCamera& camera, const glm::mat4 projection);
+  virtual void displayBk3dModel(Bk3dModel* pModel, const glm::mat4& cameraView, const glm::mat4 projection, unsigned char topologies);
+  virtual void blitToBackbuffer() {}
+
+  virtual void updateViewport(GLint x, GLint y, GLsizei width, GLsizei height) {}
+
+  friend class Bk3dModelNull;
+};
+
+RendererNull s_renderer;
+
+//------------------------------------------------------------------------------
+// Class for Object (made of 1 to N meshes)
+//------------------------------------------------------------------------------
+class Bk3dModelNull
+{
+public:
+  Bk3dModelNull(Bk3dModel* pGenericModel);
+
+private:
+  Bk3dModel*    m_pGenericModel;
+  int           m_numUsedCmdBuffers;
+  NullCmdStream m_cmdStream[MAXCMDBUFFERS];
+
+public:
+  bool buildCmdBuffer(RendererNull* pRenderer, int bufIdx, int mstart, int mend);
+  void consolidateCmdBuffers(int numCmdBuffers);
+  void displayObject(RendererNull* pRenderer);
+};  //Class Bk3dModelNull
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+bool RendererNull::initGraphics(int w, int h, int MSAA)
+{
+  m_primary.clear();
+  memset(m_executed, 0, sizeof(m_executed));
+  m_numFrames = 0;
+  m_bValid    = true;
+  return true;
+}
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+bool RendererNull::terminateGraphics()
+{
+  if(m_bValid && m_numFrames)
+  {
+    LOGI("Null renderer: %llu frames. Per frame: %.0f pipelines, %.0f vertex buffers, %.0f index buffers, %.0f object data, %.0f draws\n",
+         (unsigned long long)m_numFrames, double(m_executed[NULLCMD_BIND_PIPELINE]) / m_numFrames,
+         double(m_executed[NULLCMD_BIND_VERTEX_BUFFER]) / m_numFrames, double(m_executed[NULLCMD_BIND_INDEX_BUFFER]) / m_numFrames,
+         double(m_executed[NULLCMD_BIND_OBJECT_DATA]) / m_numFrames,
+         double(m_executed[NULLCMD_DRAW] + m_executed[NULLCMD_DRAW_INDEXED]) / m_numFrames);
+  }
+  detachModels();
+  m_bValid = false;
+  return true;
+}
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+bool RendererNull::attachModel(Bk3dModel* pGenericModel)
+{
+  if(m_bValid == false)
+    return false;
+  m_pModels.push_back(new Bk3dModelNull(pGenericModel));
+  return true;
+}
+bool RendererNull::detachModels()
+{
+  for(int i = 0; i < m_pModels.size(); i++)
+    delete m_pModels[i];
+  m_pModels.clear();
+  return true;
+}
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+bool RendererNull::buildCmdBufferModel(Bk3dModel* pGenericModel, int bufIdx, int mstart, int mend)
+{
+  if(m_bValid == false)
+    return false;
+  return ((Bk3dModelNull*)pGenericModel->m_pRendererData)->buildCmdBuffer(this, bufIdx, mstart, mend);
+}
+void RendererNull::consolidateCmdBuffersModel(Bk3dModel* pGenericModel, int numCmdBuffers)
+{
+  if(m_bValid == false)
+    return;
+  ((Bk3dModelNull*)pGenericModel->m_pRendererData)->consolidateCmdBuffers(numCmdBuffers);
+}
+//------------------------------------------------------------------------------
+// the primary stream of the frame: global matrices update, then the slices
+//------------------------------------------------------------------------------
+void RendererNull::displayStart(const glm::mat4& world, const InertiaCamera& camera, const glm::mat4& projection, bool bTimingGlitch)
+{
+  if(m_bValid == false)
+    return;
+  g_globalMatrices.mW     = world;
+  g_globalMatrices.mVP    = projection * camera.m4_view;
+  g_globalMatrices.eyePos = camera.curEyePos;
+  m_primary.clear();
+}
+void RendererNull::displayGrid(const InertiaCamera& camera, const glm::mat4 projection)
+{
+  if(m_bValid == false)
+    return;
+  m_primary.push(NULLCMD_BIND_PIPELINE, 0);
+  m_primary.push(NULLCMD_DRAW, 20 * 4);  // GRIDDEF * 4 lines of the other renderers
+}
+void RendererNull::displayBk3dModel(Bk3dModel* pGenericModel, const glm::mat4& cameraView, const glm::mat4 projection, unsigned char topologies)
+{
+  if(m_bValid == false)
+    return;
+  ((Bk3dModelNull*)pGenericModel->m_pRendererData)->displayObject(this);
+}
+//------------------------------------------------------------------------------
+// "submits" the frame: reads all what got recorded, as the GPU would
+//------------------------------------------------------------------------------
+void RendererNull::displayEnd()
+{
+  if(m_bValid == false)
+    return;
+  execute(m_primary);
+  m_numFrames++;
+}
+void RendererNull::execute(const NullCmdStream& stream)
+{
+  const NullCmd* cmd = stream.cmds.empty() ? NULL : &stream.cmds[0];
+  for(size_t i = 0; i < stream.cmds.size(); i++, cmd++)
+  {
+    m_executed[cmd->type]++;
+    if(cmd->type == NULLCMD_EXECUTE)
+      execute(*(const NullCmdStream*)(uintptr_t)cmd->args[0]);
+  }
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+Bk3dModelNull::Bk3dModelNull(Bk3dModel* pGenericModel)
+{
+  m_numUsedCmdBuffers = 0;
+  // keep track of the stuff related to this renderer
+  pGenericModel->m_pRendererData = this;
+  m_pGenericModel                = pGenericModel;
+}
+//------------------------------------------------------------------------------
+// same traversal and redundancy filtering as the Vulkan renderer: the pipeline
+// changes with the topology, the vertex buffer with the mesh, the object data
+// with the transform or the material
+//------------------------------------------------------------------------------
+bool Bk3dModelNull::buildCmdBuffer(RendererNull* pRenderer, int bufIdx, int mstart, int mend)
+{
+  NXPROFILEFUNC(__FUNCTION__);
+  if(!m_pGenericModel->m_meshFile)
+    return false;
+  NullCmdStream& stream = m_cmdStream[bufIdx];
+  stream.clear();
+
+  int    curMaterial  = -1;
+  int    curTransf    = -1;
+  GLenum lastTopology = GL_NONE;
+  if((mend <= 0) || (mend > m_pGenericModel->m_meshFile->pMeshes->n))
+    mend = m_pGenericModel->m_meshFile->pMeshes->n;
+  for(int m = mstart; m < mend; m++)
+  {
+    bk3d::Mesh* pMesh        = m_pGenericModel->m_meshFile->pMeshes->p[m];
+    int         curMeshTransf = 0;
+    if(pMesh->pTransforms && (pMesh->pTransforms->n > 0) && (bk3d::Bone*)pMesh->pTransforms->p[0])
+      curMeshTransf = pMesh->pTransforms->p[0]->ID;
+    bk3d::Slot* pS = pMesh->pSlots->p[0];
+    stream.push(NULLCMD_BIND_VERTEX_BUFFER, 0, (uint64_t)(uintptr_t)pS->pVtxBufferData);
+
+    for(int pg = 0; pg < pMesh->pPrimGroups->n; pg++)
+    {
+      bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+      // filter unsuported primitives: QUADS + Line loops
+      switch(pPG->topologyGL)
+      {
+        case GL_QUADS:
+        case GL_QUAD_STRIP:
+        case GL_LINE_LOOP:
+          continue;
+      }
+      if(lastTopology != pPG->topologyGL)
+      {
+        lastTopology = pPG->topologyGL;
+        stream.push(NULLCMD_BIND_PIPELINE, 0, lastTopology);
+      }
+      bool bNeedObjectData = false;
+      int  transf          = curMeshTransf;
+      if(pPG->pTransforms && (pPG->pTransforms->n > 0) && (bk3d::Bone*)pPG->pTransforms->p[0])
+        transf = pPG->pTransforms->p[0]->ID;
+      if(transf != curTransf)
+      {
+        curTransf       = transf;
+        bNeedObjectData = true;
+      }
+      bk3d::Material* pMat = pPG->pMaterial;
+      if(pMat && (curMaterial != pMat->ID))
+      {
+        curMaterial     = pMat->ID;
+        bNeedObjectData = true;
+      }
+      if(bNeedObjectData)
+        stream.push(NULLCMD_BIND_OBJECT_DATA, 0, curTransf * sizeof(MatrixBufferObject), std::max(curMaterial, 0) * sizeof(MaterialBuffer));
+      if(pPG->indexArrayByteSize > 0)
+      {
+        stream.push(NULLCMD_BIND_INDEX_BUFFER, 0, (uint64_t)(uintptr_t)pPG->pIndexBufferData, pPG->indexFormatGL);
+        stream.push(NULLCMD_DRAW_INDEXED, pPG->indexCount);
+      }
+      else
+      {
+        stream.push(NULLCMD_DRAW, pPG->indexCount);
+      }
+      stream.primitives += primitiveCount(pPG->topologyGL, pPG->indexCount);
+    }
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+// the statistics of the model are the ones of its slices: they are only written
+// here, on the main thread
+//------------------------------------------------------------------------------
+void Bk3dModelNull::consolidateCmdBuffers(int numCmdBuffers)
+{
+  m_numUsedCmdBuffers = numCmdBuffers;
+  Bk3dModel::Stats& stats = m_pGenericModel->m_stats;
+  memset(&stats, 0, sizeof(Bk3dModel::Stats));
+  for(int i = 0; i < numCmdBuffers; i++)
+  {
+    const NullCmdStream& stream = m_cmdStream[i];
+    stats.primitives += stream.primitives;
+    stats.drawcalls += stream.numCalls[NULLCMD_DRAW] + stream.numCalls[NULLCMD_DRAW_INDEXED];
+    stats.attr_update += stream.numCalls[NULLCMD_BIND_VERTEX_BUFFER];
+    stats.uniform_update += stream.numCalls[NULLCMD_BIND_OBJECT_DATA];
+    stats.state_binds += stream.numCalls[NULLCMD_BIND_PIPELINE];
+    stats.buffer_binds += stream.numCalls[NULLCMD_BIND_VERTEX_BUFFER] + stream.numCalls[NULLCMD_BIND_INDEX_BUFFER];
+    stats.descriptor_binds += stream.numCalls[NULLCMD_BIND_OBJECT_DATA];
+    stats.tokens += (unsigned int)stream.cmds.size();
+    stats.bytes_recorded += (unsigned int)(stream.cmds.size() * sizeof(NullCmd));
+  }
+  if(numCmdBuffers == 0)
+  {
+    for(int i = 0; i < MAXCMDBUFFERS; i++)
+      m_cmdStream[i].clear();
+  }
+}
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+void Bk3dModelNull::displayObject(RendererNull* pRenderer)
+{
+  for(int i = 0; i < m_numUsedCmdBuffers; i++)
+  {
+    if(!m_cmdStream[i].cmds.empty())
+      pRenderer->m_primary.push(NULLCMD_EXECUTE, 0, (uint64_t)(uintptr_t)&m_cmdStream[i]);
+  }
+}
+
+}  // namespace nullrenderer
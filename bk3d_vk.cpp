@@ -51,6 +51,7 @@
 #define EXTERNSVCUI
 #define WINDOWINERTIACAMERA_EXTERN
 #define EMUCMDLIST_EXTERN
+#include "allocstats.h"
 #include "gl_vk_bk3dthreaded.h"
 #include <fileformats/texture_formats.h>
 #include <fileformats/nv_dds.h>
@@ -151,10 +152,11 @@ private:
 #define CMDPOOL_BUFFER_SZ 3  // Ring buffer >= to swapchain so we are safe
     NVK::CommandPool  m_cmdPoolDynamic[CMDPOOL_BUFFER_SZ];
     NVK::CommandPool* m_curCmdPoolDynamic;
+    int               m_resetFrame;  // m_frameCounter2 when the dynamic pool got reset last
     //std::vector<VkCommandBuffer>        m_cmdBufferQueue[2];
   };
 #ifdef USEWORKERS
-  NThreadLocalVar<PerThreadData*> m_perThreadData;
+  NThreadContextVar<PerThreadData*> m_perThreadData;  // thread_local slot: no TLS key lookup in the record path
 #else
   PerThreadData*   m_perThreadData;
 #endif
@@ -197,6 +199,14 @@ private:
 
   // Profiler
   nvvk::ProfilerVK m_profilerVK;
+  // GPU time of whole frames: a pair of timestamps around m_cmdScene for each entry
+  // of m_cmdPoolFence, read back once its fence got signaled (see nextGpuFrame())
+  VkQueryPool                      m_timestampPool;
+  int                              m_gpuFrameTag;                   // frame being recorded, see tagGpuFrame()
+  int                              m_gpuFrames[CMDPOOL_BUFFER_SZ];  // frame of each pair, -1 if none to read
+  double                           m_timestampPeriod;               // ns per tick
+  PFN_vkGetCalibratedTimestampsEXT m_getCalibratedTimestamps;       // NULL: no conversion to the CPU clock
+  bool                             calibrateTimestamps(uint64_t& gpuTicks, uint64_t& cpuNs);
 
   //
   // viewport info
@@ -220,6 +230,9 @@ public:
   {
     m_frameCounter                = 0;
     m_frameCounter2               = 0;
+    m_timestampPool               = VK_NULL_HANDLE;
+    m_gpuFrameTag                 = 0;
+    m_getCalibratedTimestamps     = NULL;
     m_bValid                      = false;
     g_renderers[g_numRenderers++] = this;
   }
@@ -257,6 +270,9 @@ public:
 
   virtual void updateViewport(GLint x, GLint y, GLsizei width, GLsizei height);
 
+  virtual void tagGpuFrame(int frame) { m_gpuFrameTag = frame; }
+  virtual bool nextGpuFrame(GpuFrameTime& gpuFrame);
+
   virtual bool bFlipViewport() { return true; }
 
   friend class Bk3dModelVk;
@@ -281,9 +297,10 @@ struct ModelCmdBuffers
 class Bk3dModelVk
 {
 private:
-  Bk3dModel*      m_pGenericModel;
-  int             m_numUsedCmdBuffers;
-  ModelCmdBuffers m_cmdBuffer[MAXCMDBUFFERS];
+  Bk3dModel*       m_pGenericModel;
+  int              m_numUsedCmdBuffers;
+  ModelCmdBuffers  m_cmdBuffer[MAXCMDBUFFERS];
+  Bk3dModel::Stats m_sliceStats[MAXCMDBUFFERS];  // written by the worker recording the slice
 
 #ifdef USE_VKCMDBINDVERTEXBUFFERS_OFFSET
   std::vector<BufO> m_ObjVBOs;
@@ -303,7 +320,7 @@ public:
   Bk3dModelVk(Bk3dModel* pGenericModel);
   ~Bk3dModelVk();
 
-  bool feedCmdBuffer(RendererVk* pRendererVk, NVK::CommandBuffer& cmdBuffer, NVK::CommandBuffer* cmdBufferSplitTopo, int mstart, int mend);
+  bool feedCmdBuffer(RendererVk* pRendererVk, NVK::CommandBuffer& cmdBuffer, NVK::CommandBuffer* cmdBufferSplitTopo, int mstart, int mend, Bk3dModel::Stats& stats);
   bool buildCmdBuffer(Renderer* pRenderer, int bufIdx, int mstart, int mend);
   void consolidateCmdBuffers(int numCmdBuffers);
   bool initResources(Renderer* pRenderer);
@@ -612,6 +629,25 @@ bool RendererVk::initGraphics(int w, int h, int MSAA)
   //--------------------------------------------------------------------------
   m_profilerVK = nvvk::ProfilerVK(&g_profiler);
   m_profilerVK.init(nvk.m_device, nvk.m_gpu.device);
+  //
+  // timestamps of the frames, when the queue has some. VK_EXT_calibrated_timestamps
+  // converts them to the CPU clock, if the driver has it
+  //
+  for(int i = 0; i < CMDPOOL_BUFFER_SZ; i++)
+    m_gpuFrames[i] = -1;
+  if(nvk.m_gpu.queueProperties[0].timestampValidBits)
+  {
+    VkQueryPoolCreateInfo queryPoolInfo = {VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+    queryPoolInfo.queryType             = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolInfo.queryCount            = 2 * CMDPOOL_BUFFER_SZ;
+    if(vkCreateQueryPool(nvk.m_device, &queryPoolInfo, NULL, &m_timestampPool) != VK_SUCCESS)
+      m_timestampPool = VK_NULL_HANDLE;
+  }
+  m_timestampPeriod         = nvk.m_gpu.properties.limits.timestampPeriod;
+  m_getCalibratedTimestamps = (PFN_vkGetCalibratedTimestampsEXT)vkGetDeviceProcAddr(nvk.m_device, "vkGetCalibratedTimestampsEXT");
+  uint64_t gpuTicks, cpuNs;
+  if(m_getCalibratedTimestamps && !calibrateTimestamps(gpuTicks, cpuNs))
+    m_getCalibratedTimestamps = NULL;
 
   //
   // Create a sampler
@@ -709,6 +745,8 @@ bool RendererVk::initGraphics(int w, int h, int MSAA)
   m_matrix.Sz = sizeof(glm::vec4) * 4 * 2;
   m_matrix.buffer = nvk.utCreateAndFillBuffer(&m_perThreadData->m_cmdPoolStatic, m_matrix.Sz, NULL, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
                                               m_matrix.bufferMem, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  memTrackName(this, getName());
+  memTrack(MEMTAG_UNIFORM_BUFFERS, NULL, this, m_matrix.Sz);
   //--------------------------------------------------------------------------
   // descriptor set LAYOUTS
   //
@@ -787,6 +825,7 @@ bool RendererVk::initResourcesGrid()
   //
   m_gridBuffer.buffer = nvk.utCreateAndFillBuffer(&m_perThreadData->m_cmdPoolStatic, vboSz, data, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
                                                   m_gridBuffer.bufferMem, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  memTrack(MEMTAG_VERTEX_BUFFERS, NULL, this, vboSz);
   return true;
 }
 //------------------------------------------------------------------------------
@@ -925,6 +964,11 @@ void RendererVk::displayStart(const glm::mat4& world, const InertiaCamera& camer
   m_cmdScene = m_perThreadData->m_curCmdPoolDynamic->allocateCommandBuffer(true);
 
   m_cmdScene.beginCommandBuffer(false, true, NVK::CommandBufferInheritanceInfo(renderPass, 0, framebuffer, VK_FALSE, 0, 0));
+  if(m_timestampPool)
+  {
+    vkCmdResetQueryPool(m_cmdScene.m_cmdbuffer, m_timestampPool, 2 * m_frameCounter, 2);
+    vkCmdWriteTimestamp(m_cmdScene.m_cmdbuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_timestampPool, 2 * m_frameCounter);
+  }
 
   m_slot = m_profilerVK.beginSection("scene", m_cmdScene.m_cmdbuffer);
 
@@ -948,6 +992,8 @@ void RendererVk::displayEnd()
     m_cmdScene.cmdEndRenderPass();
     // TODO: Create a MACRO
     m_profilerVK.endSection(m_slot, m_cmdScene.m_cmdbuffer);
+    if(m_timestampPool)
+      vkCmdWriteTimestamp(m_cmdScene.m_cmdbuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_timestampPool, 2 * m_frameCounter + 1);
     m_cmdScene.endCommandBuffer();
   }
   {
@@ -955,6 +1001,10 @@ void RendererVk::displayEnd()
     nvk.queueSubmit(NVK::SubmitInfo(1, &m_semOpenGLReadDone, &waitStages, 1, m_cmdScene, 1, &m_semVKRenderingDone),
                     m_cmdPoolFence[m_frameCounter]);
   }
+  // the pair holds the previous frame until this submission: tagged only now.
+  // A frame not read back by then gets lost, the sample reads them each frame
+  if(m_timestampPool)
+    m_gpuFrames[m_frameCounter] = m_gpuFrameTag;
   // allows us to loop through the next available pool for next frame
   m_frameCounter++;
   m_frameCounter2++;
@@ -963,6 +1013,70 @@ void RendererVk::displayEnd()
   //vkQueueWaitIdle(nvk.m_queue);
 }
 //------------------------------------------------------------------------------
+// the same instant on the GPU and on the clock of NTrace::ClockNs()
+// (std::chrono::steady_clock: CLOCK_MONOTONIC, or the performance counter on Windows)
+//------------------------------------------------------------------------------
+bool RendererVk::calibrateTimestamps(uint64_t& gpuTicks, uint64_t& cpuNs)
+{
+  VkCalibratedTimestampInfoEXT infos[2] = {{VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT},
+                                           {VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT}};
+  infos[0].timeDomain                   = VK_TIME_DOMAIN_DEVICE_EXT;
+#ifdef _WIN32
+  infos[1].timeDomain = VK_TIME_DOMAIN_QUERY_PERFORMANCE_COUNTER_EXT;
+#else
+  infos[1].timeDomain = VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT;
+#endif
+  uint64_t timestamps[2];
+  uint64_t maxDeviation;
+  if(m_getCalibratedTimestamps(nvk.m_device, 2, infos, timestamps, &maxDeviation) != VK_SUCCESS)
+    return false;
+  gpuTicks = timestamps[0];
+#ifdef _WIN32
+  LARGE_INTEGER frequency;
+  QueryPerformanceFrequency(&frequency);
+  cpuNs = uint64_t(double(timestamps[1]) * 1e9 / double(frequency.QuadPart));
+#else
+  cpuNs = timestamps[1];
+#endif
+  return true;
+}
+//------------------------------------------------------------------------------
+// the frames come back in the order of their tags. A pair is complete once the
+// fence of its submission got signaled: it gets tagged right after the submission,
+// when the fence can't be the one of the previous use of the pair any more
+//------------------------------------------------------------------------------
+bool RendererVk::nextGpuFrame(GpuFrameTime& gpuFrame)
+{
+  if(!m_bValid || !m_timestampPool)
+    return false;
+  int pair = -1;
+  for(int i = 0; i < CMDPOOL_BUFFER_SZ; i++)
+  {
+    if((m_gpuFrames[i] >= 0) && ((pair < 0) || (m_gpuFrames[i] < m_gpuFrames[pair])))
+      pair = i;
+  }
+  if((pair < 0) || (vkGetFenceStatus(nvk.m_device, m_cmdPoolFence[pair]) != VK_SUCCESS))
+    return false;
+  uint64_t timestamps[2];
+  if(vkGetQueryPoolResults(nvk.m_device, m_timestampPool, 2 * pair, 2, sizeof(timestamps), timestamps, sizeof(uint64_t),
+                           VK_QUERY_RESULT_64_BIT)
+     != VK_SUCCESS)
+    return false;
+  gpuFrame.frame   = m_gpuFrames[pair];
+  gpuFrame.gpuMs   = float(double(timestamps[1] - timestamps[0]) * m_timestampPeriod / 1000000.0);
+  gpuFrame.beginNs = 0;
+  gpuFrame.endNs   = 0;
+  m_gpuFrames[pair] = -1;
+  uint64_t gpuTicks, cpuNs;
+  if(m_getCalibratedTimestamps && calibrateTimestamps(gpuTicks, cpuNs))
+  {
+    // from the calibration, which is recent: the difference of ticks is small enough for a double
+    gpuFrame.beginNs = cpuNs - uint64_t(double(int64_t(gpuTicks - timestamps[0])) * m_timestampPeriod);
+    gpuFrame.endNs   = cpuNs - uint64_t(double(int64_t(gpuTicks - timestamps[1])) * m_timestampPeriod);
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
 //
 // blit to gl backbuffer
 //
@@ -1100,6 +1214,7 @@ void RendererVk::resetCommandBuffersPool()
 
   p->m_cmdPoolDynamic[m_frameCounter].resetCommandPool(VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT);
   p->m_curCmdPoolDynamic = &p->m_cmdPoolDynamic[m_frameCounter];
+  p->m_resetFrame        = m_frameCounter2;
 }
 
 //------------------------------------------------------------------------------
@@ -1113,8 +1228,18 @@ bool RendererVk::initThreadLocalVars(int threadId)
   //--------------------------------------------------------------------------
   // CMDPOOL_BUFFER_SZ Command pools per thread!
   //
-  m_perThreadData                     = new PerThreadData;
+  // called from the thread itself: with NUMA-local allocation the pages end up on its node
+  if(g_numaLocalThreadData)
+  {
+    void* mem = NumaLocalAlloc(sizeof(PerThreadData));
+    if(mem == NULL)
+      return false;
+    m_perThreadData = new(mem) PerThreadData;
+  }
+  else
+    m_perThreadData = new PerThreadData;
   m_perThreadData->m_threadId         = threadId;
+  m_perThreadData->m_resetFrame       = -1;
   VkCommandPoolCreateInfo cmdPoolInfo = {VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
   cmdPoolInfo.queueFamilyIndex        = 0;
   cmdPoolInfo.flags                   = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
@@ -1149,7 +1274,14 @@ void RendererVk::releaseThreadLocalVars()
   cmdPoolStatic = VK_NULL_HANDLE;
   if(m_perThreadData)
   {
-    delete(PerThreadData*)m_perThreadData;
+    PerThreadData* p = m_perThreadData;
+    if(g_numaLocalThreadData)
+    {
+      p->~PerThreadData();
+      NumaLocalFree(p, sizeof(PerThreadData));
+    }
+    else
+      delete p;
   }
   m_perThreadData = NULL;
 }
@@ -1217,11 +1349,16 @@ bool RendererVk::terminateGraphics()
 
   m_gridBuffer.release();
   m_matrix.release();
+  memUntrack(MEMTAG_VERTEX_BUFFERS, NULL, this);
+  memUntrack(MEMTAG_UNIFORM_BUFFERS, NULL, this);
 
   nvk.destroySampler(m_sampler);
   m_sampler = NULL;
 
   m_profilerVK.deinit();
+  if(m_timestampPool)
+    vkDestroyQueryPool(nvk.m_device, m_timestampPool, NULL);
+  m_timestampPool = VK_NULL_HANDLE;
 
   nvk.destroySemaphore(m_semOpenGLReadDone);
   nvk.destroySemaphore(m_semVKRenderingDone);
@@ -1306,6 +1443,11 @@ bool RendererVk::buildCmdBufferModel(Bk3dModel* pGenericModel, int bufIdx, int m
 {
   if(m_bValid == false)
     return false;
+  // first recording of this thread in the frame: reset its pool here rather than in a
+  // dedicated task. Thread #0 already waited for the fence of this slot of the ring
+  PerThreadData* p = m_perThreadData;
+  if(p->m_resetFrame != m_frameCounter2)
+    resetCommandBuffersPool();
   return ((Bk3dModelVk*)pGenericModel->m_pRendererData)->buildCmdBuffer(this, bufIdx, mstart, mend);
 }
 //------------------------------------------------------------------------------
@@ -1363,6 +1505,7 @@ Bk3dModelVk::Bk3dModelVk(Bk3dModel* pGenericModel)
   m_pGenericModel     = pGenericModel;
   m_numUsedCmdBuffers = 0;
   memset(m_cmdBuffer, 0, MAXCMDBUFFERS * sizeof(ModelCmdBuffers));
+  memset(m_sliceStats, 0, MAXCMDBUFFERS * sizeof(Bk3dModel::Stats));
 }
 
 Bk3dModelVk::~Bk3dModelVk() {}
@@ -1376,6 +1519,9 @@ bool Bk3dModelVk::releaseResources(Renderer* pRenderer)
 
   m_uboObjectMatrices.release();
   m_uboMaterial.release();
+  memUntrack(MEMTAG_UNIFORM_BUFFERS, m_pGenericModel, pRendererVk);
+  memUntrack(MEMTAG_VERTEX_BUFFERS, m_pGenericModel, pRendererVk);
+  memUntrack(MEMTAG_INDEX_BUFFERS, m_pGenericModel, pRendererVk);
 #ifdef USE_VKCMDBINDVERTEXBUFFERS_OFFSET
   for(int i = 0; i < m_ObjVBOs.size(); i++)
   {
@@ -1445,8 +1591,6 @@ bool Bk3dModelVk::initResources(Renderer* pRenderer)
 {
   RendererVk* pRendererVk = static_cast<RendererVk*>(pRenderer);
 
-  //m_pGenericModel->m_meshFile->pMeshes->n = 60000;
-
   //
   // create Buffer Object for materials
   //
@@ -1462,6 +1606,7 @@ bool Bk3dModelVk::initResources(Renderer* pRenderer)
                                                      m_pGenericModel->m_material, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
                                                      m_uboMaterial.bufferMem, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
     LOGI("%d materials stored in %zu Kb\n", m_pGenericModel->m_meshFile->pMaterials->nMaterials, (m_uboMaterial.Sz + 512) / 1024);
+    memTrack(MEMTAG_UNIFORM_BUFFERS, m_pGenericModel, pRendererVk, m_uboMaterial.Sz);
   }
 
   //
@@ -1480,6 +1625,7 @@ bool Bk3dModelVk::initResources(Renderer* pRenderer)
                                   m_pGenericModel->m_objectMatrices, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
                                   m_uboObjectMatrices.bufferMem, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
     LOGI("%d matrices stored in %zu Kb\n", m_pGenericModel->m_meshFile->pTransforms->nBones, (m_uboObjectMatrices.Sz + 512) / 1024);
+    memTrack(MEMTAG_UNIFORM_BUFFERS, m_pGenericModel, pRendererVk, m_uboObjectMatrices.Sz);
   }
   //
   // DescriptorSet allocation
@@ -1671,6 +1817,8 @@ bool Bk3dModelVk::initResources(Renderer* pRenderer)
   LOGI("meshes: %d in : %f Mb VBO and %f Mb EBO \n", m_pGenericModel->m_meshFile->pMeshes->n,
        (float)totalVBOSz / (float)(1024 * 1024), (float)totalEBOSz / (float)(1024 * 1024));
 #endif
+  memTrack(MEMTAG_VERTEX_BUFFERS, m_pGenericModel, pRendererVk, totalVBOSz);
+  memTrack(MEMTAG_INDEX_BUFFERS, m_pGenericModel, pRendererVk, totalEBOSz);
   return true;
 }
 
@@ -1680,10 +1828,15 @@ bool Bk3dModelVk::initResources(Renderer* pRenderer)
 void Bk3dModelVk::consolidateCmdBuffers(int numCmdBuffers)
 {
   m_numUsedCmdBuffers = numCmdBuffers;
+  // the statistics of the model are the ones of its slices: only written here, on the main thread
+  memset(&m_pGenericModel->m_stats, 0, sizeof(Bk3dModel::Stats));
+  for(int i = 0; i < numCmdBuffers; i++)
+    m_pGenericModel->m_stats.add(m_sliceStats[i]);
   // Optional cleanup
   if(numCmdBuffers == 0)
   {
     memset(m_cmdBuffer, 0, sizeof(ModelCmdBuffers) * MAXCMDBUFFERS);
+    memset(m_sliceStats, 0, sizeof(Bk3dModel::Stats) * MAXCMDBUFFERS);
     //for(int m=0; m<MAXCMDBUFFERS*2; m++)
     //{
     //    m_cmdBuffer[m].full = NULL;
@@ -1695,9 +1848,10 @@ void Bk3dModelVk::consolidateCmdBuffers(int numCmdBuffers)
   }
 }
 //------------------------------------------------------------------------------
-//
+// stats: the commands of cmdBuffer and of the 5 cmdBufferSplitTopo. The driver
+// owns their memory: no bytes_recorded
 //------------------------------------------------------------------------------
-bool Bk3dModelVk::feedCmdBuffer(RendererVk* pRendererVk, NVK::CommandBuffer& cmdBuffer, NVK::CommandBuffer* cmdBufferSplitTopo, int mstart, int mend)
+bool Bk3dModelVk::feedCmdBuffer(RendererVk* pRendererVk, NVK::CommandBuffer& cmdBuffer, NVK::CommandBuffer* cmdBufferSplitTopo, int mstart, int mend, Bk3dModel::Stats& stats)
 {
   //NXPROFILEFUNC(__FUNCTION__);
   BufO            curVBO;
@@ -1714,10 +1868,14 @@ bool Bk3dModelVk::feedCmdBuffer(RendererVk* pRendererVk, NVK::CommandBuffer& cmd
   float         lineWidth   = 1.0;
   float         width       = pRendererVk->m_viewRect.extent.width;
   float         height      = pRendererVk->m_viewRect.extent.height;
+  int           numSplit    = cmdBufferSplitTopo ? 5 : 0;
   //
   // Bind descriptorSet for globals
   //
   {
+    stats.descriptor_binds += 1 + numSplit;
+    stats.state_binds += numSplit;
+    stats.tokens += 5 + numSplit * 6;
     vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pRendererVk->m_pipelineLayout, DSET_GLOBAL, 1,
                             &pRendererVk->m_descriptorSetGlobal, 0, NULL);
     cmdBuffer.cmdSetDepthBias(1.0f, 0.0f, 1.0f);  // offset raster
@@ -1800,6 +1958,9 @@ bool Bk3dModelVk::feedCmdBuffer(RendererVk* pRendererVk, NVK::CommandBuffer& cmd
     VkDeviceSize vboffsets[] = {0};  //(GLuint64)pS->VBOIDX.p}; // we previously stored the offset in the buffer here...
 #endif
     {
+      stats.attr_update++;
+      stats.buffer_binds += 1 + numSplit;
+      stats.tokens += 1 + numSplit;
 #ifdef USE_VKCMDBINDVERTEXBUFFERS_OFFSET
       vkCmdBindVertexBuffers(cmdBuffer, 0, 1, &curVBO.buffer, vboffsets);
 #else
@@ -1877,6 +2038,8 @@ bool Bk3dModelVk::feedCmdBuffer(RendererVk* pRendererVk, NVK::CommandBuffer& cmd
             {
               lastPipeline = pRendererVk->m_pipelineMeshLine;
               vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pRendererVk->m_pipelineMeshLine);
+              stats.state_binds++;
+              stats.tokens++;
             }
             break;
           case GL_LINE_STRIP:
@@ -1886,6 +2049,8 @@ bool Bk3dModelVk::feedCmdBuffer(RendererVk* pRendererVk, NVK::CommandBuffer& cmd
             {
               lastPipeline = pRendererVk->m_pipelineMeshLineStrip;
               vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pRendererVk->m_pipelineMeshLineStrip);
+              stats.state_binds++;
+              stats.tokens++;
             }
             break;
           case GL_TRIANGLES:
@@ -1895,6 +2060,8 @@ bool Bk3dModelVk::feedCmdBuffer(RendererVk* pRendererVk, NVK::CommandBuffer& cmd
             {
               lastPipeline = pRendererVk->m_pipelineMeshTri;
               vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pRendererVk->m_pipelineMeshTri);
+              stats.state_binds++;
+              stats.tokens++;
             }
             break;
           case GL_TRIANGLE_STRIP:
@@ -1904,6 +2071,8 @@ bool Bk3dModelVk::feedCmdBuffer(RendererVk* pRendererVk, NVK::CommandBuffer& cmd
             {
               lastPipeline = pRendererVk->m_pipelineMeshTriStrip;
               vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pRendererVk->m_pipelineMeshTriStrip);
+              stats.state_binds++;
+              stats.tokens++;
             }
             break;
           case GL_TRIANGLE_FAN:
@@ -1913,6 +2082,8 @@ bool Bk3dModelVk::feedCmdBuffer(RendererVk* pRendererVk, NVK::CommandBuffer& cmd
             {
               lastPipeline = pRendererVk->m_pipelineMeshTriFan;
               vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pRendererVk->m_pipelineMeshTriFan);
+              stats.state_binds++;
+              stats.tokens++;
             }
             break;
           default:
@@ -1931,6 +2102,9 @@ bool Bk3dModelVk::feedCmdBuffer(RendererVk* pRendererVk, NVK::CommandBuffer& cmd
                                static_cast<uint32_t>(curMaterial * sizeof(MaterialBuffer))};
         vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pRendererVk->m_pipelineLayout, DSET_OBJECT,
                                 NDSETOBJECT, m_descriptorSets, 2, offsets);
+        stats.uniform_update++;
+        stats.descriptor_binds += 1 + numSplit;
+        stats.tokens += 1 + numSplit;
         // This is not optimal: many vkCmdBindDescriptorSets in cmdBufferSplitTopo[] when not especially needed
         if(cmdBufferSplitTopo)
         {
@@ -1964,6 +2138,8 @@ bool Bk3dModelVk::feedCmdBuffer(RendererVk* pRendererVk, NVK::CommandBuffer& cmd
 #endif
           vkCmdDrawIndexed(m_curCmdBufferSplitTopo, pPG->indexCount, 1, 0, 0, 0);
         }
+        stats.buffer_binds += m_curCmdBufferSplitTopo ? 2 : 1;
+        stats.tokens += m_curCmdBufferSplitTopo ? 4 : 2;
       }
       else
       {
@@ -1972,7 +2148,11 @@ bool Bk3dModelVk::feedCmdBuffer(RendererVk* pRendererVk, NVK::CommandBuffer& cmd
         {
           vkCmdDraw(m_curCmdBufferSplitTopo, pPG->indexCount, 1, 0, 0);
         }
+        stats.tokens += m_curCmdBufferSplitTopo ? 2 : 1;
       }
+      // what the full command-buffer draws
+      stats.drawcalls++;
+      stats.primitives += primitiveCount(pPG->topologyGL, pPG->indexCount);
     }
   }
   return true;
@@ -2018,7 +2198,8 @@ bool Bk3dModelVk::buildCmdBuffer(Renderer* pRenderer, int bufIdx, int mstart, in
     //
     RendererVk::PerThreadData* perThreadData = pRendererVk->m_perThreadData;
 
-    res = feedCmdBuffer(pRendererVk, cmdBuffer.full, cmdBuffer.SplitTopo, mstart, mend);
+    memset(&m_sliceStats[bufIdx], 0, sizeof(Bk3dModel::Stats));
+    res = feedCmdBuffer(pRendererVk, cmdBuffer.full, cmdBuffer.SplitTopo, mstart, mend, m_sliceStats[bufIdx]);
 
     //if(topologies & 0x20)
     cmdBuffer.full.endCommandBuffer();
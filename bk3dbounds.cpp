@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include "mt/CThreadWork.h"
+#include "bk3dEx.h"
+#include "bk3dbounds.h"
+
+struct Bounds
+{
+  float min[3];
+  float max[3];
+};
+
+void foldMeshBounds(const bk3d::FileHeader* pFile, float min[3], float max[3])
+{
+  const Bounds empty  = {{1000.0, 1000.0, 1000.0}, {-1000.0, -1000.0, -1000.0}};
+  Bounds       bounds = parallel_reduce(0, pFile->pMeshes->n, BK3DBOUNDS_GRAIN, empty,
+                                        [&](int mstart, int mend, Bounds b) {
+                                          for(int i = mstart; i < mend; i++)
+                                          {
+                                            bk3d::Mesh* pMesh = pFile->pMeshes->p[i];
+                                            for(int c = 0; c < 3; c++)
+                                            {
+                                              if(pMesh->aabbox.min[c] < b.min[c])
+                                                b.min[c] = pMesh->aabbox.min[c];
+                                              if(pMesh->aabbox.max[c] > b.max[c])
+                                                b.max[c] = pMesh->aabbox.max[c];
+                                            }
+                                          }
+                                          return b;
+                                        },
+                                        [](Bounds a, const Bounds& b) {
+                                          for(int c = 0; c < 3; c++)
+                                          {
+                                            a.min[c] = b.min[c] < a.min[c] ? b.min[c] : a.min[c];
+                                            a.max[c] = b.max[c] > a.max[c] ? b.max[c] : a.max[c];
+                                          }
+                                          return a;
+                                        });
+  for(int c = 0; c < 3; c++)
+  {
+    min[c] = bounds.min[c];
+    max[c] = bounds.max[c];
+  }
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+
+namespace bk3d {
+struct FileHeader;
+}
+
+//------------------------------------------------------------------------------
+// Bounding-box of all the meshes of a bk3d file: a parallel_reduce() over their
+// boxes, grains of BK3DBOUNDS_GRAIN meshes. Bk3dModel::loadModel() centers and
+// scales the model with it.
+// Without meshes, min stays at 1000 and max at -1000
+//------------------------------------------------------------------------------
+#define BK3DBOUNDS_GRAIN 256
+
+void foldMeshBounds(const bk3d::FileHeader* pFile, float min[3], float max[3]);
@@ -0,0 +1,467 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <algorithm>
+
+#include <glm/gtc/type_ptr.hpp>
+
+#define EXTERNSVCUI
+#define WINDOWINERTIACAMERA_EXTERN
+#define EMUCMDLIST_EXTERN
+#include "gl_vk_bk3dthreaded.h"
+#include "mt/CThreadWork.h"
+#include "benchmark.h"
+#include "capture.h"
+
+//
+// file: CaptureFileHeader, the models (length of the name, name, posOffset, scale),
+// then the records, the floats and the ints
+//
+#define CAPTURE_MAGIC "BK3DCAP"
+#define CAPTURE_VERSION 1
+
+struct CaptureFileHeader
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t numModels;
+  uint32_t numRecords;
+  uint32_t numFloats;
+  uint32_t numInts;
+};
+
+// floats of the payload of each kind of record
+static const int s_captureFloats[CAPTURE_NUM_CALLS] = {
+    0,               // CAPTURE_FRAME
+    0,               // CAPTURE_RESET_POOL
+    16 * 3 + 3 + 3,  // CAPTURE_DISPLAY_START
+    0,               // CAPTURE_PREPARE_SLICES
+    0,               // CAPTURE_BUILD_SLICE
+    0,               // CAPTURE_CONSOLIDATE
+    16 * 2 + 3 + 3,  // CAPTURE_DISPLAY_GRID
+    16 * 2,          // CAPTURE_DISPLAY_MODEL
+    0,               // CAPTURE_DISPLAY_END
+};
+
+static void pushFloats(std::vector<float>& floats, const float* p, int n)
+{
+  floats.insert(floats.end(), p, p + n);
+}
+
+//------------------------------------------------------------------------------
+// recording
+//------------------------------------------------------------------------------
+void DrawCapture::begin(const std::vector<Bk3dModel*>& models)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_models.clear();
+  m_records.clear();
+  m_floats.clear();
+  m_ints.clear();
+  m_frameStarts.clear();
+  m_cameras.clear();
+  m_cameraOfRecord.clear();
+  for(int m = 0; m < models.size(); m++)
+  {
+    CaptureModel model;
+    model.name = models[m]->m_name;
+    for(int c = 0; c < 3; c++)
+      model.posOffset[c] = models[m]->m_posOffset[c];
+    model.scale = models[m]->m_scale;
+    m_models.push_back(model);
+  }
+}
+
+CaptureRecord& DrawCapture::push(CaptureCall call, int model)
+{
+  CaptureRecord rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.call  = call;
+  rec.model = model;
+  rec.data  = (uint32_t)m_floats.size();
+  m_records.push_back(rec);
+  return m_records.back();
+}
+
+void DrawCapture::pushCamera(const InertiaCamera& camera)
+{
+  pushFloats(m_floats, glm::value_ptr(camera.m4_view), 16);
+}
+
+void DrawCapture::frame()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_frameStarts.push_back((int)m_records.size());
+  push(CAPTURE_FRAME, -1);
+}
+
+void DrawCapture::resetPool()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  push(CAPTURE_RESET_POOL, -1);
+}
+
+void DrawCapture::displayStart(const mat4& world, const InertiaCamera& camera, const mat4& projection, bool bTimingGlitch)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  CaptureRecord& rec = push(CAPTURE_DISPLAY_START, -1);
+  rec.args[0]        = bTimingGlitch ? 1 : 0;
+  pushFloats(m_floats, glm::value_ptr(world), 16);
+  pushCamera(camera);
+  pushFloats(m_floats, glm::value_ptr(projection), 16);
+  pushFloats(m_floats, glm::value_ptr(camera.curEyePos), 3);
+  pushFloats(m_floats, glm::value_ptr(camera.curFocusPos), 3);
+}
+
+void DrawCapture::prepareSlices(int model, int numSlices, const int* sliceStarts)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  CaptureRecord& rec = push(CAPTURE_PREPARE_SLICES, model);
+  rec.args[0]        = numSlices;
+  rec.data           = (uint32_t)m_ints.size();
+  m_ints.insert(m_ints.end(), sliceStarts, sliceStarts + numSlices + 1);
+}
+
+void DrawCapture::buildSlice(int model, int bufIdx, int mstart, int mend)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  CaptureRecord& rec = push(CAPTURE_BUILD_SLICE, model);
+  rec.args[0]        = bufIdx;
+  rec.args[1]        = mstart;
+  rec.args[2]        = mend;
+}
+
+void DrawCapture::consolidate(int model, int numCmdBuffers)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  CaptureRecord& rec = push(CAPTURE_CONSOLIDATE, model);
+  rec.args[0]        = numCmdBuffers;
+}
+
+void DrawCapture::displayGrid(const InertiaCamera& camera, const mat4& projection)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  push(CAPTURE_DISPLAY_GRID, -1);
+  pushCamera(camera);
+  pushFloats(m_floats, glm::value_ptr(projection), 16);
+  pushFloats(m_floats, glm::value_ptr(camera.curEyePos), 3);
+  pushFloats(m_floats, glm::value_ptr(camera.curFocusPos), 3);
+}
+
+void DrawCapture::displayModel(int model, const mat4& cameraView, const mat4& projection, unsigned char topologies)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  CaptureRecord& rec = push(CAPTURE_DISPLAY_MODEL, model);
+  rec.args[0]        = topologies;
+  pushFloats(m_floats, glm::value_ptr(cameraView), 16);
+  pushFloats(m_floats, glm::value_ptr(projection), 16);
+}
+
+void DrawCapture::displayEnd()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  push(CAPTURE_DISPLAY_END, -1);
+}
+
+//------------------------------------------------------------------------------
+// file
+//------------------------------------------------------------------------------
+bool DrawCapture::write(const char* fname) const
+{
+  FILE* fd = fopen(fname, "wb");
+  if(!fd)
+  {
+    LOGE("could not write %s\n", fname);
+    return false;
+  }
+  CaptureFileHeader header;
+  memset(&header, 0, sizeof(header));
+  strcpy(header.magic, CAPTURE_MAGIC);
+  header.version    = CAPTURE_VERSION;
+  header.numModels  = (uint32_t)m_models.size();
+  header.numRecords = (uint32_t)m_records.size();
+  header.numFloats  = (uint32_t)m_floats.size();
+  header.numInts    = (uint32_t)m_ints.size();
+  bool bOk          = fwrite(&header, sizeof(header), 1, fd) == 1;
+  for(int m = 0; bOk && (m < m_models.size()); m++)
+  {
+    const CaptureModel& model = m_models[m];
+    uint32_t            len   = (uint32_t)model.name.size();
+    bOk = (fwrite(&len, sizeof(len), 1, fd) == 1) && (fwrite(model.name.c_str(), 1, len, fd) == len)
+          && (fwrite(model.posOffset, sizeof(float), 3, fd) == 3) && (fwrite(&model.scale, sizeof(float), 1, fd) == 1);
+  }
+  if(bOk && !m_records.empty())
+    bOk = fwrite(&m_records[0], sizeof(CaptureRecord), m_records.size(), fd) == m_records.size();
+  if(bOk && !m_floats.empty())
+    bOk = fwrite(&m_floats[0], sizeof(float), m_floats.size(), fd) == m_floats.size();
+  if(bOk && !m_ints.empty())
+    bOk = fwrite(&m_ints[0], sizeof(int), m_ints.size(), fd) == m_ints.size();
+  fclose(fd);
+  if(!bOk)
+    LOGE("could not write %s\n", fname);
+  return bOk;
+}
+
+bool DrawCapture::read(const char* fname)
+{
+  FILE* fd = fopen(fname, "rb");
+  if(!fd)
+  {
+    LOGE("could not open %s\n", fname);
+    return false;
+  }
+  begin(std::vector<Bk3dModel*>());
+  CaptureFileHeader header;
+  bool              bOk = (fread(&header, sizeof(header), 1, fd) == 1) && (memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) == 0)
+             && (header.version == CAPTURE_VERSION);
+  for(uint32_t m = 0; bOk && (m < header.numModels); m++)
+  {
+    CaptureModel model;
+    uint32_t     len = 0;
+    bOk              = (fread(&len, sizeof(len), 1, fd) == 1) && (len < 4096);
+    if(bOk)
+    {
+      model.name.resize(len);
+      bOk = (fread(&model.name[0], 1, len, fd) == len) && (fread(model.posOffset, sizeof(float), 3, fd) == 3)
+            && (fread(&model.scale, sizeof(float), 1, fd) == 1);
+      m_models.push_back(model);
+    }
+  }
+  if(bOk)
+  {
+    m_records.resize(header.numRecords);
+    m_floats.resize(header.numFloats);
+    m_ints.resize(header.numInts);
+    bOk = (fread(m_records.data(), sizeof(CaptureRecord), m_records.size(), fd) == m_records.size())
+          && (fread(m_floats.data(), sizeof(float), m_floats.size(), fd) == m_floats.size())
+          && (fread(m_ints.data(), sizeof(int), m_ints.size(), fd) == m_ints.size());
+  }
+  fclose(fd);
+  //
+  // the records must stay in the pools and refer to models of the capture
+  //
+  for(int i = 0; bOk && (i < m_records.size()); i++)
+  {
+    const CaptureRecord& rec = m_records[i];
+    if((rec.call >= CAPTURE_NUM_CALLS) || (rec.model < -1) || (rec.model >= (int)m_models.size()))
+      bOk = false;
+    else if((rec.model < 0)
+            && ((rec.call == CAPTURE_PREPARE_SLICES) || (rec.call == CAPTURE_BUILD_SLICE)
+                || (rec.call == CAPTURE_CONSOLIDATE) || (rec.call == CAPTURE_DISPLAY_MODEL)))
+      bOk = false;
+    else if(rec.call == CAPTURE_PREPARE_SLICES)
+      bOk = (rec.args[0] >= 0) && (rec.args[0] <= MAXCMDBUFFERS) && ((uint64_t)rec.data + rec.args[0] + 1 <= m_ints.size());
+    else if(rec.call == CAPTURE_BUILD_SLICE)
+      bOk = (rec.args[0] >= 0) && (rec.args[0] < MAXCMDBUFFERS);
+    else if(rec.call == CAPTURE_CONSOLIDATE)
+      bOk = (rec.args[0] >= 0) && (rec.args[0] <= MAXCMDBUFFERS);
+    else if((uint64_t)rec.data + s_captureFloats[rec.call] > m_floats.size())
+      bOk = false;
+  }
+  if(bOk && !m_records.empty() && (m_records[0].call != CAPTURE_FRAME))
+    bOk = false;
+  if(!bOk)
+  {
+    LOGE("%s is not a valid capture\n", fname);
+    begin(std::vector<Bk3dModel*>());
+    return false;
+  }
+  indexFrames();
+  return true;
+}
+
+//
+// the frames, and the cameras of displayStart() and displayGrid(): replaying them doesn't allocate
+//
+void DrawCapture::indexFrames()
+{
+  m_frameStarts.clear();
+  m_cameras.clear();
+  m_cameraOfRecord.assign(m_records.size(), -1);
+  for(int i = 0; i < m_records.size(); i++)
+  {
+    const CaptureRecord& rec = m_records[i];
+    if(rec.call == CAPTURE_FRAME)
+      m_frameStarts.push_back(i);
+    int offset = -1;  // position of the view matrix, followed by the eye and the focus 16 floats later
+    if(rec.call == CAPTURE_DISPLAY_START)
+      offset = 16;
+    else if(rec.call == CAPTURE_DISPLAY_GRID)
+      offset = 0;
+    if(offset < 0)
+      continue;
+    const float*  p     = &m_floats[rec.data + offset];
+    glm::vec3     eye   = glm::make_vec3(p + 32);
+    glm::vec3     focus = glm::make_vec3(p + 35);
+    InertiaCamera camera(eye, focus);
+    camera.m4_view      = glm::make_mat4(p);
+    camera.curEyePos    = eye;
+    camera.curFocusPos  = focus;
+    m_cameraOfRecord[i] = (int)m_cameras.size();
+    m_cameras.push_back(camera);
+  }
+}
+
+bool DrawCapture::matchesModels(const std::vector<Bk3dModel*>& models) const
+{
+  if(models.size() != m_models.size())
+    return false;
+  for(int i = 0; i < m_records.size(); i++)
+  {
+    const CaptureRecord& rec = m_records[i];
+    if(rec.model < 0)
+      continue;
+    const bk3d::FileHeader* pFile = models[rec.model]->m_meshFile;
+    int                     n     = (pFile && pFile->pMeshes) ? pFile->pMeshes->n : 0;
+    if((rec.call == CAPTURE_BUILD_SLICE) && ((rec.args[1] < 0) || (rec.args[2] > n) || (rec.args[1] > rec.args[2])))
+      return false;
+    if((rec.call == CAPTURE_PREPARE_SLICES) && (m_ints[rec.data + rec.args[0]] > n))
+      return false;
+  }
+  return true;
+}
+
+int DrawCapture::countCalls(CaptureCall call) const
+{
+  int n = 0;
+  for(int i = 0; i < m_records.size(); i++)
+    n += (m_records[i].call == call) ? 1 : 0;
+  return n;
+}
+
+//------------------------------------------------------------------------------
+// replay: the calls in the order of the capture, on the calling thread, except
+// the consecutive slices that can get recorded concurrently, as the workers did
+//------------------------------------------------------------------------------
+void DrawCapture::replayFrame(int f, Renderer* pRenderer, const std::vector<Bk3dModel*>& models, bool bParallelSlices, double* recordMs)
+{
+  int    end = (f + 1 < numFrames()) ? m_frameStarts[f + 1] : (int)m_records.size();
+  double ms  = 0.0;
+  for(int i = m_frameStarts[f] + 1; i < end; i++)
+  {
+    const CaptureRecord& rec = m_records[i];
+    const float*         p   = (s_captureFloats[rec.call] > 0) ? &m_floats[rec.data] : NULL;
+    switch(rec.call)
+    {
+      case CAPTURE_RESET_POOL:
+        pRenderer->resetCommandBuffersPool();
+        break;
+      case CAPTURE_DISPLAY_START:
+        pRenderer->displayStart(glm::make_mat4(p), m_cameras[m_cameraOfRecord[i]], glm::make_mat4(p + 32), rec.args[0] != 0);
+        break;
+      case CAPTURE_PREPARE_SLICES:
+        pRenderer->prepareCmdBuffersModel(models[rec.model], rec.args[0], &m_ints[rec.data]);
+        break;
+      case CAPTURE_BUILD_SLICE: {
+        int last = i + 1;
+        while((last < end) && (m_records[last].call == CAPTURE_BUILD_SLICE))
+          last++;
+        const CaptureRecord*                  slices = &m_records[0];
+        std::chrono::steady_clock::time_point t0     = std::chrono::steady_clock::now();
+        auto                                  build  = [&](int b, int e) {
+          for(int s = b; s < e; s++)
+            pRenderer->buildCmdBufferModel(models[slices[s].model], slices[s].args[0], slices[s].args[1], slices[s].args[2]);
+        };
+        if(bParallelSlices)
+          parallel_for(i, last, 1, build);
+        else
+          build(i, last);
+        ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        i = last - 1;
+      }
+      break;
+      case CAPTURE_CONSOLIDATE:
+        pRenderer->consolidateCmdBuffersModel(models[rec.model], rec.args[0]);
+        break;
+      case CAPTURE_DISPLAY_GRID:
+        pRenderer->displayGrid(m_cameras[m_cameraOfRecord[i]], glm::make_mat4(p + 16));
+        break;
+      case CAPTURE_DISPLAY_MODEL:
+        pRenderer->displayBk3dModel(models[rec.model], glm::make_mat4(p), glm::make_mat4(p + 16), (unsigned char)rec.args[0]);
+        break;
+      case CAPTURE_DISPLAY_END:
+        pRenderer->displayEnd();
+        break;
+    }
+  }
+  if(recordMs)
+    *recordMs = ms;
+}
+
+//------------------------------------------------------------------------------
+// -replay <file> <loops>: only the calls of the capture: no UI, camera animation
+// nor frame graph. The slices go to the workers if enabled. Then reports the CPU
+// time of the frames and of the recording of their slices
+//------------------------------------------------------------------------------
+void runReplay(BenchmarkTarget& target, DrawCapture& capture, int numLoops)
+{
+  Renderer*           pRenderer       = target.renderer();
+  bool                bParallelSlices = target.config().useWorkers;
+  std::vector<double> frameMs;
+  std::vector<double> recordMs;
+  bool                bClosed = false;
+  for(int l = 0; (l < numLoops) && !bClosed; l++)
+  {
+    for(int f = 0; f < capture.numFrames(); f++)
+    {
+      if(!target.pollEvents())
+      {
+        bClosed = true;
+        break;
+      }
+      double                                sliceMs = 0.0;
+      std::chrono::steady_clock::time_point t0      = std::chrono::steady_clock::now();
+      g_profiler.beginFrame();
+      {
+        PROFILE_SECTION("frame");
+        capture.replayFrame(f, pRenderer, g_bk3dModels, bParallelSlices, &sliceMs);
+      }
+      target.present();
+      g_profiler.endFrame();
+      frameMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+      recordMs.push_back(sliceMs);
+    }
+  }
+  pRenderer->waitForGPUIdle();
+  if(frameMs.empty())
+    return;
+  double frameSum  = 0.0;
+  double recordSum = 0.0;
+  for(int i = 0; i < frameMs.size(); i++)
+  {
+    frameSum += frameMs[i];
+    recordSum += recordMs[i];
+  }
+  std::sort(frameMs.begin(), frameMs.end());
+  std::sort(recordMs.begin(), recordMs.end());
+  int              n = (int)frameMs.size();
+  Bk3dModel::Stats stats;
+  memset(&stats, 0, sizeof(Bk3dModel::Stats));
+  for(int m = 0; m < g_bk3dModels.size(); m++)
+    g_bk3dModels[m]->addStats(stats);
+  LOGI("replay: %d frames (%d slices) x %d loops with %s, slices %s\n", capture.numFrames(),
+       capture.countCalls(CAPTURE_BUILD_SLICE), numLoops, pRenderer->getName(), bParallelSlices ? "on the workers" : "serial");
+  LOGI("replay: frame mean %.3f ms, median %.3f, min %.3f, max %.3f\n", frameSum / n, frameMs[n / 2], frameMs[0], frameMs[n - 1]);
+  LOGI("replay: recording of the slices mean %.3f ms, median %.3f, min %.3f, max %.3f\n", recordSum / n, recordMs[n / 2],
+       recordMs[0], recordMs[n - 1]);
+  LOGI("replay: %u draw calls, %u primitives, %u vertex buffer and %u object data updates per frame\n", stats.drawcalls,
+       stats.primitives, stats.attr_update, stats.uniform_update);
+}
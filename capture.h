@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// to include after gl_vk_bk3dthreaded.h (Renderer, Bk3dModel, InertiaCamera)
+
+//------------------------------------------------------------------------------
+// Capture of the renderer-level calls of frames, and their replay
+//
+// "-capture <file>" records, in the order they happen, the calls the frames make
+// to the Renderer: displayStart() with the matrices of the global uniform
+// buffer, the slices given to prepareCmdBuffersModel()/buildCmdBufferModel(),
+// the consolidations, displayGrid(), displayBk3dModel() with its topologies,
+// displayEnd(). "-replay <file>" loads the models of the capture and calls any
+// renderer, the null one included, with the same sequence in a loop: no UI nor
+// camera animation in the measure.
+//------------------------------------------------------------------------------
+enum CaptureCall
+{
+  CAPTURE_FRAME,           // start of a frame
+  CAPTURE_RESET_POOL,      // resetCommandBuffersPool()
+  CAPTURE_DISPLAY_START,   // floats: world, view, projection, eye, focus. args[0]: bTimingGlitch
+  CAPTURE_PREPARE_SLICES,  // args[0]: numSlices. ints: sliceStarts[numSlices + 1]
+  CAPTURE_BUILD_SLICE,     // args: bufIdx, mstart, mend
+  CAPTURE_CONSOLIDATE,     // args[0]: numCmdBuffers
+  CAPTURE_DISPLAY_GRID,    // floats: view, projection, eye, focus
+  CAPTURE_DISPLAY_MODEL,   // floats: view, projection. args[0]: topologies
+  CAPTURE_DISPLAY_END,
+  CAPTURE_NUM_CALLS
+};
+
+struct CaptureRecord
+{
+  uint32_t call;
+  int32_t  model;  // index in the models of the capture, or -1
+  int32_t  args[3];
+  uint32_t data;  // offset of the payload in the floats or the ints of the capture
+};
+
+struct CaptureModel
+{
+  std::string name;
+  float       posOffset[3];
+  float       scale;
+};
+
+class DrawCapture
+{
+public:
+  //
+  // recording: the calls can come from any thread (slices recorded by the workers)
+  //
+  void begin(const std::vector<Bk3dModel*>& models);
+  void frame();
+  void resetPool();
+  void displayStart(const mat4& world, const InertiaCamera& camera, const mat4& projection, bool bTimingGlitch);
+  void prepareSlices(int model, int numSlices, const int* sliceStarts);
+  void buildSlice(int model, int bufIdx, int mstart, int mend);
+  void consolidate(int model, int numCmdBuffers);
+  void displayGrid(const InertiaCamera& camera, const mat4& projection);
+  void displayModel(int model, const mat4& cameraView, const mat4& projection, unsigned char topologies);
+  void displayEnd();
+
+  bool write(const char* fname) const;
+  bool read(const char* fname);
+
+  //
+  // replay
+  //
+  const std::vector<CaptureModel>& models() const { return m_models; }
+  int                              numFrames() const { return (int)m_frameStarts.size(); }
+  // false if the slices of the capture don't fit the meshes of the models
+  bool matchesModels(const std::vector<Bk3dModel*>& models) const;
+  // models: loaded from models(), in the same order. The consecutive slices go to
+  // parallel_for() when bParallelSlices. recordMs: time spent in buildCmdBufferModel()
+  void replayFrame(int f, Renderer* pRenderer, const std::vector<Bk3dModel*>& models, bool bParallelSlices, double* recordMs = NULL);
+  // number of calls of a kind, over all the frames
+  int countCalls(CaptureCall call) const;
+
+private:
+  CaptureRecord& push(CaptureCall call, int model);
+  void           pushCamera(const InertiaCamera& camera);
+  void           indexFrames();
+
+  std::mutex                 m_mutex;
+  std::vector<CaptureModel>  m_models;
+  std::vector<CaptureRecord> m_records;
+  std::vector<float>         m_floats;
+  std::vector<int>           m_ints;
+  // replay
+  std::vector<int>           m_frameStarts;     // first record of each frame
+  std::vector<InertiaCamera> m_cameras;         // built once by read() for displayStart() and displayGrid()
+  std::vector<int>           m_cameraOfRecord;  // index in m_cameras, or -1
+};
+
+class BenchmarkTarget;
+// -replay <file> <loops>: the frames of capture, <loops> times, with the renderer of
+// target (the null one when headless). See capture.cpp
+void runReplay(BenchmarkTarget& target, DrawCapture& capture, int numLoops);
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <algorithm>
+
+#include "frametimes.h"
+
+//------------------------------------------------------------------------------
+// RollingTimes
+//------------------------------------------------------------------------------
+RollingTimes::RollingTimes(int windowSize)
+    : m_values(std::max(windowSize, 1), 0.0f)
+    , m_next(0)
+    , m_count(0)
+{
+  m_sorted.reserve(m_values.size());
+}
+
+void RollingTimes::add(float ms)
+{
+  m_values[m_next] = ms;
+  m_next           = (m_next + 1) % (int)m_values.size();
+  m_count          = std::min(m_count + 1, (int)m_values.size());
+}
+
+void RollingTimes::clear()
+{
+  std::fill(m_values.begin(), m_values.end(), 0.0f);
+  m_next  = 0;
+  m_count = 0;
+}
+
+float RollingTimes::percentile(float p) const
+{
+  if(m_count == 0)
+    return 0.0f;
+  // the samples are in [0, m_count) until the ring wraps, then everywhere
+  m_sorted.assign(m_values.begin(), m_values.begin() + m_count);
+  size_t i = (size_t)(p * (float)(m_count - 1) + 0.5f);
+  i        = std::min(i, m_sorted.size() - 1);
+  std::nth_element(m_sorted.begin(), m_sorted.begin() + i, m_sorted.end());
+  return m_sorted[i];
+}
+
+void RollingTimes::histogram(float* buckets, int numBuckets, float bucketMs) const
+{
+  for(int b = 0; b < numBuckets; b++)
+    buckets[b] = 0.0f;
+  for(int i = 0; i < m_count; i++)
+  {
+    int b = (int)(m_values[i] / bucketMs);
+    buckets[std::min(std::max(b, 0), numBuckets - 1)] += 1.0f;
+  }
+}
+
+//------------------------------------------------------------------------------
+// FrameTimeMonitor
+//------------------------------------------------------------------------------
+bool FrameTimeMonitor::addFrame(int frameNumber, float frame, float scene)
+{
+  // against the frames before this one: a long hitch doesn't raise its own threshold
+  float median = frameMs.percentile(0.5f);
+  m_bLastHitch = (frameMs.size() >= HITCH_MIN_FRAMES) && (frame > median * HITCH_FACTOR) && (frame > median + HITCH_MIN_MS);
+  frameMs.add(frame);
+  sceneMs.add(scene);
+  if(m_bLastHitch)
+  {
+    if(m_hitches.size() >= MAX_HITCHES_KEPT)
+      m_hitches.erase(m_hitches.begin());
+    FrameHitch hitch;
+    hitch.frame    = frameNumber;
+    hitch.frameMs  = frame;
+    hitch.sceneMs  = scene;
+    hitch.gpuMs    = HITCH_NO_GPU_TIME;
+    hitch.medianMs = median;
+    m_hitches.push_back(hitch);
+    m_numHitches++;
+  }
+  m_numFrames++;
+  return m_bLastHitch;
+}
+
+void FrameTimeMonitor::addGpuFrame(const GpuFrameTime& gpuFrame)
+{
+  gpuMs.add(gpuFrame.gpuMs);
+  for(size_t i = 0; i < m_hitches.size(); i++)
+  {
+    if(m_hitches[i].frame == gpuFrame.frame)
+      m_hitches[i].gpuMs = gpuFrame.gpuMs;
+  }
+}
+
+void FrameTimeMonitor::clear()
+{
+  frameMs.clear();
+  sceneMs.clear();
+  gpuMs.clear();
+  m_hitches.clear();
+  m_numFrames  = 0;
+  m_numHitches = 0;
+  m_bLastHitch = false;
+}
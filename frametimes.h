@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// GPU time of a whole frame, from timestamps the renderer wrote at the start and
+// the end of its commands. It comes back a few frames after the frame itself:
+// frame tells which one it is. beginNs/endNs are on the clock of NTrace::ClockNs()
+// (std::chrono::steady_clock), 0 when the renderer can't convert its timestamps
+//------------------------------------------------------------------------------
+struct GpuFrameTime
+{
+  int      frame;
+  float    gpuMs;
+  uint64_t beginNs;
+  uint64_t endNs;
+};
+
+//------------------------------------------------------------------------------
+// the last samples of a time, in milliseconds: percentiles over the window.
+// No allocation once the window is full
+//------------------------------------------------------------------------------
+class RollingTimes
+{
+public:
+  RollingTimes(int windowSize = 600);
+
+  void  add(float ms);
+  void  clear();
+  int   size() const { return m_count; }
+  // p in [0,1] over the window: 0.5 for the median, 1 for the max
+  float percentile(float p) const;
+  // ring of the samples, for ImGui::PlotLines(): oldest at offset()
+  const float* values() const { return m_values.data(); }
+  int          offset() const { return m_count < (int)m_values.size() ? 0 : m_next; }
+  // samples per bucket of bucketMs, the last bucket takes the rest
+  void histogram(float* buckets, int numBuckets, float bucketMs) const;
+
+private:
+  std::vector<float>         m_values;
+  int                        m_next;
+  int                        m_count;
+  mutable std::vector<float> m_sorted;
+};
+
+//------------------------------------------------------------------------------
+// a frame much longer than the ones before it: HITCH_FACTOR times the median
+// of the window, and at least HITCH_MIN_MS more
+//------------------------------------------------------------------------------
+#define HITCH_FACTOR 2.0f
+#define HITCH_MIN_MS 2.0f
+#define HITCH_MIN_FRAMES 30  // no detection before the window has a median
+#define MAX_HITCHES_KEPT 8
+#define HITCH_NO_GPU_TIME -1.0f  // not back from the GPU yet, or not measured by the renderer
+
+struct FrameHitch
+{
+  int   frame;  // number given to addFrame()
+  float frameMs;
+  float sceneMs;
+  float gpuMs;  // from addGpuFrame(), a few frames after the hitch
+  float medianMs;
+  // filled by the caller: the profiler at the end of this frame. It holds averages of
+  // its sections over the last frames, not the times of this one
+  std::string profilerDump;
+};
+
+class FrameTimeMonitor
+{
+public:
+  RollingTimes frameMs;  // whole frame, CPU wall time
+  RollingTimes sceneMs;  // recording and submission of the scene (renderFrame()), CPU wall time
+  RollingTimes gpuMs;    // whole frame, GPU, in the order the frames came back from the GPU
+
+  FrameTimeMonitor()
+      : m_numFrames(0)
+      , m_numHitches(0)
+      , m_bLastHitch(false)
+  {
+  }
+  // true when the frame is a hitch: it got appended to hitches()
+  bool addFrame(int frameNumber, float frame, float scene);
+  // GPU time of an earlier frame, once it came back
+  void addGpuFrame(const GpuFrameTime& gpuFrame);
+  void clear();
+
+  bool                           lastFrameHitch() const { return m_bLastHitch; }
+  int                            numFrames() const { return m_numFrames; }
+  int                            numHitches() const { return m_numHitches; }
+  std::vector<FrameHitch>&       hitches() { return m_hitches; }  // the last MAX_HITCHES_KEPT, oldest first
+  const std::vector<FrameHitch>& hitches() const { return m_hitches; }
+
+private:
+  int                     m_numFrames;
+  int                     m_numHitches;
+  bool                    m_bLastHitch;
+  std::vector<FrameHitch> m_hitches;
+};
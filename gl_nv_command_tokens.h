@@ -0,0 +1,698 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+//-----------------------------------------------------------------------------
+// Tokens of NV_command_list and their writer. No GL call in here: the token
+// streams can get built, parsed and benchmarked without a GPU. The headers of
+// the tokens come from the driver, see initTokenInternals()
+//-----------------------------------------------------------------------------
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <vector>
+#include "gl_nv_command_list.h"
+
+//
+// Shader stages for command-list
+//
+enum ShaderStages {
+    STAGE_VERTEX,
+    STAGE_TESS_CONTROL,
+    STAGE_TESS_EVALUATION,
+    STAGE_GEOMETRY,
+    STAGE_FRAGMENT,
+    STAGES,
+};
+
+//-----------------------------------------------------------------------------
+// Useful stuff for Command-list
+//-----------------------------------------------------------------------------
+static GLuint   s_header[GL_FRONT_FACE_COMMAND_NV+1] = { 0 };
+static GLuint   s_headerSizes[GL_FRONT_FACE_COMMAND_NV+1] = { 0 };
+
+static GLushort s_stages[STAGES];
+
+struct Token_Nop {
+    static const GLenum   ID = GL_NOP_COMMAND_NV;
+    NOPCommandNV      cmd;
+    Token_Nop() {
+        cmd.header = s_header[ID];
+    }
+};
+
+struct Token_TerminateSequence {
+    static const GLenum   ID = GL_TERMINATE_SEQUENCE_COMMAND_NV;
+
+    TerminateSequenceCommandNV cmd;
+
+    Token_TerminateSequence() {
+        cmd.header = s_header[ID];
+    }
+};
+
+struct Token_DrawElemsInstanced {
+    static const GLenum   ID = GL_DRAW_ELEMENTS_INSTANCED_COMMAND_NV;
+
+    DrawElementsInstancedCommandNV   cmd;
+
+    Token_DrawElemsInstanced() {
+        cmd.baseInstance = 0;
+        cmd.baseVertex = 0;
+        cmd.firstIndex = 0;
+        cmd.count = 0;
+        cmd.instanceCount = 1;
+
+        cmd.header = s_header[ID];
+    }
+};
+
+struct Token_DrawArraysInstanced {
+    static const GLenum   ID = GL_DRAW_ARRAYS_INSTANCED_COMMAND_NV;
+
+    DrawArraysInstancedCommandNV   cmd;
+
+    Token_DrawArraysInstanced() {
+        cmd.baseInstance = 0;
+        cmd.first = 0;
+        cmd.count = 0;
+        cmd.instanceCount = 1;
+
+        cmd.header = s_header[ID];
+    }
+};
+
+struct Token_DrawElements {
+    static const GLenum   ID = GL_DRAW_ELEMENTS_COMMAND_NV;
+
+    DrawElementsCommandNV   cmd;
+
+    Token_DrawElements() {
+        cmd.baseVertex = 0;
+        cmd.firstIndex = 0;
+        cmd.count = 0;
+
+        cmd.header = s_header[ID];
+    }
+};
+
+struct Token_DrawArrays {
+    static const GLenum   ID = GL_DRAW_ARRAYS_COMMAND_NV;
+
+    DrawArraysCommandNV   cmd;
+
+    Token_DrawArrays() {
+        cmd.first = 0;
+        cmd.count = 0;
+
+        cmd.header = s_header[ID];
+    }
+};
+
+struct Token_DrawElementsStrip {
+    static const GLenum   ID = GL_DRAW_ELEMENTS_STRIP_COMMAND_NV;
+
+    DrawElementsCommandNV   cmd;
+
+    Token_DrawElementsStrip() {
+        cmd.baseVertex = 0;
+        cmd.firstIndex = 0;
+        cmd.count = 0;
+
+        cmd.header = s_header[ID];
+    }
+};
+
+struct Token_DrawArraysStrip {
+    static const GLenum   ID = GL_DRAW_ARRAYS_STRIP_COMMAND_NV;
+
+    DrawArraysCommandNV   cmd;
+
+    Token_DrawArraysStrip() {
+        cmd.first = 0;
+        cmd.count = 0;
+
+        cmd.header = s_header[ID];
+    }
+};
+
+struct Token_AttributeAddress {
+    static const GLenum   ID = GL_ATTRIBUTE_ADDRESS_COMMAND_NV;
+
+    AttributeAddressCommandNV cmd;
+
+    Token_AttributeAddress() {
+        cmd.header = s_header[ID];
+    }
+};
+
+struct Token_ElementAddress {
+    static const GLenum   ID = GL_ELEMENT_ADDRESS_COMMAND_NV;
+
+    ElementAddressCommandNV cmd;
+
+    Token_ElementAddress() {
+        cmd.header = s_header[ID];
+    }
+};
+
+struct Token_UniformAddress {
+    static const GLenum   ID = GL_UNIFORM_ADDRESS_COMMAND_NV;
+
+    UniformAddressCommandNV   cmd;
+
+    Token_UniformAddress() {
+        cmd.header = s_header[ID];
+    }
+};
+
+struct Token_BlendColor{
+    static const GLenum   ID = GL_BLEND_COLOR_COMMAND_NV;
+
+    BlendColorCommandNV     cmd;
+
+    Token_BlendColor() {
+        cmd.header = s_header[ID];
+    }
+};
+
+struct Token_StencilRef{
+    static const GLenum   ID = GL_STENCIL_REF_COMMAND_NV;
+
+    StencilRefCommandNV cmd;
+
+    Token_StencilRef() {
+        cmd.header = s_header[ID];
+    }
+};
+
+struct Token_LineWidth{
+    static const GLenum   ID = GL_LINE_WIDTH_COMMAND_NV;
+
+    LineWidthCommandNV  cmd;
+
+    Token_LineWidth() {
+        cmd.header = s_header[ID];
+    }
+};
+
+struct Token_PolygonOffset{
+    static const GLenum   ID = GL_POLYGON_OFFSET_COMMAND_NV;
+
+    PolygonOffsetCommandNV  cmd;
+
+    Token_PolygonOffset() {
+        cmd.header = s_header[ID];
+    }
+};
+
+struct Token_AlphaRef{
+    static const GLenum   ID = GL_ALPHA_REF_COMMAND_NV;
+
+    AlphaRefCommandNV cmd;
+
+    Token_AlphaRef() {
+        cmd.header = s_header[ID];
+    }
+};
+
+struct Token_Viewport{
+    static const GLenum   ID = GL_VIEWPORT_COMMAND_NV;
+    ViewportCommandNV cmd;
+    Token_Viewport() {
+        cmd.header = s_header[ID];
+    }
+};
+
+struct Token_Scissor {
+    static const GLenum   ID = GL_SCISSOR_COMMAND_NV;
+    ScissorCommandNV  cmd;
+    Token_Scissor() {
+        cmd.header = s_header[ID];
+    }
+};
+
+struct Token_FrontFace {
+    static const GLenum   ID = GL_FRONT_FACE_COMMAND_NV;
+    FrontFaceCommandNV cmd;
+    Token_FrontFace() {
+        cmd.header = s_header[ID];
+    }
+};
+
+//-----------------------------------------------------------------------------
+// 
+//-----------------------------------------------------------------------------
+template <class T>
+void registerSize()
+{
+    s_headerSizes[T::ID] = sizeof(T);
+}
+
+
+
+//-----------------------------------------------------------------------------
+// sizes of the tokens, for the header of each token (see initTokenInternals())
+//-----------------------------------------------------------------------------
+inline void registerTokenSizes()
+{
+    registerSize<Token_TerminateSequence>();
+    registerSize<Token_Nop>();
+    registerSize<Token_DrawElements>();
+    registerSize<Token_DrawArrays>();
+    registerSize<Token_DrawElementsStrip>();
+    registerSize<Token_DrawArraysStrip>();
+    registerSize<Token_DrawElemsInstanced>();
+    registerSize<Token_DrawArraysInstanced>();
+    registerSize<Token_AttributeAddress>();
+    registerSize<Token_ElementAddress>();
+    registerSize<Token_UniformAddress>();
+    registerSize<Token_LineWidth>();
+    registerSize<Token_PolygonOffset>();
+    registerSize<Token_Scissor>();
+    registerSize<Token_BlendColor>();
+    registerSize<Token_Viewport>();
+    registerSize<Token_AlphaRef>();
+    registerSize<Token_StencilRef>();
+    registerSize<Token_FrontFace>();
+}
+
+//-----------------------------------------------------------------------------
+// Writes the tokens straight into an aligned byte buffer
+//
+// reserve() the size estimated by a pre-pass and no reallocation nor temporary
+// happens while the tokens get emitted: each token gets constructed in place.
+// The writer can also fill memory it doesn't own (a mapped buffer, a local array):
+// this memory must then be large enough, as it can't grow. It is never read back,
+// since it may be mapped write-only: once it overflows, the stream is incomplete
+//-----------------------------------------------------------------------------
+#define TOKENWRITER_ALIGNMENT 16
+
+class TokenWriter
+{
+private:
+    TokenWriter(const TokenWriter&); //these are purposely not implemented
+    TokenWriter& operator= (const TokenWriter&);
+
+    char*   m_data;
+    size_t  m_size;
+    size_t  m_capacity;
+    bool    m_owned;
+    int     m_numGrowths;   // how often the estimate of reserve() was too small
+    size_t  m_numTokens;    // pushed since the stream restarted. append() doesn't count
+
+    // operator new already aligns on 16 bytes, and it keeps the buffers visible
+    // to the allocation counting of the sample
+    static_assert(__STDCPP_DEFAULT_NEW_ALIGNMENT__ >= TOKENWRITER_ALIGNMENT, "operator new alignment");
+    static char* alignedAlloc(size_t sz) { return (char*)::operator new(sz); }
+    static void alignedFree(char* p) { ::operator delete(p); }
+    void grow(size_t minCapacity)
+    {
+        // an external buffer too small is a wrong estimate: go on in our own memory,
+        // without copying what the external one holds. isExternal() tells the owner of
+        // the buffer that the stream isn't there, and must be recorded again
+        size_t capacity = m_capacity ? m_capacity * 2 : 1024;
+        if (capacity < minCapacity)
+            capacity = minCapacity;
+        char* data = alignedAlloc(capacity);
+        if (m_size && m_owned)
+            memcpy(data, m_data, m_size);
+        if (m_owned)
+            alignedFree(m_data);
+        m_data     = data;
+        m_capacity = capacity;
+        m_owned    = true;
+        m_numGrowths++;
+    }
+public:
+    TokenWriter() : m_data(NULL), m_size(0), m_capacity(0), m_owned(true), m_numGrowths(0), m_numTokens(0) {}
+    TokenWriter(void* buffer, size_t capacity) : m_data((char*)buffer), m_size(0), m_capacity(capacity), m_owned(false), m_numGrowths(0), m_numTokens(0) {}
+    ~TokenWriter()
+    {
+        if (m_owned)
+            alignedFree(m_data);
+    }
+    /// \brief makes sure 'sz' bytes fit without reallocation. Doesn't count as a growth
+    void reserve(size_t sz)
+    {
+        if (sz <= m_capacity)
+            return;
+        int numGrowths = m_numGrowths;
+        grow(sz);
+        m_numGrowths = numGrowths;
+    }
+    /// \brief writes to 'buffer' from now on, e.g. a region of a mapped GL buffer, or
+    /// to its own memory again if NULL. The stream restarts empty
+    void setBuffer(void* buffer, size_t capacity)
+    {
+        if (m_owned)
+            alignedFree(m_data);
+        m_data      = (char*)buffer;
+        m_size      = 0;
+        m_capacity  = buffer ? capacity : 0;
+        m_owned     = (buffer == NULL);
+        m_numTokens = 0;
+    }
+    bool isExternal() const { return !m_owned; }
+    void clear() { m_size = 0; m_numTokens = 0; }
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+    size_t capacity() const { return m_capacity; }
+    int getNumGrowths() const { return m_numGrowths; }
+    size_t numTokens() const { return m_numTokens; }
+
+    /// \brief constructs a token T at the end of the stream
+    template<typename T>
+    T& push()
+    {
+        if (m_size + sizeof(T) > m_capacity)
+            grow(m_size + sizeof(T));
+        T* t = new(m_data + m_size) T;
+        m_size += sizeof(T);
+        m_numTokens++;
+        return *t;
+    }
+    void append(const void* p, size_t sz)
+    {
+        if (m_size + sz > m_capacity)
+            grow(m_size + sz);
+        memcpy(m_data + m_size, p, sz);
+        m_size += sz;
+    }
+
+    void lineWidth(float w)
+    {
+        push<Token_LineWidth>().cmd.lineWidth = w;
+    }
+    void uniformAddress(int idx, GLuint64 p, ShaderStages stage)
+    {
+        Token_UniformAddress& t = push<Token_UniformAddress>();
+        t.cmd.stage = s_stages[stage];
+        t.cmd.index = idx;
+        t.cmd.addressLo = GLuint(p & 0xFFFFFFFF);
+        t.cmd.addressHi = GLuint(p >> 32);
+    }
+    void attributeAddress(int idx, GLuint64 p)
+    {
+        Token_AttributeAddress& t = push<Token_AttributeAddress>();
+        t.cmd.index = idx;
+        t.cmd.addressLo = GLuint(p & 0xFFFFFFFF);
+        t.cmd.addressHi = GLuint(p >> 32);
+    }
+    void elementAddress(GLuint64 p, GLenum indexFormatGL)
+    {
+        Token_ElementAddress& t = push<Token_ElementAddress>();
+        t.cmd.addressLo = GLuint(p & 0xFFFFFFFF);
+        t.cmd.addressHi = GLuint(p >> 32);
+        switch (indexFormatGL)
+        {
+        case GL_UNSIGNED_INT:
+            t.cmd.typeSizeInByte = 4;
+            break;
+        case GL_UNSIGNED_SHORT:
+            t.cmd.typeSizeInByte = 2;
+            break;
+        }
+    }
+    void drawElements(GLenum topologyGL, GLuint indexCount)
+    {
+        switch (topologyGL)
+        {
+        case GL_TRIANGLE_STRIP:
+        case GL_QUAD_STRIP:
+        case GL_LINE_STRIP:
+            push<Token_DrawElementsStrip>().cmd.count = indexCount;
+            break;
+        default:
+            push<Token_DrawElements>().cmd.count = indexCount;
+            break;
+        }
+    }
+    void drawArrays(GLenum topologyGL, GLuint indexCount)
+    {
+        switch (topologyGL)
+        {
+        case GL_TRIANGLE_STRIP:
+        case GL_QUAD_STRIP:
+        case GL_LINE_STRIP:
+            push<Token_DrawArraysStrip>().cmd.count = indexCount;
+            break;
+        default:
+            push<Token_DrawArrays>().cmd.count = indexCount;
+            break;
+        }
+    }
+    void viewport(GLint x, GLint y, GLsizei width, GLsizei height)
+    {
+        Token_Viewport& t = push<Token_Viewport>();
+        t.cmd.x = x;
+        t.cmd.y = y;
+        t.cmd.width = width;
+        t.cmd.height = height;
+    }
+    void blendColor(GLclampf red, GLclampf green, GLclampf blue, GLclampf alpha)
+    {
+        Token_BlendColor& t = push<Token_BlendColor>();
+        t.cmd.red = red;
+        t.cmd.green = green;
+        t.cmd.blue = blue;
+        t.cmd.alpha = alpha;
+    }
+    void stencilRef(GLuint frontStencilRef, GLuint backStencilRef)
+    {
+        Token_StencilRef& t = push<Token_StencilRef>();
+        t.cmd.frontStencilRef = frontStencilRef;
+        t.cmd.backStencilRef = backStencilRef;
+    }
+    void polygonOffset(GLfloat scale, GLfloat bias)
+    {
+        Token_PolygonOffset& t = push<Token_PolygonOffset>();
+        t.cmd.bias = bias;
+        t.cmd.scale = scale;
+    }
+    void scissor(GLint x, GLint y, GLsizei width, GLsizei height)
+    {
+        Token_Scissor& t = push<Token_Scissor>();
+        t.cmd.x = x;
+        t.cmd.y = y;
+        t.cmd.width = width;
+        t.cmd.height = height;
+    }
+};
+
+//-----------------------------------------------------------------------------
+// token ID of a header returned by the driver (see initTokenInternals()). -1 if unknown
+//-----------------------------------------------------------------------------
+inline int tokenIdFromHeader(GLuint header)
+{
+    for (int i = 0; i <= GL_FRONT_FACE_COMMAND_NV; i++)
+    {
+        if (s_header[i] == header && s_headerSizes[i])
+            return i;
+    }
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+// Peephole pass over a consolidated token stream
+//
+// The stream is made of segments (one per state-object/FBO batch). The pass:
+// - merges adjacent segments using the same state-object and FBO
+// - drops, within a segment, the address and state tokens that get set again
+//   before any draw used them, or that set again the value the last draw used
+// - drops NOPs
+// Tokens left at the end of a segment are kept: the next segment may rely on them.
+// Everything after a TERMINATE_SEQUENCE, or after a token it doesn't know, is
+// left as is, and the segment holding it doesn't get merged with the next one.
+// The stream gets compacted in place; the object keeps its arrays from one call
+// to the other
+//-----------------------------------------------------------------------------
+#define TOKENOPTIMIZER_MAXSLOTS 64
+
+class TokenOptimizer
+{
+public:
+    struct Stats
+    {
+        size_t  bytesIn;
+        size_t  bytesOut;
+        int     tokensIn;
+        int     tokensRemoved;
+        int     segmentsMerged;
+    };
+private:
+    struct Token
+    {
+        size_t  offset;
+        GLuint  size;
+        bool    keep;
+    };
+    struct Slot
+    {
+        GLuint  key;
+        int     committed;  // token setting the value the last draw used, -1 if none yet
+        int     pending;    // token set since the last draw, -1 if none
+    };
+    std::vector<Token>  m_tokens;
+    Slot                m_slots[TOKENOPTIMIZER_MAXSLOTS];
+    int                 m_numSlots;
+    Stats               m_stats;
+
+    static GLuint slotKey(int id, const char* token)
+    {
+        switch (id)
+        {
+        case GL_ATTRIBUTE_ADDRESS_COMMAND_NV:
+            return (id << 24) | (((const AttributeAddressCommandNV*)token)->index & 0xFFFF);
+        case GL_UNIFORM_ADDRESS_COMMAND_NV:
+            return (id << 24) | (((const UniformAddressCommandNV*)token)->stage << 16) | ((const UniformAddressCommandNV*)token)->index;
+        default:
+            return id << 24;
+        }
+    }
+    Slot* findSlot(GLuint key)
+    {
+        for (int i = 0; i < m_numSlots; i++)
+        {
+            if (m_slots[i].key == key)
+                return &m_slots[i];
+        }
+        if (m_numSlots == TOKENOPTIMIZER_MAXSLOTS)
+            return NULL;
+        Slot& slot      = m_slots[m_numSlots++];
+        slot.key        = key;
+        slot.committed  = -1;
+        slot.pending    = -1;
+        return &slot;
+    }
+    /// \brief marks the tokens of one segment, after those of the segments merged before it.
+    /// False when it stopped on a TERMINATE_SEQUENCE or a token it doesn't know
+    bool markSegment(const char* data, size_t begin, size_t end)
+    {
+        size_t offset = begin;
+        while (offset < end)
+        {
+            const GLuint header = *(const GLuint*)(data + offset);
+            const int    id     = tokenIdFromHeader(header);
+            if (id < 0 || id == GL_TERMINATE_SEQUENCE_COMMAND_NV || offset + s_headerSizes[id] > end)
+            {
+                // keep the rest as one opaque piece
+                Token rest = { offset, GLuint(end - offset), true };
+                m_tokens.push_back(rest);
+                return false;
+            }
+            Token t = { offset, s_headerSizes[id], true };
+            m_stats.tokensIn++;
+            switch (id)
+            {
+            case GL_NOP_COMMAND_NV:
+                t.keep = false;
+                break;
+            case GL_DRAW_ELEMENTS_COMMAND_NV:
+            case GL_DRAW_ARRAYS_COMMAND_NV:
+            case GL_DRAW_ELEMENTS_STRIP_COMMAND_NV:
+            case GL_DRAW_ARRAYS_STRIP_COMMAND_NV:
+            case GL_DRAW_ELEMENTS_INSTANCED_COMMAND_NV:
+            case GL_DRAW_ARRAYS_INSTANCED_COMMAND_NV:
+                // the draw uses what was pending
+                for (int i = 0; i < m_numSlots; i++)
+                {
+                    if (m_slots[i].pending >= 0)
+                    {
+                        m_slots[i].committed = m_slots[i].pending;
+                        m_slots[i].pending   = -1;
+                    }
+                }
+                break;
+            default:
+            {
+                Slot* slot = findSlot(slotKey(id, data + offset));
+                if (!slot)
+                    break;
+                if (slot->pending >= 0)
+                {
+                    // overwritten before any draw
+                    m_tokens[slot->pending].keep = false;
+                    slot->pending = -1;
+                }
+                if (slot->committed >= 0 && memcmp(data + m_tokens[slot->committed].offset, data + offset, t.size) == 0)
+                    t.keep = false;  // same value as what the last draw used
+                else
+                    slot->pending = (int)m_tokens.size();
+                break;
+            }
+            }
+            m_tokens.push_back(t);
+            offset += t.size;
+        }
+        return true;
+    }
+public:
+    TokenOptimizer() : m_numSlots(0) { memset(&m_stats, 0, sizeof(m_stats)); }
+
+    /**
+     ** data: numSegments consecutive segments of sizes[i] bytes, drawn with stateGroups[i] and fbos[i].
+     ** Returns the new amount of segments: the three arrays and the data get compacted
+     **/
+    int optimize(char* data, GLsizei* sizes, GLuint* stateGroups, GLuint* fbos, int numSegments)
+    {
+        memset(&m_stats, 0, sizeof(m_stats));
+        // merge the adjacent segments that share their states, and peephole each merged
+        // segment, compacting as we go: the write offset never passes the read offset
+        int    n           = 0;
+        size_t readOffset  = 0;
+        size_t writeOffset = 0;
+        for (int i = 0; i < numSegments; )
+        {
+            m_tokens.clear();
+            m_numSlots = 0;
+            GLuint stateGroup = stateGroups[i];
+            GLuint fbo        = fbos[i];
+            bool   open       = true;
+            int    j          = i;
+            for (; j < numSegments && open && stateGroups[j] == stateGroup && fbos[j] == fbo; j++)
+            {
+                if (j > i)
+                    m_stats.segmentsMerged++;
+                m_stats.bytesIn += sizes[j];
+                open = markSegment(data, readOffset, readOffset + sizes[j]);
+                readOffset += sizes[j];
+            }
+            size_t segmentStart = writeOffset;
+            for (size_t t = 0; t < m_tokens.size(); t++)
+            {
+                if (!m_tokens[t].keep)
+                {
+                    m_stats.tokensRemoved++;
+                    continue;
+                }
+                if (writeOffset != m_tokens[t].offset)
+                    memmove(data + writeOffset, data + m_tokens[t].offset, m_tokens[t].size);
+                writeOffset += m_tokens[t].size;
+            }
+            sizes[n]       = GLsizei(writeOffset - segmentStart);
+            stateGroups[n] = stateGroup;
+            fbos[n]        = fbo;
+            n++;
+            i = j;
+        }
+        m_stats.bytesOut = writeOffset;
+        return n;
+    }
+    const Stats& getStats() const { return m_stats; }
+};
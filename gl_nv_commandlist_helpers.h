@@ -16,19 +16,7 @@
  * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
  * SPDX-License-Identifier: Apache-2.0
  */
-
-
-//
-// Shader stages for command-list
-//
-enum ShaderStages {
-    STAGE_VERTEX,
-    STAGE_TESS_CONTROL,
-    STAGE_TESS_EVALUATION,
-    STAGE_GEOMETRY,
-    STAGE_FRAGMENT,
-    STAGES,
-};
+#include "gl_nv_command_tokens.h"
 
 //
 // Put together all what is needed to give to the extension function
@@ -47,6 +35,82 @@ struct TokenBuffer
     }
 };
 //
+// Token buffer persistently mapped and cut in TOKENRING_SZ regions: the CPU writes
+// the tokens of a frame in one region while the GPU may still read the previous ones
+//
+#define TOKENRING_SZ 3
+struct TokenRing
+{
+    GLuint      bufferID;
+    GLuint64EXT bufferAddr;
+    char*       mapped;
+    size_t      regionSz;
+    int         cur;
+    GLsync      fences[TOKENRING_SZ];  // after the last GPU commands reading each region
+
+    TokenRing() : bufferID(0), bufferAddr(0), mapped(NULL), regionSz(0), cur(0)
+    {
+        memset(fences, 0, sizeof(fences));
+    }
+    /// \brief makes sure a region holds sz bytes. Re-creating the buffer waits for the GPU
+    void reserve(size_t sz)
+    {
+        if(sz <= regionSz)
+            return;
+        release();
+        // some margin, so a few more meshes don't re-create it
+        regionSz = sz + sz / 4;
+        regionSz = (regionSz + TOKENWRITER_ALIGNMENT - 1) & ~size_t(TOKENWRITER_ALIGNMENT - 1);
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glCreateBuffers(1, &bufferID);
+        glNamedBufferStorage(bufferID, regionSz * TOKENRING_SZ, NULL, flags);
+        mapped = (char*)glMapNamedBufferRange(bufferID, 0, regionSz * TOKENRING_SZ, flags);
+        glGetNamedBufferParameterui64vNV(bufferID, GL_BUFFER_GPU_ADDRESS_NV, &bufferAddr);
+        glMakeNamedBufferResidentNV(bufferID, GL_READ_ONLY);
+    }
+    /// \brief moves to the next region, once the GPU is done with it
+    void advance()
+    {
+        cur = (cur + 1) % TOKENRING_SZ;
+        if(fences[cur])
+        {
+            while(glClientWaitSync(fences[cur], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+            {
+            }
+            glDeleteSync(fences[cur]);
+            fences[cur] = 0;
+        }
+    }
+    char*       regionPtr() const { return mapped + cur * regionSz; }
+    GLuint64EXT regionAddr() const { return bufferAddr + cur * regionSz; }
+    /// \brief to call after the GPU commands reading the tokens of 'region'
+    void fence(int region)
+    {
+        if(fences[region])
+            glDeleteSync(fences[region]);
+        fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    void release()
+    {
+        if(bufferID == 0)
+            return;
+        glFinish();  // the GPU may still read any region
+        for(int i = 0; i < TOKENRING_SZ; i++)
+        {
+            if(fences[i])
+                glDeleteSync(fences[i]);
+            fences[i] = 0;
+        }
+        glMakeNamedBufferNonResidentNV(bufferID);
+        glUnmapNamedBuffer(bufferID);
+        glDeleteBuffers(1, &bufferID);
+        bufferID   = 0;
+        bufferAddr = 0;
+        mapped     = NULL;
+        regionSz   = 0;
+    }
+};
+//
 // Grouping together what is needed to issue a single command made of many states, fbos and Token Buffer pointers
 //
 struct CommandStatesBatch
@@ -69,19 +133,24 @@ struct CommandStatesBatch
         fbos.push_back(fbo_);
         numItems = fbos.size();
     }
+    /// \brief keeps the first n items
+    void resize(size_t n)
+    {
+        dataGPUPtrs.resize(n);
+        dataPtrs.resize(n);
+        sizes.resize(n);
+        stateGroups.resize(n);
+        fbos.resize(n);
+        numItems = n;
+    }
     CommandStatesBatch& operator+= (CommandStatesBatch &cb)
     {
-        // TODO: do better than that...
-        size_t sz = cb.fbos.size();
-        for(int i=0; i<sz; i++)
-        {
-            dataGPUPtrs.push_back(cb.dataGPUPtrs[i]);
-            dataPtrs.push_back(cb.dataPtrs[i]);
-            sizes.push_back(cb.sizes[i]);
-            stateGroups.push_back(cb.stateGroups[i]);
-            fbos.push_back(cb.fbos[i]);
-        }
-        numItems += sz;
+        dataGPUPtrs.insert(dataGPUPtrs.end(), cb.dataGPUPtrs.begin(), cb.dataGPUPtrs.end());
+        dataPtrs.insert(dataPtrs.end(), cb.dataPtrs.begin(), cb.dataPtrs.end());
+        sizes.insert(sizes.end(), cb.sizes.begin(), cb.sizes.end());
+        stateGroups.insert(stateGroups.end(), cb.stateGroups.begin(), cb.stateGroups.end());
+        fbos.insert(fbos.end(), cb.fbos.begin(), cb.fbos.end());
+        numItems = fbos.size();
         return *this;
     }
     std::vector<GLuint64EXT> dataGPUPtrs;   // pointer in data where to locate each separate groups (for glListDrawCommandsStatesClientNV)
@@ -109,255 +178,12 @@ struct CommandStatesBatch
     //size_t                  numItems;   // == fbos.size() or sizes.size()...
 };
 
-//-----------------------------------------------------------------------------
-// Useful stuff for Command-list
-//-----------------------------------------------------------------------------
-static GLuint   s_header[GL_FRONT_FACE_COMMAND_NV+1] = { 0 };
-static GLuint   s_headerSizes[GL_FRONT_FACE_COMMAND_NV+1] = { 0 };
-
-static GLushort s_stages[STAGES];
-
-struct Token_Nop {
-    static const GLenum   ID = GL_NOP_COMMAND_NV;
-    NOPCommandNV      cmd;
-    Token_Nop() {
-        cmd.header = s_header[ID];
-    }
-};
-
-struct Token_TerminateSequence {
-    static const GLenum   ID = GL_TERMINATE_SEQUENCE_COMMAND_NV;
-
-    TerminateSequenceCommandNV cmd;
-
-    Token_TerminateSequence() {
-        cmd.header = s_header[ID];
-    }
-};
-
-struct Token_DrawElemsInstanced {
-    static const GLenum   ID = GL_DRAW_ELEMENTS_INSTANCED_COMMAND_NV;
-
-    DrawElementsInstancedCommandNV   cmd;
-
-    Token_DrawElemsInstanced() {
-        cmd.baseInstance = 0;
-        cmd.baseVertex = 0;
-        cmd.firstIndex = 0;
-        cmd.count = 0;
-        cmd.instanceCount = 1;
-
-        cmd.header = s_header[ID];
-    }
-};
-
-struct Token_DrawArraysInstanced {
-    static const GLenum   ID = GL_DRAW_ARRAYS_INSTANCED_COMMAND_NV;
-
-    DrawArraysInstancedCommandNV   cmd;
-
-    Token_DrawArraysInstanced() {
-        cmd.baseInstance = 0;
-        cmd.first = 0;
-        cmd.count = 0;
-        cmd.instanceCount = 1;
-
-        cmd.header = s_header[ID];
-    }
-};
-
-struct Token_DrawElements {
-    static const GLenum   ID = GL_DRAW_ELEMENTS_COMMAND_NV;
-
-    DrawElementsCommandNV   cmd;
-
-    Token_DrawElements() {
-        cmd.baseVertex = 0;
-        cmd.firstIndex = 0;
-        cmd.count = 0;
-
-        cmd.header = s_header[ID];
-    }
-};
-
-struct Token_DrawArrays {
-    static const GLenum   ID = GL_DRAW_ARRAYS_COMMAND_NV;
-
-    DrawArraysCommandNV   cmd;
-
-    Token_DrawArrays() {
-        cmd.first = 0;
-        cmd.count = 0;
-
-        cmd.header = s_header[ID];
-    }
-};
-
-struct Token_DrawElementsStrip {
-    static const GLenum   ID = GL_DRAW_ELEMENTS_STRIP_COMMAND_NV;
-
-    DrawElementsCommandNV   cmd;
-
-    Token_DrawElementsStrip() {
-        cmd.baseVertex = 0;
-        cmd.firstIndex = 0;
-        cmd.count = 0;
-
-        cmd.header = s_header[ID];
-    }
-};
-
-struct Token_DrawArraysStrip {
-    static const GLenum   ID = GL_DRAW_ARRAYS_STRIP_COMMAND_NV;
-
-    DrawArraysCommandNV   cmd;
-
-    Token_DrawArraysStrip() {
-        cmd.first = 0;
-        cmd.count = 0;
-
-        cmd.header = s_header[ID];
-    }
-};
-
-struct Token_AttributeAddress {
-    static const GLenum   ID = GL_ATTRIBUTE_ADDRESS_COMMAND_NV;
-
-    AttributeAddressCommandNV cmd;
-
-    Token_AttributeAddress() {
-        cmd.header = s_header[ID];
-    }
-};
-
-struct Token_ElementAddress {
-    static const GLenum   ID = GL_ELEMENT_ADDRESS_COMMAND_NV;
-
-    ElementAddressCommandNV cmd;
-
-    Token_ElementAddress() {
-        cmd.header = s_header[ID];
-    }
-};
-
-struct Token_UniformAddress {
-    static const GLenum   ID = GL_UNIFORM_ADDRESS_COMMAND_NV;
-
-    UniformAddressCommandNV   cmd;
-
-    Token_UniformAddress() {
-        cmd.header = s_header[ID];
-    }
-};
-
-struct Token_BlendColor{
-    static const GLenum   ID = GL_BLEND_COLOR_COMMAND_NV;
-
-    BlendColorCommandNV     cmd;
-
-    Token_BlendColor() {
-        cmd.header = s_header[ID];
-    }
-};
-
-struct Token_StencilRef{
-    static const GLenum   ID = GL_STENCIL_REF_COMMAND_NV;
-
-    StencilRefCommandNV cmd;
-
-    Token_StencilRef() {
-        cmd.header = s_header[ID];
-    }
-};
-
-struct Token_LineWidth{
-    static const GLenum   ID = GL_LINE_WIDTH_COMMAND_NV;
-
-    LineWidthCommandNV  cmd;
-
-    Token_LineWidth() {
-        cmd.header = s_header[ID];
-    }
-};
-
-struct Token_PolygonOffset{
-    static const GLenum   ID = GL_POLYGON_OFFSET_COMMAND_NV;
-
-    PolygonOffsetCommandNV  cmd;
-
-    Token_PolygonOffset() {
-        cmd.header = s_header[ID];
-    }
-};
-
-struct Token_AlphaRef{
-    static const GLenum   ID = GL_ALPHA_REF_COMMAND_NV;
-
-    AlphaRefCommandNV cmd;
-
-    Token_AlphaRef() {
-        cmd.header = s_header[ID];
-    }
-};
-
-struct Token_Viewport{
-    static const GLenum   ID = GL_VIEWPORT_COMMAND_NV;
-    ViewportCommandNV cmd;
-    Token_Viewport() {
-        cmd.header = s_header[ID];
-    }
-};
-
-struct Token_Scissor {
-    static const GLenum   ID = GL_SCISSOR_COMMAND_NV;
-    ScissorCommandNV  cmd;
-    Token_Scissor() {
-        cmd.header = s_header[ID];
-    }
-};
-
-struct Token_FrontFace {
-    static const GLenum   ID = GL_FRONT_FACE_COMMAND_NV;
-    FrontFaceCommandNV cmd;
-    Token_FrontFace() {
-        cmd.header = s_header[ID];
-    }
-};
-
-//-----------------------------------------------------------------------------
-// 
-//-----------------------------------------------------------------------------
-template <class T>
-void registerSize()
-{
-    s_headerSizes[T::ID] = sizeof(T);
-}
-
-
 //-----------------------------------------------------------------------------
 // 
 //-----------------------------------------------------------------------------
 void initTokenInternals()
 {
-    registerSize<Token_TerminateSequence>();
-    registerSize<Token_Nop>();
-    registerSize<Token_DrawElements>();
-    registerSize<Token_DrawArrays>();
-    registerSize<Token_DrawElementsStrip>();
-    registerSize<Token_DrawArraysStrip>();
-    registerSize<Token_DrawElemsInstanced>();
-    registerSize<Token_DrawArraysInstanced>();
-    registerSize<Token_AttributeAddress>();
-    registerSize<Token_ElementAddress>();
-    registerSize<Token_UniformAddress>();
-    registerSize<Token_LineWidth>();
-    registerSize<Token_PolygonOffset>();
-    registerSize<Token_Scissor>();
-    registerSize<Token_BlendColor>();
-    registerSize<Token_Viewport>();
-    registerSize<Token_AlphaRef>();
-    registerSize<Token_StencilRef>();
-    registerSize<Token_FrontFace>();
+    registerTokenSizes();
 
     for (int i = 0; i < (GL_FRONT_FACE_COMMAND_NV+1); i++){
         // using i instead of a table of token IDs because the are arranged in the same order as i incrementing.
@@ -372,185 +198,57 @@ void initTokenInternals()
 }
 
 //------------------------------------------------------------------------------
-// build 
+// one token as a string, for the token buffers built once. The recording of the
+// command-buffers uses TokenWriter directly: no temporary per token
 //------------------------------------------------------------------------------
+#define TOKEN_AS_STRING(call)                               \
+    GLuint64    storage[8];                                 \
+    TokenWriter writer(storage, sizeof(storage));           \
+    writer.call;                                            \
+    return std::string(writer.data(), writer.size());
+
 std::string buildLineWidthCommand(float w)
 {
-    std::string cmd;
-    Token_LineWidth lw;
-    lw.cmd.lineWidth = w;
-    cmd = std::string((const char*)&lw, sizeof(Token_LineWidth));
-
-    return cmd;
+    TOKEN_AS_STRING(lineWidth(w));
 }
-//------------------------------------------------------------------------------
-// build 
-//------------------------------------------------------------------------------
 std::string buildUniformAddressCommand(int idx, GLuint64 p, GLsizeiptr sizeBytes, ShaderStages stage)
 {
-    std::string cmd;
-    Token_UniformAddress attr;
-    attr.cmd.stage = s_stages[stage];
-    attr.cmd.index = idx;
-    ((GLuint64EXT*)&attr.cmd.addressLo)[0] = p;
-    cmd = std::string((const char*)&attr, sizeof(Token_UniformAddress));
-
-    return cmd;
+    TOKEN_AS_STRING(uniformAddress(idx, p, stage));
 }
-//------------------------------------------------------------------------------
-// build 
-//------------------------------------------------------------------------------
 std::string buildAttributeAddressCommand(int idx, GLuint64 p, GLsizeiptr sizeBytes)
 {
-    std::string cmd;
-    Token_AttributeAddress attr;
-    attr.cmd.index = idx;
-    ((GLuint64EXT*)&attr.cmd.addressLo)[0] = p;
-    cmd = std::string((const char*)&attr, sizeof(Token_AttributeAddress));
-
-    return cmd;
+    TOKEN_AS_STRING(attributeAddress(idx, p));
 }
-//------------------------------------------------------------------------------
-// build 
-//------------------------------------------------------------------------------
 std::string buildElementAddressCommand(GLuint64 ptr, GLenum indexFormatGL)
 {
-    std::string cmd;
-    Token_ElementAddress attr;
-    ((GLuint64EXT*)&attr.cmd.addressLo)[0] = ptr;
-    switch (indexFormatGL)
-    {
-    case GL_UNSIGNED_INT:
-        attr.cmd.typeSizeInByte = 4;
-        break;
-    case GL_UNSIGNED_SHORT:
-        attr.cmd.typeSizeInByte = 2;
-        break;
-    }
-    cmd = std::string((const char*)&attr, sizeof(Token_AttributeAddress));
-
-    return cmd;
+    TOKEN_AS_STRING(elementAddress(ptr, indexFormatGL));
 }
-//------------------------------------------------------------------------------
-// 
-//------------------------------------------------------------------------------
 std::string buildDrawElementsCommand(GLenum topologyGL, GLuint indexCount)
 {
-    std::string cmd;
-    Token_DrawElements dc;
-    Token_DrawElementsStrip dcstrip;
-    switch (topologyGL)
-    {
-    case GL_TRIANGLE_STRIP:
-    case GL_QUAD_STRIP:
-    case GL_LINE_STRIP:
-        dcstrip.cmd.baseVertex = 0;
-        dcstrip.cmd.firstIndex = 0;
-        dcstrip.cmd.count = indexCount;
-        cmd = std::string((const char*)&dcstrip, sizeof(Token_DrawElementsStrip));
-        break;
-    default:
-        dc.cmd.baseVertex = 0;
-        dc.cmd.firstIndex = 0;
-        dc.cmd.count = indexCount;
-        cmd = std::string((const char*)&dc, sizeof(Token_DrawElements));
-        break;
-    }
-    return cmd;
+    TOKEN_AS_STRING(drawElements(topologyGL, indexCount));
 }
-//------------------------------------------------------------------------------
-// 
-//------------------------------------------------------------------------------
 std::string buildDrawArraysCommand(GLenum topologyGL, GLuint indexCount)
 {
-    std::string cmd;
-    Token_DrawArrays dc;
-    Token_DrawArraysStrip dcstrip;
-    switch (topologyGL)
-    {
-    case GL_TRIANGLE_STRIP:
-    case GL_QUAD_STRIP:
-    case GL_LINE_STRIP:
-        dcstrip.cmd.first = 0;
-        dcstrip.cmd.count = indexCount;
-        cmd = std::string((const char*)&dcstrip, sizeof(Token_DrawArraysStrip));
-        break;
-    default:
-        dc.cmd.first = 0;
-        dc.cmd.count = indexCount;
-        cmd = std::string((const char*)&dc, sizeof(Token_DrawArrays));
-        break;
-    }
-    return cmd;
+    TOKEN_AS_STRING(drawArrays(topologyGL, indexCount));
 }
-
-//------------------------------------------------------------------------------
-// 
-//------------------------------------------------------------------------------
 std::string buildViewportCommand(GLint x, GLint y, GLsizei width, GLsizei height)
 {
-    std::string cmd;
-    Token_Viewport dc;
-    dc.cmd.x = x;
-    dc.cmd.y = y;
-    dc.cmd.width = width;
-    dc.cmd.height = height;
-    cmd = std::string((const char*)&dc, sizeof(Token_Viewport));
-    return cmd;
+    TOKEN_AS_STRING(viewport(x, y, width, height));
 }
-
-//------------------------------------------------------------------------------
-// 
-//------------------------------------------------------------------------------
 std::string buildBlendColorCommand(GLclampf red, GLclampf green, GLclampf blue, GLclampf alpha)
 {
-    std::string cmd;
-    Token_BlendColor dc;
-    dc.cmd.red = red;
-    dc.cmd.green = green;
-    dc.cmd.blue = blue;
-    dc.cmd.alpha = alpha;
-    cmd = std::string((const char*)&dc, sizeof(Token_BlendColor));
-    return cmd;
+    TOKEN_AS_STRING(blendColor(red, green, blue, alpha));
 }
-
-//------------------------------------------------------------------------------
-// 
-//------------------------------------------------------------------------------
 std::string buildStencilRefCommand(GLuint frontStencilRef, GLuint backStencilRef)
 {
-    std::string cmd;
-    Token_StencilRef dc;
-    dc.cmd.frontStencilRef = frontStencilRef;
-    dc.cmd.backStencilRef = backStencilRef;
-    cmd = std::string((const char*)&dc, sizeof(Token_StencilRef));
-    return cmd;
+    TOKEN_AS_STRING(stencilRef(frontStencilRef, backStencilRef));
 }
-
-//------------------------------------------------------------------------------
-// 
-//------------------------------------------------------------------------------
 std::string buildPolygonOffsetCommand(GLfloat scale, GLfloat bias)
 {
-    std::string cmd;
-    Token_PolygonOffset dc;
-    dc.cmd.bias = bias;
-    dc.cmd.scale = scale;
-    cmd = std::string((const char*)&dc, sizeof(Token_PolygonOffset));
-    return cmd;
+    TOKEN_AS_STRING(polygonOffset(scale, bias));
 }
-
-//------------------------------------------------------------------------------
-// 
-//------------------------------------------------------------------------------
 std::string buildScissorCommand(GLint x, GLint y, GLsizei width, GLsizei height)
 {
-    std::string cmd;
-    Token_Scissor dc;
-    dc.cmd.x = x;
-    dc.cmd.y = y;
-    dc.cmd.width = width;
-    dc.cmd.height = height;
-    cmd = std::string((const char*)&dc, sizeof(Token_Scissor));
-    return cmd;
+    TOKEN_AS_STRING(scissor(x, y, width, height));
 }
+#undef TOKEN_AS_STRING
@@ -22,6 +22,17 @@
 
 #define DEFAULT_RENDERER 2
 #include "gl_vk_bk3dthreaded.h"
+#include "mt/CThreadWork.h"
+#include "microbench.h"
+#include "allocstats.h"
+#include "benchmark.h"
+#include "frametimes.h"
+#include "synthscene.h"
+#include "capture.h"
+#include "autotune.h"
+#include "bk3dbounds.h"
+#include <algorithm>
+#include <chrono>
 #include <imgui/backends/imgui_impl_gl.h>
 #include <nvgl/contextwindow_gl.hpp>
 
@@ -30,6 +41,7 @@
 //-----------------------------------------------------------------------------
 Renderer*        g_renderers[10];
 int              g_numRenderers = 0;
+Renderer*        g_nullRenderer = NULL;
 static Renderer* s_pCurRenderer = NULL;
 static int       s_curRenderer  = DEFAULT_RENDERER;
 //-----------------------------------------------------------------------------
@@ -98,6 +110,47 @@ static int   s_cameraAnimItems     = array_size(s_cameraAnim);
 static float s_cameraAnimIntervals = 0.1;
 static bool  s_bCameraAnim         = true;
 
+//
+// -benchmark, -apireport, -autotune...: the camera path replayed at a fixed time-step
+// (BENCHMARK_DT). See benchmark.cpp, and SampleTarget for what they call here
+//
+#define BENCHMARK_TRANSITION 1.0f  // seconds to go from a key of s_cameraAnim to the next
+static int s_benchmarkFrame = -1;  // >= 0 while the window renders the camera path: position on it
+// the size of the frames without window
+#define HEADLESS_WIDTH 1280
+#define HEADLESS_HEIGHT 720
+
+//
+// distribution of the frame times and hitches, in the UI and in the -benchmark results
+//
+static FrameTimeMonitor s_frameTimes;
+#define FRAMETIMES_BUCKETS 40
+#define FRAMETIMES_BUCKET_MS 0.5f
+
+//
+// GPU times of the frames, from the timestamps of the renderer: they come back a few
+// frames late, tagged with s_frameNumber of their frame (see collectGpuFrames())
+//
+static int                       s_frameNumber = 0;  // frames rendered so far
+static std::vector<GpuFrameTime> s_gpuFrames;        // the ones that came back during the last frame
+
+//
+// -trace <file>: Chrome trace of the frames s_traceFirstFrame to s_traceLastFrame (-traceframes)
+//
+static const char* s_traceFileName   = NULL;
+static int         s_traceFirstFrame = 100;
+static int         s_traceLastFrame  = 109;
+
+//
+// -capture <file>: renderer-level calls of the frames s_captureFirstFrame to s_captureLastFrame
+// (-captureframes). -replay runs them again, see runReplay()
+//
+static const char*  s_captureFileName   = NULL;
+static int          s_captureFirstFrame = 100;
+static int          s_captureLastFrame  = 109;
+static int          s_captureFrame      = 0;     // frames rendered so far
+static DrawCapture* s_pCapture          = NULL;  // non-NULL during the captured frames
+
 #define HELPDURATION 5.0
 static float s_helpText = 0.0;
 
@@ -107,21 +160,37 @@ static bool s_bStats = true;
 //-----------------------------------------------------------------------------
 // Stuff for Multi-threading, using 'Workers'
 //-----------------------------------------------------------------------------
-#include "mt/CThreadWork.h"
-#define NUMTHREADS 8
+int               g_numThreads      = 0;  // 0: one worker per physical core
+NWORKER_AFFINITY  g_affinity        = NWTA_NONE;
+std::vector<int>  g_affinityCpus;        // for NWTA_LIST
 ThreadWorkerPool* g_mainThreadPool = NULL;
 CEvent            g_dataReadyEvent;
 TaskQueue*        g_mainThreadQueue = NULL;
 CCriticalSection* g_crs_bk3d        = NULL;  // for concurrent access on the model
 CCriticalSection* g_crs_VK          = NULL;  // for concurrent access on Vulkan
-CEvent*           g_evt_cmdbuf      = NULL;
+TaskGraph*        g_frameGraph      = NULL;  // tasks of the frame and their dependencies
+TaskGraph*        g_recordGraph     = NULL;  // recording of the next frame, when pipelined
 bool              g_useWorkers      = false;
+//
+// 1: the command-buffers of a frame are recorded and submitted within the frame
+// 2: the recording of frame N+1 overlaps the submission, the UI and the swap of frame N.
+// The secondary command-buffers of a model are single-buffered: no deeper than 2
+//
+#define MAX_PIPELINE_DEPTH 2
+int         g_pipelineDepth  = 1;
+static bool s_recordingAhead = false;
 #endif
-int g_numCmdBuffers = 16;
+int  g_numCmdBuffers        = 16;
+bool g_numaLocalThreadData  = false;
+bool g_bOptimizeTokens      = true;
+bool g_bZeroCopyTokens      = false;
 //-----------------------------------------------------------------------------
 // forward declarations
 //-----------------------------------------------------------------------------
 void destroyCommandBuffers(bool bAll);
+#ifdef USEWORKERS
+void finishRecordingAhead();
+#endif
 void releaseThreadLocalVars();
 void initThreadLocalVars();
 //-----------------------------------------------------------------------------
@@ -157,14 +226,137 @@ MyWindow::MyWindow()
 {
 }
 
+#ifdef USEWORKERS
+//-----------------------------------------------------------------------------
+// Counters of the workers (NWorkerStats), sampled every POOLSTATS_INTERVAL
+// seconds for the UI panel and, with -poolstats <file>, appended to a CSV file
+//-----------------------------------------------------------------------------
+#define POOLSTATS_INTERVAL 1.0
+struct PoolStatsView
+{
+  int   cpu;
+  float tasksPerSec;
+  float busyPercent;
+  float idlePercent;
+  float wakeUpsPerSec;
+  int   queueHighWater;
+};
+static std::vector<NWorkerStats>             s_poolStatsPrev;
+static std::vector<PoolStatsView>            s_poolStatsView;
+static std::chrono::steady_clock::time_point s_poolStatsTime;
+static double                                s_poolStatsElapsed  = 0.0;
+static const char*                           s_poolStatsFileName = NULL;
+static FILE*                                 s_poolStatsFile     = NULL;
+
+void samplePoolStats()
+{
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  int                                   n   = (int)g_mainThreadPool->getThreadCount();
+  if(s_poolStatsPrev.size() != n)
+  {
+    // first sample: only the reference
+    s_poolStatsPrev.resize(n);
+    s_poolStatsView.resize(n);
+    for(int i = 0; i < n; i++)
+      g_mainThreadPool->getWorkerStats(i, s_poolStatsPrev[i]);
+    s_poolStatsTime = now;
+    return;
+  }
+  double dt = std::chrono::duration<double>(now - s_poolStatsTime).count();
+  if(dt < POOLSTATS_INTERVAL)
+    return;
+  s_poolStatsTime = now;
+  s_poolStatsElapsed += dt;
+  if(s_poolStatsFileName && !s_poolStatsFile)
+  {
+    s_poolStatsFile = fopen(s_poolStatsFileName, "w");
+    if(s_poolStatsFile)
+      fprintf(s_poolStatsFile, "time,worker,cpu,tasks,busy_ms,idle_ms,wakeups,shared_tasks,queue_high_water\n");
+    else
+    {
+      LOGE("could not open %s\n", s_poolStatsFileName);
+      s_poolStatsFileName = NULL;
+    }
+  }
+  for(int i = 0; i < n; i++)
+  {
+    NWorkerStats cur;
+    g_mainThreadPool->getWorkerStats(i, cur);
+    // high water mark of this interval only
+    g_mainThreadPool->getThreadWorker(i)->GetTaskQueue().ResetQueuedTaskHighWater();
+    const NWorkerStats& prev  = s_poolStatsPrev[i];
+    PoolStatsView&      view  = s_poolStatsView[i];
+    uint64              tasks = cur.tasksExecuted - prev.tasksExecuted;
+    uint64              busy  = cur.busyNs - prev.busyNs;
+    uint64              idle  = cur.idleNs - prev.idleNs;
+    uint64              wakes = cur.wakeUps - prev.wakeUps;
+    view.cpu                  = g_mainThreadPool->getThreadWorker(i)->GetCpu();
+    view.tasksPerSec          = float(tasks / dt);
+    view.busyPercent          = float(busy * 1e-7 / dt);
+    view.idlePercent          = float(idle * 1e-7 / dt);
+    view.wakeUpsPerSec        = float(wakes / dt);
+    view.queueHighWater       = cur.queueHighWater;
+    if(s_poolStatsFile)
+      fprintf(s_poolStatsFile, "%.3f,%d,%d,%llu,%.3f,%.3f,%llu,%llu,%d\n", s_poolStatsElapsed, i, view.cpu,
+              (unsigned long long)tasks, busy * 1e-6, idle * 1e-6, (unsigned long long)wakes,
+              (unsigned long long)(cur.sharedTasks - prev.sharedTasks), cur.queueHighWater);
+    s_poolStatsPrev[i] = cur;
+  }
+  if(s_poolStatsFile)
+    fflush(s_poolStatsFile);
+}
+
+#endif
+//-----------------------------------------------------------------------------
+// -countallocs: operator new calls per frame, logged every ALLOCSTATS_INTERVAL
+// seconds. Once the scratch arenas and the containers reached their size,
+// recording a steady scene shouldn't allocate anymore
+//-----------------------------------------------------------------------------
+#define ALLOCSTATS_INTERVAL 1.0
+static std::chrono::steady_clock::time_point s_allocStatsTime;
+static uint64_t                              s_allocStatsTotal      = 0;
+static uint64_t                              s_allocStatsMax        = 0;
+static int                                   s_allocStatsFrames     = 0;
+static int                                   s_allocStatsAllocating = 0;
+
+void sampleAllocStats(uint64_t frameAllocs)
+{
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  if(s_allocStatsTime == std::chrono::steady_clock::time_point())
+    s_allocStatsTime = now;
+  s_allocStatsTotal += frameAllocs;
+  s_allocStatsMax = std::max(s_allocStatsMax, frameAllocs);
+  s_allocStatsFrames++;
+  if(frameAllocs)
+    s_allocStatsAllocating++;
+  if(std::chrono::duration<double>(now - s_allocStatsTime).count() < ALLOCSTATS_INTERVAL)
+    return;
+  LOGI("heap allocations: %.1f per frame (max %llu), %d of %d frames allocated\n", double(s_allocStatsTotal) / double(s_allocStatsFrames),
+       (unsigned long long)s_allocStatsMax, s_allocStatsAllocating, s_allocStatsFrames);
+  s_allocStatsTime       = now;
+  s_allocStatsTotal      = 0;
+  s_allocStatsMax        = 0;
+  s_allocStatsFrames     = 0;
+  s_allocStatsAllocating = 0;
+}
+
 #ifdef USEWORKERS
 void initThreads()
 {
   //
   // Create a pool
   //
-  g_mainThreadPool = new ThreadWorkerPool(NUMTHREADS, false, false, NWTPS_ROUND_ROBIN, std::string("Main Worker Pool"));
-  LOGI("Creating %d workers...\n", NUMTHREADS);
+  int numThreads = g_numThreads > 0 ? g_numThreads : CThread::PhysicalCoreCount();
+  g_mainThreadPool = new ThreadWorkerPool(numThreads, false, false, NWTPS_ROUND_ROBIN, std::string("Main Worker Pool"));
+  LOGI("Creating %d workers (%d logical CPUs, %d physical cores)...\n", numThreads, (int)CThread::CpuTopology().size(),
+       CThread::PhysicalCoreCount());
+  if(g_affinity != NWTA_NONE)
+  {
+    if(!g_mainThreadPool->SetAffinity(g_affinity, &g_affinityCpus))
+      LOGE("Could not pin some of the workers\n");
+    for(int i = 0; i < numThreads; i++)
+      LOGI("worker %d on CPU %d\n", i, g_mainThreadPool->getThreadWorker(i)->GetCpu());
+  }
   //
   // Create a TaskBatch for this main thread
   //
@@ -172,12 +364,48 @@ void initThreads()
   setCurrentTaskQueue(g_mainThreadQueue);
   g_crs_bk3d = new CCriticalSection();
   g_crs_VK   = new CCriticalSection();
-  // create N events
-  g_evt_cmdbuf = new CEvent[g_bk3dModels.size() * MAXCMDBUFFERS];
+  //
+  // graph of tasks re-built at each frame
+  //
+  g_frameGraph  = new TaskGraph(g_mainThreadPool);
+  g_recordGraph = new TaskGraph(g_mainThreadPool);
+  //
+  // parallel_for()/parallel_reduce() of the loading and of the renderers
+  //
+  setParallelPool(g_mainThreadPool);
+}
+
+//
+// none|compact|scatter or a list of CPUs like 0,2,4-7
+//
+bool parseAffinity(const char* str)
+{
+  g_affinityCpus.clear();
+  if(strcmp(str, "none") == 0)
+    g_affinity = NWTA_NONE;
+  else if(strcmp(str, "compact") == 0)
+    g_affinity = NWTA_COMPACT;
+  else if(strcmp(str, "scatter") == 0)
+    g_affinity = NWTA_SCATTER;
+  else
+  {
+    if(!parseIntList(str, g_affinityCpus))
+      return false;
+    g_affinity = NWTA_LIST;
+  }
+  return true;
 }
 
 void terminateThreads()
 {
+  if(s_poolStatsFile)
+    fclose(s_poolStatsFile);
+  s_poolStatsFile = NULL;
+  setParallelPool(NULL);
+  delete g_recordGraph;
+  g_recordGraph = NULL;
+  delete g_frameGraph;
+  g_frameGraph = NULL;
   g_mainThreadPool->FlushTasks();
   g_mainThreadPool->Terminate();  // issue with NWTPS_SHARED_QUEUE
   delete g_mainThreadPool;
@@ -189,6 +417,23 @@ void terminateThreads()
   delete g_crs_VK;
   g_crs_VK = NULL;
 }
+//
+// re-creates the pool with another number of workers, for the sweeps of -benchmark
+//
+void restartThreads(int numThreads)
+{
+  destroyCommandBuffers(true);
+  releaseThreadLocalVars();
+  // the counters of all the pool sizes go to the same -poolstats file
+  FILE* poolStatsFile = s_poolStatsFile;
+  s_poolStatsFile     = NULL;
+  terminateThreads();
+  s_poolStatsFile = poolStatsFile;
+  g_numThreads    = numThreads;
+  initThreads();
+  initThreadLocalVars();
+  g_bRefreshCmdBuffersCounter = 2;
+}
 #endif
 
 //-----------------------------------------------------------------------------
@@ -214,6 +459,37 @@ static const char* s_sampleHelpCmdLine =
     "-m <bk3d file> : load a specific model\n"
     "<bk3d>    : load a specific model\n"
     "-q <msaa> : MSAA\n"
+    "-threads <n> : number of workers (default: one per physical core)\n"
+    "-affinity none|compact|scatter|<cpu list ex: 0,2,4-7> : pinning of the workers\n"
+    "-pipeline 1 or 2 : record the next frame while the current one gets submitted (2)\n"
+    "-poolstats <file> : appends the counters of the workers to a CSV file every second\n"
+    "-numa 0 or 1 : allocate the per-thread data on the NUMA node of the thread\n"
+    "-microbench <name> or all : run CPU micro-benchmarks and exit\n"
+    "-microbenchout <file> : -microbench writes its results in the JSON format of Google Benchmark\n"
+    "-microbenchbaseline <file> : -microbench compares with these results, fails when a variant is 30% slower relative to its kernel (ex: microbench_baseline.json)\n"
+    "-countallocs : log the heap allocations per frame\n"
+    "-tokenopt 0 or 1 : peephole pass on the token streams of the command-list renderer\n"
+    "-zerocopy 0 or 1 : command-list slices written straight into a mapped token buffer (no peephole pass)\n"
+    "-workers 0 or 1 : record the command-buffers with the workers\n"
+    "-headless <frames> : no window nor graphics API: render <frames> frames with the null renderer and exit\n"
+    "-benchmark <frames> : replay the camera path at a fixed time-step for <frames> frames per configuration, then exit\n"
+    "-benchrenderers <list ex: 0,2> : renderers swept by -benchmark (default: the current one)\n"
+    "-benchcmdbuffers <list ex: 4,16,64> : numbers of command-buffers swept by -benchmark\n"
+    "-benchworkers <list ex: 0,1> : workers off/on swept by -benchmark\n"
+    "-benchthreads <list ex: 1,2,4,8> : numbers of workers swept by -benchmark (the pool gets re-created)\n"
+    "-benchout <name> : -benchmark writes <name>.csv and <name>.json (default: benchmark)\n"
+    "-autotune <frames> : measures <frames> frames for each number of command-buffers (-benchcmdbuffers, default 1 to 64) with workers off and on (-benchworkers), applies the fastest and saves it for this host\n"
+    "-tunefile <file> : where -autotune saves its results and where they get reloaded from (default: autotune_<host>.cfg)\n"
+    "-notune : ignore the results of -autotune saved for this host\n"
+    "-apireport <frames> : the same scene through each renderer of -benchrenderers (default: all), binds and tokens per frame side by side in <benchout>_api.csv, then exit\n"
+    "-trace <file> : writes a Chrome trace (chrome://tracing, ui.perfetto.dev) of the CPU sections, tasks and GPU frames (Vulkan)\n"
+    "-traceframes <first>-<last> : frames of -trace (default 100-109)\n"
+    "-capture <file> : writes the renderer-level calls of frames, for -replay\n"
+    "-captureframes <first>-<last> : frames of -capture (default 100-109)\n"
+    "-replay <file> <loops> : runs the calls of a capture <loops> times with the current renderer (null one with -headless), then exits\n"
+    "-scaling <frames> : headless -benchmark over threads x command-buffers, with speedup, efficiency and serial fraction\n"
+    "-synthetic <desc> : generated scene instead of a model, ex: meshes=100000,prims=10,tri=3,line=1,verts=64,indices=96\n"
+    "-synthwrite <desc> <file> : writes the generated scene to a .bk3d file and exits\n"
     "----------------------------------------\n";
 
 //------------------------------------------------------------------------------
@@ -237,9 +513,11 @@ Bk3dModel::Bk3dModel(const char* name, glm::vec3* pPos, float* pScale)
   m_material             = NULL;
   m_materialNItems       = 0;
   m_meshFile             = NULL;
+  m_meshBufferMemory     = NULL;
   m_posOffset            = pPos ? *pPos : glm::vec3(0, 0, 0);
   m_scale                = pScale ? *pScale : 0.0f;
   m_pRenderer            = NULL;
+  memset(&m_stats, 0, sizeof(Stats));
 }
 
 Bk3dModel::~Bk3dModel()
@@ -248,26 +526,47 @@ Bk3dModel::~Bk3dModel()
   delete[] m_material;
   if(m_meshFile)
     free(m_meshFile);
+  free(m_meshBufferMemory);
+  memUntrack(MEMTAG_MODEL_FILE, this, NULL);
+  memUntrack(MEMTAG_MODEL_UNIFORMS, this, NULL);
+  memForget(this);
 }
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
 bool Bk3dModel::loadModel()
 {
-  LOGI("Loading Mesh %s..\n", m_name.c_str());
-  std::vector<std::string> m_paths;
-  m_paths.push_back(m_name);
-  m_paths.push_back(std::string("media/") + m_name);
-  m_paths.push_back(std::string("downloaded_resources/") + m_name);
-  m_paths.push_back(std::string("../downloaded_resources/") + m_name);
-  m_paths.push_back(std::string("../../downloaded_resources/") + m_name);
-  m_paths.push_back(std::string("../../../downloaded_resources/") + m_name);
-  //paths.push_back(std::string(PROJECT_RELDIRECTORY) + name);
-  for(int i = 0; i < m_paths.size(); i++)
+  if(m_name.compare(0, strlen(SYNTH_PREFIX), SYNTH_PREFIX) == 0)
   {
-    if((m_meshFile = bk3d::load(m_paths[i].c_str())))
+    SyntheticSceneDesc desc;
+    if(!parseSyntheticDesc(m_name.c_str() + strlen(SYNTH_PREFIX), desc))
     {
-      break;
+      LOGE("Wrong synthetic scene %s\n", m_name.c_str());
+      return false;
+    }
+    size_t sceneBytes = 0;
+    m_meshFile        = generateSyntheticScene(desc, &sceneBytes);
+    memTrack(MEMTAG_MODEL_FILE, this, NULL, (int64_t)sceneBytes);
+  }
+  else
+  {
+    LOGI("Loading Mesh %s..\n", m_name.c_str());
+    std::vector<std::string> m_paths;
+    m_paths.push_back(m_name);
+    m_paths.push_back(std::string("media/") + m_name);
+    m_paths.push_back(std::string("downloaded_resources/") + m_name);
+    m_paths.push_back(std::string("../downloaded_resources/") + m_name);
+    m_paths.push_back(std::string("../../downloaded_resources/") + m_name);
+    m_paths.push_back(std::string("../../../downloaded_resources/") + m_name);
+    //paths.push_back(std::string(PROJECT_RELDIRECTORY) + name);
+    for(int i = 0; i < m_paths.size(); i++)
+    {
+      unsigned int bufferBytes = 0;
+      if((m_meshFile = bk3d::load(m_paths[i].c_str(), &m_meshBufferMemory, &bufferBytes)))
+      {
+        memTrack(MEMTAG_MODEL_FILE, this, NULL, (int64_t)m_meshFile->nodeByteSize + bufferBytes);
+        break;
+      }
     }
   }
   if(m_meshFile == NULL)
@@ -275,29 +574,15 @@ bool Bk3dModel::loadModel()
     LOGE("error in loading mesh %s\n", m_name.c_str());
     return false;
   }
+  memTrackName(this, m_name.c_str());
   //
   // Some adjustment for the display
   //
   if(m_scale <= 0.0)
   {
-    float min[3] = {1000.0, 1000.0, 1000.0};
-    float max[3] = {-1000.0, -1000.0, -1000.0};
-    for(int i = 0; i < m_meshFile->pMeshes->n; i++)
-    {
-      bk3d::Mesh* pMesh = m_meshFile->pMeshes->p[i];
-      if(pMesh->aabbox.min[0] < min[0])
-        min[0] = pMesh->aabbox.min[0];
-      if(pMesh->aabbox.min[1] < min[1])
-        min[1] = pMesh->aabbox.min[1];
-      if(pMesh->aabbox.min[2] < min[2])
-        min[2] = pMesh->aabbox.min[2];
-      if(pMesh->aabbox.max[0] > max[0])
-        max[0] = pMesh->aabbox.max[0];
-      if(pMesh->aabbox.max[1] > max[1])
-        max[1] = pMesh->aabbox.max[1];
-      if(pMesh->aabbox.max[2] > max[2])
-        max[2] = pMesh->aabbox.max[2];
-    }
+    float min[3];
+    float max[3];
+    foldMeshBounds(m_meshFile, min, max);
     m_posOffset[0] = (max[0] + min[0]) * 0.5f;
     m_posOffset[1] = (max[1] + min[1]) * 0.5f;
     m_posOffset[2] = (max[2] + min[2]) * 0.5f;
@@ -337,6 +622,7 @@ bool Bk3dModel::loadModel()
       if(length(m_material[i].diffuse) <= 0.1f)
         m_material[i].diffuse = glm::vec3(1, 1, 1);
     }
+    memTrack(MEMTAG_MODEL_UNIFORMS, this, NULL, sizeof(MaterialBuffer) * m_materialNItems);
   }
   //
   // create Buffer Object for Object-matrices
@@ -350,6 +636,7 @@ bool Bk3dModel::loadModel()
       // 256 bytes aligned...
       memcpy(glm::value_ptr(m_objectMatrices[i].mO), m_meshFile->pTransforms->pBones[i]->Matrix().m, sizeof(glm::mat4));
     }
+    memTrack(MEMTAG_MODEL_UNIFORMS, this, NULL, sizeof(MatrixBufferObject) * m_objectMatricesNItems);
   }
   return true;
 }
@@ -359,10 +646,22 @@ bool Bk3dModel::loadModel()
 //------------------------------------------------------------------------------
 void Bk3dModel::addStats(Stats& stats)
 {
-  stats.primitives += m_stats.primitives;
-  stats.drawcalls += m_stats.drawcalls;
-  stats.attr_update += m_stats.attr_update;
-  stats.uniform_update += m_stats.uniform_update;
+  stats.add(m_stats);
+}
+
+void Bk3dModel::Stats::add(const Stats& s)
+{
+  primitives += s.primitives;
+  drawcalls += s.drawcalls;
+  attr_update += s.attr_update;
+  uniform_update += s.uniform_update;
+  state_binds += s.state_binds;
+  buffer_binds += s.buffer_binds;
+  descriptor_binds += s.descriptor_binds;
+  tokens += s.tokens;
+  bytes_recorded += s.bytes_recorded;
+  token_bytes += s.token_bytes;
+  token_bytes_saved += s.token_bytes_saved;
 }
 void Bk3dModel::printPosition()
 {
@@ -377,6 +676,7 @@ void Bk3dModel::printPosition()
 #define COMBO_RENDERER 2
 #define SCALAR_NCMDBUF 3
 #define CHECK_WORKERS 4
+#define SCALAR_PIPELINE 5
 void MyWindow::processUI(int width, int height, double dt)
 {
   // Update imgui configuration
@@ -393,6 +693,7 @@ void MyWindow::processUI(int width, int height, double dt)
     m_guiRegistry.enumCombobox(COMBO_RENDERER, "Renderer", &s_curRenderer);
 #ifdef USEWORKERS
     m_guiRegistry.checkbox(CHECK_WORKERS, "UseWorkers", &g_useWorkers);
+    m_guiRegistry.inputIntClamped(SCALAR_PIPELINE, "Pipeline depth", &g_pipelineDepth, 1, MAX_PIPELINE_DEPTH);
 #endif
     m_guiRegistry.inputIntClamped(SCALAR_NCMDBUF, "N Objs x&y", &g_numCmdBuffers, 1, MAXCMDBUFFERS);
     ImGui::Separator();
@@ -415,6 +716,10 @@ void MyWindow::processUI(int width, int height, double dt)
     ImGui::Checkbox("Topology Triangles\n", &g_bTopologytriangles);
     ImGui::Checkbox("Topology Tri-Strips\n", &g_bTopologytristrips);
     ImGui::Checkbox("Topology Tri-Fans\n", &g_bTopologytrifans);
+    if(ImGui::Checkbox("token peephole pass (command-list)\n", &g_bOptimizeTokens))
+      g_bRefreshCmdBuffersCounter = 1;
+    if(ImGui::Checkbox("zero-copy token buffer (command-list)\n", &g_bZeroCopyTokens))
+      g_bRefreshCmdBuffersCounter = 1;
     ImGui::Separator();
     ImGui::Text("('h' to toggle help)");
     //if(s_bStats)
@@ -449,6 +754,99 @@ void MyWindow::processUI(int width, int height, double dt)
     ImGui::ProgressBar(gpuTimeF / maxTimeF, ImVec2(0.0f, 0.0f));
     ImGui::Text("Scene CPU [ms]: %2.3f", cpuTimeF / 1000.0f);
     ImGui::ProgressBar(cpuTimeF / maxTimeF, ImVec2(0.0f, 0.0f));
+    Bk3dModel::Stats stats;
+    memset(&stats, 0, sizeof(stats));
+    for(int m = 0; m < g_bk3dModels.size(); m++)
+      g_bk3dModels[m]->addStats(stats);
+    if(stats.token_bytes)
+      ImGui::Text("Tokens    [KB]: %.1f (peephole pass: -%.1f)", stats.token_bytes / 1024.0f, stats.token_bytes_saved / 1024.0f);
+    if(ImGui::CollapsingHeader("API calls"))
+    {
+      ImGui::Text("draw calls       %u", stats.drawcalls);
+      ImGui::Text("state binds      %u", stats.state_binds);
+      ImGui::Text("buffer binds     %u", stats.buffer_binds);
+      ImGui::Text("descriptor binds %u", stats.descriptor_binds);
+      ImGui::Text("tokens           %u", stats.tokens);
+      ImGui::Text("recorded   [KB]  %.1f", stats.bytes_recorded / 1024.0f);
+    }
+    if(ImGui::CollapsingHeader("Frame times"))
+    {
+      const RollingTimes* series[] = {&s_frameTimes.frameMs, &s_frameTimes.sceneMs, &s_frameTimes.gpuMs};
+      const char*         names[]  = {"frame", "scene CPU", "frame GPU"};
+      ImGui::Text("last %d frames [ms]  p50     p95     p99     max", s_frameTimes.frameMs.size());
+      for(int i = 0; i < 3; i++)
+      {
+        ImGui::Text("%-18s %7.3f %7.3f %7.3f %7.3f", names[i], series[i]->percentile(0.5f), series[i]->percentile(0.95f),
+                    series[i]->percentile(0.99f), series[i]->percentile(1.0f));
+      }
+      const RollingTimes& frames = s_frameTimes.frameMs;
+      ImGui::PlotLines("frame [ms]", frames.values(), frames.size(), frames.offset(), NULL, 0.0f, frames.percentile(1.0f),
+                       ImVec2(0, 60));
+      float buckets[FRAMETIMES_BUCKETS];
+      frames.histogram(buckets, FRAMETIMES_BUCKETS, FRAMETIMES_BUCKET_MS);
+      ImGui::PlotHistogram("frames per 0.5 ms", buckets, FRAMETIMES_BUCKETS, 0, NULL, 0.0f, FLT_MAX, ImVec2(0, 60));
+      ImGui::Text("hitches: %d of %d frames (> %.0fx the median)", s_frameTimes.numHitches(), s_frameTimes.numFrames(), HITCH_FACTOR);
+      const std::vector<FrameHitch>& hitches = s_frameTimes.hitches();
+      for(int i = (int)hitches.size() - 1; i >= 0; i--)
+      {
+        const FrameHitch& h = hitches[i];
+        char gpu[32] = "n/a";
+        if(h.gpuMs != HITCH_NO_GPU_TIME)
+          sprintf(gpu, "%.2f", h.gpuMs);
+        if(ImGui::TreeNode(&h, "frame %d: %.2f ms (median %.2f, scene CPU %.2f, GPU %s)", h.frame, h.frameMs, h.medianMs,
+                           h.sceneMs, gpu))
+        {
+          ImGui::TextUnformatted("profiler averages at the end of the frame:");
+          ImGui::TextUnformatted(h.profilerDump.c_str());
+          ImGui::TreePop();
+        }
+      }
+    }
+    if(ImGui::CollapsingHeader("Memory"))
+    {
+      MemCounter                 tags[NUM_MEMTAGS], host, device;
+      std::vector<MemOwnerStats> owners[2];
+      const char*                kinds[2] = {"model", "renderer"};
+      memGetStats(tags, &host, &device);
+      memGetModels(owners[0]);
+      memGetRenderers(owners[1]);
+      ImGui::Text("[MB]                   current     peak");
+      ImGui::Text("%-20s %9.2f %8.2f", "host", host.current / (1024.0f * 1024.0f), host.peak / (1024.0f * 1024.0f));
+      ImGui::Text("%-20s %9.2f %8.2f", "device", device.current / (1024.0f * 1024.0f), device.peak / (1024.0f * 1024.0f));
+      ImGui::Separator();
+      for(int t = 0; t < NUM_MEMTAGS; t++)
+        ImGui::Text("%-20s %9.2f %8.2f", memTagName((MemTag)t), tags[t].current / (1024.0f * 1024.0f), tags[t].peak / (1024.0f * 1024.0f));
+      for(int k = 0; k < 2; k++)
+      {
+        for(int i = 0; i < owners[k].size(); i++)
+        {
+          const MemOwnerStats& o = owners[k][i];
+          if(ImGui::TreeNode(o.owner, "%s %s: host %.2f MB, device %.2f MB", kinds[k], o.name, o.host.current / (1024.0f * 1024.0f),
+                             o.device.current / (1024.0f * 1024.0f)))
+          {
+            for(int t = 0; t < NUM_MEMTAGS; t++)
+            {
+              if(o.tags[t].peak)
+                ImGui::Text("%-20s %9.2f %8.2f", memTagName((MemTag)t), o.tags[t].current / (1024.0f * 1024.0f),
+                            o.tags[t].peak / (1024.0f * 1024.0f));
+            }
+            ImGui::TreePop();
+          }
+        }
+      }
+    }
+#ifdef USEWORKERS
+    if(ImGui::CollapsingHeader("Worker pool"))
+    {
+      ImGui::Text("worker cpu  tasks/s  busy%%  idle%%  wakes/s  queue max");
+      for(int i = 0; i < s_poolStatsView.size(); i++)
+      {
+        const PoolStatsView& v = s_poolStatsView[i];
+        ImGui::Text("%6d %3d %8.0f %6.1f %6.1f %8.0f %10d", i, v.cpu, v.tasksPerSec, v.busyPercent, v.idlePercent,
+                    v.wakeUpsPerSec, v.queueHighWater);
+      }
+    }
+#endif
   }
   ImGui::End();
 }
@@ -476,6 +874,9 @@ bool MyWindow::open(int posX, int posY, int width, int height, const char* title
     m_guiRegistry.enumAdd(COMBO_RENDERER, i, g_renderers[i]->getName());
   }
   m_guiRegistry.checkboxAdd(CHECK_WORKERS);
+#ifdef USEWORKERS
+  m_guiRegistry.inputIntAdd(SCALAR_PIPELINE, g_pipelineDepth);
+#endif
   m_guiRegistry.inputIntAdd(SCALAR_NCMDBUF, g_numCmdBuffers);
   return true;
 }
@@ -498,6 +899,10 @@ void MyWindow::onWindowResize(int w, int h)
   if(h == 0)
     h = getHeight();
   AppWindowCameraInertia::onWindowResize(w, h);
+#ifdef USEWORKERS
+  // command-buffers recorded ahead refer to the framebuffer about to be re-created
+  finishRecordingAhead();
+#endif
   if(s_pCurRenderer)
   {
     if(s_pCurRenderer->bFlipViewport())
@@ -568,61 +973,146 @@ void MyWindow::onKeyboardChar(unsigned char key, int mods, int x, int y)
   }
 }
 
+#ifdef USEWORKERS
 //------------------------------------------------------------------------------
+// Tasks of the frame graph
+//
+// the frame is not a sequence of push-all/wait-all phases: each node runs as soon
+// as the nodes it depends on are done.
 //
+//  recording of slices (model m) --> consolidation (model m) --+
+//                                                              +--> primary assembly
+//  displayStart -----------------------------------------------+
+//
+// Nodes issuing OpenGL calls or appending to the primary command-buffer are pinned to
+// g_mainThreadQueue: the main thread executes them while waiting for the graph.
+// The consolidation of a model can start while slices of other models are still recorded.
+// There is no reset node for the pools of the workers: the renderer resets the pool of
+// a worker in the first slice this worker records in the frame
 //------------------------------------------------------------------------------
-void resetCommandBuffersPool()
+class TskUpdateCommandBuffer : public TaskNode
 {
-  // here we reset the primary pool: what is from thread #0
-  s_pCurRenderer->resetCommandBuffersPool();
-#ifdef USEWORKERS
-  if(g_useWorkers)
+private:
+  int m;
+  int cmdBufIdx;
+  int mstart, mend;
+
+public:
+  TskUpdateCommandBuffer(int modelIndex, int cIdx, int ms, int me)
   {
-    // here we reset the secondary pools: what is from thread #0
-    //---------------------------------------------------------------------
-    // Invoke a Task on all the threads to setup some thread-local variable
-    //
-    class TaskResetCommandBuffersPool : public TaskBase
-    {
-    private:
-      int m;
+    m         = modelIndex;
+    mstart    = ms;
+    mend      = me;
+    cmdBufIdx = cIdx;
+  }
+  const char* getTraceName() { return "record slice"; }
+  void Invoke()
+  {
+    if(s_pCapture)
+      s_pCapture->buildSlice(m, cmdBufIdx, mstart, mend);
+    s_pCurRenderer->buildCmdBufferModel(g_bk3dModels[m], cmdBufIdx, mstart, mend);
+  }
+};
+class TskConsolidateCmdBuffers : public TaskNode
+{
+private:
+  int m;
+  int numCmdBuffers;  // as when the slices got created: the UI may change it while recording ahead
 
-    public:
-      TaskResetCommandBuffersPool(int _m)
-          : TaskBase()
-      {
-        m = _m;
-      }
-      void Invoke()
-      {  // We are now in the Thread : let's reset the command-buffers Pool
-        s_pCurRenderer->resetCommandBuffersPool();
-        g_evt_cmdbuf[m].Set();
-      }
-    };
-    //---------------------------------------------------------------------
-    // loop in each existing thread
-    for(unsigned int i = 0; i < g_mainThreadPool->getThreadCount(); i++)
+public:
+  TskConsolidateCmdBuffers(int modelIndex, int n)
+  {
+    m             = modelIndex;
+    numCmdBuffers = n;
+  }
+  const char* getTraceName() { return "consolidate"; }
+  void Invoke()
+  {  // set the # of command buffers used to display the model and possibly do some consolidation
+    if(s_pCapture)
+      s_pCapture->consolidate(m, numCmdBuffers);
+    s_pCurRenderer->consolidateCmdBuffersModel(g_bk3dModels[m], numCmdBuffers);
+  }
+};
+class TskDisplayStart : public TaskNode
+{
+private:
+  glm::mat4            mW;
+  const InertiaCamera* camera;
+  const glm::mat4*     projection;
+  bool                 bTimingGlitch;
+
+public:
+  TskDisplayStart(const glm::mat4& _mW, const InertiaCamera* _camera, const glm::mat4* _projection, bool _bTimingGlitch)
+  {
+    mW            = _mW;
+    camera        = _camera;
+    projection    = _projection;
+    bTimingGlitch = _bTimingGlitch;
+  }
+  const char* getTraceName() { return "displayStart"; }
+  void Invoke()
+  {  // This might initiate a primary command-buffer (in Vulkan renderer)
+    if(s_pCapture)
+      s_pCapture->displayStart(mW, *camera, *projection, bTimingGlitch);
+    s_pCurRenderer->displayStart(mW, *camera, *projection, bTimingGlitch);
+  }
+};
+class TskDisplayScene : public TaskNode
+{
+private:
+  const InertiaCamera* camera;
+  const glm::mat4*     projection;
+  unsigned short       topo;
+
+public:
+  TskDisplayScene(const InertiaCamera* _camera, const glm::mat4* _projection, unsigned short _topo)
+  {
+    camera     = _camera;
+    projection = _projection;
+    topo       = _topo;
+  }
+  const char* getTraceName() { return "displayScene"; }
+  void Invoke()
+  {
+    //
+    // Grid floor: might append a sub-command to the primary command-buffer
+    //
+    if(g_bDisplayGrid)
     {
-      // Call in // threads
-      TaskResetCommandBuffersPool* taskResetCommandBuffersPool;
-      taskResetCommandBuffersPool = new TaskResetCommandBuffersPool(i);
-      // explicitly choosing threads. Note: need to check how does it work with NWTPS_SHARED_QUEUE
-      g_mainThreadPool->getThreadWorker(i)->GetTaskQueue().pushTask(taskResetCommandBuffersPool);
+      if(s_pCapture)
+        s_pCapture->displayGrid(*camera, *projection);
+      s_pCurRenderer->displayGrid(*camera, *projection);
     }
-    // wait for all before continuing
+    //
+    // Display Meshes: might append a sub-commands to the primary command-buffer
+    //
+    if(g_bDisplayObject)
     {
-      //NXPROFILEFUNC("Wait for all");
-      for(unsigned int m = 0; m < g_mainThreadPool->getThreadCount(); m++)
+      for(int m = 0; m < g_bk3dModels.size(); m++)
       {
-        //
-        // Wait for the worker to be done
-        //
-        g_evt_cmdbuf[m].WaitOnEvent();
-        g_evt_cmdbuf[m].Reset();
+        if(s_pCapture)
+          s_pCapture->displayModel(m, camera->m4_view, *projection, (unsigned char)topo);
+        s_pCurRenderer->displayBk3dModel(g_bk3dModels[m], camera->m4_view, *projection, topo);
       }
     }
+    //
+    // This might finalize a primary command-buffer (Vulkan) referring to sub-commands (create in display..() )
+    //
+    if(s_pCapture)
+      s_pCapture->displayEnd();
+    s_pCurRenderer->displayEnd();
   }
+};
 #endif
+//------------------------------------------------------------------------------
+// reset of the primary pool: what is from thread #0. The pools of the workers get
+// reset by their first recording of the frame
+//------------------------------------------------------------------------------
+void resetCommandBuffersPool()
+{
+  if(s_pCapture)
+    s_pCapture->resetPool();
+  s_pCurRenderer->resetCommandBuffersPool();
 }
 //------------------------------------------------------------------------------
 //
@@ -630,6 +1120,9 @@ void resetCommandBuffersPool()
 void destroyCommandBuffers(bool bAll)
 {
   NXPROFILEFUNC(__FUNCTION__);
+#ifdef USEWORKERS
+  finishRecordingAhead();
+#endif
   if(bAll)
   {
     // wait for the GPU to be done: we might erase commands that are still used by the GPU
@@ -643,51 +1136,8 @@ void destroyCommandBuffers(bool bAll)
 #ifdef USEWORKERS
   if(g_useWorkers)
   {
-    //---------------------------------------------------------------------
-    // Invoke a Task on all the threads to setup some thread-local variable
-    //
-    class TaskDestroyCommandBuffers : public TaskBase
-    {
-    private:
-      int  m;
-      bool bAll;
-
-    public:
-      TaskDestroyCommandBuffers(int _m, bool _bAll)
-          : TaskBase()
-      {
-        m    = _m;
-        bAll = _bAll;
-      }
-      void Invoke()
-      {  // We are now in the Thread : let's delete the command-buffers pointed through TLS
-        s_pCurRenderer->destroyCommandBuffers(bAll);
-        //if(bAll)
-        g_evt_cmdbuf[m].Set();
-      }
-    };
-    //---------------------------------------------------------------------
-    for(unsigned int i = 0; i < g_mainThreadPool->getThreadCount(); i++)
-    {
-      // Call in // threads
-      TaskDestroyCommandBuffers* taskDestroyCommandBuffers;
-      taskDestroyCommandBuffers = new TaskDestroyCommandBuffers(i, bAll);
-      // explicitly choosing threads. Note: need to check how does it work with NWTPS_SHARED_QUEUE
-      g_mainThreadPool->getThreadWorker(i)->GetTaskQueue().pushTask(taskDestroyCommandBuffers);
-      //taskDestroyCommandBuffers->(&g_mainThreadPool->getThreadWorker(i)->GetTaskQueue());
-    }
-    // wait for completion before continuing
-    {
-      NXPROFILEFUNC("Wait for all");
-      for(unsigned int m = 0; m < g_mainThreadPool->getThreadCount(); m++)
-      {
-        //
-        // Wait for the worker to be done
-        //
-        g_evt_cmdbuf[m].WaitOnEvent();
-        g_evt_cmdbuf[m].Reset();
-      }
-    }
+    // each thread deletes the command-buffers pointed through TLS
+    g_mainThreadPool->broadcast([bAll](int worker) { s_pCurRenderer->destroyCommandBuffers(bAll); });
   }
   else
 #endif
@@ -703,24 +1153,10 @@ void initThreadLocalVars()
 #ifdef USEWORKERS
   NXPROFILEFUNC(__FUNCTION__);
   //---------------------------------------------------------------------
-  // Invoke a Task on all the threads to setup some thread-local variable
+  // on all the threads at once, to setup some thread-local variable.
+  // #0 is the main thread
   //
-  class SetThreadLocalVars : public TaskSyncCall
-  {
-  public:
-    void Invoke()
-    {  // We are now in the Thread : let's create the context, share it and make it current
-      int threadId = getThreadNumber() + 1;
-      s_pCurRenderer->initThreadLocalVars(threadId);
-    }
-  };
-  //---------------------------------------------------------------------
-  static SetThreadLocalVars setThreadLocalVars;
-  for(unsigned int i = 0; i < g_mainThreadPool->getThreadCount(); i++)
-  {
-    // we will wait for the tasks to be done before continuing (Call)
-    setThreadLocalVars.Call(&g_mainThreadPool->getThreadWorker(i)->GetTaskQueue());
-  }
+  g_mainThreadPool->broadcast([](int worker) { s_pCurRenderer->initThreadLocalVars(worker + 1); });
 #endif
 }
 //------------------------------------------------------------------------------
@@ -731,152 +1167,450 @@ void releaseThreadLocalVars()
 #ifdef USEWORKERS
   NXPROFILEFUNC(__FUNCTION__);
   //---------------------------------------------------------------------
-  // Invoke a Task on all the threads to setup some thread-local variable
+  // on all the threads at once, to release the thread-local variables
   //
-  class ReleaseThreadLocalVars : public TaskSyncCall
-  {
-  public:
-    void Invoke()
-    {  // We are now in the Thread : let's create the context, share it and make it current
-      s_pCurRenderer->releaseThreadLocalVars();
-    }
-  };
-  //---------------------------------------------------------------------
-  static ReleaseThreadLocalVars releaseThreadLocalVars;
-  for(unsigned int i = 0; i < g_mainThreadPool->getThreadCount(); i++)
-  {
-    // we will wait for the tasks to be done before continuing (Call)
-    releaseThreadLocalVars.Call(&g_mainThreadPool->getThreadWorker(i)->GetTaskQueue());
-  }
+  g_mainThreadPool->broadcast([](int worker) { s_pCurRenderer->releaseThreadLocalVars(); });
 #endif
 }
 //------------------------------------------------------------------------------
-//
+// cuts the meshes of a model in slices of meshgroupsize, no more than g_numCmdBuffers:
+// the last one takes the remaining meshes. Slice i is sliceStarts[i] to sliceStarts[i+1]-1
 //------------------------------------------------------------------------------
-int refreshCmdBuffers()
+static int sliceMeshes(int nMeshes, int meshgroupsize, int* sliceStarts)
 {
-  int totalTasks = 0;
-#ifdef USEWORKERS
-  //---------------------------------------------
-  // Worker for command-buffer update
-  //
-  class TskUpdateCommandBuffer : public TaskBase
-  {
-  private:
-    int m;
-    int cmdBufIdx;
-    int mstart, mend;
-
-  public:
-    //TskUpdateCommandBuffer() {  }
-    TskUpdateCommandBuffer(int modelIndex, int cIdx, int ms, int me)
-    {
-      m         = modelIndex;
-      mstart    = ms;
-      mend      = me;
-      cmdBufIdx = cIdx;
-    }
-    virtual void Invoke()
-    {
-      s_pCurRenderer->buildCmdBufferModel(g_bk3dModels[m], cmdBufIdx, mstart, mend);
-      g_evt_cmdbuf[m * MAXCMDBUFFERS + cmdBufIdx].Set();
-    }
-    //void Done() { /* FIXME: prevent delete to happen */ }
-  };
-  //---------------------------------------------
-  //---------------------------------------------
-  if(g_useWorkers)
+  if(meshgroupsize < 1)
+    meshgroupsize = 1;
+  int i = 0;
+  for(int n = 0; n < nMeshes; n += meshgroupsize, i++)
   {
-    for(int m = 0; m < g_bk3dModels.size(); m++)
+    sliceStarts[i] = n;
+    if((i + 1) >= g_numCmdBuffers)
     {
-      int meshgroupsize = g_bk3dModels[m]->m_meshFile->pMeshes->n / g_numCmdBuffers;
-      int i             = 0;
-      for(int n = 0; n < g_bk3dModels[m]->m_meshFile->pMeshes->n; n += meshgroupsize, i++)
-      {
-        // worker will be deleted by the default method Done()
-        if((i + 1) >= g_numCmdBuffers)
-        {
-          TskUpdateCommandBuffer* tskUpdateCommandBuffer =
-              new TskUpdateCommandBuffer(m, i, n, g_bk3dModels[m]->m_meshFile->pMeshes->n);
-          g_mainThreadPool->pushTask(tskUpdateCommandBuffer);
-          totalTasks++;
-          break;
-        }
-        TskUpdateCommandBuffer* tskUpdateCommandBuffer = new TskUpdateCommandBuffer(m, i, n, n + meshgroupsize);
-        g_mainThreadPool->pushTask(tskUpdateCommandBuffer);
-        totalTasks++;
-      }
+      i++;
+      break;
     }
-  }  //if(g_useWorkers)
-  else
-#endif
+  }
+  sliceStarts[i] = nMeshes;
+  return i;
+}
+#ifdef USEWORKERS
+//------------------------------------------------------------------------------
+// adds to the graph a task for each slice of each model and the consolidation
+// of each model, once its slices are recorded.
+// All the slices are ready when the graph starts: it hands them to
+// ThreadWorkerPool::pushTasks() in one batch, so each worker gets woken up once
+// per frame instead of once per slice
+//------------------------------------------------------------------------------
+void refreshCmdBuffers(TaskGraph* graph, std::vector<TaskNode*>& consolidateNodes)
+{
+  // frame-temporary memory of the recordings of the previous frame can be recycled
+  BeginScratchFrame();
+  int sliceStarts[MAXCMDBUFFERS + 1];
+  for(int m = 0; m < g_bk3dModels.size(); m++)
   {
-    for(int m = 0; m < g_bk3dModels.size(); m++)
+    TaskNode* consolidateNode = graph->createNode<TskConsolidateCmdBuffers>(g_mainThreadQueue, m, g_numCmdBuffers);
+    consolidateNodes.push_back(consolidateNode);
+    int nMeshes       = g_bk3dModels[m]->m_meshFile->pMeshes->n;
+    int meshgroupsize = g_useWorkers ? (nMeshes / g_numCmdBuffers) : 1 + (nMeshes / g_numCmdBuffers);
+    int numSlices     = sliceMeshes(nMeshes, meshgroupsize, sliceStarts);
+    // the renderer may need the layout of all the slices before any gets recorded
+    if(s_pCapture)
+      s_pCapture->prepareSlices(m, numSlices, sliceStarts);
+    s_pCurRenderer->prepareCmdBuffersModel(g_bk3dModels[m], numSlices, sliceStarts);
+    for(int i = 0; i < numSlices; i++)
     {
-      int meshgroupsize = 1 + (g_bk3dModels[m]->m_meshFile->pMeshes->n / g_numCmdBuffers);
-      int i             = 0;
-      for(int n = 0; n < g_bk3dModels[m]->m_meshFile->pMeshes->n; n += meshgroupsize, i++)
-      {
-        if((i + 1) >= g_numCmdBuffers)
-        {
-          s_pCurRenderer->buildCmdBufferModel(g_bk3dModels[m], i, n, g_bk3dModels[m]->m_meshFile->pMeshes->n);
-          break;
-        }
-        s_pCurRenderer->buildCmdBufferModel(g_bk3dModels[m], i, n, n + meshgroupsize);
-      }
+      TaskNode* recordNode = graph->createNode<TskUpdateCommandBuffer>(NULL, m, i, sliceStarts[i], sliceStarts[i + 1]);
+      graph->addDependency(recordNode, consolidateNode);
     }
-  }  //if(g_useWorkers)
-  return totalTasks;
+  }
+}
+//------------------------------------------------------------------------------
+// pipelined frames: right after the submission of frame N, resets the primary pool
+// of frame N+1 and starts recording its command-buffers in g_recordGraph. The main
+// thread doesn't wait: it goes on with the blit, the UI and the swap of frame N.
+// The reset of the primary pool waits for the fence of the frame that used this
+// slot of the CMDPOOL_BUFFER_SZ ring last (N+1-CMDPOOL_BUFFER_SZ), as without pipelining
+//------------------------------------------------------------------------------
+void startRecordingAhead()
+{
+  static std::vector<TaskNode*> consolidateNodes;
+  consolidateNodes.clear();
+  g_recordGraph->setPool(g_mainThreadPool);
+  resetCommandBuffersPool();
+  refreshCmdBuffers(g_recordGraph, consolidateNodes);
+  g_recordGraph->run(g_mainThreadQueue);
+  s_recordingAhead = true;
+}
+//------------------------------------------------------------------------------
+// waits for the recording started by the previous frame. The consolidation nodes
+// are pinned to the main thread: it executes them here, if not done already.
+// Must also be called before anything destroying or re-creating what the
+// recording uses (command-buffers, renderer, framebuffer...)
+//------------------------------------------------------------------------------
+void finishRecordingAhead()
+{
+  if(!s_recordingAhead)
+    return;
+  NXPROFILEFUNC(__FUNCTION__);
+  g_recordGraph->wait();
+  g_recordGraph->clear();
+  s_recordingAhead = false;
 }
+#else
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
-#ifdef USEWORKERS
-void waitRefreshCmdBuffersDone(int totalTasks)
+void refreshCmdBuffers()
 {
-  //PROFILE_SECTION("waitRefreshCmdBuffersDone");
-  if(g_useWorkers)
+  BeginScratchFrame();
+  int sliceStarts[MAXCMDBUFFERS + 1];
+  for(int m = 0; m < g_bk3dModels.size(); m++)
   {
-    for(int m = 0; m < totalTasks; m++)
+    int nMeshes   = g_bk3dModels[m]->m_meshFile->pMeshes->n;
+    int numSlices = sliceMeshes(nMeshes, 1 + (nMeshes / g_numCmdBuffers), sliceStarts);
+    if(s_pCapture)
+      s_pCapture->prepareSlices(m, numSlices, sliceStarts);
+    s_pCurRenderer->prepareCmdBuffersModel(g_bk3dModels[m], numSlices, sliceStarts);
+    for(int i = 0; i < numSlices; i++)
     {
-      //
-      // Wait for the worker to be done with command-buffer creation
-      //
-      g_evt_cmdbuf[m].WaitOnEvent();
-      g_evt_cmdbuf[m].Reset();
+      if(s_pCapture)
+        s_pCapture->buildSlice(m, i, sliceStarts[i], sliceStarts[i + 1]);
+      s_pCurRenderer->buildCmdBufferModel(g_bk3dModels[m], i, sliceStarts[i], sliceStarts[i + 1]);
     }
   }
 }
 #endif
 //------------------------------------------------------------------------------
-//
+// -capture: starts on the first frame of the range, written after the last one
 //------------------------------------------------------------------------------
-void MyWindow::onWindowRefresh()
+static void captureFrameBegin()
 {
-  if(!s_pCurRenderer)
-    return;
-
-  if(g_bRefreshCmdBuffers || (g_bRefreshCmdBuffersCounter > 0))
-    resetCommandBuffersPool();
-  AppWindowCameraInertia::onWindowRefresh();
-  if(!s_pCurRenderer->valid())
+  if(s_captureFileName && (s_captureFrame == s_captureFirstFrame))
   {
-    glClearColor(0.5, 0.0, 0.0, 0.0);
-    glClear(GL_COLOR_BUFFER_BIT);
-    m_contextWindowGL.swapBuffers();
-    return;
+    s_pCapture = new DrawCapture;
+    s_pCapture->begin(g_bk3dModels);
   }
-  float dt = (float)m_realtime.getFrameDT();
-  //
-  // Simple camera change for animation
-  //
-  if(s_bCameraAnim)
+  if(s_pCapture)
+    s_pCapture->frame();
+}
+
+static void captureFrameEnd()
+{
+  if(s_pCapture && (s_captureFrame == s_captureLastFrame))
   {
-    if(s_cameraAnimItems == 0)
-    {
-      LOGE("NO Animation loaded (-i <file>)\n");
-      s_bCameraAnim = false;
-    }
+    if(s_pCapture->write(s_captureFileName))
+      LOGI("capture of frames %d to %d written to %s\n", s_captureFirstFrame, s_captureLastFrame, s_captureFileName);
+    delete s_pCapture;
+    s_pCapture        = NULL;
+    s_captureFileName = NULL;
+  }
+  s_captureFrame++;
+}
+
+#ifdef USEWORKERS
+// the next frame gets captured: it can't be recorded ahead, its slices must be in its own records
+static bool captureNextFrame()
+{
+  return s_captureFileName && (s_captureFrame + 1 >= s_captureFirstFrame);
+}
+#endif
+//------------------------------------------------------------------------------
+// records and submits the scene with the current renderer: the frame graph of
+// the workers, or the main thread alone
+//------------------------------------------------------------------------------
+// wall time of the last renderFrame(): recording, consolidation and submission, without
+// the wait for the GPU, the blit, the UI and the swap of the window
+static double s_recordMs = 0.0;
+
+void renderFrame(const InertiaCamera& camera, const glm::mat4& projection, bool bTimingGlitch, bool bRefreshCmdBuffers)
+{
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  s_pCurRenderer->tagGpuFrame(s_frameNumber);
+  captureFrameBegin();
+  // a replay starts without any command-buffer: the first captured frame records them
+  if(s_pCapture && (s_captureFrame == s_captureFirstFrame))
+    bRefreshCmdBuffers = true;
+  glm::mat4 mW(1);
+  // somehow a hack for the CAD models to be back on better scale and orientation
+  if(!g_bk3dModels.empty())
+  {
+    mW = glm::rotate(mW, -glm::radians(90.0f), glm::vec3(1, 0, 0));
+    mW = glm::translate(mW, -g_bk3dModels[0]->m_posOffset);
+    mW = glm::scale(mW, glm::vec3(g_bk3dModels[0]->m_scale));
+  }
+  unsigned short topo = (g_bTopologyLines ? 1 : 0) | (g_bTopologylinestrip ? 2 : 0) | (g_bTopologytriangles ? 4 : 0)
+                        | (g_bTopologytristrips ? 8 : 0) | (g_bTopologytrifans ? 0x10 : 0) | (g_bUnsortedPrims ? 0x20 : 0);
+#ifdef USEWORKERS
+  {
+    PROFILE_SECTION("frame graph");
+    //
+    // without workers, the recording tasks get executed by the main thread in wait()
+    //
+    g_frameGraph->setPool(g_useWorkers ? g_mainThreadPool : NULL);
+    // nodes live in the arena of the graph: no allocation once the arena and this vector reached their size
+    static std::vector<TaskNode*> consolidateNodes;
+    consolidateNodes.clear();
+    if(s_recordingAhead)
+    {
+      // the command-buffers of this frame got recorded while the previous frame was finishing
+      finishRecordingAhead();
+      bRefreshCmdBuffers = false;
+    }
+    if(bRefreshCmdBuffers)
+      resetCommandBuffersPool();
+    TaskNode* displayStartNode =
+        g_frameGraph->createNode<TskDisplayStart>(g_mainThreadQueue, mW, &camera, &projection, bTimingGlitch);
+    TaskNode* displaySceneNode = g_frameGraph->createNode<TskDisplayScene>(g_mainThreadQueue, &camera, &projection, topo);
+    g_frameGraph->addDependency(displayStartNode, displaySceneNode);
+    //
+    // recording of the command-buffers by the workers
+    //
+    if(g_bDisplayObject && bRefreshCmdBuffers)
+    {
+      refreshCmdBuffers(g_frameGraph, consolidateNodes);
+      if(g_bRefreshCmdBuffersCounter > 0)
+        g_bRefreshCmdBuffersCounter--;
+      for(int m = 0; m < consolidateNodes.size(); m++)
+      {
+        g_frameGraph->addDependency(consolidateNodes[m], displaySceneNode);
+      }
+    }
+    g_frameGraph->run(g_mainThreadQueue);
+    // the main thread executes the nodes pinned to it (displayStart, consolidation...) while waiting
+    g_frameGraph->wait();
+    g_frameGraph->clear();
+    samplePoolStats();
+    //
+    // frame submitted: the recording of the next one can overlap what remains of this one
+    //
+    if((g_pipelineDepth > 1) && g_useWorkers && g_bDisplayObject
+       && (g_bRefreshCmdBuffers || (g_bRefreshCmdBuffersCounter > 0)) && !captureNextFrame())
+    {
+      startRecordingAhead();
+      if(g_bRefreshCmdBuffersCounter > 0)
+        g_bRefreshCmdBuffersCounter--;
+    }
+  }
+#else
+  {
+    //
+    // This might initiate a primary command-buffer (in Vulkan renderer)
+    //
+    {
+      if(s_pCapture)
+        s_pCapture->displayStart(mW, camera, projection, bTimingGlitch);
+      s_pCurRenderer->displayStart(mW, camera, projection, bTimingGlitch);
+    }
+    if(g_bDisplayObject)
+    {
+      PROFILE_SECTION("refresh CmdBuffers");
+      if(bRefreshCmdBuffers)
+      {
+        refreshCmdBuffers();
+        if(g_bRefreshCmdBuffersCounter > 0)
+          g_bRefreshCmdBuffersCounter--;
+        for(int m = 0; m < g_bk3dModels.size(); m++)
+        {
+          // set the # of command buffers used to display the model and possibly do some consolidation
+          if(s_pCapture)
+            s_pCapture->consolidate(m, g_numCmdBuffers);
+          s_pCurRenderer->consolidateCmdBuffersModel(g_bk3dModels[m], g_numCmdBuffers);
+        }
+      }
+    }  //if(g_bDisplayObject)
+    //
+    // Grid floor: might append a sub-command to the primary command-buffer
+    //
+    if(g_bDisplayGrid)
+    {
+      if(s_pCapture)
+        s_pCapture->displayGrid(camera, projection);
+      s_pCurRenderer->displayGrid(camera, projection);
+    }
+    //
+    // Display Meshes: might append a sub-commands to the primary command-buffer
+    //
+    if(g_bDisplayObject)
+    {
+      for(int m = 0; m < g_bk3dModels.size(); m++)
+      {
+        if(s_pCapture)
+          s_pCapture->displayModel(m, camera.m4_view, projection, (unsigned char)topo);
+        s_pCurRenderer->displayBk3dModel(g_bk3dModels[m], camera.m4_view, projection, topo);
+      }
+    }
+    //
+    // This might finalize a primary command-buffer (Vulkan) referring to sub-commands (create in display..() )
+    //
+    if(s_pCapture)
+      s_pCapture->displayEnd();
+    s_pCurRenderer->displayEnd();
+  }
+#endif
+  captureFrameEnd();
+  s_recordMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+//------------------------------------------------------------------------------
+// the GPU times the renderer got back since the last call, into s_gpuFrames.
+// bWait: once the GPU is idle, with the frames that were still on it
+//------------------------------------------------------------------------------
+static void collectGpuFrames(bool bWait)
+{
+  if(bWait)
+    s_pCurRenderer->waitForGPUIdle();
+  s_gpuFrames.clear();
+  GpuFrameTime gpuFrame;
+  while(s_pCurRenderer->nextGpuFrame(gpuFrame))
+    s_gpuFrames.push_back(gpuFrame);
+}
+//------------------------------------------------------------------------------
+// -trace: the frames of the window get recorded by NTrace. The GPU gets a track
+// of its own, with the frames as their timestamps give them on the CPU clock.
+// None with the renderers that can't convert their timestamps (OpenGL)
+//------------------------------------------------------------------------------
+static bool traceLastFrame()
+{
+  return s_traceFileName && (s_frameNumber == s_traceLastFrame);
+}
+
+static void traceFrameBegin()
+{
+  if(s_traceFileName && (s_frameNumber == s_traceFirstFrame))
+    NTrace::Start();
+}
+
+// after collectGpuFrames(traceLastFrame()): the last frame of the trace waited for the GPU
+static void traceFrameEnd()
+{
+  if(NTrace::IsRecording())
+  {
+    for(size_t i = 0; i < s_gpuFrames.size(); i++)
+    {
+      const GpuFrameTime& gpuFrame = s_gpuFrames[i];
+      if(!gpuFrame.beginNs || (gpuFrame.frame < s_traceFirstFrame) || (gpuFrame.frame > s_traceLastFrame))
+        continue;
+      NTrace::AddTrackSpan("GPU", "frame", gpuFrame.beginNs, gpuFrame.endNs, "frame", gpuFrame.frame);
+    }
+  }
+  if(traceLastFrame())
+  {
+    NTrace::Stop();
+#ifdef USEWORKERS
+    // the workers may still be adding spans
+    finishRecordingAhead();
+#endif
+    if(NTrace::WriteChromeTrace(s_traceFileName))
+      LOGI("trace of frames %d to %d written to %s\n", s_traceFirstFrame, s_traceLastFrame, s_traceFileName);
+    else
+      LOGE("Couldn't write %s\n", s_traceFileName);
+    NTrace::Clear();
+  }
+}
+//------------------------------------------------------------------------------
+// feeds s_frameTimes at the end of frame s_frameNumber, with the GPU times that
+// came back during it, then goes to the next frame. A hitch keeps what the
+// profiler shows then: averages over the last frames, the hitch only weighs in
+//------------------------------------------------------------------------------
+static bool monitorFrame(double frameMs, double sceneMs)
+{
+  for(size_t i = 0; i < s_gpuFrames.size(); i++)
+    s_frameTimes.addGpuFrame(s_gpuFrames[i]);
+  bool bHitch = s_frameTimes.addFrame(s_frameNumber, (float)frameMs, (float)sceneMs);
+  s_frameNumber++;
+  if(!bHitch)
+    return false;
+  FrameHitch& hitch = s_frameTimes.hitches().back();
+  g_profiler.print(hitch.profilerDump);
+  LOGI("hitch: frame %d took %.2f ms (median %.2f ms, scene CPU %.2f ms)\n", hitch.frame, hitch.frameMs, hitch.medianMs,
+       hitch.sceneMs);
+  return true;
+}
+//------------------------------------------------------------------------------
+// the camera path at the time t, without inertia nor frame-rate dependency:
+// each key of s_cameraAnim is held for its sleep time, then a smooth transition
+// of BENCHMARK_TRANSITION seconds leads to the next key. The path loops
+//------------------------------------------------------------------------------
+static void cameraAnimAt(float t, glm::vec3& eye, glm::vec3& focus)
+{
+  float period = 0.0f;
+  for(int i = 0; i < s_cameraAnimItems; i++)
+    period += s_cameraAnim[i].sleep + BENCHMARK_TRANSITION;
+  t = fmodf(t, period);
+  for(int i = 0; i < s_cameraAnimItems; i++)
+  {
+    const CameraAnim& key  = s_cameraAnim[i];
+    const CameraAnim& next = s_cameraAnim[(i + 1) % s_cameraAnimItems];
+    if(t < key.sleep)
+    {
+      eye   = key.eye;
+      focus = key.focus;
+      return;
+    }
+    t -= key.sleep;
+    if(t < BENCHMARK_TRANSITION)
+    {
+      float a = t / BENCHMARK_TRANSITION;
+      a       = a * a * (3.0f - 2.0f * a);
+      eye     = glm::mix(key.eye, next.eye, a);
+      focus   = glm::mix(key.focus, next.focus, a);
+      return;
+    }
+    t -= BENCHMARK_TRANSITION;
+  }
+  eye   = s_cameraAnim[0].eye;
+  focus = s_cameraAnim[0].focus;
+}
+//
+// the view of a benchmark frame. The renderers only read m4_view and curEyePos
+//
+static void setBenchmarkCamera(InertiaCamera& camera, int frame)
+{
+  glm::vec3 eye, focus;
+  // the path is the one of the submarine: other models (or -a 0) stay on its first viewpoint
+  cameraAnimAt(s_bCameraAnim ? (float)frame * BENCHMARK_DT : 0.0f, eye, focus);
+  camera.curEyePos = eye;
+  camera.m4_view   = glm::lookAt(eye, focus, glm::vec3(0, 1, 0));
+}
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+void MyWindow::onWindowRefresh()
+{
+  if(!s_pCurRenderer)
+    return;
+
+  uint64_t                              allocsFrameStart = getAllocCount();
+  std::chrono::steady_clock::time_point frameStart       = std::chrono::steady_clock::now();
+  bool bRefreshCmdBuffers = g_bRefreshCmdBuffers || (g_bRefreshCmdBuffersCounter > 0);
+#ifndef USEWORKERS
+  if(bRefreshCmdBuffers)
+    resetCommandBuffersPool();
+#endif
+  AppWindowCameraInertia::onWindowRefresh();
+  if(!s_pCurRenderer->valid())
+  {
+    glClearColor(0.5, 0.0, 0.0, 0.0);
+    glClear(GL_COLOR_BUFFER_BIT);
+    m_contextWindowGL.swapBuffers();
+    return;
+  }
+  float dt = (float)m_realtime.getFrameDT();
+  //
+  // Simple camera change for animation
+  //
+  if(s_benchmarkFrame >= 0)
+  {
+    // fixed time-step: the same frames whatever the frame-rate
+    dt = BENCHMARK_DT;
+    setBenchmarkCamera(m_camera, s_benchmarkFrame);
+  }
+  else if(s_bCameraAnim)
+  {
+    if(s_cameraAnimItems == 0)
+    {
+      LOGE("NO Animation loaded (-i <file>)\n");
+      s_bCameraAnim = false;
+    }
     s_cameraAnimIntervals -= dt;
     if((m_camera.eyeD <= 0.01 /*m_camera.epsilon*/) && (m_camera.focusD <= 0.01 /*m_camera.epsilon*/)
        && (s_cameraAnimIntervals <= 0.0))
@@ -893,82 +1627,19 @@ void MyWindow::onWindowRefresh()
   //
   // render the scene
   //
+  double sceneMs = 0.0;
+  traceFrameBegin();
   g_profiler.beginFrame();
   {
     PROFILE_SECTION("frame");
 
-    glm::mat4 mW(1);
-    // somehow a hack for the CAD models to be back on better scale and orientation
-    if(!g_bk3dModels.empty())
-    {
-      mW = glm::rotate(mW, -glm::radians(90.0f), glm::vec3(1, 0, 0));
-      mW = glm::translate(mW, -g_bk3dModels[0]->m_posOffset);
-      mW = glm::scale(mW, glm::vec3(g_bk3dModels[0]->m_scale));
-    }
-    {
-      //
-      // This might initiate a primary command-buffer (in Vulkan renderer)
-      //
-      {
-        s_pCurRenderer->displayStart(mW, m_camera, m_projection, m_timingGlitch);
-      }
-      //
-      // kick a bunch of workers to update the command-buffers
-      // AFTER displayStart: because displayStart alternate the ping-pong index needed below
-      //
-      int totalTasks = 0;
-      if(g_bDisplayObject)
-      {
-        PROFILE_SECTION("refresh CmdBuffers");
-        if(g_bRefreshCmdBuffers || (g_bRefreshCmdBuffersCounter > 0))
-        {
-          totalTasks = refreshCmdBuffers();
-          if(g_bRefreshCmdBuffersCounter > 0)
-            g_bRefreshCmdBuffersCounter--;
-#ifdef USEWORKERS
-          // NOTE: we could do things in the meantime, rather than waiting...
-          waitRefreshCmdBuffersDone(totalTasks);
-#endif
-          for(int m = 0; m < g_bk3dModels.size(); m++)
-          {
-            // set the # of command buffers used to display the model and possibly do some consolidation
-            s_pCurRenderer->consolidateCmdBuffersModel(g_bk3dModels[m], g_numCmdBuffers);
-          }
-        }
-      }  //if(g_bDisplayObject)
-      //
-      // Grid floor: might append a sub-command to the primary command-buffer
-      //
-      if(g_bDisplayGrid)
-      {
-        s_pCurRenderer->displayGrid(m_camera, m_projection);
-      }
-      //
-      // Display Meshes: might append a sub-commands to the primary command-buffer
-      //
-      unsigned short topo = (g_bTopologyLines ? 1 : 0) | (g_bTopologylinestrip ? 2 : 0) | (g_bTopologytriangles ? 4 : 0)
-                            | (g_bTopologytristrips ? 8 : 0) | (g_bTopologytrifans ? 0x10 : 0) | (g_bUnsortedPrims ? 0x20 : 0);
-      if(g_bDisplayObject)
-      {
-        for(int m = 0; m < g_bk3dModels.size(); m++)
-        {
-          //
-          // Then use it
-          //
-          s_pCurRenderer->displayBk3dModel(g_bk3dModels[m], m_camera.m4_view, m_projection, topo);
-        }
-      }
-      //
-      // This might finalize a primary command-buffer (Vulkan) referring to sub-commands (create in display..() )
-      //
-      {
-        s_pCurRenderer->displayEnd();
-      }
-      //
-      // copy FBO to backbuffer
-      //
-      s_pCurRenderer->blitToBackbuffer();
-    }
+    std::chrono::steady_clock::time_point sceneStart = std::chrono::steady_clock::now();
+    renderFrame(m_camera, m_projection, m_timingGlitch, bRefreshCmdBuffers);
+    sceneMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sceneStart).count();
+    //
+    // copy FBO to backbuffer
+    //
+    s_pCurRenderer->blitToBackbuffer();
     if(1 /*useUI*/)
     {
       int width  = getWidth();
@@ -983,8 +1654,178 @@ void MyWindow::onWindowRefresh()
   }  //PROFILE_SECTION("frame");
   m_contextWindowGL.swapBuffers();
   g_profiler.endFrame();
+  collectGpuFrames(traceLastFrame());
+  traceFrameEnd();
+  monitorFrame(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count(), sceneMs);
+  if(getAllocCounting())
+    sampleAllocStats(getAllocCount() - allocsFrameStart);
 }
 //------------------------------------------------------------------------------
+// replaces the current renderer: the models get attached to the new one
+//------------------------------------------------------------------------------
+static void switchRenderer(MyWindow& window, Renderer* renderer)
+{
+#ifdef USEWORKERS
+  finishRecordingAhead();
+#endif
+  s_pCurRenderer->waitForGPUIdle();
+  releaseThreadLocalVars();
+  s_pCurRenderer->terminateGraphics();
+  g_profiler.reset(1);
+  s_pCurRenderer = renderer;
+  s_pCurRenderer->initGraphics(window.getWidth(), window.getHeight(), g_MSAA);
+  initThreadLocalVars();
+  window.onWindowResize(window.getWidth(), window.getHeight());
+  for(int m = 0; m < g_bk3dModels.size(); m++)
+  {
+    s_pCurRenderer->attachModel(g_bk3dModels[m]);
+    s_pCurRenderer->initResourcesModel(g_bk3dModels[m]);
+  }
+  g_bRefreshCmdBuffersCounter = 2;
+}
+//------------------------------------------------------------------------------
+// the sample for the modes of benchmark.cpp, autotune.cpp and capture.cpp: with
+// the window, or headless with the null renderer. Headless, the frames have no
+// window camera: the camera of the path and the projection are built here, once
+//------------------------------------------------------------------------------
+class SampleTarget : public BenchmarkTarget
+{
+public:
+  SampleTarget(MyWindow* pWindow)
+      : m_pWindow(pWindow)
+      , m_camera(s_cameraAnim[0].eye, s_cameraAnim[0].focus)
+      , m_projection(glm::perspective(glm::radians(50.0f), float(HEADLESS_WIDTH) / float(HEADLESS_HEIGHT), 0.01f, 10.0f))
+  {
+    setBenchmarkCamera(m_camera, 0);
+    // headless, every frame records its command-buffers
+    if(!m_pWindow)
+      g_bRefreshCmdBuffers = true;
+  }
+
+  bool      hasWindow() const override { return m_pWindow != NULL; }
+  Renderer* renderer() const override { return s_pCurRenderer; }
+
+  bool switchRenderer(int index) override
+  {
+    if(index < 0)
+      return true;
+    if(!m_pWindow || (index >= g_numRenderers))
+      return false;
+    if(g_renderers[index] != s_pCurRenderer)
+    {
+      s_curRenderer = index;
+      ::switchRenderer(*m_pWindow, g_renderers[index]);
+    }
+    return true;
+  }
+
+  BenchmarkConfig config() const override
+  {
+    BenchmarkConfig config;
+    config.numCmdBuffers     = g_numCmdBuffers;
+    config.refreshCmdBuffers = g_bRefreshCmdBuffers;
+#ifdef USEWORKERS
+    config.useWorkers    = g_useWorkers;
+    config.numThreads    = (int)g_mainThreadPool->getThreadCount();
+    config.pipelineDepth = g_pipelineDepth;
+#else
+    config.useWorkers    = false;
+    config.numThreads    = 1;
+    config.pipelineDepth = 1;
+#endif
+    return config;
+  }
+
+  void setConfig(const BenchmarkConfig& config) override
+  {
+    int numCmdBuffers = std::min(std::max(config.numCmdBuffers, 1), MAXCMDBUFFERS);
+#ifdef USEWORKERS
+    if(config.useWorkers && (config.numThreads > 0) && (config.numThreads != (int)g_mainThreadPool->getThreadCount()))
+      restartThreads(config.numThreads);
+    if((numCmdBuffers != g_numCmdBuffers) || (config.useWorkers != g_useWorkers))
+      destroyCommandBuffers();
+    g_useWorkers    = config.useWorkers;
+    g_pipelineDepth = std::min(std::max(config.pipelineDepth, 1), MAX_PIPELINE_DEPTH);
+#else
+    if(numCmdBuffers != g_numCmdBuffers)
+      destroyCommandBuffers();
+#endif
+    g_numCmdBuffers      = numCmdBuffers;
+    g_bRefreshCmdBuffers = config.refreshCmdBuffers;
+  }
+
+  void destroyCommandBuffers() override
+  {
+    ::destroyCommandBuffers(true);
+    g_bRefreshCmdBuffersCounter = 2;
+  }
+
+  bool renderFrame(int frame) override
+  {
+    if(m_pWindow)
+    {
+      if(!m_pWindow->pollEvents())
+        return false;
+#ifdef USEWORKERS
+      while(g_mainThreadQueue->pollTask())
+      {
+      }
+#endif
+      // onWindowRefresh() puts the camera on the path and feeds s_frameTimes
+      s_benchmarkFrame = frame;
+      m_pWindow->onWindowRefresh();
+      return true;
+    }
+    uint64_t                              allocsFrameStart = getAllocCount();
+    std::chrono::steady_clock::time_point t0               = std::chrono::steady_clock::now();
+    setBenchmarkCamera(m_camera, frame);
+    traceFrameBegin();
+    g_profiler.beginFrame();
+    {
+      PROFILE_SECTION("frame");
+      ::renderFrame(m_camera, m_projection, false, true);
+    }
+    g_profiler.endFrame();
+    collectGpuFrames(traceLastFrame());
+    traceFrameEnd();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    monitorFrame(ms, s_recordMs);
+    if(getAllocCounting())
+      sampleAllocStats(getAllocCount() - allocsFrameStart);
+    return true;
+  }
+
+  void endFrames() override
+  {
+    s_benchmarkFrame = -1;
+#ifdef USEWORKERS
+    finishRecordingAhead();
+#endif
+  }
+
+  double            recordMs() const override { return s_recordMs; }
+  FrameTimeMonitor& frameTimes() override { return s_frameTimes; }
+
+  int                              frameNumber() const override { return s_frameNumber; }
+  const std::vector<GpuFrameTime>& gpuFrames() const override { return s_gpuFrames; }
+  void                             finishGpuFrames() override { collectGpuFrames(true); }
+
+  bool pollEvents() override { return m_pWindow ? m_pWindow->pollEvents() : true; }
+
+  void present() override
+  {
+    if(!m_pWindow)
+      return;
+    s_pCurRenderer->blitToBackbuffer();
+    m_pWindow->m_contextWindowGL.swapBuffers();
+  }
+
+private:
+  MyWindow*     m_pWindow;  // NULL: headless
+  InertiaCamera m_camera;
+  glm::mat4     m_projection;
+};
+//------------------------------------------------------------------------------
 // Main initialization point
 //------------------------------------------------------------------------------
 void readConfigFile(const char* fname)
@@ -1042,33 +1883,35 @@ int main(int argc, const char** argv)
 {
   NVPSystem system(PROJECT_NAME);
 
-  // you can create more than only one
-  static MyWindow myWindow;
-
-  // -------------------------------
-  // Basic OpenGL settings
-  //
-  nvgl::ContextWindowCreateInfo context(4,      //major;
-                                        3,      //minor;
-                                        false,  //core;
-                                        1,      //MSAA;
-                                        24,     //depth bits
-                                        8,      //stencil bits
-                                        false,  //debug;
-                                        false,  //robust;
-                                        false,  //forward;
-                                        false,  //stereo
-                                        NULL    //share;
-  );
-
-  // -------------------------------
-  // Create the window
-  //
-  if(!myWindow.open(0, 0, 1280, 720, "gl_vk_bk3dthreaded", context))
+  // CPU micro-benchmarks: no window nor graphics API needed
+  const char* microbench         = NULL;
+  const char* microbenchOut      = NULL;
+  const char* microbenchBaseline = NULL;
+  for(int i = 1; i < argc - 1; i++)
   {
-    LOGE("Failed to initialize the sample\n");
-    return EXIT_FAILURE;
+    if(strcmp(argv[i], "-microbench") == 0)
+      microbench = argv[i + 1];
+    if(strcmp(argv[i], "-microbenchout") == 0)
+      microbenchOut = argv[i + 1];
+    if(strcmp(argv[i], "-microbenchbaseline") == 0)
+      microbenchBaseline = argv[i + 1];
+    // a synthetic scene as a .bk3d file: then loaded like any model
+    if((strcmp(argv[i], "-synthwrite") == 0) && (i < argc - 2))
+    {
+      SyntheticSceneDesc desc;
+      if(!parseSyntheticDesc(argv[i + 1], desc))
+      {
+        LOGE("Wrong synthetic scene %s\n", argv[i + 1]);
+        return EXIT_FAILURE;
+      }
+      return writeSyntheticScene(desc, argv[i + 2]) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
   }
+  if(microbench)
+    return runMicroBenchmarks(microbench, microbenchOut, microbenchBaseline);
+
+  // you can create more than only one
+  static MyWindow myWindow;
 
   // -------------------------------
   // Parse arguments/options
@@ -1084,6 +1927,100 @@ int main(int argc, const char** argv)
     }
     if(strlen(argv[i]) <= 1)
       continue;
+    // -benchmark, -headless, -autotune, -replay...
+    if(parseBenchmarkArg(argc, argv, i))
+      continue;
+#ifdef USEWORKERS
+    if((strcmp(argv[i], "-threads") == 0) && (i < argc - 1))
+    {
+      g_numThreads = atoi(argv[++i]);
+      LOGI("g_numThreads set to %d\n", g_numThreads);
+      continue;
+    }
+    if((strcmp(argv[i], "-poolstats") == 0) && (i < argc - 1))
+    {
+      s_poolStatsFileName = argv[++i];
+      LOGI("worker counters written to %s\n", s_poolStatsFileName);
+      continue;
+    }
+    if((strcmp(argv[i], "-pipeline") == 0) && (i < argc - 1))
+    {
+      g_pipelineDepth = std::min(std::max(atoi(argv[++i]), 1), MAX_PIPELINE_DEPTH);
+      LOGI("g_pipelineDepth set to %d\n", g_pipelineDepth);
+      continue;
+    }
+    if((strcmp(argv[i], "-affinity") == 0) && (i < argc - 1))
+    {
+      if(!parseAffinity(argv[++i]))
+        LOGE("Wrong affinity %s\n", argv[i]);
+      continue;
+    }
+    if((strcmp(argv[i], "-workers") == 0) && (i < argc - 1))
+    {
+      g_useWorkers = atoi(argv[++i]) ? true : false;
+      LOGI("g_useWorkers set to %s\n", g_useWorkers ? "true" : "false");
+      continue;
+    }
+#endif
+    if((strcmp(argv[i], "-synthetic") == 0) && (i < argc - 1))
+    {
+      std::string name = std::string(SYNTH_PREFIX) + argv[++i];
+      LOGI("Load Model set to %s\n", name.c_str());
+      g_bk3dModels.push_back(new Bk3dModel(name.c_str()));
+      continue;
+    }
+    if((strcmp(argv[i], "-trace") == 0) && (i < argc - 1))
+    {
+      s_traceFileName = argv[++i];
+      continue;
+    }
+    if((strcmp(argv[i], "-capture") == 0) && (i < argc - 1))
+    {
+      s_captureFileName = argv[++i];
+      continue;
+    }
+    if((strcmp(argv[i], "-captureframes") == 0) && (i < argc - 1))
+    {
+      if((sscanf(argv[++i], "%d-%d", &s_captureFirstFrame, &s_captureLastFrame) != 2) || (s_captureLastFrame < s_captureFirstFrame))
+      {
+        LOGE("Wrong frame range %s\n", argv[i]);
+        s_captureLastFrame = s_captureFirstFrame;
+      }
+      continue;
+    }
+    if((strcmp(argv[i], "-traceframes") == 0) && (i < argc - 1))
+    {
+      if((sscanf(argv[++i], "%d-%d", &s_traceFirstFrame, &s_traceLastFrame) != 2) || (s_traceLastFrame < s_traceFirstFrame))
+      {
+        LOGE("Wrong frame range %s\n", argv[i]);
+        s_traceLastFrame = s_traceFirstFrame;
+      }
+      continue;
+    }
+    if(strcmp(argv[i], "-countallocs") == 0)
+    {
+      setAllocCounting(true);
+      LOGI("counting the heap allocations of each frame\n");
+      continue;
+    }
+    if((strcmp(argv[i], "-tokenopt") == 0) && (i < argc - 1))
+    {
+      g_bOptimizeTokens = atoi(argv[++i]) ? true : false;
+      LOGI("g_bOptimizeTokens set to %s\n", g_bOptimizeTokens ? "true" : "false");
+      continue;
+    }
+    if((strcmp(argv[i], "-zerocopy") == 0) && (i < argc - 1))
+    {
+      g_bZeroCopyTokens = atoi(argv[++i]) ? true : false;
+      LOGI("g_bZeroCopyTokens set to %s\n", g_bZeroCopyTokens ? "true" : "false");
+      continue;
+    }
+    if((strcmp(argv[i], "-numa") == 0) && (i < argc - 1))
+    {
+      g_numaLocalThreadData = atoi(argv[++i]) ? true : false;
+      LOGI("g_numaLocalThreadData set to %s\n", g_numaLocalThreadData ? "true" : "false");
+      continue;
+    }
     switch(argv[i][1])
     {
       case 'm':
@@ -1130,8 +2067,56 @@ int main(int argc, const char** argv)
         break;
     }
   }
-  Renderer* renderer = g_renderers[s_curRenderer];
-  if(renderer->initGraphics(myWindow.getWidth(), myWindow.getHeight(), g_MSAA) == false)
+  finishBenchmarkArgs();
+  const BenchmarkOptions& benchOptions = g_benchOptions;
+  DrawCapture             replay;
+  if(benchOptions.replayFileName)
+  {
+    if(!replay.read(benchOptions.replayFileName))
+      return EXIT_FAILURE;
+    // the models of the capture, unless the command-line gives some
+    if(g_bk3dModels.empty())
+    {
+      for(int m = 0; m < replay.models().size(); m++)
+      {
+        const CaptureModel& model = replay.models()[m];
+        glm::vec3           pos   = glm::make_vec3(model.posOffset);
+        float               scale = model.scale;
+        g_bk3dModels.push_back(new Bk3dModel(model.name.c_str(), &pos, &scale));
+      }
+    }
+  }
+  bool bHeadless = (benchOptions.headlessFrames > 0);
+  if(!bHeadless)
+  {
+    // -------------------------------
+    // Basic OpenGL settings
+    //
+    nvgl::ContextWindowCreateInfo context(4,      //major;
+                                          3,      //minor;
+                                          false,  //core;
+                                          1,      //MSAA;
+                                          24,     //depth bits
+                                          8,      //stencil bits
+                                          false,  //debug;
+                                          false,  //robust;
+                                          false,  //forward;
+                                          false,  //stereo
+                                          NULL    //share;
+    );
+
+    // -------------------------------
+    // Create the window
+    //
+    if(!myWindow.open(0, 0, 1280, 720, "gl_vk_bk3dthreaded", context))
+    {
+      LOGE("Failed to initialize the sample\n");
+      return EXIT_FAILURE;
+    }
+  }
+  Renderer* renderer = bHeadless ? g_nullRenderer : g_renderers[s_curRenderer];
+  if(renderer->initGraphics(bHeadless ? HEADLESS_WIDTH : myWindow.getWidth(), bHeadless ? HEADLESS_HEIGHT : myWindow.getHeight(), g_MSAA)
+     == false)
     return 1;
 
   s_pCurRenderer = renderer;
@@ -1154,6 +2139,13 @@ int main(int argc, const char** argv)
     // if the model is NOT the submarine, let's cancel the dedicated animation
     s_bCameraAnim = false;
   }
+// -------------------------------
+// Initialize what is needed for Multithreading
+// the pool is already used by the loading of the models
+//
+#ifdef USEWORKERS
+  initThreads();
+#endif
   for(int m = 0; m < g_bk3dModels.size(); m++)
   {
     if(g_bk3dModels[m]->loadModel() == false)
@@ -1163,24 +2155,39 @@ int main(int argc, const char** argv)
     s_pCurRenderer->initResourcesModel(g_bk3dModels[m]);
   }
 
-// -------------------------------
-// Initialize what is needed for Multithreading
-//
 #ifdef USEWORKERS
-  initThreads();
   // the current renderer will store things local to each thread (in TLS):
   initThreadLocalVars();
 #endif
-  myWindow.m_contextWindowGL.makeContextCurrent();
-  myWindow.m_contextWindowGL.swapInterval(0);
-  //
-  // reshape will setup the first windows size and related stuff: main command-buffer, for example
-  //
-  myWindow.onWindowResize();
+  SampleTarget target(bHeadless ? NULL : &myWindow);
+  bool         bExit = bHeadless;
+  if(!bHeadless)
+  {
+    myWindow.m_contextWindowGL.makeContextCurrent();
+    myWindow.m_contextWindowGL.swapInterval(0);
+    //
+    // reshape will setup the first windows size and related stuff: main command-buffer, for example
+    //
+    myWindow.onWindowResize();
+  }
+  if(benchOptions.replayFileName)
+  {
+    if(replay.matchesModels(g_bk3dModels))
+      runReplay(target, replay, benchOptions.replayLoops);
+    else
+      LOGE("the models don't match the slices of %s\n", benchOptions.replayFileName);
+    bExit = true;
+  }
+  else
+  {
+    applyTuning(target);
+    if(runBenchmarkModes(target))
+      bExit = true;
+  }
   // -------------------------------
   // Message pump loop
   //
-  while(myWindow.pollEvents())
+  while(!bExit && myWindow.pollEvents())
   {
 #ifdef USEWORKERS
     // manage possible tasks, queued for this main thread
@@ -1210,25 +2217,16 @@ int main(int argc, const char** argv)
 #endif
     if(myWindow.m_guiRegistry.checkValueChange(COMBO_RENDERER))
     {
-      s_pCurRenderer->waitForGPUIdle();
-      releaseThreadLocalVars();
-      s_pCurRenderer->terminateGraphics();
-      g_profiler.reset(1);
-      s_pCurRenderer = g_renderers[s_curRenderer];  // s_curRenderer setup by ImGui
-      s_pCurRenderer->initGraphics(myWindow.getWidth(), myWindow.getHeight(), g_MSAA);
-      initThreadLocalVars();
-      myWindow.onWindowResize(myWindow.getWidth(), myWindow.getHeight());
-      for(int m = 0; m < g_bk3dModels.size(); m++)
-      {
-        s_pCurRenderer->attachModel(g_bk3dModels[m]);
-        s_pCurRenderer->initResourcesModel(g_bk3dModels[m]);
-      }
-      g_bRefreshCmdBuffersCounter = 2;
+      switchRenderer(myWindow, g_renderers[s_curRenderer]);  // s_curRenderer setup by ImGui
+      applyTuning(target);
     }
     if(myWindow.m_guiRegistry.checkValueChange(COMBO_MSAA))
     {
       //g_MSAA setup by ImGui
       // involves some changes at the source of initialization... re-create all
+#ifdef USEWORKERS
+      finishRecordingAhead();
+#endif
       s_pCurRenderer->waitForGPUIdle();
       releaseThreadLocalVars();
       s_pCurRenderer->terminateGraphics();
@@ -1260,7 +2258,9 @@ int main(int argc, const char** argv)
      // -------------------------------
      // Terminate
      //
-
+#ifdef USEWORKERS
+  finishRecordingAhead();
+#endif
   releaseThreadLocalVars();
   s_pCurRenderer->terminateGraphics();
 
@@ -1279,6 +2279,7 @@ int main(int argc, const char** argv)
   terminateThreads();
 #endif
 
-  myWindow.m_contextWindowGL.deinit();
+  if(!bHeadless)
+    myWindow.m_contextWindowGL.deinit();
   return EXIT_SUCCESS;
 }
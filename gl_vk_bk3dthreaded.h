@@ -34,17 +34,22 @@ using namespace glm;
 #include "GLSLShader.h"
 #include "gl_nv_command_list.h"
 #include <nvh/profiler.hpp>
+// after the profiler: NXPROFILEFUNC feeds NTrace when NSight markers aren't available
+#include "mt/CThread.h"
 
 #include <nvh/appwindowcamerainertia.hpp>
 
 #include "helper_fbo.h"
+#include "frametimes.h"
 
 #ifdef NVP_SUPPORTS_GZLIB
 #include "zlib.h"
 #endif
 #include "bk3dEx.h"  // a baked binary format for few models
 
-#define PROFILE_SECTION(name) nvh::Profiler::Section _tempTimer(g_profiler, name)
+#define PROFILE_SECTION(name)                                                                                         \
+  nvh::Profiler::Section _tempTimer(g_profiler, name);                                                                 \
+  NTraceScope            _tempTrace(name)
 
 //
 // For the case where we work with Descriptor Sets (Vulkan)
@@ -114,6 +119,10 @@ extern bool   g_bDisplayGrid;
 
 extern MatrixBufferGlobal g_globalMatrices;
 
+extern bool g_numaLocalThreadData;  // per-thread data allocated on the NUMA node of its thread
+extern bool g_bOptimizeTokens;      // peephole pass on the token streams of the command-list renderer
+extern bool g_bZeroCopyTokens;      // command-list renderer: slices written straight into a mapped token buffer
+
 //------------------------------------------------------------------------------
 class Bk3dModel;
 //------------------------------------------------------------------------------
@@ -140,6 +149,9 @@ public:
   virtual bool initResourcesModel(Bk3dModel* pModel) = 0;
 
   virtual bool buildPrimaryCmdBuffer() = 0;
+  // called on the main thread before the slices of a model get recorded: slice i
+  // contains the meshes sliceStarts[i] to sliceStarts[i+1]-1
+  virtual void prepareCmdBuffersModel(Bk3dModel* pModelcmd, int numSlices, const int* sliceStarts) {}
   // bufIdx: index of cmdBuffer to create, containing mesh mstart to mend-1 (for testing concurrent cmd buffer creation)
   virtual bool buildCmdBufferModel(Bk3dModel* pModelcmd, int bufIdx = 0, int mstart = 0, int mend = -1) = 0;
   virtual void consolidateCmdBuffersModel(Bk3dModel* pModelcmd, int numCmdBuffers)                      = 0;
@@ -158,9 +170,17 @@ public:
   virtual void updateViewport(GLint x, GLint y, GLsizei width, GLsizei height) = 0;
 
   virtual bool bFlipViewport() { return false; }
+
+  // GPU time of the frames, for the renderers writing timestamps of their own (Vulkan).
+  // tagGpuFrame(): number of the frame recorded next, before its displayStart().
+  // nextGpuFrame(): the oldest frame the GPU finished and that wasn't returned yet,
+  // false when there is none or the renderer has no such timestamps
+  virtual void tagGpuFrame(int frame) {}
+  virtual bool nextGpuFrame(GpuFrameTime& gpuFrame) { return false; }
 };
 extern Renderer* g_renderers[10];
 extern int       g_numRenderers;
+extern Renderer* g_nullRenderer;  // no graphics API, for -headless. Not in g_renderers
 
 //------------------------------------------------------------------------------
 // Class for Object (made of 1 to N meshes)
@@ -175,12 +195,26 @@ public:
   vec3        m_posOffset;
   float       m_scale;
   std::string m_name;
+  //
+  // what the last frame recorded. Each renderer counts what it issues: GL calls for the
+  // standard one, tokens for the command-list one, commands of all the secondary
+  // command-buffers for Vulkan (the full one and the ones split per topology)
+  //
   struct Stats
   {
     unsigned int primitives;
     unsigned int drawcalls;
-    unsigned int attr_update;
-    unsigned int uniform_update;
+    unsigned int attr_update;        // vertex attributes or vertex buffers of the meshes
+    unsigned int uniform_update;     // transforms and materials of the meshes
+    unsigned int state_binds;        // programs, state objects or pipelines
+    unsigned int buffer_binds;       // vertex and index buffers, or their addresses
+    unsigned int descriptor_binds;   // uniform buffer bindings or addresses, descriptor sets
+    unsigned int tokens;             // GL calls, tokens or Vulkan commands
+    unsigned int bytes_recorded;     // size of the slices, when the renderer owns their memory
+    unsigned int token_bytes;        // command-list renderer: size of the consolidated token stream
+    unsigned int token_bytes_saved;  // what the peephole pass removed from it
+
+    void add(const Stats& s);
   };
 
   MatrixBufferObject* m_objectMatrices;
@@ -190,6 +224,7 @@ public:
   int             m_materialNItems;
 
   bk3d::FileHeader* m_meshFile;
+  void*             m_meshBufferMemory;  // buffer area of a loaded file. Part of m_meshFile for a synthetic scene
 
   Stats m_stats;
 
@@ -205,6 +240,24 @@ public:
 
 extern std::vector<Bk3dModel*> g_bk3dModels;
 
+// primitives drawn by indexCount vertices of a GL topology
+inline unsigned int primitiveCount(GLenum topologyGL, unsigned int indexCount)
+{
+  switch(topologyGL)
+  {
+    case GL_LINES:
+      return indexCount / 2;
+    case GL_LINE_STRIP:
+      return indexCount > 0 ? indexCount - 1 : 0;
+    case GL_TRIANGLES:
+      return indexCount / 3;
+    case GL_TRIANGLE_STRIP:
+    case GL_TRIANGLE_FAN:
+      return indexCount > 2 ? indexCount - 2 : 0;
+  }
+  return 0;
+}
+
 #define FOREACHMODEL(cmd)                                                                                              \
   {                                                                                                                    \
     for(int m = 0; m < g_bk3dModels.size(); m++)                                                                       \
@@ -0,0 +1,1354 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <string>
+
+#define EXTERNSVCUI
+#define WINDOWINERTIACAMERA_EXTERN
+#define EMUCMDLIST_EXTERN
+#include "gl_vk_bk3dthreaded.h"
+#include "mt/CThreadWork.h"
+#include "nvh/nvprint.hpp"
+#include "microbench.h"
+#include "allocstats.h"
+#include "gl_nv_command_tokens.h"
+#include "bk3dEx.h"
+#include "bk3dbounds.h"
+#include "synthscene.h"
+
+typedef std::chrono::high_resolution_clock BenchClock;
+
+static inline double usSince(const BenchClock::time_point& t0, const BenchClock::time_point& t1)
+{
+  return std::chrono::duration<double, std::micro>(t1 - t0).count();
+}
+
+//------------------------------------------------------------------------------
+// Results, in the JSON layout of Google Benchmark (-microbenchout <file>): one
+// entry per kernel and variant, times per iteration. The variants of a kernel share
+// the prefix of their name up to the first '/', the first one being the reference
+// the others get compared with (compareBaseline())
+//------------------------------------------------------------------------------
+struct MicroBenchResult
+{
+  std::string name;
+  long long   iterations;
+  double      realNs;
+  double      cpuNs;
+  double      itemsPerSecond;  // 0 when the kernel has no items
+  double      bytesPerSecond;  // 0 when the kernel has no bytes
+};
+static std::vector<MicroBenchResult> s_results;
+
+// wall and process CPU time of the measured sections only: start()/stop() around
+// each of them. clock() is the wall time on Windows
+class BenchTimer
+{
+public:
+  BenchTimer()
+      : m_realUs(0)
+      , m_cpuUs(0)
+  {
+  }
+  void start()
+  {
+    m_t0 = BenchClock::now();
+    m_c0 = clock();
+  }
+  void stop()
+  {
+    m_realUs += usSince(m_t0, BenchClock::now());
+    m_cpuUs += double(clock() - m_c0) * 1000000.0 / double(CLOCKS_PER_SEC);
+  }
+  double realUs() const { return m_realUs; }
+  double cpuUs() const { return m_cpuUs; }
+
+private:
+  BenchClock::time_point m_t0;
+  clock_t                m_c0;
+  double                 m_realUs;
+  double                 m_cpuUs;
+};
+
+// items and bytes: per iteration. When a kernel runs several times (MICROBENCH_REPETITIONS),
+// the fastest run of each variant is kept
+static void addResult(const std::string& name, const BenchTimer& timer, long long iterations, double items, double bytes)
+{
+  MicroBenchResult r;
+  double           us = timer.realUs() > 0.0 ? timer.realUs() : 1e-3;
+  r.name              = name;
+  r.iterations        = iterations;
+  r.realNs            = timer.realUs() * 1000.0 / double(iterations);
+  r.cpuNs             = timer.cpuUs() * 1000.0 / double(iterations);
+  r.itemsPerSecond    = items * double(iterations) * 1000000.0 / us;
+  r.bytesPerSecond    = bytes * double(iterations) * 1000000.0 / us;
+  LOGI("%-40s %14.1f %14.1f %10lld %14.3g\n", r.name.c_str(), r.realNs, r.cpuNs, r.iterations, r.itemsPerSecond);
+  for(size_t i = 0; i < s_results.size(); i++)
+  {
+    if(s_results[i].name == name)
+    {
+      if(r.realNs < s_results[i].realNs)
+        s_results[i] = r;
+      return;
+    }
+  }
+  s_results.push_back(r);
+}
+
+static void logResultHeader()
+{
+  LOGI("%-40s %14s %14s %10s %14s\n", "benchmark", "real ns", "cpu ns", "iterations", "items/s");
+}
+
+//------------------------------------------------------------------------------
+// Submit-to-start latency
+//------------------------------------------------------------------------------
+class TskLatencyProbe : public TaskBase
+{
+public:
+  BenchClock::time_point m_start;
+  NInterlockedValue*     m_remaining;
+  CEvent*                m_doneEvent;
+  void                   Invoke() { m_start = BenchClock::now(); }
+  // the probes live in a vector of the benchmark: no delete
+  void Done()
+  {
+#ifdef WIN32
+    if(InterlockedDecrement(m_remaining) == 0)
+#else
+    if(__sync_sub_and_fetch(m_remaining, 1) == 0)
+#endif
+      m_doneEvent->Set();
+  }
+};
+
+struct LatencyResult
+{
+  double submit;  // time spent in the submission call(s)
+  double first;   // submission to the start of the first task
+  double avg;     // submission to the start of the tasks, averaged
+  double last;    // submission to the start of the last task
+};
+
+static LatencyResult measureSubmitLatency(ThreadWorkerPool* pool, int numTasks, bool batched, int iterations)
+{
+  std::vector<TskLatencyProbe> probes(numTasks);
+  std::vector<TaskBase*>       tasks(numTasks);
+  NInterlockedValue            remaining;
+  CEvent                       doneEvent;
+  LatencyResult                res = {0, 0, 0, 0};
+  for(int i = 0; i < numTasks; i++)
+  {
+    probes[i].m_remaining = &remaining;
+    probes[i].m_doneEvent = &doneEvent;
+    tasks[i]              = &probes[i];
+  }
+  for(int it = 0; it < iterations; it++)
+  {
+    remaining = numTasks;
+    BenchClock::time_point t0 = BenchClock::now();
+    if(batched)
+      pool->pushTasks(&tasks[0], numTasks);
+    else
+    {
+      for(int i = 0; i < numTasks; i++)
+        pool->pushTask(tasks[i]);
+    }
+    BenchClock::time_point t1 = BenchClock::now();
+    doneEvent.WaitOnEvent();
+
+    double first = 1e30, last = 0, sum = 0;
+    for(int i = 0; i < numTasks; i++)
+    {
+      double us = usSince(t0, probes[i].m_start);
+      first     = us < first ? us : first;
+      last      = us > last ? us : last;
+      sum += us;
+    }
+    res.submit += usSince(t0, t1);
+    res.first += first;
+    res.last += last;
+    res.avg += sum / (double)numTasks;
+  }
+  res.submit /= (double)iterations;
+  res.first /= (double)iterations;
+  res.avg /= (double)iterations;
+  res.last /= (double)iterations;
+  return res;
+}
+
+bool benchTaskSubmitLatency()
+{
+  const int                   numThreads  = 8;
+  const int                   iterations  = 100;
+  const int                   taskCounts[] = {8, 64, 256};
+  const char*                 schedNames[] = {"least-queued", "round-robin", "shared-queue"};
+  NWORKER_THREADPOOL_SCHEDULE scheds[]     = {NWTPS_LEAST_QUEUED_TASKS, NWTPS_ROUND_ROBIN, NWTPS_SHARED_QUEUE};
+  LOGI("task submit-to-start latency: %d workers, %d iterations (us)\n", numThreads, iterations);
+  LOGI("%-13s %5s %-8s %8s %8s %8s %8s\n", "schedule", "tasks", "mode", "submit", "first", "avg", "last");
+  for(int s = 0; s < 3; s++)
+  {
+    ThreadWorkerPool pool(numThreads, false, false, scheds[s], std::string("bench"));
+    for(int c = 0; c < 3; c++)
+    {
+      for(int batched = 0; batched < 2; batched++)
+      {
+        LatencyResult r = measureSubmitLatency(&pool, taskCounts[c], batched != 0, iterations);
+        LOGI("%-13s %5d %-8s %8.2f %8.2f %8.2f %8.2f\n", schedNames[s], taskCounts[c], batched ? "batched" : "single",
+             r.submit, r.first, r.avg, r.last);
+      }
+    }
+    pool.FlushTasks();
+  }
+  return true;
+}
+
+#ifdef LINUX
+//------------------------------------------------------------------------------
+// Wake latency of CEvent/CSemaphore: futex versus pthread implementation
+//------------------------------------------------------------------------------
+static void busyWait(double us)
+{
+  BenchClock::time_point t0 = BenchClock::now();
+  while(usSince(t0, BenchClock::now()) < us)
+  {
+  }
+}
+
+// the worker answers each ping with a pong: measures hot handoffs (spinning helps)
+// or, with a delay before each ping, the wake-up of a sleeping thread
+class TskPingPong : public TaskBase
+{
+public:
+  CEvent*                             m_ping;
+  CEvent*                             m_pong;
+  CSemaphore*                         m_semPing;
+  std::vector<BenchClock::time_point> m_wakeTimes;
+  void                                Invoke()
+  {
+    for(size_t i = 0; i < m_wakeTimes.size(); i++)
+    {
+      if(m_semPing)
+        m_semPing->AcquireSemaphore();
+      else
+        m_ping->WaitOnEvent();
+      m_wakeTimes[i] = BenchClock::now();
+      m_pong->Set();
+    }
+  }
+  void Done() {}
+};
+
+struct WakeResult
+{
+  double roundTrip;  // hot ping-pong, per round trip
+  double coldWake;   // Set()/Release() to the return of the sleeping waiter
+};
+
+static WakeResult measureWakeLatency(ThreadWorkerPool* pool, bool futex, bool semaphore, int iterations)
+{
+  WakeResult res = {0, 0};
+  bool       old = GetUseFutexSync();
+  SetUseFutexSync(futex);
+  {
+    CEvent      ping, pong;
+    CSemaphore  semPing(0);
+    TskPingPong tsk;
+    tsk.m_ping    = &ping;
+    tsk.m_pong    = &pong;
+    tsk.m_semPing = semaphore ? &semPing : NULL;
+    // hot
+    tsk.m_wakeTimes.resize(iterations);
+    pool->pushTask(&tsk);
+    BenchClock::time_point t0 = BenchClock::now();
+    for(int i = 0; i < iterations; i++)
+    {
+      if(semaphore)
+        semPing.ReleaseSemaphore();
+      else
+        ping.Set();
+      pong.WaitOnEvent();
+    }
+    res.roundTrip = usSince(t0, BenchClock::now()) / (double)iterations;
+    // cold: leave enough time for the waiter to stop spinning and sleep
+    const int coldIterations = iterations / 10 > 10 ? iterations / 10 : 10;
+    tsk.m_wakeTimes.resize(coldIterations);
+    pool->pushTask(&tsk);
+    for(int i = 0; i < coldIterations; i++)
+    {
+      busyWait(500.0);
+      BenchClock::time_point t1 = BenchClock::now();
+      if(semaphore)
+        semPing.ReleaseSemaphore();
+      else
+        ping.Set();
+      pong.WaitOnEvent();
+      res.coldWake += usSince(t1, tsk.m_wakeTimes[i]);
+    }
+    res.coldWake /= (double)coldIterations;
+  }
+  SetUseFutexSync(old);
+  return res;
+}
+
+bool benchWakeLatency()
+{
+  const int        iterations = 20000;
+  ThreadWorkerPool pool(1, false, false, NWTPS_ROUND_ROBIN, std::string("bench"));
+  LOGI("wake latency, %d hot round trips (us)\n", iterations);
+  LOGI("%-10s %-8s %10s %10s\n", "primitive", "impl", "roundtrip", "cold wake");
+  for(int sem = 0; sem < 2; sem++)
+  {
+    for(int futex = 0; futex < 2; futex++)
+    {
+      WakeResult r = measureWakeLatency(&pool, futex != 0, sem != 0, iterations);
+      LOGI("%-10s %-8s %10.2f %10.2f\n", sem ? "CSemaphore" : "CEvent", futex ? "futex" : "pthread", r.roundTrip, r.coldWake);
+    }
+  }
+  return true;
+}
+#endif
+
+//------------------------------------------------------------------------------
+// Thread-local access cost
+//------------------------------------------------------------------------------
+#ifdef WIN32
+#define BENCH_NOINLINE __declspec(noinline)
+#else
+#define BENCH_NOINLINE __attribute__((noinline))
+#endif
+
+struct TlsPayload
+{
+  int value;
+};
+
+static NThreadLocalVar<TlsPayload*>   s_tlsKeyVar;
+static NThreadContextVar<TlsPayload*> s_tlsContextVar;
+static thread_local TlsPayload*       s_tlsRaw;
+static TlsPayload*                    s_tlsGlobal;
+
+// one access per call, like feedCmdBuffer() reading m_perThreadData: the lookup
+// can't get hoisted out of the benchmark loop
+static BENCH_NOINLINE int readTlsKey()
+{
+  return s_tlsKeyVar->value;
+}
+static BENCH_NOINLINE int readTlsContext()
+{
+  return s_tlsContextVar->value;
+}
+static BENCH_NOINLINE int readTlsRaw()
+{
+  return s_tlsRaw->value;
+}
+static BENCH_NOINLINE int readGlobal()
+{
+  return s_tlsGlobal->value;
+}
+
+static double measureTlsAccess(int (*read)(), int iterations, int* sink)
+{
+  int                    sum = 0;
+  BenchClock::time_point t0  = BenchClock::now();
+  for(int i = 0; i < iterations; i++)
+    sum += read();
+  BenchClock::time_point t1 = BenchClock::now();
+  *sink += sum;
+  return usSince(t0, t1) * 1000.0 / (double)iterations;
+}
+
+bool benchTlsAccess()
+{
+  const int  iterations = 20000000;
+  TlsPayload payload    = {1};
+  s_tlsKeyVar           = &payload;
+  s_tlsContextVar       = &payload;
+  s_tlsRaw              = &payload;
+  s_tlsGlobal           = &payload;
+  struct
+  {
+    const char* name;
+    int (*read)();
+  } variants[] = {
+      {"global (no TLS)", readGlobal},
+      {"thread_local", readTlsRaw},
+      {"NThreadContextVar", readTlsContext},
+      {"NThreadLocalVar", readTlsKey},
+  };
+  int sink = 0;
+  LOGI("thread-local pointer read, %d calls (ns per access)\n", iterations);
+  for(int v = 0; v < (int)(sizeof(variants) / sizeof(variants[0])); v++)
+  {
+    measureTlsAccess(variants[v].read, iterations / 10, &sink);  // warm-up
+    double ns = measureTlsAccess(variants[v].read, iterations, &sink);
+    LOGI("%-20s %8.3f\n", variants[v].name, ns);
+  }
+  s_tlsKeyVar     = NULL;
+  s_tlsContextVar = NULL;
+  if(sink != iterations * 4 + (iterations / 10) * 4)
+  {
+    LOGE("tls_access: unexpected checksum\n");
+    return false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Frame-temporary containers: heap versus scratch arena of the worker
+//------------------------------------------------------------------------------
+template<typename IntVector>
+class TskScratchSlice : public TaskNode
+{
+public:
+  int m_numItems;
+  int m_checksum;
+  TskScratchSlice(int numItems)
+      : m_numItems(numItems)
+      , m_checksum(0)
+  {
+  }
+  // what buildCmdBuffer() does with its offsets: grows a vector item after item
+  void Invoke()
+  {
+    IntVector offsets;
+    for(int i = 0; i < m_numItems; i++)
+      offsets.push_back(i * 16);
+    m_checksum = offsets.back();
+  }
+};
+
+struct ScratchResult
+{
+  double usPerFrame;
+  double allocsPerFrame;
+};
+
+template<typename IntVector>
+static ScratchResult measureScratchFrames(TaskGraph* graph, int numSlices, int numItems, int frames)
+{
+  ScratchResult res = {0, 0};
+  for(int f = -10; f < frames; f++)  // 10 frames to reach the steady state
+  {
+    uint64_t               allocs0 = getAllocCount();
+    BenchClock::time_point t0      = BenchClock::now();
+    BeginScratchFrame();
+    for(int i = 0; i < numSlices; i++)
+      graph->createNode<TskScratchSlice<IntVector> >(NULL, numItems);
+    graph->run();
+    graph->wait();
+    graph->clear();
+    if(f >= 0)
+    {
+      res.usPerFrame += usSince(t0, BenchClock::now());
+      res.allocsPerFrame += double(getAllocCount() - allocs0);
+    }
+  }
+  res.usPerFrame /= (double)frames;
+  res.allocsPerFrame /= (double)frames;
+  return res;
+}
+
+bool benchScratchAlloc()
+{
+  const int        numThreads = 4;
+  const int        numSlices  = 64;
+  const int        numItems   = 1000;
+  const int        frames     = 200;
+  ThreadWorkerPool pool(numThreads, false, false, NWTPS_ROUND_ROBIN, std::string("bench"));
+  TaskGraph        graph(&pool);
+  bool             counting = getAllocCounting();
+  setAllocCounting(true);
+  ScratchResult heap    = measureScratchFrames<std::vector<int> >(&graph, numSlices, numItems, frames);
+  ScratchResult scratch = measureScratchFrames<ScratchVector<int> >(&graph, numSlices, numItems, frames);
+  setAllocCounting(counting);
+  LOGI("%d slices of %d push_back per frame, %d workers, %d frames\n", numSlices, numItems, numThreads, frames);
+  LOGI("%-16s %10s %14s\n", "container", "us/frame", "allocs/frame");
+  LOGI("%-16s %10.2f %14.1f\n", "std::vector", heap.usPerFrame, heap.allocsPerFrame);
+  LOGI("%-16s %10.2f %14.1f\n", "ScratchVector", scratch.usPerFrame, scratch.allocsPerFrame);
+  if(scratch.allocsPerFrame != 0.0)
+  {
+    LOGE("scratch_alloc: steady-state frames still allocate\n");
+    return false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// NV_command_list token streams, built the way buildCmdBuffer() does
+//------------------------------------------------------------------------------
+#define TOKENBENCH_ATTRIBS 3
+#define TOKENBENCH_PRIMGROUPS 2
+#define TOKENBENCH_TOKENS_PER_MESH (1 + TOKENBENCH_ATTRIBS + TOKENBENCH_PRIMGROUPS * 3)
+
+// what the build*Command() helpers did: a string per token, appended
+template<typename T>
+static std::string tokenAsString(const T& t)
+{
+  std::string cmd;
+  cmd = std::string((const char*)&t, sizeof(T));
+  return cmd;
+}
+
+static size_t buildTokensString(std::string& stream, int numMeshes)
+{
+  stream.clear();
+  for(int m = 0; m < numMeshes; m++)
+  {
+    Token_UniformAddress transform;
+    transform.cmd.index = 1;
+    transform.cmd.stage = s_stages[STAGE_VERTEX];
+    ((GLuint64EXT*)&transform.cmd.addressLo)[0] = 0x100000000ULL + m * 256;
+    stream += tokenAsString(transform);
+    for(int a = 0; a < TOKENBENCH_ATTRIBS; a++)
+    {
+      Token_AttributeAddress attr;
+      attr.cmd.index = a;
+      ((GLuint64EXT*)&attr.cmd.addressLo)[0] = 0x200000000ULL + m * 4096 + a * 12;
+      stream += tokenAsString(attr);
+    }
+    for(int pg = 0; pg < TOKENBENCH_PRIMGROUPS; pg++)
+    {
+      Token_UniformAddress material;
+      material.cmd.index = 2;
+      material.cmd.stage = s_stages[STAGE_FRAGMENT];
+      ((GLuint64EXT*)&material.cmd.addressLo)[0] = 0x300000000ULL + pg * 256;
+      stream += tokenAsString(material);
+      Token_ElementAddress elements;
+      ((GLuint64EXT*)&elements.cmd.addressLo)[0] = 0x400000000ULL + m * 1024;
+      elements.cmd.typeSizeInByte = 4;
+      stream += tokenAsString(elements);
+      Token_DrawElements draw;
+      draw.cmd.count = 300;
+      stream += tokenAsString(draw);
+    }
+  }
+  return stream.size();
+}
+
+static size_t buildTokensWriter(TokenWriter& tokens, int numMeshes)
+{
+  tokens.clear();
+  for(int m = 0; m < numMeshes; m++)
+  {
+    tokens.uniformAddress(1, 0x100000000ULL + m * 256, STAGE_VERTEX);
+    for(int a = 0; a < TOKENBENCH_ATTRIBS; a++)
+      tokens.attributeAddress(a, 0x200000000ULL + m * 4096 + a * 12);
+    for(int pg = 0; pg < TOKENBENCH_PRIMGROUPS; pg++)
+    {
+      tokens.uniformAddress(2, 0x300000000ULL + pg * 256, STAGE_FRAGMENT);
+      tokens.elementAddress(0x400000000ULL + m * 1024, GL_UNSIGNED_INT);
+      tokens.drawElements(GL_TRIANGLES, 300);
+    }
+  }
+  return tokens.size();
+}
+
+// pre-pass, as Bk3dModelCMDList::estimateCmdBufferSize()
+static size_t estimateTokens(int numMeshes)
+{
+  return numMeshes
+         * (sizeof(Token_UniformAddress) + TOKENBENCH_ATTRIBS * sizeof(Token_AttributeAddress)
+            + TOKENBENCH_PRIMGROUPS * (sizeof(Token_UniformAddress) + sizeof(Token_ElementAddress) + sizeof(Token_DrawElements)));
+}
+
+bool benchTokenWriter()
+{
+  const int numMeshes  = 2000;
+  const int iterations = 1000;
+  // no driver here: the ID of each token is its header
+  registerTokenSizes();
+  for(int i = 0; i <= GL_FRONT_FACE_COMMAND_NV; i++)
+    s_header[i] = i;
+  const double tokens = double(numMeshes) * TOKENBENCH_TOKENS_PER_MESH * iterations;
+  const char* resultNames[] = {"token_writer/string", "token_writer/growing", "token_writer/prepass", "token_writer/kept"};
+  std::vector<std::string> lines;
+  LOGI("%d meshes of %d tokens, %d streams\n", numMeshes, TOKENBENCH_TOKENS_PER_MESH, iterations);
+  logResultHeader();
+  for(int variant = 0; variant < 4; variant++)
+  {
+    bool                   counting = getAllocCounting();
+    uint64_t               allocs0  = getAllocCount();
+    size_t                 bytes    = 0;
+    std::string            stream;
+    TokenWriter            persistent;
+    const char*            name = "";
+    BenchTimer             timer;
+    setAllocCounting(true);
+    timer.start();
+    for(int it = 0; it < iterations; it++)
+    {
+      switch(variant)
+      {
+        case 0:
+          // a new stream each time, as buildCmdBuffer() did with a cleared std::string
+          name = "std::string += temporaries";
+          bytes += buildTokensString(stream, numMeshes);
+          break;
+        case 1: {
+          name = "TokenWriter, growing";
+          TokenWriter tw;
+          bytes += buildTokensWriter(tw, numMeshes);
+          break;
+        }
+        case 2: {
+          name = "TokenWriter, pre-pass";
+          TokenWriter tw;
+          tw.reserve(estimateTokens(numMeshes));
+          bytes += buildTokensWriter(tw, numMeshes);
+          break;
+        }
+        case 3:
+          // the writer of a model slice: kept from one frame to the other
+          name = "TokenWriter, kept";
+          persistent.reserve(estimateTokens(numMeshes));
+          bytes += buildTokensWriter(persistent, numMeshes);
+          break;
+      }
+    }
+    timer.stop();
+    double us = timer.realUs();
+    setAllocCounting(counting);
+    addResult(resultNames[variant], timer, iterations, double(numMeshes) * TOKENBENCH_TOKENS_PER_MESH, double(bytes) / iterations);
+    char line[128];
+    snprintf(line, sizeof(line), "%-28s %12.1f %10.1f %8.1f\n", name, tokens / us, double(bytes) / us,
+             double(getAllocCount() - allocs0) / iterations);
+    lines.push_back(line);
+  }
+  LOGI("%-28s %12s %10s %8s\n", "", "Mtokens/s", "MB/s", "allocs");
+  for(size_t i = 0; i < lines.size(); i++)
+    LOGI("%s", lines[i].c_str());
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Peephole pass on a consolidated token stream, checked against a CPU simulation
+//------------------------------------------------------------------------------
+struct TokenSegments
+{
+  std::vector<GLsizei> sizes;
+  std::vector<GLuint>  stateGroups;
+  std::vector<GLuint>  fbos;
+};
+
+// slices as buildCmdBuffer() writes them: each starts with its own global uniforms,
+// meshes re-set their attributes, the state object changes with the topology
+static void buildSlicedStream(TokenWriter& tokens, TokenSegments& segs, int numSlices, int meshesPerSlice)
+{
+  tokens.clear();
+  segs.sizes.clear();
+  segs.stateGroups.clear();
+  segs.fbos.clear();
+  unsigned int rnd = 1;
+  for(int slice = 0; slice < numSlices; slice++)
+  {
+    size_t segStart = tokens.size();
+    GLuint state    = 1;
+    tokens.lineWidth(1.0f);
+    tokens.uniformAddress(0, 0x1000, STAGE_VERTEX);
+    tokens.uniformAddress(1, 0x2000, STAGE_VERTEX);
+    tokens.uniformAddress(2, 0x3000, STAGE_FRAGMENT);
+    for(int m = 0; m < meshesPerSlice; m++)
+    {
+      int mesh = slice * meshesPerSlice + m;
+      rnd      = rnd * 1103515245 + 12345;
+      // meshes often share their transform and their vertex buffer with the previous one
+      tokens.uniformAddress(1, 0x2000 + (mesh / 4) * 256, STAGE_VERTEX);
+      for(int a = 0; a < 3; a++)
+        tokens.attributeAddress(a, 0x100000 + (mesh / 2) * 4096 + a * 12);
+      for(int pg = 0; pg < 2; pg++)
+      {
+        GLuint newState = ((rnd >> (16 + pg)) & 7) == 0 ? 2 : 1;
+        if(newState != state)
+        {
+          segs.sizes.push_back(GLsizei(tokens.size() - segStart));
+          segs.stateGroups.push_back(state);
+          segs.fbos.push_back(1);
+          segStart = tokens.size();
+          state    = newState;
+        }
+        tokens.uniformAddress(3, 0x4000 + pg * 64, STAGE_FRAGMENT);
+        tokens.elementAddress(0x800000 + mesh * 1024, GL_UNSIGNED_INT);
+        tokens.drawElements(state == 2 ? GL_LINES : GL_TRIANGLES, 300 + pg);
+      }
+    }
+    segs.sizes.push_back(GLsizei(tokens.size() - segStart));
+    segs.stateGroups.push_back(state);
+    segs.fbos.push_back(1);
+  }
+}
+
+// what each draw sees: its token, the states of its segment and all the token states
+// set so far. Token states are inherited from one segment to the next. A segment stops
+// at a TERMINATE_SEQUENCE or a token without a known header: the rest of it, which the
+// pass must leave as is, counts as one more draw
+static void simulateDraws(const char* data, const TokenSegments& segs, int numSegments, std::vector<std::string>& draws)
+{
+  std::map<GLuint, std::string> state;
+  size_t                        offset = 0;
+  draws.clear();
+  for(int i = 0; i < numSegments; i++)
+  {
+    size_t end = offset + segs.sizes[i];
+    while(offset < end)
+    {
+      int id = tokenIdFromHeader(*(const GLuint*)(data + offset));
+      if(id < 0 || id == GL_TERMINATE_SEQUENCE_COMMAND_NV)
+      {
+        draws.push_back("rest:" + std::string(data + offset, end - offset));
+        offset = end;
+        break;
+      }
+      std::string token(data + offset, s_headerSizes[id]);
+      if(id >= GL_DRAW_ELEMENTS_COMMAND_NV && id <= GL_DRAW_ARRAYS_INSTANCED_COMMAND_NV)
+      {
+        char seg[32];
+        sprintf(seg, "%u/%u:", segs.stateGroups[i], segs.fbos[i]);
+        std::string d = seg + token;
+        for(std::map<GLuint, std::string>::const_iterator it = state.begin(); it != state.end(); ++it)
+          d += it->second;
+        draws.push_back(d);
+      }
+      else if(id == GL_UNIFORM_ADDRESS_COMMAND_NV)
+        state[(id << 24) | (((const UniformAddressCommandNV*)token.data())->stage << 16) | ((const UniformAddressCommandNV*)token.data())->index] = token;
+      else if(id == GL_ATTRIBUTE_ADDRESS_COMMAND_NV)
+        state[(id << 24) | ((const AttributeAddressCommandNV*)token.data())->index] = token;
+      else if(id != GL_NOP_COMMAND_NV)
+        state[id << 24] = token;
+      offset += s_headerSizes[id];
+    }
+  }
+}
+
+static void endSegment(TokenWriter& tokens, TokenSegments& segs, size_t& segStart, GLuint state)
+{
+  segs.sizes.push_back(GLsizei(tokens.size() - segStart));
+  segs.stateGroups.push_back(state);
+  segs.fbos.push_back(1);
+  segStart = tokens.size();
+}
+
+// two segments with the same states, the first one cut by 'stop': a TERMINATE_SEQUENCE
+// or a token the pass doesn't know. Redundant tokens on both sides of it
+static void buildStoppedStream(TokenWriter& tokens, TokenSegments& segs, bool terminate)
+{
+  tokens.clear();
+  segs.sizes.clear();
+  segs.stateGroups.clear();
+  segs.fbos.clear();
+  size_t segStart = 0;
+  tokens.uniformAddress(0, 0x1000, STAGE_VERTEX);
+  tokens.uniformAddress(0, 0x1000, STAGE_VERTEX);
+  tokens.drawElements(GL_TRIANGLES, 3);
+  tokens.uniformAddress(0, 0x1000, STAGE_VERTEX);
+  if(terminate)
+    tokens.push<Token_TerminateSequence>();
+  else
+  {
+    const GLuint unknown[2] = {0xBADC0DE, 0};
+    tokens.append(unknown, sizeof(unknown));
+  }
+  tokens.uniformAddress(0, 0x1000, STAGE_VERTEX);
+  tokens.drawElements(GL_TRIANGLES, 6);
+  endSegment(tokens, segs, segStart, 1);
+  tokens.uniformAddress(0, 0x1000, STAGE_VERTEX);
+  tokens.drawElements(GL_TRIANGLES, 9);
+  tokens.uniformAddress(0, 0x2000, STAGE_VERTEX);
+  tokens.uniformAddress(0, 0x2000, STAGE_VERTEX);
+  tokens.drawElements(GL_TRIANGLES, 12);
+  endSegment(tokens, segs, segStart, 1);
+}
+
+// one segment setting more distinct uniforms than TokenOptimizer has slots, each one
+// overwritten before the first draw and set again to the same value before the second
+static void buildManySlotsStream(TokenWriter& tokens, TokenSegments& segs)
+{
+  const int numUniforms = TOKENOPTIMIZER_MAXSLOTS + 16;
+  tokens.clear();
+  segs.sizes.clear();
+  segs.stateGroups.clear();
+  segs.fbos.clear();
+  size_t segStart = 0;
+  for(int pass = 0; pass < 2; pass++)
+  {
+    for(int i = 0; i < numUniforms; i++)
+      tokens.uniformAddress(i, 0x1000 + i * 256 + 16, STAGE_VERTEX);
+    for(int i = 0; i < numUniforms; i++)
+      tokens.uniformAddress(i, 0x1000 + i * 256, STAGE_VERTEX);
+    tokens.drawElements(GL_TRIANGLES, 3 + pass);
+  }
+  endSegment(tokens, segs, segStart, 1);
+}
+
+// runs the pass on a copy of the stream: the draws must see the same states before and after it
+static bool checkPeephole(const char* name, const TokenWriter& tokens, TokenSegments segs)
+{
+  std::vector<char>        data(tokens.data(), tokens.data() + tokens.size());
+  std::vector<std::string> before, after;
+  TokenOptimizer           optimizer;
+  simulateDraws(data.data(), segs, (int)segs.sizes.size(), before);
+  int numSegments = optimizer.optimize(data.data(), &segs.sizes[0], &segs.stateGroups[0], &segs.fbos[0], (int)segs.sizes.size());
+  simulateDraws(data.data(), segs, numSegments, after);
+  if(before != after)
+  {
+    LOGE("token_peephole: %s FAILED, the draws don't see the same states anymore\n", name);
+    return false;
+  }
+  LOGI("token_peephole: %-10s %5d draws see the same states, %d of %d tokens removed\n", name, (int)after.size(),
+       optimizer.getStats().tokensRemoved, optimizer.getStats().tokensIn);
+  return true;
+}
+
+bool benchTokenPeephole()
+{
+  const int numSlices      = 16;
+  const int meshesPerSlice = 500;
+  const int iterations     = 50;
+  registerTokenSizes();
+  for(int i = 0; i <= GL_FRONT_FACE_COMMAND_NV; i++)
+    s_header[i] = i;
+
+  TokenWriter    tokens;
+  TokenSegments  segs;
+  TokenOptimizer optimizer;
+  double         us = 0;
+  for(int it = 0; it < iterations; it++)
+  {
+    buildSlicedStream(tokens, segs, numSlices, meshesPerSlice);
+    BenchClock::time_point t0 = BenchClock::now();
+    optimizer.optimize((char*)tokens.data(), &segs.sizes[0], &segs.stateGroups[0], &segs.fbos[0], (int)segs.sizes.size());
+    us += usSince(t0, BenchClock::now());
+  }
+  const TokenOptimizer::Stats& stats = optimizer.getStats();
+  LOGI("%d slices of %d meshes: %d tokens\n", numSlices, meshesPerSlice, stats.tokensIn);
+  LOGI("bytes      %8zu -> %8zu (%.1f%% saved)\n", stats.bytesIn, stats.bytesOut, 100.0 * double(stats.bytesIn - stats.bytesOut) / double(stats.bytesIn));
+  LOGI("tokens removed %d, segments merged %d\n", stats.tokensRemoved, stats.segmentsMerged);
+  LOGI("pass: %.1f us, %.1f MB/s\n", us / iterations, double(stats.bytesIn) * iterations / us);
+
+  bool bOk = true;
+  buildSlicedStream(tokens, segs, numSlices, meshesPerSlice);
+  bOk &= checkPeephole("sliced", tokens, segs);
+  buildStoppedStream(tokens, segs, true);
+  bOk &= checkPeephole("terminate", tokens, segs);
+  buildStoppedStream(tokens, segs, false);
+  bOk &= checkPeephole("unknown", tokens, segs);
+  buildManySlotsStream(tokens, segs);
+  bOk &= checkPeephole("slots", tokens, segs);
+  return bOk;
+}
+
+//------------------------------------------------------------------------------
+// bk3d files: load() of a synthetic scene written to disk, and resolvePointers()
+// alone on copies of the file in memory
+//------------------------------------------------------------------------------
+#define MICROBENCH_SCENE "meshes=10000,prims=4,tri=3,line=1,verts=64,indices=96"
+#define MICROBENCH_SCENE_FILE "microbench_scene.bk3d"
+
+bool benchBk3dLoad()
+{
+  const int          iterations = 50;
+  SyntheticSceneDesc desc;
+  parseSyntheticDesc(MICROBENCH_SCENE, desc);
+  if(!writeSyntheticScene(desc, MICROBENCH_SCENE_FILE))
+  {
+    LOGE("bk3d_load: couldn't write %s\n", MICROBENCH_SCENE_FILE);
+    return false;
+  }
+  // the raw file, to copy before each resolvePointers()
+  std::vector<char> file;
+  FILE*             fp = fopen(MICROBENCH_SCENE_FILE, "rb");
+  if(fp)
+  {
+    fseek(fp, 0, SEEK_END);
+    file.resize((size_t)ftell(fp));
+    fseek(fp, 0, SEEK_SET);
+    if(fread(file.data(), 1, file.size(), fp) != file.size())
+      file.clear();
+    fclose(fp);
+  }
+  if(file.size() < sizeof(bk3d::FileHeader))
+  {
+    LOGE("bk3d_load: couldn't read %s back\n", MICROBENCH_SCENE_FILE);
+    remove(MICROBENCH_SCENE_FILE);
+    return false;
+  }
+  LOGI("%s: %d meshes, %.1f MB\n", MICROBENCH_SCENE, desc.numMeshes, double(file.size()) / (1024.0 * 1024.0));
+  logResultHeader();
+  char name[64];
+
+  bool       bOk = true;
+  BenchTimer timer;
+  for(int it = 0; it < iterations; it++)
+  {
+    void* pBuffer = NULL;
+    timer.start();
+    bk3d::FileHeader* pHeader = bk3d::load(MICROBENCH_SCENE_FILE, &pBuffer);
+    timer.stop();
+    if(!pHeader)
+    {
+      LOGE("bk3d_load: couldn't load %s\n", MICROBENCH_SCENE_FILE);
+      bOk = false;
+      break;
+    }
+    free(pHeader);
+    free(pBuffer);
+  }
+  snprintf(name, sizeof(name), "bk3d_load/file/meshes:%d", desc.numMeshes);
+  addResult(name, timer, iterations, desc.numMeshes, (double)file.size());
+
+  size_t structBytes = ((bk3d::FileHeader*)file.data())->nodeByteSize;
+  char*  pStructs    = (char*)malloc(structBytes);
+  char*  pBuffer     = (char*)malloc(file.size() - structBytes + 1);
+  int    numOffsets  = 0;
+  BenchTimer resolveTimer;
+  for(int it = 0; it < iterations; it++)
+  {
+    memcpy(pStructs, file.data(), structBytes);
+    memcpy(pBuffer, file.data() + structBytes, file.size() - structBytes);
+    resolveTimer.start();
+    ((bk3d::FileHeader*)pStructs)->resolvePointers(pBuffer);
+    resolveTimer.stop();
+    numOffsets = ((bk3d::FileHeader*)pStructs)->pRelocationTable->numRelocationOffsets;
+  }
+  snprintf(name, sizeof(name), "bk3d_load/resolve/meshes:%d", desc.numMeshes);
+  addResult(name, resolveTimer, iterations, numOffsets, 0.0);
+  free(pStructs);
+  free(pBuffer);
+  remove(MICROBENCH_SCENE_FILE);
+  return bOk;
+}
+
+//------------------------------------------------------------------------------
+// Bounding-box fold of Bk3dModel::loadModel(), serial and on a pool
+//------------------------------------------------------------------------------
+bool benchBoundsFold()
+{
+  const int          iterations = 200;
+  const int          numThreads = 8;
+  SyntheticSceneDesc desc;
+  parseSyntheticDesc("meshes=100000,prims=1,verts=4,indices=6", desc);
+  bk3d::FileHeader* pScene = generateSyntheticScene(desc);
+  if(!pScene)
+    return false;
+  ThreadWorkerPool  pool(numThreads, false, false, NWTPS_ROUND_ROBIN, std::string("bench"));
+  ThreadWorkerPool* prevPool = getParallelPool();
+  LOGI("%d meshes\n", desc.numMeshes);
+  logResultHeader();
+  float min[3];
+  float max[3];
+  for(int variant = 0; variant < 2; variant++)
+  {
+    setParallelPool(variant ? &pool : NULL);
+    BenchTimer timer;
+    timer.start();
+    for(int it = 0; it < iterations; it++)
+      foldMeshBounds(pScene, min, max);
+    timer.stop();
+    char name[64];
+    snprintf(name, sizeof(name), "bounds_fold/meshes:%d/threads:%d", desc.numMeshes, variant ? numThreads : 1);
+    addResult(name, timer, iterations, desc.numMeshes, 0.0);
+  }
+  setParallelPool(prevPool);
+  free(pScene);
+  if((min[0] > max[0]) || (min[1] > max[1]) || (min[2] > max[2]))
+  {
+    LOGE("bounds_fold: empty bounds\n");
+    return false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Draw-list traversal: buildCmdBufferModel() of the null renderer, the walk over
+// the meshes and primitive groups with the filtering and state tracking of the
+// renderers, recording into plain memory. The whole model in one slice, then cut
+// in 16 slices as the other renderers do by default
+//------------------------------------------------------------------------------
+bool benchDrawTraversal()
+{
+  const int iterations  = 100;
+  const int sliceCounts[] = {1, 16};
+  if(!g_nullRenderer)
+    return false;
+  Bk3dModel model(SYNTH_PREFIX MICROBENCH_SCENE);
+  if(!model.loadModel())
+    return false;
+  g_nullRenderer->initGraphics(0, 0, 0);
+  g_nullRenderer->attachModel(&model);
+  int numMeshes = model.m_meshFile->pMeshes->n;
+  logResultHeader();
+  for(int s = 0; s < 2; s++)
+  {
+    int numSlices = sliceCounts[s];
+    int sliceStarts[16 + 1];
+    for(int i = 0; i <= numSlices; i++)
+      sliceStarts[i] = (int)((long long)numMeshes * i / numSlices);
+    BenchTimer timer;
+    timer.start();
+    for(int it = 0; it < iterations; it++)
+    {
+      for(int i = 0; i < numSlices; i++)
+        g_nullRenderer->buildCmdBufferModel(&model, i, sliceStarts[i], sliceStarts[i + 1]);
+    }
+    timer.stop();
+    g_nullRenderer->consolidateCmdBuffersModel(&model, numSlices);
+    char name[64];
+    snprintf(name, sizeof(name), "draw_traversal/meshes:%d/slices:%d", numMeshes, numSlices);
+    addResult(name, timer, iterations, model.m_stats.drawcalls, model.m_stats.bytes_recorded);
+  }
+  LOGI("%s: %d draws, %d commands\n", MICROBENCH_SCENE, model.m_stats.drawcalls, model.m_stats.tokens);
+  g_nullRenderer->terminateGraphics();
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// TaskQueue push and pop on the same thread, and the round trip of a task
+// through a ThreadWorkerPool: push, execution by a worker, wake-up of the caller
+//------------------------------------------------------------------------------
+class TskEmpty : public TaskBase
+{
+public:
+  void Invoke() {}
+  // owned by the benchmark: no delete
+  void Done() {}
+};
+
+bool benchQueueLatency()
+{
+  const int             items     = 640000;
+  const int             batches[] = {1, 64};
+  std::vector<TskEmpty> tasks(64);
+  logResultHeader();
+  for(int b = 0; b < 2; b++)
+  {
+    TaskQueue  queue((NThreadID)0);
+    int        batch = batches[b];
+    BenchTimer timer;
+    timer.start();
+    for(int n = 0; n < items; n += batch)
+    {
+      for(int i = 0; i < batch; i++)
+        queue.pushTask(&tasks[i]);
+      while(queue.pollTask())
+      {
+      }
+    }
+    timer.stop();
+    char name[64];
+    snprintf(name, sizeof(name), "queue_pushpop/batch:%d", batch);
+    addResult(name, timer, items, 1.0, 0.0);
+  }
+  const int roundTrips   = 2000;
+  const int threadCounts[] = {1, 8};
+  for(int t = 0; t < 2; t++)
+  {
+    ThreadWorkerPool pool(threadCounts[t], false, false, NWTPS_ROUND_ROBIN, std::string("bench"));
+    BenchTimer       timer;
+    timer.start();
+    LatencyResult r = measureSubmitLatency(&pool, 1, false, roundTrips);
+    timer.stop();
+    char name[64];
+    snprintf(name, sizeof(name), "pool_roundtrip/threads:%d", threadCounts[t]);
+    addResult(name, timer, roundTrips, 1.0, 0.0);
+    LOGI("  push to start %.2f us\n", r.first);
+    pool.FlushTasks();
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// NRingBuffer: what the queues of the workers hold, written and read one item
+// at a time or in batches
+//------------------------------------------------------------------------------
+bool benchRingBuffer()
+{
+  const int              items    = 1 << 22;
+  const int              batches[] = {1, 64};
+  std::vector<TaskBase*> in(64);
+  std::vector<TaskBase*> out(64);
+  for(int i = 0; i < 64; i++)
+    in[i] = (TaskBase*)(uintptr_t)(i + 1);
+  bool bOk = true;
+  logResultHeader();
+  for(int b = 0; b < 2; b++)
+  {
+    NRingBuffer<TaskBase*> ring(256);
+    int                    batch = batches[b];
+    uintptr_t              sum   = 0;
+    BenchTimer             timer;
+    timer.start();
+    for(int n = 0; n < items; n += batch)
+    {
+      ring.WriteData(&in[0], batch);
+      ring.ReadData(&out[0], batch);
+      sum += (uintptr_t)out[batch - 1];
+    }
+    timer.stop();
+    char name[64];
+    snprintf(name, sizeof(name), "ring_buffer/batch:%d", batch);
+    addResult(name, timer, items / batch, batch, double(batch * sizeof(TaskBase*)));
+    if(sum != (uintptr_t)(items / batch) * batch)
+    {
+      LOGE("ring_buffer: wrong items read back\n");
+      bOk = false;
+    }
+  }
+  return bOk;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+struct MicroBenchmark
+{
+  const char* name;
+  bool (*func)();  // false when the results of the kernel fail its own checks
+};
+static MicroBenchmark s_microBenchmarks[] = {
+    {"submit_latency", benchTaskSubmitLatency},
+    {"tls_access", benchTlsAccess},
+    {"scratch_alloc", benchScratchAlloc},
+    {"token_writer", benchTokenWriter},
+    {"token_peephole", benchTokenPeephole},
+    {"bk3d_load", benchBk3dLoad},
+    {"bounds_fold", benchBoundsFold},
+    {"draw_traversal", benchDrawTraversal},
+    {"queue_latency", benchQueueLatency},
+    {"ring_buffer", benchRingBuffer},
+#ifdef LINUX
+    {"wake_latency", benchWakeLatency},
+#endif
+};
+
+//------------------------------------------------------------------------------
+// Google Benchmark JSON
+//------------------------------------------------------------------------------
+static bool writeResultsJSON(const char* fname)
+{
+  FILE* fp = fopen(fname, "w");
+  if(!fp)
+  {
+    LOGE("Couldn't write %s\n", fname);
+    return false;
+  }
+  char      date[64];
+  time_t    now = time(NULL);
+  struct tm tmNow = *localtime(&now);
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tmNow);
+  fprintf(fp, "{\n  \"context\": {\n");
+  fprintf(fp, "    \"date\": \"%s\",\n", date);
+  fprintf(fp, "    \"executable\": \"gl_vk_bk3dthreaded -microbench\",\n");
+  fprintf(fp, "    \"num_cpus\": %u,\n", std::thread::hardware_concurrency());
+#ifdef NDEBUG
+  fprintf(fp, "    \"library_build_type\": \"release\"\n");
+#else
+  fprintf(fp, "    \"library_build_type\": \"debug\"\n");
+#endif
+  fprintf(fp, "  },\n  \"benchmarks\": [");
+  for(size_t i = 0; i < s_results.size(); i++)
+  {
+    const MicroBenchResult& r = s_results[i];
+    fprintf(fp, "%s\n    {\n", i ? "," : "");
+    fprintf(fp, "      \"name\": \"%s\",\n", r.name.c_str());
+    fprintf(fp, "      \"run_name\": \"%s\",\n", r.name.c_str());
+    fprintf(fp, "      \"run_type\": \"iteration\",\n");
+    fprintf(fp, "      \"iterations\": %lld,\n", r.iterations);
+    fprintf(fp, "      \"real_time\": %.4f,\n", r.realNs);
+    fprintf(fp, "      \"cpu_time\": %.4f,\n", r.cpuNs);
+    fprintf(fp, "      \"time_unit\": \"ns\"");
+    if(r.itemsPerSecond > 0.0)
+      fprintf(fp, ",\n      \"items_per_second\": %.4f", r.itemsPerSecond);
+    if(r.bytesPerSecond > 0.0)
+      fprintf(fp, ",\n      \"bytes_per_second\": %.4f", r.bytesPerSecond);
+    fprintf(fp, "\n    }");
+  }
+  fprintf(fp, "%s]\n}\n", s_results.empty() ? "" : "\n  ");
+  fclose(fp);
+  return true;
+}
+
+// what compareBaseline() needs of a file written by writeResultsJSON() or by Google Benchmark
+struct BaselineResult
+{
+  double realNs;
+  double itemsPerSecond;  // 0 when the entry has none
+};
+static bool readBaselineJSON(const char* fname, std::map<std::string, BaselineResult>& results, int& numCpus)
+{
+  FILE* fp = fopen(fname, "rb");
+  if(!fp)
+  {
+    LOGE("Couldn't read %s\n", fname);
+    return false;
+  }
+  std::string text;
+  char        buf[4096];
+  size_t      n;
+  while((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    text.append(buf, n);
+  fclose(fp);
+  size_t cpus = text.find("\"num_cpus\":");
+  numCpus     = (cpus == std::string::npos) ? 1 : atoi(text.c_str() + cpus + 11);
+  size_t pos  = text.find("\"benchmarks\"");
+  while(pos != std::string::npos)
+  {
+    pos = text.find("\"name\":", pos);
+    if(pos == std::string::npos)
+      break;
+    size_t start = text.find('"', pos + 7);
+    size_t end   = (start == std::string::npos) ? start : text.find('"', start + 1);
+    size_t close = (end == std::string::npos) ? end : text.find('}', end);
+    size_t time  = text.find("\"real_time\":", pos);
+    if((close == std::string::npos) || (time == std::string::npos) || (time > close))
+      break;
+    size_t         items = text.find("\"items_per_second\":", pos);
+    BaselineResult r;
+    r.realNs         = strtod(text.c_str() + time + 12, NULL);
+    r.itemsPerSecond = (items < close) ? strtod(text.c_str() + items + 19, NULL) : 0.0;
+    results[text.substr(start + 1, end - start - 1)] = r;
+    pos = close;
+  }
+  return !results.empty();
+}
+
+// time per item, or per iteration for the kernels without items
+static double costOf(double realNs, double itemsPerSecond)
+{
+  return (itemsPerSecond > 0.0) ? 1e9 / itemsPerSecond : realNs;
+}
+
+// N of a ".../threads:N" variant, 1 otherwise
+static int threadsOf(const std::string& name)
+{
+  size_t pos = name.find("threads:");
+  return (pos == std::string::npos) ? 1 : atoi(name.c_str() + pos + 8);
+}
+
+// Absolute times depend too much on the machine to be compared with a file measured
+// elsewhere. Each variant is compared instead through its cost relative to the reference
+// of its kernel (the first variant with the same prefix) in the same run: the ratio
+// changes when the code of the variant regresses, much less with the CPU. The
+// references themselves aren't checked. False when a relative cost grew by more than
+// MICROBENCH_TOLERANCE. Variants with more threads than this machine or the one of the
+// baseline has CPUs are skipped
+#define MICROBENCH_TOLERANCE 0.3
+static bool compareBaseline(const char* fname)
+{
+  std::map<std::string, BaselineResult> baseline;
+  int                                   baselineCpus;
+  if(!readBaselineJSON(fname, baseline, baselineCpus))
+    return false;
+  int  numCpus = std::min((int)std::thread::hardware_concurrency(), baselineCpus);
+  bool bOk     = true;
+  LOGI("---------- against %s ----------\n", fname);
+  LOGI("%-40s %-36s %10s %10s %8s\n", "benchmark", "relative to", "baseline", "now", "ratio");
+  for(size_t i = 0; i < s_results.size(); i++)
+  {
+    const MicroBenchResult& r      = s_results[i];
+    const MicroBenchResult* ref    = NULL;
+    std::string             kernel = r.name.substr(0, r.name.find('/'));
+    for(size_t j = 0; (j < i) && !ref; j++)
+    {
+      if(s_results[j].name.compare(0, kernel.size() + 1, kernel + "/") == 0)
+        ref = &s_results[j];
+    }
+    if(!ref)
+      continue;
+    if(threadsOf(r.name) > numCpus)
+    {
+      LOGI("%-40s skipped: %d CPUs\n", r.name.c_str(), numCpus);
+      continue;
+    }
+    std::map<std::string, BaselineResult>::const_iterator it    = baseline.find(r.name);
+    std::map<std::string, BaselineResult>::const_iterator itRef = baseline.find(ref->name);
+    if((it == baseline.end()) || (itRef == baseline.end()))
+    {
+      LOGI("%-40s skipped: not in the baseline\n", r.name.c_str());
+      continue;
+    }
+    double baseCost = costOf(itRef->second.realNs, itRef->second.itemsPerSecond);
+    double cost     = costOf(ref->realNs, ref->itemsPerSecond);
+    if((baseCost <= 0.0) || (cost <= 0.0))
+      continue;
+    double baseRelative = costOf(it->second.realNs, it->second.itemsPerSecond) / baseCost;
+    double relative     = costOf(r.realNs, r.itemsPerSecond) / cost;
+    double ratio        = relative / baseRelative;
+    if(ratio > 1.0 + MICROBENCH_TOLERANCE)
+    {
+      LOGE("%-40s %-36s %10.3f %10.3f %8.2f slower\n", r.name.c_str(), ref->name.c_str(), baseRelative, relative, ratio);
+      bOk = false;
+    }
+    else
+      LOGI("%-40s %-36s %10.3f %10.3f %8.2f\n", r.name.c_str(), ref->name.c_str(), baseRelative, relative, ratio);
+  }
+  return bOk;
+}
+
+#define MICROBENCH_REPETITIONS 5
+int runMicroBenchmarks(const char* filter, const char* jsonOut, const char* baseline)
+{
+  // results that get written or compared: best of a few runs of each kernel
+  int repetitions = (jsonOut || baseline) ? MICROBENCH_REPETITIONS : 1;
+  int ran         = 0;
+  int failed      = 0;
+  s_results.clear();
+  for(int i = 0; i < (int)(sizeof(s_microBenchmarks) / sizeof(s_microBenchmarks[0])); i++)
+  {
+    if(strcmp(filter, "all") && strcmp(filter, s_microBenchmarks[i].name))
+      continue;
+    for(int rep = 0; rep < repetitions; rep++)
+    {
+      if(repetitions > 1)
+        LOGI("---------- %s (%d/%d) ----------\n", s_microBenchmarks[i].name, rep + 1, repetitions);
+      else
+        LOGI("---------- %s ----------\n", s_microBenchmarks[i].name);
+      if(!s_microBenchmarks[i].func())
+      {
+        failed++;
+        break;
+      }
+    }
+    ran++;
+  }
+  if(ran == 0)
+  {
+    LOGE("unknown micro-benchmark %s. Available:\n", filter);
+    for(int i = 0; i < (int)(sizeof(s_microBenchmarks) / sizeof(s_microBenchmarks[0])); i++)
+      LOGE("  %s\n", s_microBenchmarks[i].name);
+    return EXIT_FAILURE;
+  }
+  if(failed)
+  {
+    LOGE("micro-benchmarks: %d of %d failed their checks\n", failed, ran);
+    return EXIT_FAILURE;
+  }
+  if(jsonOut && writeResultsJSON(jsonOut))
+    LOGI("micro-benchmarks: %d results written to %s\n", (int)s_results.size(), jsonOut);
+  if(baseline && !compareBaseline(baseline))
+    return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+#include <stddef.h>
+
+//------------------------------------------------------------------------------
+// CPU-only micro-benchmarks
+//
+// selected with "-microbench <name>" ("all" runs everything). They run before any
+// window or graphics API gets created, print their results and exit the sample.
+// jsonOut: the results in the JSON layout of Google Benchmark (-microbenchout).
+// baseline: such a file to compare with (-microbenchbaseline), an error when a
+// variant got more than 30% slower relative to the reference variant of its kernel.
+// EXIT_FAILURE as well when a kernel fails the checks of its own results: each
+// bench*() below returns false then
+//------------------------------------------------------------------------------
+int runMicroBenchmarks(const char* filter, const char* jsonOut = NULL, const char* baseline = NULL);
+
+// single pushTask() calls versus one pushTasks() batch: time from the submission
+// to the start of the tasks on the workers
+bool benchTaskSubmitLatency();
+
+// cost of reading a per-thread pointer: NThreadLocalVar (OS TLS key) versus
+// NThreadContextVar and a plain thread_local
+bool benchTlsAccess();
+
+// frame-temporary vectors grown by tasks: std::vector versus ScratchVector, with the
+// heap allocations per frame (expected to be 0 for ScratchVector)
+bool benchScratchAlloc();
+
+// NV_command_list tokens per second: std::string appends of one string per token
+// versus TokenWriter, with and without the size pre-pass. No GL needed
+bool benchTokenWriter();
+
+// TokenOptimizer on a stream sliced like the consolidated command-lists: bytes saved,
+// speed of the pass, and a check that each draw still sees the same token states,
+// also with a TERMINATE_SEQUENCE, an unknown token and more states than its slots
+bool benchTokenPeephole();
+
+// bk3d::load() of a synthetic scene written to disk, and FileHeader::resolvePointers()
+// alone on copies of the file in memory
+bool benchBk3dLoad();
+
+// foldMeshBounds() of Bk3dModel::loadModel(): serial, then on a pool of workers
+bool benchBoundsFold();
+
+// buildCmdBufferModel() of the null renderer on a synthetic model, in 1 and 16
+// slices: draws per second
+bool benchDrawTraversal();
+
+// TaskQueue push and pop on one thread, one task and 64 at a time, and the round
+// trip of a single task through a ThreadWorkerPool
+bool benchQueueLatency();
+
+// NRingBuffer write + read of pointers, one at a time and in batches
+bool benchRingBuffer();
+
+#ifdef LINUX
+// CEvent/CSemaphore handoffs between two threads, futex versus pthread implementation
+bool benchWakeLatency();
+#endif
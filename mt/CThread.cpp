@@ -28,10 +28,26 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include <pthread.h>
+#ifdef LINUX
+#include <sched.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#endif
 #endif
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
 #include "CThread.h"
 
 //----------------------------------------------------------------------------------
@@ -81,6 +97,76 @@ int CThread::CpuCount()
     }
     return Cpus;
 }
+
+// CpuTopology
+static void QueryCpuTopology(std::vector<NCpuInfo>& cpus)
+{
+    int ncpu = CThread::CpuCount();
+    if(ncpu > (int)(sizeof(ULONG_PTR) * 8))
+        ncpu = (int)(sizeof(ULONG_PTR) * 8);
+    cpus.resize(ncpu);
+    for(int i = 0; i < ncpu; i++)
+    {
+        NCpuInfo c = {i, i, 0, 0, 0};
+        cpus[i] = c;
+    }
+    DWORD len = 0;
+    GetLogicalProcessorInformation(NULL, &len);
+    if(len == 0)
+        return;
+    std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(len / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+    if(!GetLogicalProcessorInformation(&info[0], &len))
+        return;
+    int core = 0, package = 0;
+    for(size_t i = 0; i < info.size(); i++)
+    {
+        int smt = 0;
+        for(int bit = 0; bit < ncpu; bit++)
+        {
+            if((info[i].ProcessorMask & ((ULONG_PTR)1 << bit)) == 0)
+                continue;
+            switch(info[i].Relationship)
+            {
+            case RelationProcessorCore:
+                cpus[bit].core = core;
+                cpus[bit].smt  = smt++;
+                break;
+            case RelationProcessorPackage:
+                cpus[bit].package = package;
+                break;
+            case RelationNumaNode:
+                cpus[bit].numaNode = (int)info[i].NumaNode.NodeNumber;
+                break;
+            }
+        }
+        if(info[i].Relationship == RelationProcessorCore)
+            core++;
+        else if(info[i].Relationship == RelationProcessorPackage)
+            package++;
+    }
+}
+
+// SetThreadCpu
+bool CThread::SetThreadCpu(NThreadHandle thread, int cpu)
+{
+    return SetThreadAffinityMask(thread, (DWORD_PTR)1 << cpu) != 0;
+}
+
+// NumaLocalAlloc
+void* NumaLocalAlloc(size_t sz)
+{
+    PROCESSOR_NUMBER pn;
+    USHORT node;
+    GetCurrentProcessorNumberEx(&pn);
+    if(GetNumaProcessorNodeEx(&pn, &node))
+        return VirtualAllocExNuma(GetCurrentProcess(), NULL, sz, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+    return VirtualAlloc(NULL, sz, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+void NumaLocalFree(void* p, size_t sz)
+{
+    if(p)
+        VirtualFree(p, 0, MEM_RELEASE);
+}
 //int CThread::CpuCount0() 
 //{
 //    static int Cpus = -1;
@@ -344,7 +430,7 @@ int CThread::CpuCount() {
         size_t s = sizeof(Cpus);
         sysctlbyname("hw.logicalcpu", &Cpus, &s, NULL, 0);
 #endif // IOS
-#ifdef ANDROID
+#if defined ANDROID || defined LINUX
         Cpus = sysconf(_SC_NPROCESSORS_ONLN);
 #endif // ANDROID
         Cpus = Cpus > 1 ? Cpus : 1;
@@ -352,6 +438,116 @@ int CThread::CpuCount() {
     return Cpus;
 }
 
+#ifdef LINUX
+static int readSysInt(const char* path, int defaultValue)
+{
+    FILE* fp = fopen(path, "r");
+    if(fp == NULL)
+        return defaultValue;
+    int v = defaultValue;
+    if(fscanf(fp, "%d", &v) != 1)
+        v = defaultValue;
+    fclose(fp);
+    return v;
+}
+// the node of a CPU shows up as a "nodeN" entry in its sysfs directory
+static int readCpuNumaNode(int cpu)
+{
+    char path[128];
+    sprintf(path, "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* dir = opendir(path);
+    if(dir == NULL)
+        return 0;
+    int node = 0;
+    struct dirent* e;
+    while((e = readdir(dir)))
+    {
+        if((strncmp(e->d_name, "node", 4) == 0) && (sscanf(e->d_name + 4, "%d", &node) == 1))
+            break;
+        node = 0;
+    }
+    closedir(dir);
+    return node;
+}
+#endif
+
+// CpuTopology
+static void QueryCpuTopology(std::vector<NCpuInfo>& cpus)
+{
+#ifdef LINUX
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    bool hasMask = sched_getaffinity(0, sizeof(mask), &mask) == 0;
+    int  ncpu    = (int)sysconf(_SC_NPROCESSORS_CONF);
+    for(int i = 0; (i < ncpu) && (i < CPU_SETSIZE); i++)
+    {
+        // only what the process is allowed to run on (taskset, containers...)
+        if(hasMask && !CPU_ISSET(i, &mask))
+            continue;
+        char path[128];
+        NCpuInfo c;
+        c.cpu = i;
+        sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/core_id", i);
+        c.core = readSysInt(path, i);
+        sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", i);
+        c.package  = readSysInt(path, 0);
+        c.numaNode = readCpuNumaNode(i);
+        c.smt      = 0;
+        for(size_t j = 0; j < cpus.size(); j++)
+        {
+            if((cpus[j].core == c.core) && (cpus[j].package == c.package))
+                c.smt++;
+        }
+        cpus.push_back(c);
+    }
+#else
+    int ncpu = CThread::CpuCount();
+    for(int i = 0; i < ncpu; i++)
+    {
+        NCpuInfo c = {i, i, 0, 0, 0};
+        cpus.push_back(c);
+    }
+#endif
+}
+
+// SetThreadCpu
+bool CThread::SetThreadCpu(NThreadHandle thread, int cpu)
+{
+#ifdef LINUX
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+// NumaLocalAlloc
+void* NumaLocalAlloc(size_t sz)
+{
+#ifdef LINUX
+    // Linux places a page on the node of the thread that touches it first
+    void* p = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED)
+        return NULL;
+    memset(p, 0, sz);
+    return p;
+#else
+    return malloc(sz);
+#endif
+}
+void NumaLocalFree(void* p, size_t sz)
+{
+    if(p == NULL)
+        return;
+#ifdef LINUX
+    munmap(p, sz);
+#else
+    free(p);
+#endif
+}
+
 // Sleep
 void CThread::Sleep(const unsigned long Milliseconds) {
     usleep(1000 * (useconds_t)Milliseconds);
@@ -428,12 +624,91 @@ void CMutex::UnlockMutex() {
     pthread_mutex_unlock(&m_mutex);
 }
 
+#ifdef LINUX
+/////////////////////////////////////////////////////////////////////////////////////
+// FUTEX FUTEX FUTEX FUTEX FUTEX FUTEX FUTEX FUTEX FUTEX FUTEX FUTEX FUTEX FUTEX   //
+/////////////////////////////////////////////////////////////////////////////////////
+static bool s_useFutexSync = true;
+void SetUseFutexSync(bool b)
+{
+    s_useFutexSync = b;
+}
+bool GetUseFutexSync()
+{
+    return s_useFutexSync;
+}
+
+#define FUTEX_SPIN_MIN  16
+#define FUTEX_SPIN_MAX  4096
+#define FUTEX_SPIN_INIT 256
+#if defined(__i386__) || defined(__x86_64__)
+#   define FUTEX_CPU_PAUSE() __builtin_ia32_pause()
+#else
+#   define FUTEX_CPU_PAUSE()
+#endif
+
+static inline int futexWait(volatile int* addr, int expected, const struct timespec* relTimeout)
+{
+    return syscall(SYS_futex, (int*)addr, FUTEX_WAIT_PRIVATE, expected, relTimeout, NULL, 0);
+}
+static inline int futexWake(volatile int* addr, int count)
+{
+    return syscall(SYS_futex, (int*)addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+// spinning only makes sense if the thread we wait for can run meanwhile
+static inline int futexInitialSpin()
+{
+    return CThread::CpuCount() > 1 ? FUTEX_SPIN_INIT : 0;
+}
+// spin got it: allow longer spins. We had to sleep: spin less next time
+static inline void futexAdaptSpin(int& spinCount, bool spinWasEnough)
+{
+    if (spinCount == 0)
+        return;
+    if (spinWasEnough)
+        spinCount = (spinCount * 2) < FUTEX_SPIN_MAX ? spinCount * 2 : FUTEX_SPIN_MAX;
+    else
+        spinCount = (spinCount / 2) > FUTEX_SPIN_MIN ? spinCount / 2 : FUTEX_SPIN_MIN;
+}
+// FUTEX_WAIT takes a relative timeout: keep the absolute deadline to recompute it after each wake-up
+static inline void futexDeadline(int msTimeOut, struct timespec& deadline)
+{
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += msTimeOut / 1000;
+    deadline.tv_nsec += (long)(msTimeOut % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+}
+static inline bool futexRemaining(const struct timespec& deadline, struct timespec& rel)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rel.tv_sec  = deadline.tv_sec - now.tv_sec;
+    rel.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+    if (rel.tv_nsec < 0)
+    {
+        rel.tv_sec--;
+        rel.tv_nsec += 1000000000L;
+    }
+    return rel.tv_sec >= 0;
+}
+#endif // LINUX
+
 /////////////////////////////////////////////////////////////////////////////////////
 // SEMAPHORE SEMAPHORE SEMAPHORE SEMAPHORE SEMAPHORE SEMAPHORE SEMAPHORE SEMAPHORE //
 /////////////////////////////////////////////////////////////////////////////////////
 CSemaphore::CSemaphore(long initialCnt, long maxCnt)
 {
     CSemaphore::CreateSemaphore(m_semaphore, initialCnt, maxCnt);
+#ifdef LINUX
+    m_useFutex     = s_useFutexSync;
+    m_futexCount   = (int)initialCnt;
+    m_futexWaiters = 0;
+    m_spinCount    = futexInitialSpin();
+#endif
 }
 
 CSemaphore::~CSemaphore()
@@ -460,6 +735,51 @@ void CSemaphore::DeleteSemaphore()
 // AcquireSemaphore
 bool CSemaphore::AcquireSemaphore(int msTimeOut) 
 {
+#ifdef LINUX
+    if (m_useFutex)
+    {
+        struct timespec deadline, rel;
+        if (msTimeOut > 0)
+            futexDeadline(msTimeOut, deadline);
+        int  spin  = m_spinCount;
+        bool spun  = false;
+        bool slept = false;
+        while (true)
+        {
+            int c = __atomic_load_n(&m_futexCount, __ATOMIC_ACQUIRE);
+            if (c > 0)
+            {
+                if (__sync_bool_compare_and_swap(&m_futexCount, c, c - 1))
+                {
+                    if (slept || spun)
+                        futexAdaptSpin(m_spinCount, !slept);
+                    return true;
+                }
+                continue;
+            }
+            if (msTimeOut == 0)
+                return false;
+            if (spin > 0)
+            {
+                spin--;
+                spun = true;
+                FUTEX_CPU_PAUSE();
+                continue;
+            }
+            const struct timespec* timeout = NULL;
+            if (msTimeOut > 0)
+            {
+                if (!futexRemaining(deadline, rel))
+                    return false;
+                timeout = &rel;
+            }
+            slept = true;
+            __atomic_add_fetch(&m_futexWaiters, 1, __ATOMIC_SEQ_CST);
+            futexWait(&m_futexCount, 0, timeout);
+            __atomic_sub_fetch(&m_futexWaiters, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+#endif
     //if(msTimeOut == 0)
         sem_wait(&m_semaphore);
     /*else {
@@ -491,6 +811,19 @@ bool CSemaphore::AcquireSemaphore(int msTimeOut)
 // ReleaseSemaphore
 void CSemaphore::ReleaseSemaphore(long cnt) 
 {    
+#ifdef LINUX
+    if (m_useFutex)
+    {
+        if (cnt <= 0)
+            return;
+        __atomic_add_fetch(&m_futexCount, (int)cnt, __ATOMIC_SEQ_CST);
+        // a waiter increments m_futexWaiters before sleeping on the value it saw: either
+        // we see it here, or the kernel sees the new count and doesn't put it to sleep
+        if (__atomic_load_n(&m_futexWaiters, __ATOMIC_SEQ_CST) > 0)
+            futexWake(&m_futexCount, cnt > INT_MAX ? INT_MAX : (int)cnt);
+        return;
+    }
+#endif
     for(;cnt > 0; cnt--)
         sem_post(&m_semaphore);
     
@@ -508,6 +841,12 @@ CEvent::CEvent(bool manualReset, bool initialState)
     m_manualReset = manualReset;
     // TODO: put it in CreateEvent
     pthread_mutex_init(&m_mutex, NULL); // do we need non-default attrs (second arg)?
+#ifdef LINUX
+    m_useFutex     = s_useFutexSync;
+    m_futexWord    = initialState ? 1 : 0;
+    m_futexWaiters = 0;
+    m_spinCount    = futexInitialSpin();
+#endif
 }
 CEvent::~CEvent()
 {
@@ -528,6 +867,16 @@ void CEvent::DeleteEvent()
 }
 bool CEvent::Set()
 {
+#ifdef LINUX
+    if (m_useFutex)
+    {
+        __atomic_store_n(&m_futexWord, 1, __ATOMIC_SEQ_CST);
+        // auto-reset: only one waiter can consume the signal
+        if (__atomic_load_n(&m_futexWaiters, __ATOMIC_SEQ_CST) > 0)
+            futexWake(&m_futexWord, m_manualReset ? INT_MAX : 1);
+        return true;
+    }
+#endif
     int r = 0;
     pthread_mutex_lock(&m_mutex);
     
@@ -542,6 +891,15 @@ bool CEvent::Set()
 }
 bool CEvent::Pulse()
 {
+#ifdef LINUX
+    if (m_useFutex)
+    {
+        // like the broadcast below: waiters wake up, see nothing signaled and wait again
+        if (__atomic_load_n(&m_futexWaiters, __ATOMIC_SEQ_CST) > 0)
+            futexWake(&m_futexWord, INT_MAX);
+        return true;
+    }
+#endif
     pthread_mutex_lock(&m_mutex);
     
     int r = pthread_cond_broadcast(&m_event);
@@ -551,6 +909,13 @@ bool CEvent::Pulse()
 }
 bool CEvent::Reset()
 {
+#ifdef LINUX
+    if (m_useFutex)
+    {
+        __atomic_store_n(&m_futexWord, 0, __ATOMIC_SEQ_CST);
+        return false;
+    }
+#endif
     pthread_mutex_lock(&m_mutex);
     m_signaled = false;
     pthread_mutex_unlock(&m_mutex);
@@ -558,6 +923,51 @@ bool CEvent::Reset()
 }
 bool CEvent::WaitOnEvent(int msTimeOut)
 {
+#ifdef LINUX
+    if (m_useFutex)
+    {
+        struct timespec deadline, rel;
+        if (msTimeOut > 0)
+            futexDeadline(msTimeOut, deadline);
+        int  spin  = m_spinCount;
+        bool spun  = false;
+        bool slept = false;
+        while (true)
+        {
+            // manual reset: the signal stays for everybody. Auto-reset: the first one consumes it
+            if (m_manualReset)
+            {
+                if (__atomic_load_n(&m_futexWord, __ATOMIC_ACQUIRE) == 1)
+                    break;
+            }
+            else if (__sync_bool_compare_and_swap(&m_futexWord, 1, 0))
+                break;
+            if (msTimeOut == 0)
+                return false;
+            if (spin > 0)
+            {
+                spin--;
+                spun = true;
+                FUTEX_CPU_PAUSE();
+                continue;
+            }
+            const struct timespec* timeout = NULL;
+            if (msTimeOut > 0)
+            {
+                if (!futexRemaining(deadline, rel))
+                    return false;
+                timeout = &rel;
+            }
+            slept = true;
+            __atomic_add_fetch(&m_futexWaiters, 1, __ATOMIC_SEQ_CST);
+            futexWait(&m_futexWord, 0, timeout);
+            __atomic_sub_fetch(&m_futexWaiters, 1, __ATOMIC_SEQ_CST);
+        }
+        if (slept || spun)
+            futexAdaptSpin(m_spinCount, !slept);
+        return true;
+    }
+#endif
     pthread_mutex_lock(&m_mutex);
     
     //convert timeout to a timespec, pthreads wants the final time not the length
@@ -602,6 +1012,36 @@ bool CEvent::WaitOnEvent(int msTimeOut)
 }
 #endif // IOS || ANDROID
 
+/////////////////////////////////////////////////////////////////////////////////////
+// TOPOLOGY TOPOLOGY TOPOLOGY TOPOLOGY TOPOLOGY TOPOLOGY TOPOLOGY TOPOLOGY TOPOLOGY //
+/////////////////////////////////////////////////////////////////////////////////////
+const std::vector<NCpuInfo>& CThread::CpuTopology()
+{
+    static std::vector<NCpuInfo> cpus;
+    if(cpus.empty())
+    {
+        QueryCpuTopology(cpus);
+        if(cpus.empty())
+        {
+            NCpuInfo c = {0, 0, 0, 0, 0};
+            cpus.push_back(c);
+        }
+    }
+    return cpus;
+}
+
+int CThread::PhysicalCoreCount()
+{
+    const std::vector<NCpuInfo>& cpus = CpuTopology();
+    int n = 0;
+    for(size_t i = 0; i < cpus.size(); i++)
+    {
+        if(cpus[i].smt == 0)
+            n++;
+    }
+    return n > 0 ? n : 1;
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -635,3 +1075,211 @@ void NThreadLocalNonPODBase::DeleteAllTLSDataInThisThread()
 }
 
 
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////////
+// NThreadContext NThreadContext NThreadContext NThreadContext NThreadContext NThreadContext
+///////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int AllocThreadContextSlot()
+{
+  static CCriticalSection cs;
+  static int              numSlots = 0;
+  CCriticalSectionHolder  h(cs);
+  assert(numSlots < NTHREADCONTEXT_MAXSLOTS);
+  if(numSlots >= NTHREADCONTEXT_MAXSLOTS)
+  {
+    fprintf(stderr, "AllocThreadContextSlot: raise NTHREADCONTEXT_MAXSLOTS (%d)\n", NTHREADCONTEXT_MAXSLOTS);
+    abort();
+  }
+  return numSlots++;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////////
+// NTrace NTrace NTrace NTrace NTrace NTrace NTrace NTrace NTrace NTrace NTrace NTrace NTrace NTrace
+///////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////////
+
+volatile bool NTrace::s_recording = false;
+
+struct TraceSpan
+{
+  const char* name;
+  uint64      beginNs;
+  uint64      endNs;
+};
+// spans of one thread: only this thread appends to it
+struct TraceBuffer
+{
+  std::vector<TraceSpan> spans;
+  std::string            threadName;
+};
+struct TraceTrackSpan
+{
+  const char* track;
+  const char* name;
+  uint64      beginNs;
+  uint64      endNs;
+  const char* argName;
+  double      argValue;
+};
+// a std::mutex rather than a CCriticalSection: the locks of CMutex are traced themselves
+static std::mutex                  s_traceLock;
+static std::vector<TraceBuffer*>   s_traceBuffers;
+static std::vector<TraceTrackSpan> s_traceTrackSpans;
+static std::thread::id             s_traceStartThread;
+
+static NThreadContextVar<TraceBuffer*>& traceBufferOfThread()
+{
+  static NThreadContextVar<TraceBuffer*> s_buffer;
+  return s_buffer;
+}
+
+static void writeJSONString(FILE* fp, const char* str)
+{
+  fputc('"', fp);
+  for(const char* c = str; *c; c++)
+  {
+    if(*c == '"' || *c == '\\')
+      fputc('\\', fp);
+    fputc((unsigned char)*c >= 0x20 ? *c : ' ', fp);
+  }
+  fputc('"', fp);
+}
+
+void NTrace::Start()
+{
+  {
+    std::lock_guard<std::mutex> h(s_traceLock);
+    s_traceStartThread = std::this_thread::get_id();
+  }
+  s_recording = true;
+}
+
+void NTrace::Stop()
+{
+  s_recording = false;
+}
+
+void NTrace::Clear()
+{
+  std::lock_guard<std::mutex> h(s_traceLock);
+  for(size_t i = 0; i < s_traceBuffers.size(); i++)
+    s_traceBuffers[i]->spans.clear();
+  s_traceTrackSpans.clear();
+}
+
+uint64 NTrace::ClockNs()
+{
+  return (uint64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void NTrace::AddSpan(const char* name, uint64 beginNs, uint64 endNs)
+{
+  if(!s_recording)
+    return;
+  TraceBuffer* buffer = traceBufferOfThread();
+  if(!buffer)
+  {
+    // first span of this thread: the buffer is kept when the thread exits
+    buffer = new TraceBuffer;
+    buffer->spans.reserve(4096);
+    NThreadContext& ctx = GetThreadContext();
+    char            threadName[64];
+    if(ctx.workerStats)
+      snprintf(threadName, sizeof(threadName), "worker %d", ctx.threadNumber);
+    else if(std::this_thread::get_id() == s_traceStartThread)
+      snprintf(threadName, sizeof(threadName), "main thread");
+    else
+      snprintf(threadName, sizeof(threadName), "thread");
+    buffer->threadName = threadName;
+    {
+      std::lock_guard<std::mutex> h(s_traceLock);
+      s_traceBuffers.push_back(buffer);
+    }
+    traceBufferOfThread() = buffer;
+  }
+  TraceSpan span = {name, beginNs, endNs};
+  buffer->spans.push_back(span);
+}
+
+void NTrace::AddTrackSpan(const char* track, const char* name, uint64 beginNs, uint64 endNs, const char* argName, double argValue)
+{
+  if(!s_recording)
+    return;
+  TraceTrackSpan span = {track, name, beginNs, endNs, argName, argValue};
+  std::lock_guard<std::mutex> h(s_traceLock);
+  s_traceTrackSpans.push_back(span);
+}
+
+bool NTrace::WriteChromeTrace(const char* fname)
+{
+  std::lock_guard<std::mutex> h(s_traceLock);
+  FILE*                       fp = fopen(fname, "w");
+  if(!fp)
+    return false;
+  // times relative to the first span, in microseconds
+  uint64 originNs = ~(uint64)0;
+  for(size_t b = 0; b < s_traceBuffers.size(); b++)
+    for(size_t i = 0; i < s_traceBuffers[b]->spans.size(); i++)
+      originNs = std::min(originNs, s_traceBuffers[b]->spans[i].beginNs);
+  for(size_t i = 0; i < s_traceTrackSpans.size(); i++)
+    originNs = std::min(originNs, s_traceTrackSpans[i].beginNs);
+
+  fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  bool bFirst = true;
+  for(size_t b = 0; b < s_traceBuffers.size(); b++)
+  {
+    const TraceBuffer* buffer = s_traceBuffers[b];
+    if(buffer->spans.empty())
+      continue;
+    int tid = (int)b + 1;
+    fprintf(fp, "%s{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":", bFirst ? "" : ",\n", tid);
+    writeJSONString(fp, buffer->threadName.c_str());
+    fprintf(fp, "}}");
+    bFirst = false;
+    for(size_t i = 0; i < buffer->spans.size(); i++)
+    {
+      const TraceSpan& span = buffer->spans[i];
+      fprintf(fp, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"name\":", tid,
+              double(span.beginNs - originNs) / 1000.0, double(span.endNs - span.beginNs) / 1000.0);
+      writeJSONString(fp, span.name);
+      fprintf(fp, "}");
+    }
+  }
+  // one pseudo-thread per track, after the threads
+  std::vector<const char*> tracks;
+  for(size_t i = 0; i < s_traceTrackSpans.size(); i++)
+  {
+    const TraceTrackSpan& span = s_traceTrackSpans[i];
+    size_t                t    = 0;
+    while(t < tracks.size() && strcmp(tracks[t], span.track) != 0)
+      t++;
+    int tid = 1000 + (int)t;
+    if(t == tracks.size())
+    {
+      tracks.push_back(span.track);
+      fprintf(fp, "%s{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":", bFirst ? "" : ",\n", tid);
+      writeJSONString(fp, span.track);
+      fprintf(fp, "}}");
+      bFirst = false;
+    }
+    fprintf(fp, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"name\":", tid,
+            double(span.beginNs - originNs) / 1000.0, double(span.endNs - span.beginNs) / 1000.0);
+    writeJSONString(fp, span.name);
+    if(span.argName)
+    {
+      fprintf(fp, ",\"args\":{");
+      writeJSONString(fp, span.argName);
+      fprintf(fp, ":%g}", span.argValue);
+    }
+    fprintf(fp, "}");
+  }
+  fprintf(fp, "\n]}\n");
+  fclose(fp);
+  return true;
+}
@@ -81,9 +81,12 @@ typedef pthread_mutex_t                   NMutexHandle;
 #    define NX_RANGEPUSH(name)
 #    define NX_RANGEPUSHCOL(name, c)
 #    define NX_RANGEPOP()
-#    define NXPROFILEFUNC(name)
-#    define NXPROFILEFUNCCOL(name, c)
-#    define NXPROFILEFUNCCOL2(name, c, a)
+#    undef NXPROFILEFUNC
+#    undef NXPROFILEFUNCCOL
+#    undef NXPROFILEFUNCCOL2
+#    define NXPROFILEFUNC(name) NTraceScope nxTraceMe(name)
+#    define NXPROFILEFUNCCOL(name, c) NTraceScope nxTraceMe(name)
+#    define NXPROFILEFUNCCOL2(name, c, a) NTraceScope nxTraceMe(name)
 
 #endif
 #ifdef WIN32
@@ -155,14 +158,30 @@ typedef HANDLE                            NMutexHandle;
 #    define NX_RANGEPUSH(name)
 #    define NX_RANGEPUSHCOL(name, c)
 #    define NX_RANGEPOP()
-#    define NXPROFILEFUNC(name)
-#    define NXPROFILEFUNCCOL(name, c)
-#    define NXPROFILEFUNCCOL2(name, c, a)
+#    undef NXPROFILEFUNC
+#    undef NXPROFILEFUNCCOL
+#    undef NXPROFILEFUNCCOL2
+#    define NXPROFILEFUNC(name) NTraceScope nxTraceMe(name)
+#    define NXPROFILEFUNCCOL(name, c) NTraceScope nxTraceMe(name)
+#    define NXPROFILEFUNCCOL2(name, c, a) NTraceScope nxTraceMe(name)
 #endif
 #endif // _WIN32
 
 
 extern void thread_function(void *pData);
+/******************************************************************************/
+/**
+ ** \brief one logical CPU, as seen by the OS
+ **/
+struct NCpuInfo
+{
+    int cpu;        ///< index for the affinity calls
+    int core;       ///< physical core id (unique in the package)
+    int package;    ///< socket
+    int numaNode;
+    int smt;        ///< 0 for the first hardware thread of the core, 1 for its sibling...
+};
+
 /******************************************************************************/
 /**
  ** CThread class
@@ -196,6 +215,12 @@ public:
 
     // static methods
     static int CpuCount();
+    /// \brief CPUs available to the process. Cached after the first call
+    static const std::vector<NCpuInfo>& CpuTopology();
+    /// \brief amount of distinct (package, core) in CpuTopology()
+    static int PhysicalCoreCount();
+    /// \brief pins a thread to one logical CPU
+    static bool SetThreadCpu(NThreadHandle thread, int cpu);
     static void Sleep(const unsigned long Milliseconds);
     static void WaitThreads(const NThreadHandle *Threads, const int Count);
 
@@ -285,6 +310,13 @@ protected:
     void DeleteSemaphore();
 
     NSemaphoreHandle m_semaphore;
+#ifdef LINUX
+    // futex version: the count itself is the futex word
+    bool         m_useFutex;
+    volatile int m_futexCount;
+    volatile int m_futexWaiters;
+    int          m_spinCount;
+#endif
 };
 
 /******************************************************************************/
@@ -315,9 +347,40 @@ protected:
     mutable bool m_signaled;
     mutable bool m_manualReset;
 #endif // _WIN32
-
+#ifdef LINUX
+    // futex version: m_futexWord is 1 when signaled
+    bool         m_useFutex;
+    volatile int m_futexWord;
+    volatile int m_futexWaiters;
+    int          m_spinCount;
+#endif
 };
 
+/******************************************************************************/
+/**
+ ** \brief memory placed on the NUMA node of the calling thread
+ **
+ ** the pages get committed and touched by the caller: a worker pinned to a CPU gets
+ ** its per-thread data on its own node. Page granularity: meant for few, long lived
+ ** allocations
+ **/
+void* NumaLocalAlloc(size_t sz);
+void  NumaLocalFree(void* p, size_t sz);
+
+#ifdef LINUX
+/******************************************************************************/
+/**
+ ** \brief Linux: CEvent and CSemaphore created after this call use a futex (default)
+ ** or the pthread condition variable / sem_t implementation.
+ **
+ ** The futex version spins a little before sleeping in the kernel: handoffs between
+ ** frame phases are expected to last microseconds. The spin length adapts to how
+ ** often spinning was enough. No spinning at all on single-CPU systems
+ **/
+void SetUseFutexSync(bool b);
+bool GetUseFutexSync();
+#endif
+
 #ifdef WIN32
 
 //for some bizzarre reason MS doesn't define all of these on x86...
@@ -697,3 +760,113 @@ public:
 };
 
 
+//////////////////////////////////////////////////////////////////////////////////////////////
+class TaskQueue;
+class TaskArena;
+struct NWorkerStats;
+
+#define NTHREADCONTEXT_MAXSLOTS 16
+
+/******************************************************************************/
+/**
+ ** \brief what a thread needs on hot paths, in one compiler TLS block
+ **
+ ** NThreadLocalVar goes through TlsGetValue/pthread_getspecific on every access.
+ ** This struct is reached through a single NV_DECLSPEC_THREAD variable instead: a
+ ** segment-relative load. The workers fill the fixed fields when they start; the
+ ** slots are handed to NThreadContextVar for the per-renderer data
+ **/
+struct NThreadContext
+{
+    int             threadNumber;   ///< worker ID, 0 for threads that aren't workers
+    TaskQueue*      taskQueue;      ///< queue of the worker running on this thread
+    NWorkerStats*   workerStats;    ///< counters of this worker (NULL for other threads)
+    TaskArena*      scratch;        ///< frame-temporary memory, see GetThreadScratch()
+    int             scratchFrame;   ///< scratch frame in which 'scratch' got reset last
+    void*           slots[NTHREADCONTEXT_MAXSLOTS];
+};
+
+__forceinline NThreadContext& GetThreadContext()
+{
+    // POD and zero-initialized: no guard, no constructor call on first access
+    static NV_DECLSPEC_THREAD NThreadContext s_ctx;
+    return s_ctx;
+}
+
+/**
+ ** \brief reserves one of the NThreadContext::slots
+ **
+ ** Slots are never given back: a new owner would otherwise read the pointers the
+ ** previous one left in the other threads
+ **/
+int AllocThreadContextSlot();
+
+/******************************************************************************/
+/**
+ ** \brief drop-in for NThreadLocalVar<T*> stored in a NThreadContext slot
+ **/
+template <class T>
+class NThreadContextVar;
+
+template <class T>
+class NThreadContextVar<T*>
+{
+    int m_slot;
+    __forceinline T* GetPtr() const { return (T*)GetThreadContext().slots[m_slot]; }
+public:
+    __forceinline NThreadContextVar() { m_slot = AllocThreadContextSlot(); }
+    __forceinline T* operator=(T* v)
+    {
+        GetThreadContext().slots[m_slot] = v;
+        return v;
+    }
+    __forceinline operator T*() { return GetPtr(); }
+    __forceinline operator const T*() const { return GetPtr(); }
+    __forceinline T* operator->() { return GetPtr(); }
+    __forceinline const T* operator-> () const{ return GetPtr(); }
+};
+
+/******************************************************************************/
+/**
+ ** \brief timeline of the threads, written as a Chrome trace (chrome://tracing,
+ ** ui.perfetto.dev)
+ **
+ ** While recording, NTraceScope (NXPROFILEFUNC when no other profiler is plugged),
+ ** the tasks of the workers and the sections of the sample append spans to a buffer
+ ** owned by the calling thread: nothing is shared on the way. Buffers outlive their
+ ** threads, so a trace can cover a re-creation of the pool. Names must be static
+ ** strings. Stop() then WriteChromeTrace() once no thread adds spans anymore
+ **/
+class NTrace
+{
+public:
+    static void     Start();
+    static void     Stop();
+    __forceinline static bool IsRecording() { return s_recording; }
+    /// \brief forgets the spans recorded so far
+    static void     Clear();
+    static uint64   ClockNs();
+    /// \brief span on the timeline of the calling thread
+    static void     AddSpan(const char* name, uint64 beginNs, uint64 endNs);
+    /// \brief span on a timeline of its own, not tied to a thread (ex: "GPU"). argName/argValue show in the details
+    static void     AddTrackSpan(const char* track, const char* name, uint64 beginNs, uint64 endNs, const char* argName = NULL, double argValue = 0.0);
+    static bool     WriteChromeTrace(const char* fname);
+private:
+    static volatile bool s_recording;
+};
+
+/**
+ ** \brief span of the scope, when NTrace records
+ **/
+class NTraceScope
+{
+    const char* m_name;
+    uint64      m_beginNs;
+public:
+    __forceinline NTraceScope(const char* name) : m_name(name), m_beginNs(NTrace::IsRecording() ? NTrace::ClockNs() : 0) {}
+    __forceinline ~NTraceScope()
+    {
+        if (m_beginNs)
+            NTrace::AddSpan(m_name, m_beginNs, NTrace::ClockNs());
+    }
+};
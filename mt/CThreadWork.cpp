@@ -28,6 +28,9 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
 #include "CThreadWork.h"
 #include "nvh/nvprint.hpp"
 
@@ -65,6 +68,11 @@
 
 //#pragma mark - Task base
 
+static inline uint64 statsClockNs()
+{
+    return (uint64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 /************************************************************************************/
 /************************************************************************************/
 /************************************************************************************/
@@ -233,8 +241,7 @@ uint GetNumCPUCores()
 //    else
 //        return 2; //T20
 #else
-#   pragma warning CPU cores is hard coded to 2 for now...
-    return 2;
+    return (uint)CThread::CpuCount();
 #endif
 #endif
 }
@@ -255,9 +262,111 @@ TaskBase::~TaskBase()
  **/
 void TaskBase::Done()
 {
-  delete this; // ok because ~NThreadTaskBase is virtual
+  Destroy();
   return;
 }
+/**
+    tasks from a TaskArena don't own their memory: only call the destructor
+ **/
+void TaskBase::Destroy()
+{
+  if(m_heapAllocated)
+    delete this; // ok because ~NThreadTaskBase is virtual
+  else
+    this->~TaskBase();
+}
+
+//#pragma mark - Task arena
+
+/************************************************************************************/
+/************************************************************************************/
+/************************************************************************************/
+/**
+ ** Constructors
+ **/
+TaskArena::TaskArena(size_t blockSize) :
+    m_blockSize(blockSize),
+    m_curBlock(0),
+    m_offset(0)
+{
+}
+
+TaskArena::~TaskArena()
+{
+    for (size_t i = 0; i < m_blocks.size(); i++)
+        ::operator delete(m_blocks[i].ptr);
+    m_blocks.clear();
+}
+
+/************************************************************************************/
+/**
+ ** bump allocation in the current block. A new block only gets allocated when
+ ** all the existing ones are full: after few frames, this never happens anymore
+ **/
+void* TaskArena::allocate(size_t sz, size_t alignment)
+{
+    while (m_curBlock < m_blocks.size())
+    {
+        Block& b = m_blocks[m_curBlock];
+        size_t offset = (m_offset + alignment - 1) & ~(alignment - 1);
+        if (offset + sz <= b.size)
+        {
+            m_offset = offset + sz;
+            return b.ptr + offset;
+        }
+        m_curBlock++;
+        m_offset = 0;
+    }
+    Block b;
+    b.size = sz > m_blockSize ? sz : m_blockSize;
+    b.ptr  = (char*)::operator new(b.size); // not malloc: visible to the allocation counting of the sample
+    m_blocks.push_back(b);
+    m_curBlock = m_blocks.size() - 1;
+    m_offset   = sz;
+    return b.ptr;
+}
+
+/************************************************************************************/
+/**
+ ** 
+ **/
+void TaskArena::reset()
+{
+    m_curBlock = 0;
+    m_offset   = 0;
+}
+
+/************************************************************************************/
+/**
+ ** scratch frames: only the thread owning an arena resets it, lazily
+ **/
+static volatile int g_scratchFrame = 0;
+
+TaskArena* GetThreadScratch()
+{
+    NThreadContext& ctx = GetThreadContext();
+    if (!ctx.scratch)
+    {
+        // not a worker: kept until the process exits
+        ctx.scratch      = new TaskArena();
+        ctx.scratchFrame = g_scratchFrame;
+    }
+    else if (ctx.scratchFrame != g_scratchFrame)
+    {
+        ctx.scratch->reset();
+        ctx.scratchFrame = g_scratchFrame;
+    }
+    return ctx.scratch;
+}
+
+void BeginScratchFrame()
+{
+#ifdef WIN32
+    InterlockedIncrement((volatile LONG*)&g_scratchFrame);
+#else
+    __sync_add_and_fetch(&g_scratchFrame, 1);
+#endif
+}
 
 //#pragma mark - Task list
 
@@ -273,6 +382,7 @@ TaskQueue::TaskQueue() :
     m_dataReadyEvent(NULL),
 #endif
     m_taskCount(0),
+    m_taskCountHighWater(0),
     m_thread(0)
     {}
 
@@ -281,7 +391,8 @@ TaskQueue::TaskQueue(/*CThread **/NThreadHandle thread, CEvent* dataReadyEvent)
     m_taskQueue(16),
     m_dataReadyEvent(dataReadyEvent),
 #endif
-    m_taskCount(0)
+    m_taskCount(0),
+    m_taskCountHighWater(0)
 {
 #ifdef WIN32
     if(thread)
@@ -303,7 +414,8 @@ TaskQueue::TaskQueue(NThreadID id, CEvent* dataReadyEvent) :
     m_taskQueue(16),
     m_dataReadyEvent(dataReadyEvent),
 #endif
-    m_taskCount(0)
+    m_taskCount(0),
+    m_taskCountHighWater(0)
 {
     if(id == 0)
         m_threadID = GetCurrentThreadId();
@@ -325,6 +437,7 @@ TaskQueue::~TaskQueue()
 
 TaskQueue::TaskQueue(CEvent* dataReadyEvent) :
     m_taskCount(0),
+    m_taskCountHighWater(0),
     m_thread(0),
     m_dataReadyEvent(dataReadyEvent),
     m_taskQueue(16)
@@ -367,18 +480,56 @@ void TaskQueue::pushTask(TaskBase * task)
 #if !defined WIN32 || defined NOWIN32BUILTIN
     task->m_queueCountRef = &m_taskCount;
 #ifdef WIN32
-    InterlockedIncrement(&m_taskCount);
+    updateHighWater((int)InterlockedIncrement(&m_taskCount));
 #else
-    __sync_fetch_and_add(&m_taskCount, 1);
+    updateHighWater((int)__sync_add_and_fetch(&m_taskCount, 1));
 #endif
     pushTaskFunc(taskThreadFunc, task);
 #else
     task->m_queueCountRef = &m_taskCount;
-    InterlockedIncrement(&m_taskCount);
+    updateHighWater((int)InterlockedIncrement(&m_taskCount));
     pushTaskFunc(taskThreadFunc, task);
 #endif
 }
 /************************************************************************************/
+/**
+ ** one lock and one Set() of the event for the whole batch: pushing N tasks with
+ ** pushTask() would wake the thread up N times and make it fight for the lock
+ **/
+void TaskQueue::pushTasks(TaskBase** tasks, int count, int stride)
+{
+    NXPROFILEFUNCCOL(__FUNCTION__, COLOR_CYAN);
+    if (count <= 0)
+        return;
+    for (int i = 0; i < count; i++)
+        tasks[i*stride]->m_queueCountRef = &m_taskCount;
+#ifdef WIN32
+    updateHighWater((int)InterlockedExchangeAdd(&m_taskCount, count) + count);
+#else
+    updateHighWater((int)__sync_add_and_fetch(&m_taskCount, count));
+#endif
+#if !defined WIN32 || defined NOWIN32BUILTIN
+    CCriticalSectionHolder h(m_taskQueueLock);
+    for (int i = 0; i < count; i++)
+        m_taskQueue.WriteData(std::make_pair((ThreadFunc)taskThreadFunc, (void*)tasks[i*stride]));
+    if (m_dataReadyEvent)
+        m_dataReadyEvent->Set();
+#else
+    // APCs are queued one by one anyway: the thread gets them all at its next alertable wait
+    for (int i = 0; i < count; i++)
+        pushTaskFunc(taskThreadFunc, tasks[i*stride]);
+#endif
+}
+/************************************************************************************/
+/**
+ ** only grows until reset. Not atomic: concurrent pushes may miss a peak by a few tasks
+ **/
+void TaskQueue::updateHighWater(int n)
+{
+    if (n > m_taskCountHighWater)
+        m_taskCountHighWater = n;
+}
+/************************************************************************************/
 /**
  ** timeout != 0 means that we are getting stuck for a timeout amount (or infinitely)
  ** if no task are there. Can be used when we want to really wait for some things to be done
@@ -427,7 +578,20 @@ void TaskQueue::taskThreadFunc(void* params)
     //    LOGI("invoking task %p\n", params);
     //}
 #endif
+    // busy time of a worker: what the task didn't spend waiting. Tasks nesting others
+    // (QueuedWorkProcessorTask) account for them as they go: busyNs is set, not added to
+    NWorkerStats* stats = GetThreadContext().workerStats;
+    uint64 t0 = 0, idle0 = 0, busy0 = 0;
+    if (stats)
+    {
+        t0 = statsClockNs();
+        idle0 = stats->idleNs;
+        busy0 = stats->busyNs;
+    }
+    uint64 traceBegin = NTrace::IsRecording() ? NTrace::ClockNs() : 0;
     task->Invoke();
+    if (traceBegin)
+        NTrace::AddSpan(task->getTraceName(), traceBegin, NTrace::ClockNs());
     
     if (task->m_queueCountRef)
     {
@@ -442,6 +606,11 @@ void TaskQueue::taskThreadFunc(void* params)
         //NXPROFILEFUNCCOL("task->Done", COLOR_BLUE);
         task->Done();
     }
+    if (stats)
+    {
+        stats->busyNs = busy0 + (statsClockNs() - t0) - (stats->idleNs - idle0);
+        stats->tasksExecuted++;
+    }
 }
 
 /************************************************************************************/
@@ -453,29 +622,47 @@ void TaskQueue::FlushTasks(bool waitAlertable /*= false*/)
     //TODO : we should spin into this untill the work is done (because we assume we added ourselves to the end of the queue)
 }
 
+#if defined WIN32 && !defined NOWIN32BUILTIN
+static void CB_CONV wakeUpFunc(void* params)
+{
+    // nothing to do: the APC only exists to get the thread out of its alertable wait
+}
+#endif
+/************************************************************************************/
+/**
+ **
+ **/
+void TaskQueue::wakeUp()
+{
+#if !defined WIN32 || defined NOWIN32BUILTIN
+    if (m_dataReadyEvent)
+        m_dataReadyEvent->Set();
+#else
+    pushTaskFunc(wakeUpFunc, NULL);
+#endif
+}
+
 //#pragma mark - Thread worker
 /************************************************************************************/
 /************************************************************************************/
 /************************************************************************************/
 
-static NThreadLocalVar<TaskQueue*> g_tl_currentTaskQueue;
+// current queue and number of the thread are kept in its NThreadContext
 TaskQueue* getCurrentTaskQueue()
 {
-  return g_tl_currentTaskQueue;
+  return GetThreadContext().taskQueue;
 }
 void setCurrentTaskQueue(TaskQueue * tb)
 {
-  g_tl_currentTaskQueue = tb;
+  GetThreadContext().taskQueue = tb;
 }
-// keep locally the number of the thread
-static NThreadLocalVar<int> g_tl_ThreadNumber;
 int getThreadNumber()
 {
-  return g_tl_ThreadNumber;
+  return GetThreadContext().threadNumber;
 }
 void setThreadNumber(int n)
 {
-  g_tl_ThreadNumber = n;
+  GetThreadContext().threadNumber = n;
 }
 
 
@@ -487,8 +674,9 @@ ThreadWorker::ThreadWorker(const std::string& threadName, bool discardQueuedOnEx
   m_invoker(&m_dataReadyEvent),
 #endif
   m_discardQueuedOnExit(discardQueuedOnExit), //m_alertableOnExit(waitAleratableOnExit),
-  m_threadName(threadName)
+  m_threadName(threadName), m_cpu(-1)
 {
+    memset(&m_stats, 0, sizeof(m_stats));
     static int cnt = 0;
     m_workerID = cnt++;
 #ifdef WIN32
@@ -691,6 +879,57 @@ void ThreadWorker::SetBackgroundMode(bool b)
 #endif
 }
 
+/************************************************************************************/
+/**
+ ** 
+ **/
+bool ThreadWorker::SetCpu(int cpu)
+{
+  bool ok;
+  if(cpu < 0)
+  {
+#ifdef WIN32
+    DWORD_PTR processMask, systemMask;
+    GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask);
+    ok = SetThreadAffinityMask(m_invoker.m_thread, processMask) != 0;
+#elif defined LINUX
+    const std::vector<NCpuInfo>& cpus = CThread::CpuTopology();
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(size_t i = 0; i < cpus.size(); i++)
+      CPU_SET(cpus[i].cpu, &set);
+    ok = pthread_setaffinity_np(m_invoker.m_thread, sizeof(set), &set) == 0;
+#else
+    ok = true;
+#endif
+  }
+  else
+    ok = CThread::SetThreadCpu(m_invoker.m_thread, cpu);
+  if(ok)
+    m_cpu = cpu;
+  return ok;
+}
+
+/************************************************************************************/
+/**
+ ** 
+ **/
+void ThreadWorker::GetStats(NWorkerStats& stats)
+{
+  stats                = m_stats;
+  stats.queueHighWater = m_invoker.GetQueuedTaskHighWater();
+  // the wait in progress counts as idle already
+  uint64 waitStart = stats.waitStartNs;
+  if (waitStart)
+    stats.idleNs += statsClockNs() - waitStart;
+}
+void ThreadWorker::ResetStats()
+{
+  // executed from another thread than the worker: a task finishing meanwhile may add its counts
+  memset(&m_stats, 0, sizeof(m_stats));
+  m_invoker.ResetQueuedTaskHighWater();
+}
+
 #if !defined WIN32 || defined NOWIN32BUILTIN
 /************************************************************************************/
 /**
@@ -706,9 +945,13 @@ NTHREAD_PROC_CALL_CONV ThreadWorker::threadFunc(void* p)
   NXPROFILEFUNCCOL(__FUNCTION__, COLOR_RED2);
   ThreadWorker* t = (ThreadWorker*)p;
 
-  g_tl_ThreadNumber = t->GetWorkerID();
+  NThreadContext& ctx = GetThreadContext();
+  ctx.threadNumber = t->GetWorkerID();
   // Set the m_invoker as the current TaskQueue
-  g_tl_currentTaskQueue = &t->GetTaskQueue();
+  ctx.taskQueue = &t->GetTaskQueue();
+  ctx.workerStats = &t->m_stats;
+  ctx.scratch = &t->m_scratch;
+  ctx.scratchFrame = g_scratchFrame;
   {
     CCriticalSectionHolder h(t->m_threadNameSec);
     if (t->m_threadName.size())
@@ -724,7 +967,12 @@ NTHREAD_PROC_CALL_CONV ThreadWorker::threadFunc(void* p)
     //wait for a new task (the cross thread invoker will signal this event
     // see TaskQueue::Invoke(...) 
     // m_dataReadyEvent shared with TaskQueue
+    uint64 t0 = statsClockNs();
+    t->m_stats.waitStartNs = t0;
     t->m_dataReadyEvent.WaitOnEvent();
+    t->m_stats.waitStartNs = 0;
+    t->m_stats.idleNs += statsClockNs() - t0;
+    t->m_stats.wakeUps++;
     // Execute all the Jobs that are inside the m_invoker
     while(t->m_invoker.pollTask())
     {
@@ -750,9 +998,13 @@ unsigned NTHREAD_PROC_CALL_CONV ThreadWorker::threadFunc(void* p)
 {
   ThreadWorker* t = (ThreadWorker*)p;
 
-  g_tl_ThreadNumber = t->GetWorkerID();
-    // Set the m_invoker as the current TaskQueue
-  g_tl_currentTaskQueue = &t->GetTaskQueue();
+  NThreadContext& ctx = GetThreadContext();
+  ctx.threadNumber = t->GetWorkerID();
+  // Set the m_invoker as the current TaskQueue
+  ctx.taskQueue = &t->GetTaskQueue();
+  ctx.workerStats = &t->m_stats;
+  ctx.scratch = &t->m_scratch;
+  ctx.scratchFrame = g_scratchFrame;
 
   {
     CCriticalSectionHolder h(t->m_threadNameSec);
@@ -767,11 +1019,18 @@ unsigned NTHREAD_PROC_CALL_CONV ThreadWorker::threadFunc(void* p)
   //t->m_doneEvent.WaitAlertable(); //we are alertable here so the cross thread invoker will do it's thing
   // But equivalent to spin in APC events :
   NX_RANGEPUSHCOL("ThreadWorker::threadFunc WaitForSingleObjectEx", COLOR_RED2);
+  // the APCs run inside the wait: idle is what the wait lasted minus the time of the tasks
+  uint64 t0 = statsClockNs(), busy0 = t->m_stats.busyNs;
   while(WaitForSingleObjectEx(t->m_doneEvent.GetHandle(), INFINITE, TRUE) != WAIT_OBJECT_0)
   {
     NX_RANGEPOP();
     NX_RANGEPUSHCOL("ThreadWorker::threadFunc WaitForSingleObjectEx", COLOR_RED2);
     //do nothing...we will periodically be woken if an APC fires or something so sleep again if it's not the event
+    uint64 t1 = statsClockNs(), busy1 = t->m_stats.busyNs;
+    t->m_stats.idleNs += (t1 - t0) - (busy1 - busy0);
+    t->m_stats.wakeUps++;
+    t0    = t1;
+    busy0 = busy1;
   }
   NX_RANGEPOP();
   //the done event fired so return
@@ -847,9 +1106,10 @@ void TaskSyncCall::Call(TaskQueue* destQueue, bool waitAltertable)
 ThreadWorkerPool::QueuedWorkProcessorTask::QueuedWorkProcessorTask(bool discardOnExit) : 
     m_discardOnExit(discardOnExit), 
     m_dataReadySem(0), 
-    m_doneEvent(false, true), //manual reset since all threads read it
+    m_doneEvent(true, false), //manual reset since all threads read it
     m_dataProcessedSem(0),
-    m_taskQueue(64)
+    m_taskQueue(64),
+    m_taskQueueHighWater(0)
 {
     
 }
@@ -870,9 +1130,19 @@ ThreadWorkerPool::QueuedWorkProcessorTask::QueuedWorkProcessorTask(bool discardO
 void ThreadWorkerPool::QueuedWorkProcessorTask::Invoke()
 {
     NXPROFILEFUNCCOL(__FUNCTION__, COLOR_YELLOW2);
+    NWorkerStats* stats = GetThreadContext().workerStats;
     while(!m_doneEvent.WaitOnEvent(0))
     {
+        uint64 t0 = stats ? statsClockNs() : 0;
+        if (stats)
+            stats->waitStartNs = t0;
         m_dataReadySem.AcquireSemaphore(); //wait for some data to be pushed in the TaskQueue
+        if (stats)
+        {
+            stats->waitStartNs = 0;
+            stats->idleNs += statsClockNs() - t0;
+            stats->wakeUps++;
+        }
         
         //our thread woke up because there is something to eat in the TaskQueue
         TaskBase* childTask = NULL;
@@ -883,8 +1153,18 @@ void ThreadWorkerPool::QueuedWorkProcessorTask::Invoke()
         
         if (childTask)
         {
+            uint64 t1 = stats ? statsClockNs() : 0;
+            uint64 traceBegin = NTrace::IsRecording() ? NTrace::ClockNs() : 0;
             childTask->Invoke();
+            if (traceBegin)
+                NTrace::AddSpan(childTask->getTraceName(), traceBegin, NTrace::ClockNs());
             childTask->Done();
+            if (stats)
+            {
+                stats->busyNs += statsClockNs() - t1;
+                stats->tasksExecuted++;
+                stats->sharedTasks++;
+            }
         }
         
         m_dataProcessedSem.ReleaseSemaphore();
@@ -967,6 +1247,8 @@ m_threadCount(numThreads), m_schedule(sched), m_invokedTaskCount(0), m_queueTask
 ThreadWorkerPool::~ThreadWorkerPool()
 {
     Terminate();
+    for (size_t i = 0; i < m_parallelHelpers.size(); i++)
+        delete m_parallelHelpers[i];
 }
 /************************************************************************************/
 /**
@@ -1027,11 +1309,78 @@ void ThreadWorkerPool::pushTask(TaskBase* task)
     {
         CCriticalSectionHolder h(m_queueTask->m_taskQueueLock);
         m_queueTask->m_taskQueue.WriteData(task);
+        m_queueTask->m_taskQueueHighWater = std::max(m_queueTask->m_taskQueueHighWater, (int)m_queueTask->m_taskQueue.GetStoredSize());
         //wake up somebody
         m_queueTask->m_dataReadySem.ReleaseSemaphore();
     }
 }
 /************************************************************************************/
+/**
+ ** round-robin: worker w gets the tasks w, w+N, w+2N... in one pushTasks(). Only
+ ** the workers that receive something get woken up.
+ ** shared queue: all the tasks are written under one lock and the semaphore
+ ** gets released once with the whole count.
+ ** least-queued: the tasks are spread so that the queues end up at the same level
+ **/
+void ThreadWorkerPool::pushTasks(TaskBase** tasks, int count)
+{
+    NXPROFILEFUNCCOL(__FUNCTION__, COLOR_GREEN);
+    if (count <= 0)
+        return;
+    if (count == 1)
+    {
+        pushTask(tasks[0]);
+        return;
+    }
+    if (m_schedule == NWTPS_ROUND_ROBIN)
+    {
+        // same distribution as 'count' calls of pushTask()
+        uint first = m_invokedTaskCount + 1;
+        m_invokedTaskCount += count;
+        uint numQueues = (uint)count < m_threadCount ? (uint)count : m_threadCount;
+        for (uint i = 0; i < numQueues; i++)
+        {
+            int n = (count - (int)i + (int)m_threadCount - 1) / (int)m_threadCount;
+            m_threads[(first + i) % m_threadCount].GetTaskQueue().pushTasks(tasks + i, n, (int)m_threadCount);
+        }
+    }
+    else if (m_schedule == NWTPS_SHARED_QUEUE)
+    {
+        m_invokedTaskCount += count;
+        {
+            CCriticalSectionHolder h(m_queueTask->m_taskQueueLock);
+            for (int i = 0; i < count; i++)
+                m_queueTask->m_taskQueue.WriteData(tasks[i]);
+            m_queueTask->m_taskQueueHighWater = std::max(m_queueTask->m_taskQueueHighWater, (int)m_queueTask->m_taskQueue.GetStoredSize());
+        }
+        // one token per task: each QueuedWorkProcessorTask loop consumes one
+        m_queueTask->m_dataReadySem.ReleaseSemaphore(count);
+    }
+    else
+    {
+        // level the queues: each one gets filled up to the average of what will be queued
+        m_invokedTaskCount += count;
+        int total = count;
+        for (uint t = 0; t < m_threadCount; t++)
+            total += m_threads[t].GetTaskQueue().GetQueuedTaskCount();
+        int level = (total + (int)m_threadCount - 1) / (int)m_threadCount;
+        int i = 0;
+        for (uint t = 0; (t < m_threadCount) && (i < count); t++)
+        {
+            int n = level - m_threads[t].GetTaskQueue().GetQueuedTaskCount();
+            if (n > count - i)
+                n = count - i;
+            if (n <= 0)
+                continue;
+            m_threads[t].GetTaskQueue().pushTasks(tasks + i, n);
+            i += n;
+        }
+        // counters moved meanwhile: the rest goes to the first queue
+        if (i < count)
+            m_threads[0].GetTaskQueue().pushTasks(tasks + i, count - i);
+    }
+}
+/************************************************************************************/
 /**
  ** 
  **/
@@ -1042,6 +1391,35 @@ ThreadWorker * ThreadWorkerPool::getThreadWorker(int n)
     return m_threads+n;
 }
 /************************************************************************************/
+/**
+ ** 
+ **/
+bool ThreadWorkerPool::getWorkerStats(int n, NWorkerStats& stats)
+{
+    ThreadWorker* w = getThreadWorker(n);
+    if (w == NULL)
+        return false;
+    w->GetStats(stats);
+    return true;
+}
+int ThreadWorkerPool::getSharedQueueHighWater()
+{
+    if (m_queueTask == NULL)
+        return 0;
+    CCriticalSectionHolder h(m_queueTask->m_taskQueueLock);
+    return m_queueTask->m_taskQueueHighWater;
+}
+void ThreadWorkerPool::resetStats()
+{
+    for (uint i = 0; i < m_threadCount; i++)
+        m_threads[i].ResetStats();
+    if (m_queueTask)
+    {
+        CCriticalSectionHolder h(m_queueTask->m_taskQueueLock);
+        m_queueTask->m_taskQueueHighWater = (int)m_queueTask->m_taskQueue.GetStoredSize();
+    }
+}
+/************************************************************************************/
 /**
  ** 
  **/
@@ -1053,6 +1431,68 @@ void ThreadWorkerPool::SetBackgroundMode(bool b)
     }
 }
 
+/************************************************************************************/
+/**
+ ** compact: SMT siblings first, so workers share caches.
+ ** scatter: one worker per physical core, spread over the packages, before the siblings
+ **/
+bool ThreadWorkerPool::SetAffinity(NWORKER_AFFINITY policy, const std::vector<int>* cpuList)
+{
+    std::vector<int> order;
+    const std::vector<NCpuInfo>& cpus = CThread::CpuTopology();
+    switch(policy)
+    {
+    case NWTA_NONE:
+        break;
+    case NWTA_LIST:
+        if(cpuList)
+            order = *cpuList;
+        break;
+    case NWTA_COMPACT:
+    case NWTA_SCATTER:
+    {
+        // rank of each core inside its package, so scatter can alternate between packages
+        std::vector<NCpuInfo> sorted(cpus);
+        std::vector<int> coreRank(sorted.size(), 0);
+        for(size_t i = 0; i < sorted.size(); i++)
+        {
+            for(size_t j = 0; j < sorted.size(); j++)
+            {
+                if((sorted[j].package == sorted[i].package) && (sorted[j].smt == 0) && (sorted[j].core < sorted[i].core))
+                    coreRank[i]++;
+            }
+            sorted[i].core = coreRank[i];
+        }
+        bool scatter = policy == NWTA_SCATTER;
+        std::sort(sorted.begin(), sorted.end(), [scatter](const NCpuInfo& a, const NCpuInfo& b) {
+            if(scatter)
+            {
+                if(a.smt != b.smt)
+                    return a.smt < b.smt;
+                if(a.core != b.core)
+                    return a.core < b.core;
+                return a.package < b.package;
+            }
+            if(a.package != b.package)
+                return a.package < b.package;
+            if(a.core != b.core)
+                return a.core < b.core;
+            return a.smt < b.smt;
+        });
+        for(size_t i = 0; i < sorted.size(); i++)
+            order.push_back(sorted[i].cpu);
+        break;
+    }
+    }
+    bool ok = true;
+    for(uint i = 0; i < m_threadCount; i++)
+    {
+        int cpu = order.empty() ? -1 : order[i % order.size()];
+        ok &= m_threads[i].SetCpu(cpu);
+    }
+    return ok;
+}
+
 /************************************************************************************/
 /**
  ** 
@@ -1084,9 +1524,473 @@ void ThreadWorkerPool::FlushTasks(bool waitAlertable)
             m_threads[i].GetTaskQueue().FlushTasks(waitAlertable);
         }
     }
-    
+
+}
+
+//#pragma mark - TaskGraph
+/************************************************************************************/
+/************************************************************************************/
+/************************************************************************************/
+/**
+ ** the node doesn't get deleted: it belongs to the graph
+ **/
+void TaskNode::Done()
+{
+    m_graph->nodeDone(this);
+}
+
+/************************************************************************************/
+/**
+ **
+ **/
+TaskGraph::TaskGraph(ThreadWorkerPool* pool) :
+    m_pool(pool),
+    m_hostQueue(NULL),
+    m_numPendingNodes(0),
+    m_doneEvent(true, true) //manual reset: an empty graph is done
+{
+}
+
+TaskGraph::~TaskGraph()
+{
+    clear();
+}
+
+/************************************************************************************/
+/**
+ **
+ **/
+TaskNode* TaskGraph::addNode(TaskNode* node, TaskQueue* queue)
+{
+    node->m_graph           = this;
+    node->m_queue           = queue;
+    node->m_numDeps         = 0;
+    node->m_successors      = NULL;
+    node->m_lastSuccessor   = NULL;
+    m_nodes.push_back(node);
+    return node;
 }
 
+/************************************************************************************/
+/**
+ **
+ **/
+void TaskGraph::addDependency(TaskNode* before, TaskNode* after)
+{
+    assert(before->m_graph == this && after->m_graph == this);
+    // append, so that successors get scheduled in the order of declaration
+    TaskNode::Edge* edge = (TaskNode::Edge*)m_arena.allocate(sizeof(TaskNode::Edge));
+    edge->node = after;
+    edge->next = NULL;
+    if (before->m_lastSuccessor)
+        before->m_lastSuccessor->next = edge;
+    else
+        before->m_successors = edge;
+    before->m_lastSuccessor = edge;
+    after->m_numDeps++;
+}
+
+/************************************************************************************/
+/**
+ ** nodes with a dedicated queue go there. Others go to the pool, or to the host
+ ** queue when no pool is available (the caller of wait() will then execute them)
+ **/
+#define NV_TASKGRAPH_BATCH 64
+void TaskGraph::schedule(TaskNode* node, TaskBase** ready, int& numReady)
+{
+    if (node->m_queue)
+        node->m_queue->pushTask(node);
+    else if (m_pool)
+    {
+        ready[numReady++] = node;
+        if (numReady == NV_TASKGRAPH_BATCH)
+            flushReady(ready, numReady);
+    }
+    else
+    {
+        assert(m_hostQueue);
+        m_hostQueue->pushTask(node);
+    }
+}
+
+/************************************************************************************/
+/**
+ ** the nodes that became ready together get submitted in one pushTasks(): when the
+ ** reset nodes of a frame are done, all the recording slices wake the workers only once
+ **/
+void TaskGraph::flushReady(TaskBase** ready, int& numReady)
+{
+    if (numReady > 0)
+        m_pool->pushTasks(ready, numReady);
+    numReady = 0;
+}
+
+/************************************************************************************/
+/**
+ **
+ **/
+void TaskGraph::run(TaskQueue* hostQueue)
+{
+    NXPROFILEFUNCCOL(__FUNCTION__, COLOR_GREEN);
+    m_hostQueue = hostQueue;
+    if (m_nodes.empty())
+        return;
+    m_doneEvent.Reset();
+    m_numPendingNodes = (NInterlockedValue)m_nodes.size();
+    // all the counters must be ready before any node gets a chance to finish
+    for (size_t i = 0; i < m_nodes.size(); i++)
+        m_nodes[i]->m_numPendingDeps = m_nodes[i]->m_numDeps;
+    TaskBase* ready[NV_TASKGRAPH_BATCH];
+    int numReady = 0;
+    for (size_t i = 0; i < m_nodes.size(); i++)
+    {
+        if (m_nodes[i]->m_numDeps == 0)
+            schedule(m_nodes[i], ready, numReady);
+    }
+    flushReady(ready, numReady);
+}
+
+/************************************************************************************/
+/**
+ ** called from the thread that executed the node
+ **/
+void TaskGraph::nodeDone(TaskNode* node)
+{
+    TaskBase* ready[NV_TASKGRAPH_BATCH];
+    int numReady = 0;
+    for (TaskNode::Edge* edge = node->m_successors; edge; edge = edge->next)
+    {
+        TaskNode* succ = edge->node;
+#ifdef WIN32
+        if (InterlockedDecrement(&succ->m_numPendingDeps) == 0)
+#else
+        if (__sync_sub_and_fetch(&succ->m_numPendingDeps, 1) == 0)
+#endif
+            schedule(succ, ready, numReady);
+    }
+    flushReady(ready, numReady);
+    // keep the host queue locally: the graph can be released as soon as m_doneEvent is set
+    TaskQueue* hostQueue = m_hostQueue;
+#ifdef WIN32
+    if (InterlockedDecrement(&m_numPendingNodes) == 0)
+#else
+    if (__sync_sub_and_fetch(&m_numPendingNodes, 1) == 0)
+#endif
+    {
+        if (hostQueue)
+            hostQueue->wakeUp();
+        m_doneEvent.Set();
+    }
+}
+
+/************************************************************************************/
+/**
+ **
+ **/
+void TaskGraph::wait()
+{
+    NXPROFILEFUNCCOL(__FUNCTION__, COLOR_YELLOW);
+    if (m_hostQueue)
+    {
+        while (m_numPendingNodes > 0)
+        {
+            // execute what got pushed to us. Sleep only when our queue is empty:
+            // the last node done or any push will wake us up
+            if (!m_hostQueue->pollTask(0) && (m_numPendingNodes > 0))
+                m_hostQueue->pollTask(-1);
+        }
+    }
+    // makes sure nodeDone() is out of the graph before returning
+    m_doneEvent.WaitOnEvent();
+}
+
+/************************************************************************************/
+/**
+ **
+ **/
+void TaskGraph::clear()
+{
+    assert(m_numPendingNodes == 0);
+    for (size_t i = 0; i < m_nodes.size(); i++)
+        m_nodes[i]->Destroy();
+    m_nodes.clear(); // keeps the capacity for next time
+    m_arena.reset();
+}
+
+
+//#pragma mark - Parallel loops
+/************************************************************************************/
+/************************************************************************************/
+/************************************************************************************/
+static ThreadWorkerPool* g_parallelPool = NULL;
+void setParallelPool(ThreadWorkerPool* pool)
+{
+    g_parallelPool = pool;
+}
+ThreadWorkerPool* getParallelPool()
+{
+    return g_parallelPool;
+}
+
+/************************************************************************************/
+/**
+ ** \brief task pushed to the pool to help the caller of a parallel loop
+ **
+ ** The helper and the caller race for the job with claim(): a helper that starts after the
+ ** loop is over loses and leaves the job alone. Both hold a reference to the helper: the
+ ** last release() gives it back to the free list of the pool
+ **/
+class ParallelHelperTask : public TaskBase
+{
+    ThreadWorkerPool*   m_pool;
+    ParallelJob*        m_job;
+    NAtomicInt          m_claimed;
+    NAtomicInt          m_refCount;
+public:
+    ParallelHelperTask(ThreadWorkerPool* pool) : m_pool(pool), m_job(NULL), m_claimed(0), m_refCount(0) {}
+    virtual const char* getTraceName() { return "parallel chunks"; }
+    void start(ParallelJob* job)
+    {
+        m_job = job;
+        m_claimed.Exchange(0);
+        m_refCount.Exchange(2);
+    }
+    /// \brief true for the first one of the helper and the caller
+    inline bool claim() { return m_claimed.Exchange(1) == 0; }
+    void release()
+    {
+        if (m_refCount.Decrement() == 0)
+            m_pool->recycleParallelHelper(this);
+    }
+    virtual void Invoke()
+    {
+        if (claim())
+        {
+            m_job->runChunks();
+            m_job->helperLeft();
+        }
+    }
+    /// \brief the pool owns the helper: no TaskBase::Done()
+    virtual void Done()
+    {
+        release();
+    }
+#ifdef DBGTHREAD
+    const char *getDbgString() { return __FUNCTION__; };
+#endif
+};
+
+/************************************************************************************/
+/**
+ **
+ **/
+ParallelHelperTask* ThreadWorkerPool::acquireParallelHelper()
+{
+    {
+        CCriticalSectionHolder h(m_parallelHelpersLock);
+        if (!m_parallelHelpers.empty())
+        {
+            ParallelHelperTask* helper = m_parallelHelpers.back();
+            m_parallelHelpers.pop_back();
+            return helper;
+        }
+    }
+    return new ParallelHelperTask(this);
+}
+
+void ThreadWorkerPool::recycleParallelHelper(ParallelHelperTask* helper)
+{
+    CCriticalSectionHolder h(m_parallelHelpersLock);
+    m_parallelHelpers.push_back(helper);
+}
+
+/************************************************************************************/
+/**
+ **
+ **/
+ParallelJob::ParallelJob(int begin, int end, int grain) :
+    m_nextChunk(0),
+    m_numChunksDone(0),
+    m_numHelpersIn(0),
+    m_begin(begin),
+    m_end(end),
+    m_grain(grain)
+{
+    m_numChunks = (end - begin + grain - 1) / grain;
+}
+
+/************************************************************************************/
+/**
+ **
+ **/
+void ParallelJob::runChunks()
+{
+    while (true)
+    {
+#ifdef WIN32
+        int chunk = (int)InterlockedIncrement(&m_nextChunk) - 1;
+#else
+        int chunk = (int)__sync_fetch_and_add(&m_nextChunk, 1);
+#endif
+        if (chunk >= m_numChunks)
+            break;
+        int chunkBegin = m_begin + chunk * m_grain;
+        int chunkEnd   = chunkBegin + m_grain;
+        runChunk(chunk, chunkBegin, chunkEnd < m_end ? chunkEnd : m_end);
+#ifdef WIN32
+        if (InterlockedIncrement(&m_numChunksDone) == m_numChunks)
+#else
+        if (__sync_add_and_fetch(&m_numChunksDone, 1) == m_numChunks)
+#endif
+            m_doneEvent.Set();
+    }
+}
+
+/// \brief atomic read: what the other threads did before changing the value is visible after it
+static inline long readInterlocked(NInterlockedValue* v)
+{
+#ifdef WIN32
+    return InterlockedCompareExchange(v, 0, 0);
+#else
+    return __sync_add_and_fetch(v, 0);
+#endif
+}
+
+void ParallelJob::helperLeft()
+{
+#ifdef WIN32
+    InterlockedDecrement(&m_numHelpersIn);
+#else
+    __sync_sub_and_fetch(&m_numHelpersIn, 1);
+#endif
+}
+
+/************************************************************************************/
+/**
+ ** no more helpers than chunks left for them: the caller takes one chunk itself.
+ ** Once the chunks are done, the caller claims back the helpers that didn't start. The
+ ** others are past their last chunk: waiting for them to leave is a short spin
+ **/
+void ParallelJob::execute(ThreadWorkerPool* pool)
+{
+    NXPROFILEFUNCCOL(__FUNCTION__, COLOR_GREEN);
+    const int MAXHELPERS = 64;
+    ParallelHelperTask* helpers[MAXHELPERS];
+    TaskBase*           tasks[MAXHELPERS];
+    int numHelpers = m_numChunks - 1;
+    if (numHelpers > (int)pool->getThreadCount())
+        numHelpers = (int)pool->getThreadCount();
+    if (numHelpers > MAXHELPERS)
+        numHelpers = MAXHELPERS;
+    m_numHelpersIn = numHelpers; // nobody else knows about the job, yet
+    for (int i = 0; i < numHelpers; i++)
+    {
+        helpers[i] = pool->acquireParallelHelper();
+        helpers[i]->start(this);
+        tasks[i] = helpers[i];
+    }
+    pool->pushTasks(tasks, numHelpers);
+
+    runChunks();
+    if (readInterlocked(&m_numChunksDone) < m_numChunks)
+        m_doneEvent.WaitOnEvent();
+    for (int i = 0; i < numHelpers; i++)
+    {
+        if (helpers[i]->claim())
+            helperLeft();
+        helpers[i]->release();
+    }
+    while (readInterlocked(&m_numHelpersIn) > 0)
+        NYieldCPU(0);
+}
+
+//#pragma mark - Broadcast // MacOSX thing
+/************************************************************************************/
+/**
+ ** 
+ **/
+class BroadcastTask : public TaskBase
+{
+    BroadcastJob* m_job;
+    int           m_worker;
+public:
+    BroadcastTask(BroadcastJob* job, int worker) : m_job(job), m_worker(worker) {}
+    virtual const char* getTraceName() { return "broadcast"; }
+    virtual void Invoke()
+    {
+        m_job->runWorker(m_worker);
+    }
+    virtual void Done()
+    {
+        m_job->workerDone();
+        m_job->release();
+        TaskBase::Done();
+    }
+#ifdef DBGTHREAD
+    const char *getDbgString() { return __FUNCTION__; };
+#endif
+};
+
+/************************************************************************************/
+/**
+ **
+ **/
+void BroadcastJob::workerDone()
+{
+#ifdef WIN32
+    if (InterlockedDecrement(&m_numPending) == 0)
+#else
+    if (__sync_sub_and_fetch(&m_numPending, 1) == 0)
+#endif
+        m_doneEvent.Set();
+}
+
+/************************************************************************************/
+/**
+ ** the tasks go straight to the queue of each worker, bypassing the scheduling of the pool
+ **/
+void BroadcastJob::execute(ThreadWorkerPool* pool)
+{
+    NXPROFILEFUNCCOL(__FUNCTION__, COLOR_GREEN);
+    int n = (int)pool->getThreadCount();
+    if (n == 0)
+        return;
+    // waiting for our own queue would never end: a worker of the pool runs its part inline
+    TaskQueue* current = getCurrentTaskQueue();
+    int self = -1;
+    for (int i = 0; i < n; i++)
+    {
+        if (&pool->getThreadWorker(i)->GetTaskQueue() == current)
+            self = i;
+    }
+    m_numPending = n;
+    m_refCount += (self >= 0) ? n - 1 : n; // nobody else knows about the job, yet
+    for (int i = 0; i < n; i++)
+    {
+        if (i != self)
+            pool->getThreadWorker(i)->GetTaskQueue().pushTask(new BroadcastTask(this, i));
+    }
+    if (self >= 0)
+    {
+        runWorker(self);
+        workerDone();
+    }
+    m_doneEvent.WaitOnEvent();
+}
+
+/************************************************************************************/
+/**
+ **
+ **/
+void BroadcastJob::release()
+{
+#ifdef WIN32
+    if (InterlockedDecrement(&m_refCount) == 0)
+#else
+    if (__sync_sub_and_fetch(&m_refCount, 1) == 0)
+#endif
+        delete this;
+}
 
 #define NV_FAKE_WAIT_ALERTABLE_SLICES_MS 5
 /************************************************************************************/
@@ -26,6 +26,9 @@
 #endif
 
 #include <string>
+#include <vector>
+#include <new>
+#include <utility>
 #include <assert.h>
 #include "CThread.h"
 
@@ -114,20 +117,114 @@ class TaskBase
 private:
     /// \brief pointer to TaskQueue::m_taskCount
     NInterlockedValue* m_queueCountRef; 
+    /// \brief false when the task was placement-constructed (TaskArena): no delete, only the destructor
+    bool m_heapAllocated;
 protected:
-    TaskBase() /*: m_queueCountRef(NULL)*/ {}
+    TaskBase() : /*m_queueCountRef(NULL),*/ m_heapAllocated(true) {}
     virtual ~TaskBase();
 public:
     /// \brief the main entry point for Task execution : this method is the one called to exectute the Task
     virtual void Invoke() = 0;
     /// \brief when the Task got accomplished, Done() gets called.
     virtual void Done();
+    /// \brief deletes the task, or only destructs it if its memory doesn't come from the heap
+    void Destroy();
+    /// \brief name of the spans of the task in NTrace: a static string
+    virtual const char* getTraceName() { return "task"; }
 #ifdef DBGTHREAD
     virtual const char *getDbgString() { return "NONAME"; };
 #endif
     friend class TaskQueue;
+    friend class TaskArena;
 };
 
+/************************************************************************************/
+/**
+ ** \brief Linear allocator for tasks that only live for a frame
+ **
+ ** create<T>(args) placement-constructs the task in blocks that are kept from one
+ ** frame to the other: once the arena reached its size, no more malloc/free happen.
+ ** Tasks created here are not deleted by Done() : the owner calls Destroy() then reset()
+ ** Not thread-safe: tasks are expected to be created by the thread owning the arena
+ **/
+class TaskArena
+{
+private:
+    TaskArena(const TaskArena&); //these are purposely not implemented
+    TaskArena& operator= (const TaskArena&);
+
+    struct Block
+    {
+        char*   ptr;
+        size_t  size;
+    };
+    std::vector<Block>  m_blocks;
+    size_t              m_blockSize;
+    size_t              m_curBlock;
+    size_t              m_offset;
+public:
+    TaskArena(size_t blockSize = 64*1024);
+    ~TaskArena();
+    /// \brief raw memory, valid until reset()
+    void* allocate(size_t sz, size_t alignment = sizeof(void*));
+    /// \brief makes all the memory available again. Objects must have been destroyed before
+    void reset();
+    /// \brief placement-construction of a task that Done()/Destroy() won't delete
+    template<typename T, typename... Args>
+    T* create(Args&&... args)
+    {
+        T* task = new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        static_cast<TaskBase*>(task)->m_heapAllocated = false;
+        return task;
+    }
+};
+
+/************************************************************************************/
+/**
+ ** \brief per-thread TaskArena for frame-temporary data
+ **
+ ** Workers use their own arena, other threads get one on their first call.
+ ** The arena gets reset by the first call of its thread after BeginScratchFrame():
+ ** the memory stays valid until the next scratch frame, so it must not outlive the
+ ** tasks of the frame
+ **/
+TaskArena* GetThreadScratch();
+/// \brief starts a new scratch frame. Called once per frame, while no task uses its scratch
+void BeginScratchFrame();
+
+/************************************************************************************/
+/**
+ ** \brief STL allocator taking its memory from a TaskArena
+ **
+ ** deallocate() does nothing: memory comes back with the reset of the arena. By
+ ** default, the scratch of the calling thread:
+ **   ScratchVector<int> offsets; // no malloc once the arena of the thread reached its size
+ **/
+template<typename T>
+class ScratchAllocator
+{
+public:
+    typedef T value_type;
+    TaskArena* m_arena;
+
+    ScratchAllocator() : m_arena(GetThreadScratch()) {}
+    ScratchAllocator(TaskArena* arena) : m_arena(arena) {}
+    template<typename U>
+    ScratchAllocator(const ScratchAllocator<U>& a) : m_arena(a.m_arena) {}
+
+    T* allocate(size_t n) { return (T*)m_arena->allocate(n * sizeof(T), alignof(T)); }
+    void deallocate(T* p, size_t n) {}
+
+    template<typename U>
+    bool operator==(const ScratchAllocator<U>& a) const { return m_arena == a.m_arena; }
+    template<typename U>
+    bool operator!=(const ScratchAllocator<U>& a) const { return m_arena != a.m_arena; }
+};
+
+template<typename T>
+using ScratchVector = std::vector<T, ScratchAllocator<T> >;
+typedef std::basic_string<char, std::char_traits<char>, ScratchAllocator<char> > ScratchString;
+
 // ?? Shall we create a bas class for tasks that we want to be able to invoke other Tasks
 
 //#pragma mark - Cross Thread // MacOSX thing
@@ -223,17 +320,26 @@ private:
 
     /// \brief maintains the total amount of tasks
     NInterlockedValue m_taskCount;
+    /// \brief max of m_taskCount since the last reset (instrumentation)
+    volatile int      m_taskCountHighWater;
+    void updateHighWater(int n);
     
     /// \brief push a function in the list ring of functions to call
     void pushTaskFunc(ThreadFunc call, void* params);    
 public:
     inline int GetQueuedTaskCount() { return (int)m_taskCount; }
+    inline int GetQueuedTaskHighWater() { return m_taskCountHighWater; }
+    inline void ResetQueuedTaskHighWater() { m_taskCountHighWater = (int)m_taskCount; }
     /// \brief push a task into the execution buffer. Using taskThreadFunc.
     void pushTask(TaskBase * task);
+    /// \brief pushes tasks[0], tasks[stride], tasks[2*stride]... under one lock, with only one wake-up of the thread
+    void pushTasks(TaskBase** tasks, int count, int stride = 1);
     /// \brief poll a Task's function from the execution buffer and execute it
     bool pollTask(int timeout=0);
+    /// \brief wakes up the thread waiting in pollTask(timeout), even if nothing got pushed
+    void wakeUp();
     void FlushTasks(bool waitAlertable = false);
-    
+
     inline NThreadHandle GetDestinationThread() { return m_thread; }
   #ifdef WIN32
     inline NThreadID GetDestinationThreadID() { return m_threadID; }
@@ -247,6 +353,30 @@ public:
 
 
 //#pragma mark - Task Worker // MacOSX thing
+/************************************************************************************/
+/**
+ ** \brief counters of a worker, always on
+ **
+ ** Written by the worker thread only, without synchronization: a reader gets values
+ ** that can be one task late. Times are in nanoseconds.
+ **/
+struct NWorkerStats
+{
+    uint64  tasksExecuted;
+    /// \brief time spent executing tasks
+    uint64  busyNs;
+    /// \brief time spent waiting for tasks
+    uint64  idleNs;
+    /// \brief times the thread got woken up from its wait
+    uint64  wakeUps;
+    /// \brief tasks taken from the shared queue of the pool (NWTPS_SHARED_QUEUE): the pool doesn't steal work otherwise
+    uint64  sharedTasks;
+    /// \brief max amount of tasks waiting in the queue of the worker
+    int     queueHighWater;
+    /// \brief when the current wait started, 0 if the worker isn't waiting
+    uint64  waitStartNs;
+};
+
 /************************************************************************************/
 /**
  ** \brief Pool of workers
@@ -272,6 +402,9 @@ private:
     TaskQueue           m_invoker; 
     volatile bool       m_discardQueuedOnExit;
     //volatile bool       m_alertableOnExit;
+    int                 m_cpu;
+    NWorkerStats        m_stats;
+    TaskArena           m_scratch;
 
 #ifdef WIN32
     /// \brief the real function that the thread will invoke - Win32 version
@@ -298,10 +431,62 @@ public:
 
     const std::string& GetThreadName()/* const*/;
     void SetThreadName(const std::string& n);
+    /// \brief pins the thread on a logical CPU (-1 lets the OS schedule it anywhere again)
+    bool SetCpu(int cpu);
+    inline int GetCpu() { return m_cpu; }
+    /// \brief snapshot of the counters
+    void GetStats(NWorkerStats& stats);
+    void ResetStats();
     /// @}
     void SetBackgroundMode(bool b);
 };
 
+//#pragma mark - Broadcast // MacOSX thing
+class ThreadWorkerPool;
+class ParallelHelperTask;
+/************************************************************************************/
+/**
+ ** \brief Work executed once by each worker of a pool (see ThreadWorkerPool::broadcast())
+ **
+ ** One task goes to the queue of each worker; the caller waits for a single counter to
+ ** reach zero rather than for one event per worker. If the caller is itself a worker of
+ ** the pool, it runs its part inline.
+ ** Ref-counted: the last task out of the job deletes it
+ **/
+class BroadcastJob
+{
+private:
+    BroadcastJob(const BroadcastJob&); //these are purposely not implemented
+    BroadcastJob& operator= (const BroadcastJob&);
+
+    NInterlockedValue   m_numPending;
+    NInterlockedValue   m_refCount;
+    CEvent              m_doneEvent;
+    void workerDone();
+protected:
+    BroadcastJob() : m_numPending(0), m_refCount(1) {}
+    virtual ~BroadcastJob() {}
+    virtual void runWorker(int worker) = 0;
+public:
+    /// \brief pushes one task per worker and returns when all of them are done
+    void execute(ThreadWorkerPool* pool);
+    void release();
+    friend class BroadcastTask;
+};
+
+/**
+ ** \brief fn(worker) on each worker
+ **/
+template<typename Fn>
+class BroadcastFnJob : public BroadcastJob
+{
+private:
+    const Fn& m_fn;
+    virtual void runWorker(int worker) { m_fn(worker); }
+public:
+    BroadcastFnJob(const Fn& fn) : m_fn(fn) {}
+};
+
 //#pragma mark - Pool of workers // MacOSX thing
 /************************************************************************************/
 /**
@@ -318,6 +503,22 @@ enum NWORKER_THREADPOOL_SCHEDULE
     NWTPS_SHARED_QUEUE, 
 };
 
+/************************************************************************************/
+/**
+ ** \brief how the workers of a pool get pinned to the CPUs
+ **/
+enum NWORKER_AFFINITY
+{
+    //no pinning: the OS decides
+    NWTA_NONE,
+    //fill the SMT siblings of a core, then the next core, then the next package
+    NWTA_COMPACT,
+    //one worker per physical core (spread across packages) before using SMT siblings
+    NWTA_SCATTER,
+    //explicit list of logical CPUs given to SetAffinity()
+    NWTA_LIST,
+};
+
 /************************************************************************************/
 /**
  ** \brief Pool of thread workers
@@ -345,16 +546,25 @@ private:
                     m_dataProcessedSem;
         NRingBuffer<TaskBase*>  m_taskQueue;
         CCriticalSection        m_taskQueueLock;
+        int                     m_taskQueueHighWater;
         
         QueuedWorkProcessorTask(bool discardOnExit);
         virtual void Invoke();
         virtual void Done();
+        virtual const char* getTraceName() { return "shared queue"; }
 #ifdef DBGTHREAD
         const char *getDbgString() { return __FUNCTION__; };
 #endif
     };
     //this is only non-null if you are using NWTPS_SHARED_QUEUE
     QueuedWorkProcessorTask* m_queueTask;
+    /// \brief helpers of parallel_for() and parallel_reduce() that are not in use
+    std::vector<ParallelHelperTask*> m_parallelHelpers;
+    CCriticalSection        m_parallelHelpersLock;
+    ParallelHelperTask* acquireParallelHelper();
+    void recycleParallelHelper(ParallelHelperTask* helper);
+    friend class ParallelJob;
+    friend class ParallelHelperTask;
     
 public:
     /// \brief constructor
@@ -366,10 +576,283 @@ public:
     ThreadWorker * getThreadWorker(int n);
     /// this destroys the task when it's done
     void pushTask(TaskBase* task);
+    /// \brief same as calling pushTask() on each task, but each worker involved gets woken up only once
+    void pushTasks(TaskBase** tasks, int count);
     
     void SetBackgroundMode(bool b);
+    /// \brief pins worker i on the i-th CPU of the order given by the policy (wrapping around)
+    bool SetAffinity(NWORKER_AFFINITY policy, const std::vector<int>* cpuList = NULL);
+    /// \brief runs fn(workerIndex) once on each worker, returns when all are done.
+    /// For per-thread setup/cleanup: the worker can't be chosen with pushTask()
+    template<typename Fn>
+    void broadcast(const Fn& fn)
+    {
+        BroadcastFnJob<Fn>* job = new BroadcastFnJob<Fn>(fn);
+        job->execute(this);
+        job->release();
+    }
+    /// \name instrumentation
+    /// @{
+    bool getWorkerStats(int n, NWorkerStats& stats);
+    /// \brief max amount of tasks waiting in the shared queue (NWTPS_SHARED_QUEUE only)
+    int  getSharedQueueHighWater();
+    void resetStats();
+    /// @}
     void FlushTasks(bool waitAlertable = false);
     void Terminate();
 };
 
+//#pragma mark - Task Graph // MacOSX thing
+class TaskGraph;
+/************************************************************************************/
+/**
+ ** \brief Task that is part of a TaskGraph
+ **
+ ** A TaskNode declares its dependencies through TaskGraph::addDependency(). It gets pushed
+ ** to the pool (or to its own TaskQueue, when the node must run on a specific thread) as
+ ** soon as all the nodes it depends on are done: no need for the caller to wait on events
+ ** between phases.
+ ** The TaskGraph owns its nodes: Done() doesn't delete the node but schedules the successors
+ **/
+class TaskNode : public TaskBase
+{
+private:
+    TaskGraph*              m_graph;
+    /// \brief optional queue on which the node must run (ex: main thread for OpenGL calls)
+    TaskQueue*              m_queue;
+    /// \brief amount of dependencies still not done
+    NInterlockedValue       m_numPendingDeps;
+    int                     m_numDeps;
+    /// \brief list of the nodes waiting for this one. Edges are allocated in the arena of the graph
+    struct Edge
+    {
+        TaskNode*   node;
+        Edge*       next;
+    };
+    Edge*                   m_successors;
+    Edge*                   m_lastSuccessor;
+protected:
+    TaskNode() : m_graph(NULL), m_queue(NULL), m_numPendingDeps(0), m_numDeps(0), m_successors(NULL), m_lastSuccessor(NULL) {}
+    virtual ~TaskNode() {}
+public:
+    virtual void Invoke() = 0;
+    /// \brief schedules the nodes that were waiting for this one
+    virtual void Done();
+    friend class TaskGraph;
+};
 
+/************************************************************************************/
+/**
+ ** \brief Graph of tasks with continuation scheduling
+ **
+ ** Typical use:
+ **   graph.clear();
+ **   TaskNode* a = graph.createNode<TskA>(NULL);               // or graph.addNode(new TskA())
+ **   TaskNode* b = graph.createNode<TskB>(g_mainThreadQueue);  // must run on the main thread
+ **   graph.addDependency(a, b);
+ **   graph.run(g_mainThreadQueue);
+ **   graph.wait(); // the main thread executes its own nodes while waiting
+ **
+ ** When no pool is given, nodes without a dedicated queue run in the host queue
+ **/
+class TaskGraph
+{
+private:
+    TaskGraph(const TaskGraph&); //these are purposely not implemented
+    TaskGraph& operator= (const TaskGraph&);
+
+    ThreadWorkerPool*       m_pool;
+    TaskQueue*              m_hostQueue;
+    std::vector<TaskNode*>  m_nodes;
+    /// \brief memory for the nodes created with createNode() and for the edges. Reset by clear()
+    TaskArena               m_arena;
+    /// \brief amount of nodes that are not yet done since run()
+    NInterlockedValue       m_numPendingNodes;
+    CEvent                  m_doneEvent;
+
+    /// \brief nodes for the pool are gathered in 'ready' so that flushReady() submits them at once
+    void schedule(TaskNode* node, TaskBase** ready, int& numReady);
+    void flushReady(TaskBase** ready, int& numReady);
+    void nodeDone(TaskNode* node);
+public:
+    TaskGraph(ThreadWorkerPool* pool = NULL);
+    ~TaskGraph();
+
+    inline void setPool(ThreadWorkerPool* pool) { m_pool = pool; }
+    inline int  getNodeCount() { return (int)m_nodes.size(); }
+    /// \brief the graph takes ownership of the node. queue: optional queue on which the node must run
+    TaskNode* addNode(TaskNode* node, TaskQueue* queue = NULL);
+    /// \brief allocation-free version of addNode(new T(args), queue): the node lives in the arena of the graph
+    template<typename T, typename... Args>
+    T* createNode(TaskQueue* queue, Args&&... args)
+    {
+        T* node = m_arena.create<T>(std::forward<Args>(args)...);
+        addNode(node, queue);
+        return node;
+    }
+    /// \brief 'after' will be scheduled when 'before' is done
+    void addDependency(TaskNode* before, TaskNode* after);
+    /// \brief pushes the nodes without dependency. hostQueue is the queue of the thread that will call wait()
+    void run(TaskQueue* hostQueue = NULL);
+    /// \brief waits for all the nodes to be done. Tasks pushed to the host queue get executed meanwhile
+    void wait();
+    /// \brief destroys the nodes and recycles the arena. Must not be called while the graph is running
+    void clear();
+    friend class TaskNode;
+};
+
+//#pragma mark - Parallel loops // MacOSX thing
+/************************************************************************************/
+/**
+ ** \brief pool used by parallel_for() and parallel_reduce(). NULL: loops run serially on the caller
+ **/
+extern void setParallelPool(ThreadWorkerPool* pool);
+extern ThreadWorkerPool* getParallelPool();
+
+/************************************************************************************/
+/**
+ ** \brief Shared state of a parallel loop
+ **
+ ** [begin, end) is cut in chunks of 'grain' items. The caller and helper tasks pushed to the
+ ** pool grab chunks until there is none left: if all the workers are busy, the caller
+ ** simply does the whole loop.
+ ** The job lives on the stack of the caller and the helpers come from a free list of the
+ ** pool: a loop allocates nothing once the list is warm. A helper that starts after the
+ ** loop is over finds the job taken back by the caller and doesn't touch it. This is what
+ ** allows the caller to be a worker of the pool
+ **/
+class ParallelJob
+{
+private:
+    ParallelJob(const ParallelJob&); //these are purposely not implemented
+    ParallelJob& operator= (const ParallelJob&);
+
+    NInterlockedValue   m_nextChunk;
+    NInterlockedValue   m_numChunksDone;
+    /// \brief helpers that got the job: the caller doesn't return before they left it
+    NInterlockedValue   m_numHelpersIn;
+    CEvent              m_doneEvent;
+    /// \brief grabs and runs chunks until none is left
+    void runChunks();
+    /// \brief last access of a helper to the job
+    void helperLeft();
+protected:
+    int                 m_begin;
+    int                 m_end;
+    int                 m_grain;
+    int                 m_numChunks;
+    ParallelJob(int begin, int end, int grain);
+    virtual ~ParallelJob() {}
+    virtual void runChunk(int chunk, int chunkBegin, int chunkEnd) = 0;
+public:
+    /// \brief pushes the helpers, participates and returns when all the chunks are done
+    void execute(ThreadWorkerPool* pool);
+    inline int getNumChunks() { return m_numChunks; }
+    friend class ParallelHelperTask;
+};
+
+/**
+ ** \brief fn(chunkBegin, chunkEnd) for each chunk
+ **/
+template<typename Fn>
+class ParallelForJob : public ParallelJob
+{
+private:
+    const Fn& m_fn;
+    virtual void runChunk(int chunk, int chunkBegin, int chunkEnd) { m_fn(chunkBegin, chunkEnd); }
+public:
+    ParallelForJob(int begin, int end, int grain, const Fn& fn) : ParallelJob(begin, end, grain), m_fn(fn) {}
+};
+
+/**
+ ** \brief each chunk folds its range: result(chunk) = fn(chunkBegin, chunkEnd, identity)
+ **
+ ** The partial results stay in the job, each on its own cache line so that the workers
+ ** writing them don't share lines. There are at most PARALLEL_REDUCE_MAXCHUNKS of them:
+ ** the grain grows with larger ranges
+ **/
+#define PARALLEL_REDUCE_MAXCHUNKS 64
+template<typename T, typename Fn>
+class ParallelReduceJob : public ParallelJob
+{
+private:
+    struct alignas(64) Slot
+    {
+        T value;
+        Slot(const T& v) : value(v) {}
+    };
+    const Fn& m_fn;
+    alignas(64) char m_slots[PARALLEL_REDUCE_MAXCHUNKS * sizeof(Slot)];
+    inline Slot* slot(int chunk) { return (Slot*)m_slots + chunk; }
+    virtual void runChunk(int chunk, int chunkBegin, int chunkEnd) { slot(chunk)->value = m_fn(chunkBegin, chunkEnd, slot(chunk)->value); }
+    static int reduceGrain(int begin, int end, int grain)
+    {
+        int minGrain = (end - begin + PARALLEL_REDUCE_MAXCHUNKS - 1) / PARALLEL_REDUCE_MAXCHUNKS;
+        return grain > minGrain ? grain : minGrain;
+    }
+public:
+    ParallelReduceJob(int begin, int end, int grain, const T& identity, const Fn& fn)
+        : ParallelJob(begin, end, reduceGrain(begin, end, grain)), m_fn(fn)
+    {
+        for (int c = 0; c < m_numChunks; c++)
+            new (slot(c)) Slot(identity);
+    }
+    ~ParallelReduceJob()
+    {
+        for (int c = 0; c < m_numChunks; c++)
+            slot(c)->~Slot();
+    }
+    inline const T& result(int chunk) { return slot(chunk)->value; }
+};
+
+/************************************************************************************/
+/**
+ ** \brief calls fn(b, e) on sub-ranges of [begin, end) of at most 'grain' items, on the
+ ** parallel pool and on the calling thread. Returns when all the ranges are done
+ **
+ **   parallel_for(0, n, 64, [&](int b, int e) { for(int i = b; i < e; i++) work(i); });
+ **/
+template<typename Fn>
+void parallel_for(int begin, int end, int grain, const Fn& fn)
+{
+    if (end <= begin)
+        return;
+    if (grain < 1)
+        grain = 1;
+    ThreadWorkerPool* pool = getParallelPool();
+    if ((pool == NULL) || (end - begin <= grain))
+    {
+        fn(begin, end);
+        return;
+    }
+    ParallelForJob<Fn> job(begin, end, grain, fn);
+    job.execute(pool);
+}
+
+/************************************************************************************/
+/**
+ ** \brief folds [begin, end): each sub-range computes fn(b, e, identity) -> T and the
+ ** results are combined in the order of the ranges, so the result doesn't depend on
+ ** which thread did what
+ **
+ **   int sum = parallel_reduce(0, n, 256, 0,
+ **       [&](int b, int e, int acc) { for(int i = b; i < e; i++) acc += v[i]; return acc; },
+ **       [](int a, int b) { return a + b; });
+ **/
+template<typename T, typename Fn, typename Combine>
+T parallel_reduce(int begin, int end, int grain, const T& identity, const Fn& fn, const Combine& combine)
+{
+    if (end <= begin)
+        return identity;
+    if (grain < 1)
+        grain = 1;
+    ThreadWorkerPool* pool = getParallelPool();
+    if ((pool == NULL) || (end - begin <= grain))
+        return fn(begin, end, identity);
+    ParallelReduceJob<T, Fn> job(begin, end, grain, identity, fn);
+    job.execute(pool);
+    T result = identity;
+    for (int c = 0; c < job.getNumChunks(); c++)
+        result = combine(result, job.result(c));
+    return result;
+}
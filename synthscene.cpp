@@ -0,0 +1,744 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <nvh/nvprint.hpp>
+
+#include "bk3dEx.h"
+#include "synthscene.h"
+
+#define SYNTH_CELL_SIZE 1.25f  // spacing of the transforms on the ground grid
+#define SYNTH_BUMP 0.15f       // height of the waves of the shapes
+
+SyntheticSceneDesc::SyntheticSceneDesc()
+    : numMeshes(1000)
+    , primGroupsPerMesh(4)
+    , numMaterials(16)
+    , numTransforms(0)
+    , verticesPerMesh(256)
+    , indicesPerPrimGroup(384)
+    , index32(false)
+    , seed(1)
+{
+  for(int t = 0; t < SYNTH_NUM_TOPOLOGIES; t++)
+    topologyWeights[t] = 0;
+  topologyWeights[SYNTH_TRIANGLES] = 1;
+}
+
+bool parseSyntheticDesc(const char* str, SyntheticSceneDesc& desc)
+{
+  static const char* topoKeys[SYNTH_NUM_TOPOLOGIES] = {"line", "linestrip", "tri", "tristrip", "trifan"};
+  bool                bTopoGiven                    = false;
+  const char*         p                             = str;
+  while(*p)
+  {
+    const char* eq = strchr(p, '=');
+    if(!eq)
+      return false;
+    std::string key(p, eq - p);
+    char*       end;
+    long        value = strtol(eq + 1, &end, 10);
+    if((end == eq + 1) || (value < 0) || (*end != ',' && *end != '\0'))
+      return false;
+    if(key == "meshes")
+      desc.numMeshes = (int)value;
+    else if(key == "prims")
+      desc.primGroupsPerMesh = (int)value;
+    else if(key == "materials")
+      desc.numMaterials = (int)value;
+    else if(key == "transforms")
+      desc.numTransforms = (int)value;
+    else if(key == "verts")
+      desc.verticesPerMesh = (int)value;
+    else if(key == "indices")
+      desc.indicesPerPrimGroup = (int)value;
+    else if(key == "index32")
+      desc.index32 = value ? true : false;
+    else if(key == "seed")
+      desc.seed = (unsigned int)value;
+    else
+    {
+      int t = 0;
+      while((t < SYNTH_NUM_TOPOLOGIES) && (key != topoKeys[t]))
+        t++;
+      if(t == SYNTH_NUM_TOPOLOGIES)
+        return false;
+      // the first topology given replaces the default mix
+      if(!bTopoGiven)
+        for(int i = 0; i < SYNTH_NUM_TOPOLOGIES; i++)
+          desc.topologyWeights[i] = 0;
+      bTopoGiven              = true;
+      desc.topologyWeights[t] = (int)value;
+    }
+    p = (*end == ',') ? end + 1 : end;
+  }
+  return true;
+}
+
+namespace {
+//------------------------------------------------------------------------------
+// xorshift: the same scene for the same seed, whatever the platform
+//------------------------------------------------------------------------------
+struct SynthRandom
+{
+  unsigned int state;
+
+  // spread the bits of small seeds: xorshift starts slowly from them
+  SynthRandom(unsigned int seed)
+      : state(seed * 0x9E3779B9u + 0x6A09E667u)
+  {
+    if(state == 0)
+      state = 1;
+  }
+  unsigned int next()
+  {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+  }
+  float unit() { return (float)(next() >> 8) * (1.0f / 16777216.0f); }
+};
+
+enum ImageArea
+{
+  AREA_STRUCTS,
+  AREA_BUFFERS
+};
+
+//------------------------------------------------------------------------------
+// a bk3d file under construction: the structures, header first, then the
+// vertex and index data. Pointers are relocations: they hold offsets until
+// FileHeader::resolvePointers() turns them into addresses, as for a file.
+// The areas are malloc() blocks, so that detach() hands the scene over without
+// a copy of the structures: they are most of the memory at large draw counts
+//------------------------------------------------------------------------------
+class Bk3dImage
+{
+public:
+  Bk3dImage() { memset(m_areas, 0, sizeof(m_areas)); }
+  ~Bk3dImage()
+  {
+    free(m_areas[AREA_STRUCTS].data);
+    free(m_areas[AREA_BUFFERS].data);
+  }
+  void reserve(size_t structBytes, size_t bufferBytes, size_t numRelocs)
+  {
+    grow(m_areas[AREA_STRUCTS], structBytes);
+    grow(m_areas[AREA_BUFFERS], bufferBytes);
+    m_relocs.reserve(numRelocs);
+  }
+  // 16 bytes aligned and zeroed. Invalidates the pointers previously taken in this area
+  size_t alloc(ImageArea area, size_t bytes)
+  {
+    Area&  a      = m_areas[area];
+    size_t offset = (a.size + 15) & ~(size_t)15;
+    if(offset + bytes > a.capacity)
+      grow(a, std::max(offset + bytes, a.capacity * 2));
+    memset(a.data + a.size, 0, offset + bytes - a.size);
+    a.size = offset + bytes;
+    return offset;
+  }
+  template <class T>
+  T* structAt(size_t offset)
+  {
+    return (T*)(m_areas[AREA_STRUCTS].data + offset);
+  }
+  char* bufferAt(size_t offset) { return m_areas[AREA_BUFFERS].data + offset; }
+  // the 64 bits pointer 'field', in the structures, points to 'target'
+  void relocate(const void* field, ImageArea area, size_t target)
+  {
+    Reloc r = {(unsigned int)((const char*)field - m_areas[AREA_STRUCTS].data), (unsigned int)target, (unsigned char)area};
+    m_relocs.push_back(r);
+  }
+  // appends the relocation table: the image is then the content of a .bk3d file
+  bool finalize();
+  // the structures then the buffers in one block, pointers resolved. The image is empty after it
+  bk3d::FileHeader* detach();
+  bool              write(FILE* fd) const;
+
+  size_t structBytes() const { return m_areas[AREA_STRUCTS].size; }
+  size_t bufferBytes() const { return m_areas[AREA_BUFFERS].size; }
+
+private:
+  struct Area
+  {
+    char*  data;
+    size_t size;
+    size_t capacity;
+  };
+  // 32 bits offsets, as in the relocation table: finalize() checks they didn't overflow
+  struct Reloc
+  {
+    unsigned int  field;
+    unsigned int  target;
+    unsigned char area;
+  };
+  Area               m_areas[2];
+  std::vector<Reloc> m_relocs;
+
+  static void grow(Area& a, size_t capacity)
+  {
+    if(capacity <= a.capacity)
+      return;
+    char* data = (char*)realloc(a.data, capacity);
+    if(!data)
+      throw std::bad_alloc();
+    a.data     = data;
+    a.capacity = capacity;
+  }
+  // the offset as a file has it, in place of the 64 bits pointer
+  static void writeOffset(void* field, unsigned long long offset) { memcpy(field, &offset, sizeof(offset)); }
+};
+
+bool Bk3dImage::finalize()
+{
+  size_t numRelocs  = m_relocs.size();
+  size_t totalBytes = structBytes() + sizeof(bk3d::RelocationTable) + numRelocs * sizeof(bk3d::RelocationTable::Offsets) + bufferBytes() + 64;
+  if(totalBytes > 0xFFFFFFFFull)
+  {
+    LOGE("synthetic scene of %zu Mb: more than the 4 Gb a bk3d file can address\n", totalBytes >> 20);
+    return false;
+  }
+  size_t tableOffset = alloc(AREA_STRUCTS, sizeof(bk3d::RelocationTable));
+  size_t offsOffset  = alloc(AREA_STRUCTS, numRelocs * sizeof(bk3d::RelocationTable::Offsets));
+  alloc(AREA_STRUCTS, 0);  // pads the structures to 16 bytes
+  size_t            structSize = structBytes();
+  bk3d::FileHeader* pHeader    = structAt<bk3d::FileHeader>(0);
+  pHeader->nodeByteSize        = (unsigned int)structSize;
+  // these two are resolved against the header, outside of the table
+  bk3d::RelocationTable* pTable = new(structAt<bk3d::RelocationTable>(tableOffset)) bk3d::RelocationTable;
+  pTable->nodeByteSize          = sizeof(bk3d::RelocationTable);
+  pTable->numRelocationOffsets  = (LONG)numRelocs;
+  writeOffset(&pTable->pRelocationOffsets, offsOffset);
+  writeOffset(&pHeader->pRelocationTable, tableOffset);
+
+  bk3d::RelocationTable::Offsets* pOffsets = structAt<bk3d::RelocationTable::Offsets>(offsOffset);
+  for(size_t i = 0; i < numRelocs; i++)
+  {
+    const Reloc&       r      = m_relocs[i];
+    unsigned long long target = r.target + (r.area == AREA_BUFFERS ? structSize : 0);
+    writeOffset(m_areas[AREA_STRUCTS].data + r.field, target);
+    pOffsets[i].ptrOffset = r.field;
+    pOffsets[i].offset    = (unsigned LONG)target;
+  }
+  std::vector<Reloc>().swap(m_relocs);
+  return true;
+}
+
+bk3d::FileHeader* Bk3dImage::detach()
+{
+  Area& structs = m_areas[AREA_STRUCTS];
+  Area& buffers = m_areas[AREA_BUFFERS];
+  grow(structs, structs.size + buffers.size);
+  memcpy(structs.data + structs.size, buffers.data, buffers.size);
+  bk3d::FileHeader* pHeader = (bk3d::FileHeader*)structs.data;
+  pHeader->resolvePointers(structs.data + structs.size);
+  free(buffers.data);
+  memset(m_areas, 0, sizeof(m_areas));
+  return pHeader;
+}
+
+bool Bk3dImage::write(FILE* fd) const
+{
+  for(int a = 0; a < 2; a++)
+    if(fwrite(m_areas[a].data, 1, m_areas[a].size, fd) != m_areas[a].size)
+      return false;
+  return true;
+}
+
+template <class Pool>
+size_t poolBytes(int n)
+{
+  // the pools end with an array of one pointer
+  return sizeof(Pool) + (std::max(n, 1) - 1) * sizeof(bk3d::Ptr64<bk3d::Node>);
+}
+
+template <class T>
+T* newNode(Bk3dImage& image, size_t offset, const char* fmt, int idx)
+{
+  T* pNode            = new(image.structAt<T>(offset)) T;
+  pNode->nodeByteSize = sizeof(T);
+  snprintf(pNode->name, NODENAMESZ, fmt, idx);
+  return pNode;
+}
+
+//------------------------------------------------------------------------------
+// geometry: a wavy square grid of side x side vertices, position + normal
+// interleaved as the renderers expect them
+//------------------------------------------------------------------------------
+struct SynthVertex
+{
+  float pos[3];
+  float normal[3];
+};
+
+void makeShapeVertices(int shape, int side, SynthVertex* pVertices)
+{
+  const float twoPi = 6.2831853f;
+  float       fx    = twoPi * (float)(1 + shape % 4);
+  float       fz    = twoPi * (float)(1 + (shape / 4) % 4);
+  float       phase = 0.4f * (float)shape;
+  for(int r = 0; r < side; r++)
+    for(int c = 0; c < side; c++)
+    {
+      SynthVertex& v  = pVertices[r * side + c];
+      float        x  = (float)c / (float)(side - 1) - 0.5f;
+      float        z  = (float)r / (float)(side - 1) - 0.5f;
+      float        dx = SYNTH_BUMP * fx * cosf(fx * x + phase) * cosf(fz * z);
+      float        dz = -SYNTH_BUMP * fz * sinf(fx * x + phase) * sinf(fz * z);
+      float        l  = sqrtf(dx * dx + 1.0f + dz * dz);
+      v.pos[0]        = x;
+      v.pos[1]        = SYNTH_BUMP * sinf(fx * x + phase) * cosf(fz * z);
+      v.pos[2]        = z;
+      v.normal[0]     = -dx / l;
+      v.normal[1]     = 1.0f / l;
+      v.normal[2]     = -dz / l;
+    }
+}
+
+// whole primitives only, and at least one
+int primGroupIndexCount(int topo, int indices)
+{
+  switch(topo)
+  {
+    case SYNTH_LINES:
+      return std::max(indices - indices % 2, 2);
+    case SYNTH_LINE_STRIP:
+      return std::max(indices, 2);
+    case SYNTH_TRIANGLES:
+      return std::max(indices - indices % 3, 3);
+    default:
+      return std::max(indices, 3);
+  }
+}
+
+int primitiveCount(int topo, int n)
+{
+  switch(topo)
+  {
+    case SYNTH_LINES:
+      return n / 2;
+    case SYNTH_LINE_STRIP:
+      return n - 1;
+    case SYNTH_TRIANGLES:
+      return n / 3;
+    default:
+      return n - 2;
+  }
+}
+
+// n indices walking the quads of the grid from 'firstQuad', wrapping around
+void makeIndices(int topo, int side, int firstQuad, int n, std::vector<unsigned int>& indices)
+{
+  int quadsPerRow = side - 1;
+  int numQuads    = quadsPerRow * quadsPerRow;
+  int numVertices = side * side;
+  int q           = firstQuad % numQuads;
+  int r           = q / quadsPerRow;
+  int c           = q % quadsPerRow;
+  indices.clear();
+  switch(topo)
+  {
+    case SYNTH_LINES:
+    case SYNTH_TRIANGLES:
+      while((int)indices.size() < n)
+      {
+        unsigned int a = r * side + c;
+        unsigned int b = a + 1;
+        unsigned int d = a + side;
+        if(topo == SYNTH_LINES)
+        {
+          unsigned int quad[4] = {a, b, a, d};
+          indices.insert(indices.end(), quad, quad + 4);
+        }
+        else
+        {
+          unsigned int quad[6] = {a, d, b, b, d, d + 1};
+          indices.insert(indices.end(), quad, quad + 6);
+        }
+        q = (q + 1) % numQuads;
+        r = q / quadsPerRow;
+        c = q % quadsPerRow;
+      }
+      break;
+    case SYNTH_TRIANGLE_STRIP:
+      // one strip per row of quads, stitched with degenerate triangles
+      while((int)indices.size() < n)
+      {
+        indices.push_back(r * side + c);
+        indices.push_back((r + 1) * side + c);
+        if(++c == side)
+        {
+          indices.push_back((r + 1) * side + side - 1);
+          r = (r + 1) % quadsPerRow;
+          c = 0;
+          indices.push_back(r * side);
+        }
+      }
+      break;
+    case SYNTH_LINE_STRIP:
+    case SYNTH_TRIANGLE_FAN: {
+      // the vertices in row order, around the first one for the fan
+      int v = r * side + c;
+      if(topo == SYNTH_TRIANGLE_FAN)
+      {
+        indices.push_back(v);
+        v += side;
+      }
+      while((int)indices.size() < n)
+        indices.push_back((v++) % numVertices);
+    }
+    break;
+  }
+  indices.resize(n);
+}
+}  // namespace
+
+//------------------------------------------------------------------------------
+// layout of the image:
+// header | meshes | materials | transforms | attributes | relocation table
+// then the vertices of the shapes and the indices of the primitive groups.
+// All the meshes use the vertices of SYNTH_MAX_SHAPES shapes and the primitive
+// groups share their indices by topology and rank: the memory is in the
+// structures, about 300 bytes per draw
+//------------------------------------------------------------------------------
+static bool buildScene(const SyntheticSceneDesc& descIn, Bk3dImage& image)
+{
+  SyntheticSceneDesc desc = descIn;
+  desc.numMeshes          = std::max(desc.numMeshes, 1);
+  desc.primGroupsPerMesh  = std::max(desc.primGroupsPerMesh, 1);
+  desc.numMaterials       = std::max(desc.numMaterials, 1);
+  desc.numTransforms      = desc.numTransforms > 0 ? std::min(desc.numTransforms, desc.numMeshes) : desc.numMeshes;
+  int side                = std::max((int)ceilf(sqrtf((float)std::max(desc.verticesPerMesh, 4))), 2);
+  int numVertices         = side * side;
+  int numShapes           = std::min(desc.numMeshes, SYNTH_MAX_SHAPES);
+  int numPrims            = desc.primGroupsPerMesh;
+  int totalWeight         = 0;
+  for(int t = 0; t < SYNTH_NUM_TOPOLOGIES; t++)
+    totalWeight += std::max(desc.topologyWeights[t], 0);
+  bool         bIndex32  = desc.index32 || (numVertices > 0xFFFF);
+  unsigned int indexSize = bIndex32 ? 4 : 2;
+
+  size_t numMeshes = desc.numMeshes;
+  size_t numDraws  = numMeshes * numPrims;
+  size_t meshBytes = sizeof(bk3d::Mesh) + poolBytes<bk3d::SlotPool>(1) + sizeof(bk3d::Slot) + poolBytes<bk3d::PrimGroupPool>(numPrims)
+                     + poolBytes<bk3d::TransformRefs>(1) + numPrims * sizeof(bk3d::PrimGroup) + 96;
+  image.reserve(numMeshes * meshBytes + desc.numTransforms * 512 + desc.numMaterials * 1024 + (1 << 16),
+                numShapes * numVertices * sizeof(SynthVertex) + SYNTH_NUM_TOPOLOGIES * numPrims * (desc.indicesPerPrimGroup + 4) * indexSize + 256,
+                numMeshes * 9 + numDraws * 4 + desc.numTransforms * 4 + desc.numMaterials * 3 + 64);
+
+  //
+  // Header and pools
+  //
+  size_t            headerOffs = image.alloc(AREA_STRUCTS, sizeof(bk3d::FileHeader));
+  size_t            meshesOffs = image.alloc(AREA_STRUCTS, poolBytes<bk3d::MeshPool>(desc.numMeshes));
+  size_t            matsOffs   = image.alloc(AREA_STRUCTS, poolBytes<bk3d::MaterialPool>(desc.numMaterials));
+  size_t            transfOffs = image.alloc(AREA_STRUCTS, poolBytes<bk3d::TransformPool>(desc.numTransforms));
+  bk3d::FileHeader* pHeader    = newNode<bk3d::FileHeader>(image, headerOffs, "synthetic", 0);
+  image.relocate(&pHeader->pMeshes, AREA_STRUCTS, meshesOffs);
+  image.relocate(&pHeader->pMaterials, AREA_STRUCTS, matsOffs);
+  image.relocate(&pHeader->pTransforms, AREA_STRUCTS, transfOffs);
+  image.structAt<bk3d::MeshPool>(meshesOffs)->n = desc.numMeshes;
+
+  //
+  // Materials: random diffuse colors
+  //
+  SynthRandom rnd(desc.seed);
+  size_t      matDataOffs = image.alloc(AREA_STRUCTS, desc.numMaterials * sizeof(bk3d::MaterialData));
+  size_t      matOffs     = image.alloc(AREA_STRUCTS, desc.numMaterials * sizeof(bk3d::Material));
+  {
+    bk3d::MaterialPool* pPool = image.structAt<bk3d::MaterialPool>(matsOffs);
+    pPool->nMaterials         = desc.numMaterials;
+    image.relocate(&pPool->tableMaterialData, AREA_STRUCTS, matDataOffs);
+    for(int i = 0; i < desc.numMaterials; i++)
+    {
+      size_t              offs  = matOffs + i * sizeof(bk3d::Material);
+      size_t              dOffs = matDataOffs + i * sizeof(bk3d::MaterialData);
+      bk3d::Material*     pMat  = newNode<bk3d::Material>(image, offs, "synthMat%d", i);
+      bk3d::MaterialData* pData = new(image.structAt<bk3d::MaterialData>(dOffs)) bk3d::MaterialData;
+      pMat->ID                  = i;
+      pData->diffuse.x          = 0.2f + 0.8f * rnd.unit();
+      pData->diffuse.y          = 0.2f + 0.8f * rnd.unit();
+      pData->diffuse.z          = 0.2f + 0.8f * rnd.unit();
+      pData->specexp            = 16.0f;
+      image.relocate(&pMat->parentPool, AREA_STRUCTS, matsOffs);
+      image.relocate(&pMat->pMaterialData, AREA_STRUCTS, dOffs);
+      image.relocate(&pPool->pMaterials[i], AREA_STRUCTS, offs);
+    }
+  }
+
+  //
+  // Transforms: roots placed on a square grid of cells, centered on the origin
+  //
+  int    cells         = (int)ceilf(sqrtf((float)desc.numTransforms));
+  size_t boneDataOffs  = image.alloc(AREA_STRUCTS, desc.numTransforms * sizeof(bk3d::BoneDataType));
+  size_t matrixAbsOffs = image.alloc(AREA_STRUCTS, desc.numTransforms * sizeof(bk3d::MatrixType));
+  size_t transformOffs = image.alloc(AREA_STRUCTS, desc.numTransforms * sizeof(bk3d::TransformSimple));
+  std::vector<float> cellPos(desc.numTransforms * 2);
+  {
+    bk3d::TransformPool* pPool = image.structAt<bk3d::TransformPool>(transfOffs);
+    pPool->nBones              = desc.numTransforms;
+    pPool->offsetIKHandles     = desc.numTransforms;
+    image.relocate(&pPool->tableBoneData, AREA_STRUCTS, boneDataOffs);
+    image.relocate(&pPool->tableMatrixAbs, AREA_STRUCTS, matrixAbsOffs);
+    for(int i = 0; i < desc.numTransforms; i++)
+    {
+      size_t                 offs  = transformOffs + i * sizeof(bk3d::TransformSimple);
+      size_t                 dOffs = boneDataOffs + i * sizeof(bk3d::BoneDataType);
+      size_t                 mOffs = matrixAbsOffs + i * sizeof(bk3d::MatrixType);
+      bk3d::TransformSimple* pT    = newNode<bk3d::TransformSimple>(image, offs, "synthTransf%d", i);
+      bk3d::BoneDataType*    pData = new(image.structAt<bk3d::BoneDataType>(dOffs)) bk3d::BoneDataType;
+      bk3d::MatrixType*      pAbs  = image.structAt<bk3d::MatrixType>(mOffs);
+      cellPos[i * 2 + 0]           = ((float)(i % cells) - 0.5f * (float)(cells - 1)) * SYNTH_CELL_SIZE;
+      cellPos[i * 2 + 1]           = ((float)(i / cells) - 0.5f * (float)(cells - 1)) * SYNTH_CELL_SIZE;
+      pT->ID                       = i;
+      pT->scale.x                  = 1.0f;
+      pT->scale.y                  = 1.0f;
+      pT->scale.z                  = 1.0f;
+      pT->scaleAbs                 = pT->scale;
+      pData->parentID              = 0xFFFF;
+      pData->DOFID                 = 0xFFFF;
+      pData->validComps            = TRANSFCOMP_matrix | TRANSFCOMP_abs_matrix;
+      pData->quat.w                = 1.0f;
+      pData->quatAbs.w             = 1.0f;
+      for(int k = 0; k < 4; k++)
+        pData->matrix.m[k * 5] = 1.0f;
+      pData->matrix.m[12] = cellPos[i * 2 + 0];
+      pData->matrix.m[14] = cellPos[i * 2 + 1];
+      *pAbs               = pData->matrix;
+      image.relocate(&pT->pBoneData, AREA_STRUCTS, dOffs);
+      image.relocate(&pT->parentPool, AREA_STRUCTS, transfOffs);
+      image.relocate(&pT->pMatrixAbs, AREA_STRUCTS, mOffs);
+      image.relocate(&pPool->pBones[i], AREA_STRUCTS, offs);
+    }
+  }
+
+  //
+  // Shapes: their vertices, and the position + normal attributes pointing in them
+  //
+  std::vector<size_t> shapeVtxOffs(numShapes);
+  std::vector<size_t> shapeAttrOffs(numShapes);
+  for(int s = 0; s < numShapes; s++)
+  {
+    shapeVtxOffs[s] = image.alloc(AREA_BUFFERS, numVertices * sizeof(SynthVertex));
+    makeShapeVertices(s, side, (SynthVertex*)image.bufferAt(shapeVtxOffs[s]));
+    shapeAttrOffs[s]            = image.alloc(AREA_STRUCTS, poolBytes<bk3d::AttributePool>(2));
+    size_t               aOffs  = image.alloc(AREA_STRUCTS, 2 * sizeof(bk3d::Attribute));
+    bk3d::AttributePool* pAttrs = image.structAt<bk3d::AttributePool>(shapeAttrOffs[s]);
+    pAttrs->n                   = 2;
+    for(int a = 0; a < 2; a++)
+    {
+      bk3d::Attribute* pA = newNode<bk3d::Attribute>(image, aOffs + a * sizeof(bk3d::Attribute), a ? MESH_NORMAL : MESH_POSITION, 0);
+      pA->formatDX9         = D3DDECLTYPE_FLOAT3;
+      pA->formatDXGI        = DXGI_FORMAT_R32G32B32_FLOAT;
+      pA->formatGL          = GL_FLOAT;
+      pA->numComp           = 3;
+      pA->strideBytes       = sizeof(SynthVertex);
+      pA->alignedByteOffset = a * 3 * sizeof(float);
+      pA->dataOffsetBytes   = a * 3 * sizeof(float);
+      image.relocate(&pA->pAttributeBufferData, AREA_BUFFERS, shapeVtxOffs[s] + pA->dataOffsetBytes);
+      image.relocate(&pAttrs->p[a], AREA_STRUCTS, aOffs + a * sizeof(bk3d::Attribute));
+    }
+  }
+
+  //
+  // Indices: one array per topology and rank of primitive group in the mesh,
+  // each rank starting further in the grid
+  //
+  struct IndexArray
+  {
+    size_t       offset;
+    int          count;
+    unsigned int minIndex;
+    unsigned int maxIndex;
+  };
+  std::vector<IndexArray>   indexArrays(SYNTH_NUM_TOPOLOGIES * numPrims);
+  std::vector<unsigned int> indices;
+  int                       numQuads = (side - 1) * (side - 1);
+  for(int t = 0; t < SYNTH_NUM_TOPOLOGIES; t++)
+  {
+    if((totalWeight > 0) ? (desc.topologyWeights[t] <= 0) : (t != SYNTH_TRIANGLES))
+      continue;
+    for(int pg = 0; pg < numPrims; pg++)
+    {
+      IndexArray& ia = indexArrays[t * numPrims + pg];
+      ia.count       = primGroupIndexCount(t, desc.indicesPerPrimGroup);
+      makeIndices(t, side, (int)((long long)pg * numQuads / numPrims), ia.count, indices);
+      ia.offset   = image.alloc(AREA_BUFFERS, ia.count * indexSize);
+      ia.minIndex = *std::min_element(indices.begin(), indices.end());
+      ia.maxIndex = *std::max_element(indices.begin(), indices.end());
+      for(int i = 0; i < ia.count; i++)
+      {
+        if(bIndex32)
+          ((unsigned int*)image.bufferAt(ia.offset))[i] = indices[i];
+        else
+          ((unsigned short*)image.bufferAt(ia.offset))[i] = (unsigned short)indices[i];
+      }
+    }
+  }
+
+  //
+  // Meshes
+  //
+  static const GLTopology       topoGL[SYNTH_NUM_TOPOLOGIES] = {GL_LINES, GL_LINE_STRIP, GL_TRIANGLES, GL_TRIANGLE_STRIP, GL_TRIANGLE_FAN};
+  static const D3DPRIMITIVETYPE topoDX9[SYNTH_NUM_TOPOLOGIES] = {D3DPT_LINELIST, D3DPT_LINESTRIP, D3DPT_TRIANGLELIST,
+                                                                 D3DPT_TRIANGLESTRIP, D3DPT_TRIANGLEFAN};
+  static const D3D11_PRIMITIVE_TOPOLOGY topoDX11[SYNTH_NUM_TOPOLOGIES] = {
+      D3D11_PRIMITIVE_TOPOLOGY_LINELIST, D3D11_PRIMITIVE_TOPOLOGY_LINESTRIP, D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST,
+      D3D11_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP, D3D11_PRIMITIVE_TOPOLOGY_UNDEFINED};
+  for(int m = 0; m < desc.numMeshes; m++)
+  {
+    int    shape      = m % numShapes;
+    int    transf     = m % desc.numTransforms;
+    size_t meshOffs   = image.alloc(AREA_STRUCTS, sizeof(bk3d::Mesh));
+    size_t slotsOffs  = image.alloc(AREA_STRUCTS, poolBytes<bk3d::SlotPool>(1));
+    size_t slotOffs   = image.alloc(AREA_STRUCTS, sizeof(bk3d::Slot));
+    size_t refsOffs   = image.alloc(AREA_STRUCTS, poolBytes<bk3d::TransformRefs>(1));
+    size_t pgPoolOffs = image.alloc(AREA_STRUCTS, poolBytes<bk3d::PrimGroupPool>(numPrims));
+    size_t pgOffs     = image.alloc(AREA_STRUCTS, numPrims * sizeof(bk3d::PrimGroup));
+    image.relocate(&image.structAt<bk3d::MeshPool>(meshesOffs)->p[m], AREA_STRUCTS, meshOffs);
+
+    bk3d::Mesh* pMesh = newNode<bk3d::Mesh>(image, meshOffs, "synthMesh%d", m);
+    pMesh->visible    = 1.0f;
+    for(int c = 0; c < 3; c++)
+    {
+      float center          = c == 0 ? cellPos[transf * 2 + 0] : (c == 2 ? cellPos[transf * 2 + 1] : 0.0f);
+      float half            = c == 1 ? SYNTH_BUMP : 0.5f;
+      pMesh->aabbox.min[c]  = center - half;
+      pMesh->aabbox.max[c]  = center + half;
+      pMesh->bsphere.pos[c] = center;
+    }
+    pMesh->bsphere.radius = sqrtf(0.5f + SYNTH_BUMP * SYNTH_BUMP);
+    image.relocate(&pMesh->pSlots, AREA_STRUCTS, slotsOffs);
+    image.relocate(&pMesh->pPrimGroups, AREA_STRUCTS, pgPoolOffs);
+    image.relocate(&pMesh->pAttributes, AREA_STRUCTS, shapeAttrOffs[shape]);
+    image.relocate(&pMesh->pTransforms, AREA_STRUCTS, refsOffs);
+
+    bk3d::SlotPool* pSlots = image.structAt<bk3d::SlotPool>(slotsOffs);
+    pSlots->n              = 1;
+    image.relocate(&pSlots->p[0], AREA_STRUCTS, slotOffs);
+    bk3d::Slot* pSlot           = newNode<bk3d::Slot>(image, slotOffs, "synthSlot%d", m);
+    pSlot->vtxBufferSizeBytes   = numVertices * sizeof(SynthVertex);
+    pSlot->vtxBufferStrideBytes = sizeof(SynthVertex);
+    pSlot->vertexCount          = numVertices;
+    image.relocate(&pSlot->pAttributes, AREA_STRUCTS, shapeAttrOffs[shape]);
+    image.relocate(&pSlot->pVtxBufferData, AREA_BUFFERS, shapeVtxOffs[shape]);
+
+    bk3d::TransformRefs* pRefs = image.structAt<bk3d::TransformRefs>(refsOffs);
+    pRefs->n                   = 1;
+    image.relocate(&pRefs->p[0], AREA_STRUCTS, transformOffs + transf * sizeof(bk3d::TransformSimple));
+
+    bk3d::PrimGroupPool* pPGs = image.structAt<bk3d::PrimGroupPool>(pgPoolOffs);
+    pPGs->n                   = numPrims;
+    for(int pg = 0; pg < numPrims; pg++)
+    {
+      int t = SYNTH_TRIANGLES;
+      if(totalWeight > 0)
+      {
+        int w = (int)(rnd.next() % (unsigned int)totalWeight);
+        for(t = 0; w >= std::max(desc.topologyWeights[t], 0); t++)
+          w -= std::max(desc.topologyWeights[t], 0);
+      }
+      const IndexArray& ia     = indexArrays[t * numPrims + pg];
+      size_t            offs   = pgOffs + pg * sizeof(bk3d::PrimGroup);
+      bk3d::PrimGroup*  pPG    = newNode<bk3d::PrimGroup>(image, offs, "synthPG%d", pg);
+      pPG->indexCount          = ia.count;
+      pPG->indexArrayByteSize  = ia.count * indexSize;
+      pPG->primitiveCount      = primitiveCount(t, ia.count);
+      pPG->indexPerVertex      = 1;
+      pPG->indexFormatDX9      = bIndex32 ? D3DFMT_INDEX32 : D3DFMT_INDEX16;
+      pPG->indexFormatDXGI     = bIndex32 ? DXGI_FORMAT_R32_UINT : DXGI_FORMAT_R16_UINT;
+      pPG->indexFormatGL       = bIndex32 ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+      pPG->topologyDX9         = topoDX9[t];
+      pPG->topologyDX11        = topoDX11[t];
+      pPG->topologyGL          = topoGL[t];
+      pPG->minIndex            = ia.minIndex;
+      pPG->maxIndex            = ia.maxIndex;
+      pPG->primRestartIndex    = bIndex32 ? 0xFFFFFFFF : 0xFFFF;
+      pPG->bsphere             = pMesh->bsphere;
+      pPG->aabbox              = pMesh->aabbox;
+      pPG->visible             = 1.0f;
+      image.relocate(&pPG->pIndexBufferData, AREA_BUFFERS, ia.offset);
+      image.relocate(&pPG->pMaterial, AREA_STRUCTS, matOffs + (rnd.next() % desc.numMaterials) * sizeof(bk3d::Material));
+      // the GL renderer expects the transforms of the groups: the ones of the mesh
+      image.relocate(&pPG->pTransforms, AREA_STRUCTS, refsOffs);
+      image.relocate(&pPGs->p[pg], AREA_STRUCTS, offs);
+    }
+  }
+  if(!image.finalize())
+    return false;
+  LOGI("synthetic scene: %d meshes, %zu draws, %d materials, %d transforms: %.1f Mb of structures, %.1f Mb of vertices and indices\n",
+       desc.numMeshes, numDraws, desc.numMaterials, desc.numTransforms, (float)image.structBytes() / (1024.0f * 1024.0f),
+       (float)image.bufferBytes() / (1024.0f * 1024.0f));
+  return true;
+}
+
+bk3d::FileHeader* generateSyntheticScene(const SyntheticSceneDesc& desc, size_t* pSizeBytes)
+{
+  try
+  {
+    Bk3dImage image;
+    if(!buildScene(desc, image))
+      return NULL;
+    if(pSizeBytes)
+      *pSizeBytes = image.structBytes() + image.bufferBytes();
+    return image.detach();
+  }
+  catch(const std::bad_alloc&)
+  {
+    LOGE("not enough memory for the synthetic scene\n");
+    return NULL;
+  }
+}
+
+bool writeSyntheticScene(const SyntheticSceneDesc& desc, const char* fname)
+{
+  try
+  {
+    Bk3dImage image;
+    if(!buildScene(desc, image))
+      return false;
+    FILE* fd = fopen(fname, "wb");
+    if(!fd)
+    {
+      LOGE("could not write %s\n", fname);
+      return false;
+    }
+    bool bOk = image.write(fd);
+    fclose(fd);
+    if(!bOk)
+      LOGE("could not write %s\n", fname);
+    else
+      LOGI("synthetic scene written to %s\n", fname);
+    return bOk;
+  }
+  catch(const std::bad_alloc&)
+  {
+    LOGE("not enough memory for the synthetic scene\n");
+    return false;
+  }
+}
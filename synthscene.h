@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+#include <stddef.h>
+
+namespace bk3d {
+struct FileHeader;
+}
+
+//------------------------------------------------------------------------------
+// Procedural bk3d scenes, to stress the loaders and the renderers at draw
+// counts no asset reaches (10^4..10^7 draws) without shipping the files.
+//
+// The scene is the same relocatable image bk3d::load() reads: it can be
+// generated in memory or written to a .bk3d file.
+// A model named "synthetic:<desc>" is generated instead of loaded, ex:
+//   synthetic:meshes=100000,prims=10,tri=3,line=1,verts=64,indices=96
+//------------------------------------------------------------------------------
+#define SYNTH_PREFIX "synthetic:"
+#define SYNTH_MAX_SHAPES 16  // meshes share the vertex data of this many shapes
+
+enum SynthTopology
+{
+  SYNTH_LINES,
+  SYNTH_LINE_STRIP,
+  SYNTH_TRIANGLES,
+  SYNTH_TRIANGLE_STRIP,
+  SYNTH_TRIANGLE_FAN,
+  SYNTH_NUM_TOPOLOGIES
+};
+
+struct SyntheticSceneDesc
+{
+  int numMeshes;          // "meshes"
+  int primGroupsPerMesh;  // "prims": one draw each
+  int numMaterials;       // "materials"
+  int numTransforms;      // "transforms": meshes use them round-robin. 0 for one per mesh
+  int verticesPerMesh;    // "verts": rounded up to a square grid
+  int indicesPerPrimGroup;  // "indices": rounded down to whole primitives
+  // relative weights of the topologies of the primitive groups:
+  // "line", "linestrip", "tri", "tristrip", "trifan"
+  int          topologyWeights[SYNTH_NUM_TOPOLOGIES];
+  bool         index32;  // "index32": 32 bits indices even when 16 bits would do
+  unsigned int seed;     // "seed": materials and topologies of the primitive groups
+
+  SyntheticSceneDesc();
+};
+
+// "meshes=1000,prims=4,tri=3,line=1": comma-separated key=value, the missing keys keep their defaults
+bool parseSyntheticDesc(const char* str, SyntheticSceneDesc& desc);
+
+// same memory layout as what bk3d::load() returns, but in a single block: free() releases all of it.
+// pSizeBytes: size of the block
+bk3d::FileHeader* generateSyntheticScene(const SyntheticSceneDesc& desc, size_t* pSizeBytes = NULL);
+// a .bk3d file that bk3d::load() reads back
+bool writeSyntheticScene(const SyntheticSceneDesc& desc, const char* fname);